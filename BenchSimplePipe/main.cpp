@@ -0,0 +1,607 @@
+﻿//SimpleNamedPipe.h 用ベンチマーク
+// フレーミング処理(Serializer::Next, Receiver::Feed, Deserializer::Feed)のマイクロベンチマークと、
+// 実際のトランスポートでのエコー(メッセージサイズ 8B～64MiB × BUF_SIZE)のスループット・レイテンシを計測し、
+// バッファーサイズを超えるメッセージは固定の断片サイズと適応的な断片サイズ(EnableAdaptiveFragments)を比較する。
+// 結果をJSONで標準出力へ出力する。進捗は標準エラー出力へ出力する。
+//  --quick : 計測量を減らして短時間で実行する
+//  --micro : マイクロベンチマークのみ
+//  --e2e   : エコーのみ
+//  --huge  : 数GiBのメッセージの片方向の送信を加える(受信側は一時ファイルで結合する)
+#include "pch.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include "../inc/SimpleNamedPipe.h"
+
+namespace {
+    using namespace abt::comm::simple_pipe;
+    using Clock = std::chrono::steady_clock;
+
+    //1回の読み込みサイズ(TypicalSimpleNamedPipeServerのバッファーサイズ相当)
+    constexpr size_t READ_SIZE = 64 * 1024;
+    //受信データ列のサイズ(受信直後のデータと同様にキャッシュに載るサイズ)
+    constexpr size_t STREAM_SIZE = 1024 * 1024;
+    //複数パケットに分割するメッセージのサイズ(Deserializer::Feedの結合)
+    constexpr size_t ASSEMBLED_SIZE = 1024 * 1024;
+    //分割ヘッダー入力でヘッダーを分割する位置
+    constexpr size_t HEADER_SPLIT = SimpleNamedPipeBase::HeaderSize / 2;
+
+    struct Options {
+        bool quick{ false };
+        bool micro{ true };
+        bool e2e{ true };
+        bool huge{ false };
+    };
+
+    struct Mix {
+        std::string name;
+        std::vector<size_t> sizes;  //パケットデータサイズ
+    };
+
+    //受信データ列(パケットの連続)
+    struct Stream {
+        std::vector<BYTE> bytes;
+        std::vector<size_t> offsets;    //各パケットの先頭位置
+        size_t dataBytes{ 0 };          //データ部の合計
+    };
+
+    //マイクロベンチマークの結果
+    struct MicroResult {
+        std::string bench;
+        std::string input;
+        std::string mode;
+        std::string mix;
+        size_t messages;    //1計測で処理したメッセージ(パケット)数
+        size_t bytes;       //1計測で処理したデータ部のバイト数
+        double seconds;     //最良値
+    };
+
+    //エコーの結果
+    struct EchoResult {
+        DWORD bufSize;
+        bool adaptive;                  //適応的な断片サイズ
+        size_t messageSize;
+        size_t count;
+        double seconds;
+        double fragments;               //1メッセージあたりの送信パケット数
+        std::vector<double> latencies;  //往復時間(マイクロ秒)、昇順
+    };
+
+    //数GiBのメッセージの送信結果
+    struct HugeResult {
+        DWORD bufSize;
+        size_t messageSize;
+        double seconds;
+        std::uint64_t spilled;          //一時ファイルで結合したメッセージ数
+        size_t poolHighWater;           //受信側のメッセージの結合領域の最大サイズ
+    };
+
+    //1計測で受信データ列を処理する回数
+    int Passes(const Options& options) { return options.quick ? 8 : 64; }
+    //計測回数(最良値を採用)
+    int Repeat(const Options& options) { return options.quick ? 3 : 7; }
+
+    void AppendPacket(Stream& stream, const SimpleNamedPipeBase::Header& header, size_t dataSize, BYTE fill)
+    {
+        const BYTE* h = reinterpret_cast<const BYTE*>(&header);
+        stream.offsets.push_back(stream.bytes.size());
+        stream.bytes.insert(stream.bytes.end(), h, h + SimpleNamedPipeBase::HeaderSize);
+        stream.bytes.resize(stream.bytes.size() + dataSize, fill);
+        stream.dataBytes += dataSize;
+    }
+
+    //1パケットで完結するメッセージの受信データ列を生成
+    Stream BuildStream(const Mix& mix)
+    {
+        Stream stream;
+        stream.bytes.reserve(STREAM_SIZE + READ_SIZE + SimpleNamedPipeBase::HeaderSize);
+        size_t index = 0;
+        while (stream.bytes.size() < STREAM_SIZE) {
+            const size_t dataSize = mix.sizes[index++ % mix.sizes.size()];
+            AppendPacket(stream, SimpleNamedPipeBase::Header::Create(static_cast<DWORD>(dataSize), true, true), dataSize, static_cast<BYTE>(index));
+        }
+        return stream;
+    }
+
+    //ASSEMBLED_SIZEのメッセージをパケットデータサイズで分割した受信データ列を生成
+    Stream BuildAssembledStream(size_t splitSize)
+    {
+        Stream stream;
+        std::vector<BYTE> message(ASSEMBLED_SIZE, 0x5A);
+        SimpleNamedPipeBase::Serializer serializer(SimpleNamedPipeBase::Buffer(message.data(), message.size()), static_cast<DWORD>(splitSize));
+        for (;;) {
+            auto [fragment, header] = serializer.Next();
+            if (fragment.Empty()) {
+                break;
+            }
+            AppendPacket(stream, header, fragment.Size(), 0x5A);
+        }
+        return stream;
+    }
+
+    //Feedの区切り位置(各Feedの終端)
+    std::vector<size_t> Cuts(const Stream& stream, const std::string& input)
+    {
+        std::vector<size_t> cuts;
+        if (input == "whole") {
+            //1回のFeedに1パケット
+            for (size_t i = 1; i < stream.offsets.size(); ++i) {
+                cuts.push_back(stream.offsets[i]);
+            }
+        }
+        else if (input == "fragmented") {
+            //読み込みサイズ単位。パケットは読み込みを跨いで分割される
+            for (size_t offset = READ_SIZE; offset < stream.bytes.size(); offset += READ_SIZE) {
+                cuts.push_back(offset);
+            }
+        }
+        else {
+            //全てのパケットのヘッダーの途中で区切る
+            for (size_t i = 1; i < stream.offsets.size(); ++i) {
+                cuts.push_back(stream.offsets[i] + HEADER_SPLIT);
+            }
+        }
+        cuts.push_back(stream.bytes.size());
+        return cuts;
+    }
+
+    template<typename Function>
+    double Best(const Options& options, Function function)
+    {
+        double best = (std::numeric_limits<double>::max)();
+        for (int i = 0; i < Repeat(options); ++i) {
+            auto start = Clock::now();
+            function();
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            best = (std::min)(best, elapsed.count());
+        }
+        return best;
+    }
+
+    //受信データ列を区切り位置毎にFeedした時間を計測
+    template<typename Receiver>
+    double MeasureFeed(const Options& options, Receiver& receiver, const Stream& stream, const std::vector<size_t>& cuts)
+    {
+        return Best(options, [&]() {
+            receiver.Reset();
+            for (int pass = 0; pass < Passes(options); ++pass) {
+                size_t offset = 0;
+                for (auto cut : cuts) {
+                    receiver.Feed(&stream.bytes[offset], cut - offset);
+                    offset = cut;
+                }
+            }
+        });
+    }
+
+    void BenchSerializer(const Options& options, const Mix& mix, std::vector<MicroResult>& results)
+    {
+        if (mix.sizes.size() != 1) {
+            return;
+        }
+        std::vector<BYTE> message(STREAM_SIZE, 0xA5);
+        size_t packets = 0;
+        size_t sum = 0;
+        auto sec = Best(options, [&]() {
+            packets = 0;
+            for (int pass = 0; pass < Passes(options); ++pass) {
+                SimpleNamedPipeBase::Serializer serializer(SimpleNamedPipeBase::Buffer(message.data(), message.size()), static_cast<DWORD>(mix.sizes[0]));
+                for (;;) {
+                    auto [fragment, header] = serializer.Next();
+                    if (fragment.Empty()) {
+                        break;
+                    }
+                    sum += header.DataSize();
+                    ++packets;
+                }
+            }
+        });
+        if (sum == 0) {
+            throw std::runtime_error("serializer produced no packets");
+        }
+        results.push_back({ "Serializer::Next", "message", "split", mix.name, packets / static_cast<size_t>(Passes(options)), message.size(), sec });
+    }
+
+    void BenchReceiver(const Options& options, const Mix& mix, const Stream& stream, std::vector<MicroResult>& results)
+    {
+        const auto packets = stream.offsets.size();
+        for (const std::string input : { "whole", "fragmented", "split-header" }) {
+            const auto cuts = Cuts(stream, input);
+
+            size_t sum = 0;
+            SimpleNamedPipeBase::Receiver single(READ_SIZE, MAX_DATA_SIZE, [&](const SimpleNamedPipeBase::Packet* packet) {
+                sum += packet->head.DataSize();
+            });
+            const double singleSec = MeasureFeed(options, single, stream, cuts);
+
+            size_t batchSum = 0;
+            SimpleNamedPipeBase::Receiver batch(READ_SIZE, MAX_DATA_SIZE, SimpleNamedPipeBase::Receiver::Batch{}, [&](SimpleNamedPipeBase::PacketBatch batchPackets) {
+                for (const auto packet : batchPackets) {
+                    batchSum += packet->head.DataSize();
+                }
+            });
+            const double batchSec = MeasureFeed(options, batch, stream, cuts);
+
+            if (sum != batchSum || sum != stream.dataBytes * static_cast<size_t>(Passes(options) * Repeat(options))) {
+                throw std::runtime_error("receiver mismatch: " + mix.name + " " + input);
+            }
+            results.push_back({ "Receiver::Feed", input, "single", mix.name, packets, stream.dataBytes, singleSec });
+            results.push_back({ "Receiver::Feed", input, "batch", mix.name, packets, stream.dataBytes, batchSec });
+        }
+    }
+
+    void BenchDeserializer(const Options& options, const std::string& name, const Stream& stream, std::vector<MicroResult>& results)
+    {
+        size_t messages = 0;
+        size_t sum = 0;
+        SimpleNamedPipeBase::Deserializer deserializer(READ_SIZE, MAX_DATA_SIZE, [&](SimpleNamedPipeBase::Buffer buffer) {
+            sum += buffer.Size();
+            ++messages;
+        });
+        const auto sec = Best(options, [&]() {
+            deserializer.Reset();
+            for (int pass = 0; pass < Passes(options); ++pass) {
+                for (auto offset : stream.offsets) {
+                    deserializer.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&stream.bytes[offset]));
+                }
+            }
+        });
+        if (sum != stream.dataBytes * static_cast<size_t>(Passes(options) * Repeat(options))) {
+            throw std::runtime_error("deserializer mismatch: " + name);
+        }
+        const auto perPass = messages / static_cast<size_t>(Passes(options) * Repeat(options));
+        //1パケットで完結するメッセージは受信バッファーを直接渡し、複数パケットのメッセージは結合する
+        const bool assembled = stream.offsets.size() != perPass;
+        results.push_back({ "Deserializer::Feed", assembled ? "assembled" : "single-packet", assembled ? "copy" : "direct", name, perPass, stream.dataBytes, sec });
+    }
+
+    std::vector<MicroResult> RunMicro(const Options& options)
+    {
+        std::vector<Mix> mixes = {
+            { "16B",   { 16 } },
+            { "64B",   { 64 } },
+            { "256B",  { 256 } },
+            { "1KiB",  { 1024 } },
+            { "4KiB",  { 4 * 1024 } },
+            { "16KiB", { 16 * 1024 } },
+            { "64KiB", { 64 * 1024 - SimpleNamedPipeBase::HeaderSize } },
+        };
+        {
+            //16B～64KiBを対数一様に混在
+            std::mt19937 rng(12345);
+            std::uniform_real_distribution<double> dist(4.0, 16.0);
+            Mix mixed{ "mixed", {} };
+            for (int i = 0; i < 4096; ++i) {
+                mixed.sizes.push_back(static_cast<size_t>(std::pow(2.0, dist(rng))) - SimpleNamedPipeBase::HeaderSize);
+            }
+            mixes.push_back(mixed);
+        }
+
+        std::vector<MicroResult> results;
+        for (const auto& mix : mixes) {
+            std::cerr << "micro: " << mix.name << std::endl;
+            const auto stream = BuildStream(mix);
+            BenchSerializer(options, mix, results);
+            BenchReceiver(options, mix, stream, results);
+            BenchDeserializer(options, mix.name, stream, results);
+            if (mix.sizes.size() == 1 && mix.sizes[0] < ASSEMBLED_SIZE) {
+                BenchDeserializer(options, mix.name, BuildAssembledStream(mix.sizes[0]), results);
+            }
+        }
+        return results;
+    }
+
+#ifdef _WIN32
+    std::wstring PipeName(DWORD bufSize, bool adaptive)
+    {
+        return L"\\\\.\\pipe\\BenchSimplePipe-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(bufSize) + (adaptive ? L"-adaptive" : L"");
+    }
+#else
+    std::string PipeName(DWORD bufSize, bool adaptive)
+    {
+        return "@BenchSimplePipe-" + std::to_string(::getpid()) + "-" + std::to_string(bufSize) + (adaptive ? "-adaptive" : "");
+    }
+#endif
+
+    /// <summary>
+    /// 1メッセージずつ送信し、サーバーがエコーしたメッセージの受信までの往復時間を計測する
+    /// </summary>
+    /// <param name="adaptive">送信側、エコー側の両方で適応的な断片サイズを有効にする</param>
+    template<DWORD BUF_SIZE>
+    void BenchEcho(const Options& options, const std::vector<size_t>& sizes, bool adaptive, std::vector<EchoResult>& results)
+    {
+        std::mutex lock;
+        std::condition_variable cv;
+        bool connected = false;
+        size_t echoed = 0;
+        size_t echoedBytes = 0;
+
+        const auto name = PipeName(BUF_SIZE, adaptive);
+        SimpleNamedPipeServer<BUF_SIZE> server(name.c_str(), nullptr, [&](auto& ps, const PipeEventParam& param) {
+            switch (param.type) {
+            case PipeEventType::CONNECTED:
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                connected = true;
+            }
+            cv.notify_all();
+            break;
+            case PipeEventType::RECEIVED:
+                ps.Write(param.readBuffer, param.readedSize);
+                break;
+            default:
+                break;
+            }
+        });
+        SimpleNamedPipeClient<BUF_SIZE> client(name.c_str(), [&](auto&, const PipeEventParam& param) {
+            if (param.type == PipeEventType::RECEIVED) {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ++echoed;
+                    echoedBytes += param.readedSize;
+                }
+                cv.notify_all();
+            }
+        });
+        if (adaptive) {
+            server.EnableAdaptiveFragments();
+            client.EnableAdaptiveFragments();
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!cv.wait_for(guard, std::chrono::seconds(10), [&]() { return connected; })) {
+                throw std::runtime_error("connection timeout");
+            }
+        }
+
+        //サイズ毎の送信量の目安と計測回数の範囲
+        const size_t totalBytes = options.quick ? 16 * 1024 * 1024 : 256 * 1024 * 1024;
+        const size_t minCount = options.quick ? 2 : 8;
+        const size_t maxCount = options.quick ? 2000 : 20000;
+        const size_t warmup = options.quick ? 10 : 100;
+
+        for (auto size : sizes) {
+            std::cerr << "e2e: BUF_SIZE=" << BUF_SIZE << " size=" << size << (adaptive ? " adaptive" : "") << std::endl;
+            std::vector<BYTE> message(size, 0xC3);
+            const size_t count = (std::max)(minCount, (std::min)(maxCount, totalBytes / size));
+            const size_t warmupCount = (std::min)(warmup, count);
+            EchoResult result{ BUF_SIZE, adaptive, size, count, 0.0, 0.0, {} };
+            result.latencies.reserve(count);
+            auto start = Clock::now();
+            auto fragments = client.Stats().fragmentsSent;
+            for (size_t i = 0; i < warmupCount + count; ++i) {
+                if (i == warmupCount) {
+                    start = Clock::now();
+                    fragments = client.Stats().fragmentsSent;
+                }
+                size_t expected = 0;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    expected = echoed + 1;
+                }
+                const auto sent = Clock::now();
+                client.Write(message.data(), message.size());
+                std::unique_lock<std::mutex> guard(lock);
+                if (!cv.wait_for(guard, std::chrono::seconds(60), [&]() { return echoed >= expected; })) {
+                    throw std::runtime_error("echo timeout");
+                }
+                if (i >= warmupCount) {
+                    result.latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+                }
+            }
+            result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            result.fragments = static_cast<double>(client.Stats().fragmentsSent - fragments) / static_cast<double>(count);
+            std::sort(result.latencies.begin(), result.latencies.end());
+            results.push_back(std::move(result));
+        }
+        if (echoedBytes == 0) {
+            throw std::runtime_error("no echo");
+        }
+        client.Close();
+        server.Close();
+    }
+
+    std::vector<EchoResult> RunEcho(const Options& options)
+    {
+        std::vector<size_t> sizes;
+        for (size_t size = 8; size <= 64 * 1024 * 1024; size *= 8) {
+            sizes.push_back(size);
+        }
+        if (sizes.back() != 64 * 1024 * 1024) {
+            sizes.push_back(64 * 1024 * 1024);
+        }
+        std::vector<EchoResult> results;
+        BenchEcho<4 * 1024>(options, sizes, false, results);
+        BenchEcho<TYPICAL_BUFFER_SIZE>(options, sizes, false, results);
+        BenchEcho<1024 * 1024>(options, sizes, false, results);
+        //適応的な断片サイズはバッファーサイズを超えるメッセージのみ比較する
+        auto over = [&sizes](size_t bufSize) {
+            std::vector<size_t> larger;
+            std::copy_if(sizes.begin(), sizes.end(), std::back_inserter(larger), [bufSize](size_t size) { return size > bufSize; });
+            return larger;
+        };
+        BenchEcho<4 * 1024>(options, over(4 * 1024), true, results);
+        BenchEcho<TYPICAL_BUFFER_SIZE>(options, over(TYPICAL_BUFFER_SIZE), true, results);
+        return results;
+    }
+
+    /// <summary>
+    /// 数GiBのメッセージを1つ送信し、受信完了までの時間を計測する
+    /// 受信側はメッセージ全体のサイズ(HeaderV2)で一度に確保せず、受信に合わせて一時ファイルを拡張する。
+    /// </summary>
+    template<DWORD BUF_SIZE>
+    HugeResult BenchHuge(const Options& options)
+    {
+        //MAX_DATA_SIZE(32bit長)を超えるサイズ
+        const size_t size = options.quick ? 2ull * 1024 * 1024 * 1024 : 4ull * 1024 * 1024 * 1024 + 1024 * 1024;
+        std::mutex lock;
+        std::condition_variable cv;
+        bool connected = false;
+        size_t received = 0;
+
+        const auto name = PipeName(BUF_SIZE, false);
+        SimpleNamedPipeServer<BUF_SIZE, MAX_DATA_SIZE64> server(name.c_str(), nullptr, [&](auto&, const PipeEventParam& param) {
+            switch (param.type) {
+            case PipeEventType::CONNECTED:
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                connected = true;
+            }
+            cv.notify_all();
+            break;
+            case PipeEventType::RECEIVED:
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                received = param.readedSize;
+            }
+            cv.notify_all();
+            break;
+            default:
+                break;
+            }
+        });
+        server.EnableSpill();
+        SimpleNamedPipeClient<BUF_SIZE, MAX_DATA_SIZE64> client(name.c_str(), [&](auto&, const PipeEventParam&) {});
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!cv.wait_for(guard, std::chrono::seconds(10), [&]() { return connected; })) {
+                throw std::runtime_error("connection timeout");
+            }
+        }
+
+        std::cerr << "huge: BUF_SIZE=" << BUF_SIZE << " size=" << size << std::endl;
+        //内容は問わないので初期化しない(送信側のメモリー使用量を抑える)
+        std::unique_ptr<BYTE[]> message(new BYTE[size]);
+        const auto start = Clock::now();
+        client.Write(message.get(), size);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!cv.wait_for(guard, std::chrono::minutes(10), [&]() { return received != 0; })) {
+                throw std::runtime_error("huge timeout");
+            }
+        }
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (received != size) {
+            throw std::runtime_error("huge size mismatch");
+        }
+        const auto stats = server.Stats();
+        client.Close();
+        server.Close();
+        return { BUF_SIZE, size, seconds, stats.messagesSpilled, stats.deserializerPoolHighWater };
+    }
+
+    //昇順の標本の百分位数(最近順位法)
+    double Percentile(const std::vector<double>& sorted, double p)
+    {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+        return sorted[(std::max)(rank, static_cast<size_t>(1)) - 1];
+    }
+
+    std::string Quote(const std::string& value)
+    {
+        return "\"" + value + "\"";
+    }
+
+    void WriteJson(std::ostream& out, const Options& options, const std::vector<MicroResult>& micro, const std::vector<EchoResult>& echo, const std::vector<HugeResult>& huge)
+    {
+        out << std::setprecision(6);
+        out << "{\n  \"platform\": " << Quote(
+#ifdef _WIN32
+            "windows"
+#else
+            "posix"
+#endif
+        ) << ",\n  \"quick\": " << (options.quick ? "true" : "false") << ",\n  \"micro\": [";
+        for (size_t i = 0; i < micro.size(); ++i) {
+            const auto& r = micro[i];
+            const double passes = Passes(options);
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"bench\": " << Quote(r.bench) << ", \"input\": " << Quote(r.input) << ", \"mode\": " << Quote(r.mode)
+                << ", \"mix\": " << Quote(r.mix) << ", \"messages\": " << r.messages << ", \"bytes\": " << r.bytes
+                << ", \"seconds\": " << r.seconds
+                << ", \"msgs_per_sec\": " << (static_cast<double>(r.messages) * passes / r.seconds)
+                << ", \"gb_per_sec\": " << (static_cast<double>(r.bytes) * passes / r.seconds / 1e9) << "}";
+        }
+        out << "\n  ],\n  \"e2e\": [";
+        for (size_t i = 0; i < echo.size(); ++i) {
+            const auto& r = echo[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"buf_size\": " << r.bufSize << ", \"fragmentation\": " << Quote(r.adaptive ? "adaptive" : "fixed")
+                << ", \"message_size\": " << r.messageSize << ", \"count\": " << r.count
+                << ", \"seconds\": " << r.seconds << ", \"fragments_per_message\": " << r.fragments
+                << ", \"msgs_per_sec\": " << (static_cast<double>(r.count) / r.seconds)
+                << ", \"gb_per_sec\": " << (static_cast<double>(r.count) * static_cast<double>(r.messageSize) / r.seconds / 1e9)
+                << ", \"latency_us\": {\"p50\": " << Percentile(r.latencies, 50.0) << ", \"p99\": " << Percentile(r.latencies, 99.0)
+                << ", \"p999\": " << Percentile(r.latencies, 99.9) << "}}";
+        }
+        out << "\n  ],\n  \"huge\": [";
+        for (size_t i = 0; i < huge.size(); ++i) {
+            const auto& r = huge[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"buf_size\": " << r.bufSize << ", \"message_size\": " << r.messageSize
+                << ", \"seconds\": " << r.seconds
+                << ", \"gb_per_sec\": " << (static_cast<double>(r.messageSize) / r.seconds / 1e9)
+                << ", \"spilled\": " << r.spilled << ", \"pool_high_water\": " << r.poolHighWater << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--quick") {
+            options.quick = true;
+        }
+        else if (arg == "--micro") {
+            options.e2e = false;
+        }
+        else if (arg == "--e2e") {
+            options.micro = false;
+        }
+        else if (arg == "--huge") {
+            options.huge = true;
+        }
+        else {
+            std::cerr << "usage: " << argv[0] << " [--quick] [--micro | --e2e] [--huge]" << std::endl;
+            return 2;
+        }
+    }
+
+    try {
+        std::vector<MicroResult> micro;
+        std::vector<EchoResult> echo;
+        std::vector<HugeResult> huge;
+        if (options.micro) {
+            micro = RunMicro(options);
+        }
+        if (options.e2e) {
+            echo = RunEcho(options);
+        }
+        if (options.huge) {
+            huge.push_back(BenchHuge<TYPICAL_BUFFER_SIZE>(options));
+        }
+        WriteJson(std::cout, options, micro, echo, huge);
+    }
+    catch (std::exception& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,5 @@
+﻿#pragma once
+#ifdef _WIN32
+#include <winrt/Windows.Foundation.h>
+#include <winrt/Windows.Foundation.Collections.h>
+#endif
@@ -0,0 +1,94 @@
+﻿#include "pch.h"
+#include <windows.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include "CppUnitTest.h"
+#include "../inc/SimpleNamedPipe.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+//テストモジュール内のヒープ確保回数
+static std::atomic_size_t allocationCount{ 0 };
+
+void* operator new(size_t size)
+{
+    allocationCount.fetch_add(1);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    allocationCount.fetch_add(1);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace abt::comm::simple_pipe::test::allocation
+{
+    using namespace abt::comm::simple_pipe;
+
+    //送信処理のヒープ確保テストクラス
+    TEST_CLASS(TestAllocation)
+    {
+    public:
+        //ウォームアップ後の同期送信ではヒープ確保を行わない(受信側の処理も含む)
+        TEST_METHOD(WriteWithoutAllocation)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            std::atomic_int connected{ 0 };
+            std::atomic_int received{ 0 };
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    connected.fetch_add(1);
+                    break;
+                case PipeEventType::RECEIVED:
+                    received.fetch_add(1);
+                    break;
+                default:
+                    break;
+                }
+            });
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto&) {});
+            while (connected.load() == 0) {
+                std::this_thread::yield();
+            }
+
+            constexpr int WARMUP = 100;
+            constexpr int REPEAT = 1000;
+            const std::string message(100, 'm');
+
+            for (int i = 0; i < WARMUP; ++i) {
+                client.Write(message.data(), message.size());
+            }
+            while (received.load() < WARMUP) {
+                std::this_thread::yield();
+            }
+
+            auto before = allocationCount.load();
+            for (int i = 0; i < REPEAT; ++i) {
+                client.Write(message.data(), message.size());
+            }
+            while (received.load() < WARMUP + REPEAT) {
+                std::this_thread::yield();
+            }
+            auto after = allocationCount.load();
+
+            Assert::AreEqual(static_cast<size_t>(0), after - before);
+        }
+    };
+}
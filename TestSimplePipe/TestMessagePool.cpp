@@ -0,0 +1,97 @@
+﻿#include "pch.h"
+#include <windows.h>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <cstring>
+#include "CppUnitTest.h"
+#include "../inc/SimpleNamedPipe.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace abt::comm::simple_pipe::test::message_pool
+{
+    using namespace abt::comm::simple_pipe;
+
+    //abt::comm::simple_pipe::MessagePoolテストクラス
+    TEST_CLASS(TestMessagePool)
+    {
+        TEST_METHOD(SizeClasses)
+        {
+            //バッファーサイズから2倍ずつ、最後は上限サイズ
+            auto pool = MessagePool::Create(64, 300);
+            Assert::AreEqual(static_cast<size_t>(4), pool->ClassCount());
+            Assert::AreEqual(static_cast<size_t>(64), pool->ClassSize(0));
+            Assert::AreEqual(static_cast<size_t>(128), pool->ClassSize(1));
+            Assert::AreEqual(static_cast<size_t>(256), pool->ClassSize(2));
+            Assert::AreEqual(static_cast<size_t>(300), pool->ClassSize(3));
+
+            Assert::ExpectException<std::length_error>([&]() {
+                pool->Acquire(301);
+            });
+            Assert::ExpectException<std::invalid_argument>([&]() {
+                MessagePool::Create(0, 300);
+            });
+        }
+
+        TEST_METHOD(Recycle)
+        {
+            auto pool = MessagePool::Create(64, 1024);
+            LPCVOID first = nullptr;
+            {
+                auto message = pool->Acquire(10);
+                Assert::IsTrue(message.Empty() == false);
+                Assert::AreEqual(static_cast<size_t>(0), message.Size());
+                first = message.Data();
+                Assert::AreEqual(static_cast<size_t>(0), pool->CachedCount());
+            }
+            //返却したスラブは同じサイズクラスで再利用する
+            Assert::AreEqual(static_cast<size_t>(1), pool->CachedCount());
+            auto again = pool->Acquire(64);
+            Assert::IsTrue(first == again.Data());
+            Assert::AreEqual(static_cast<size_t>(0), pool->CachedCount());
+            //別のサイズクラスは新たに確保する
+            auto large = pool->Acquire(65);
+            Assert::IsTrue(first != large.Data());
+        }
+
+        TEST_METHOD(SharedHandle)
+        {
+            auto pool = MessagePool::Create(4, 1024);
+            PipeMessage message;
+            Assert::IsTrue(message.Empty());
+            Assert::IsNull(message.Data());
+
+            //スラブの容量を超える追加は上位のサイズクラスへ移し替える
+            const char text[] = "0123456789";
+            pool->Append(message, text, 3);
+            pool->Append(message, text + 3, 7);
+            Assert::AreEqual(static_cast<size_t>(10), message.Size());
+            Assert::AreEqual(0, std::memcmp(text, message.Data(), 10));
+
+            //コピーしたハンドルがすべて破棄されるまでプールへ返却しない
+            auto copy = message;
+            PipeMessage moved = std::move(message);
+            Assert::IsTrue(message.Empty());
+            auto cached = pool->CachedCount();
+            copy = PipeMessage();
+            Assert::AreEqual(cached, pool->CachedCount());
+            std::thread([m = std::move(moved)]() {
+                Assert::AreEqual(static_cast<size_t>(10), m.Size());
+            }).join();
+            Assert::AreEqual(cached + 1, pool->CachedCount());
+        }
+
+        TEST_METHOD(OutlivePool)
+        {
+            //プールより長く保持したハンドルも有効
+            PipeMessage message;
+            {
+                auto pool = MessagePool::Create(64, 64);
+                pool->Append(message, "ABC", 3);
+            }
+            Assert::AreEqual(static_cast<size_t>(3), message.Size());
+            Assert::AreEqual(0, std::memcmp("ABC", message.Data(), 3));
+        }
+    };
+}
@@ -0,0 +1,125 @@
+﻿#include "pch.h"
+#include <windows.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include "CppUnitTest.h"
+#include "../inc/SimpleNamedPipe.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace abt::comm::simple_pipe::test::send_queue
+{
+    using namespace abt::comm::simple_pipe;
+
+    //abt::comm::simple_pipe::SimpleNamedPipeBase::SendQueueテストクラス
+    TEST_CLASS(TestSendQueue)
+    {
+        TEST_METHOD(PushPop)
+        {
+            SimpleNamedPipeBase::SendQueue<int> queue(4);
+            Assert::AreEqual(static_cast<size_t>(4), queue.Capacity());
+            Assert::IsTrue(queue.Empty());
+            Assert::IsFalse(queue.Full());
+            Assert::IsFalse(queue.TryPop().has_value());
+
+            //2周分追加と取り出しを繰り返しても順序を維持する
+            for (int round = 0; round < 2; ++round) {
+                for (int i = 0; i < 4; ++i) {
+                    int v = round * 10 + i;
+                    Assert::IsTrue(queue.TryPush(v));
+                }
+                Assert::IsTrue(queue.Full());
+                int over = 99;
+                Assert::IsFalse(queue.TryPush(over));
+                Assert::AreEqual(99, over);
+                for (int i = 0; i < 4; ++i) {
+                    auto v = queue.TryPop();
+                    Assert::IsTrue(v.has_value());
+                    Assert::AreEqual(round * 10 + i, v.value());
+                }
+                Assert::IsTrue(queue.Empty());
+                Assert::IsFalse(queue.Full());
+            }
+        }
+
+        TEST_METHOD(MoveOnly)
+        {
+            SimpleNamedPipeBase::SendQueue<std::unique_ptr<int>> queue(2);
+            auto p = std::make_unique<int>(1);
+            Assert::IsTrue(queue.TryPush(p));
+            Assert::IsFalse(static_cast<bool>(p));
+            auto q = std::make_unique<int>(2);
+            Assert::IsTrue(queue.TryPush(q));
+            auto r = std::make_unique<int>(3);
+            Assert::IsFalse(queue.TryPush(r));
+            //満杯で追加できなかった場合はムーブしない
+            Assert::IsTrue(static_cast<bool>(r));
+            Assert::AreEqual(1, *queue.TryPop().value());
+            Assert::AreEqual(2, *queue.TryPop().value());
+        }
+
+        TEST_METHOD(Peek)
+        {
+            SimpleNamedPipeBase::SendQueue<int> queue(2);
+            Assert::IsNull(queue.Peek());
+            int v = 1;
+            Assert::IsTrue(queue.TryPush(v));
+            v = 2;
+            Assert::IsTrue(queue.TryPush(v));
+            //参照しても取り出さない
+            Assert::AreEqual(1, *queue.Peek());
+            Assert::AreEqual(1, *queue.Peek());
+            Assert::AreEqual(1, queue.TryPop().value());
+            Assert::AreEqual(2, *queue.Peek());
+            Assert::AreEqual(2, queue.TryPop().value());
+            Assert::IsNull(queue.Peek());
+        }
+
+        TEST_METHOD(BadCapacity)
+        {
+            Assert::ExpectException<std::invalid_argument>([]() { SimpleNamedPipeBase::SendQueue<int> queue(0); });
+            Assert::ExpectException<std::invalid_argument>([]() { SimpleNamedPipeBase::SendQueue<int> queue(1); });
+            Assert::ExpectException<std::invalid_argument>([]() { SimpleNamedPipeBase::SendQueue<int> queue(6); });
+        }
+
+        TEST_METHOD(MultiProducer)
+        {
+            constexpr int PRODUCERS = 8;
+            constexpr int COUNT = 10000;
+            SimpleNamedPipeBase::SendQueue<int> queue(16);
+            std::vector<std::thread> producers;
+            for (int t = 0; t < PRODUCERS; ++t) {
+                producers.emplace_back([&queue, t]() {
+                    for (int i = 0; i < COUNT; ++i) {
+                        int v = t * COUNT + i;
+                        while (!queue.TryPush(v)) {
+                            std::this_thread::yield();
+                        }
+                    }
+                });
+            }
+            //プロデューサー毎の順序を維持したまま全件取り出せること
+            std::vector<int> last(PRODUCERS, -1);
+            int received = 0;
+            while (received < PRODUCERS * COUNT) {
+                auto v = queue.TryPop();
+                if (!v) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto t = v.value() / COUNT;
+                auto i = v.value() % COUNT;
+                Assert::AreEqual(last[t] + 1, i);
+                last[t] = i;
+                ++received;
+            }
+            for (auto& p : producers) {
+                p.join();
+            }
+            Assert::IsTrue(queue.Empty());
+        }
+    };
+}
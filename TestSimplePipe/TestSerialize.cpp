@@ -16,7 +16,7 @@ namespace abt::comm::simple_pipe::test::serialize
 
     std::wstring StrFromBuffer(const SimpleNamedPipeBase::Buffer& buffer)
     {
-        return std::wstring(reinterpret_cast<LPCWSTR>(buffer.Pointer()), 0, buffer.Size() / sizeof(WCHAR));
+        return std::wstring(reinterpret_cast<LPCWSTR>(buffer.Pointer()), buffer.Size() / sizeof(WCHAR));
     }
 
     TEST_CLASS(TestSerializer)
@@ -105,6 +105,65 @@ namespace abt::comm::simple_pipe::test::serialize
                 Assert::IsTrue(buffer.Empty());
             }
         }
+        TEST_METHOD(WriteGather)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUBWXYZ" };
+            TCHAR testData2[]{ L"HELLO" };
+            constexpr DWORD splitSize = 10 * sizeof(WCHAR);
+            //2パケット分(ヘッダー + splitSize)の容量
+            constexpr size_t capacity = (SimpleNamedPipeBase::HeaderSize + splitSize) * 2;
+            SimpleNamedPipeBase::WriteGather gather(capacity);
+            Assert::IsTrue(gather.Empty());
+            Assert::AreEqual(capacity, gather.Capacity());
+
+            //容量を超えた時点で書き出し、連続する2つのメッセージをまとめる
+            std::vector<std::vector<BYTE>> writes;
+            auto flush = [&]() {
+                std::vector<BYTE> w;
+                for (const auto& segment : gather.Segments()) {
+                    w.insert(w.end(), segment.Begin(), segment.End());
+                }
+                Assert::AreEqual(gather.Size(), w.size());
+                writes.emplace_back(std::move(w));
+                gather.Clear();
+            };
+            for (auto data : { SimpleNamedPipeBase::Buffer(testData1, sizeof(testData1) - sizeof(WCHAR)), SimpleNamedPipeBase::Buffer(testData2, sizeof(testData2) - sizeof(WCHAR)) }) {
+                SimpleNamedPipeBase::Serializer serializer(data, splitSize);
+                while (true) {
+                    auto [buffer, header] = serializer.Next();
+                    if (buffer.Empty()) {
+                        break;
+                    }
+                    if (!gather.CanAppend(buffer.Size())) {
+                        flush();
+                    }
+                    gather.Append(header, buffer);
+                }
+            }
+            Assert::AreEqual(static_cast<size_t>(2), gather.PacketCount());
+            Assert::ExpectException<std::length_error>([&]() {
+                gather.Append(SimpleNamedPipeBase::Header::Create(splitSize, true, true), SimpleNamedPipeBase::Buffer(testData1, splitSize));
+            });
+            flush();
+            //"ABCDEFGHIJ" + "KLMNOPQRST", "UBWXYZ" + "HELLO"
+            Assert::AreEqual(static_cast<size_t>(2), writes.size());
+            Assert::AreEqual(capacity, writes[0].size());
+            Assert::AreEqual(SimpleNamedPipeBase::HeaderSize * 2 + 11 * sizeof(WCHAR), writes[1].size());
+
+            std::vector<std::wstring> results;
+            SimpleNamedPipeBase::Deserializer deserializer(0, 1024, [&](SimpleNamedPipeBase::Buffer b) {
+                results.push_back(StrFromBuffer(b));
+            });
+            SimpleNamedPipeBase::Receiver receiver(0, 1024, [&](const SimpleNamedPipeBase::Packet* packet) {
+                deserializer.Feed(packet);
+            });
+            for (const auto& w : writes) {
+                receiver.Feed(w.data(), w.size());
+            }
+            Assert::AreEqual(static_cast<size_t>(2), results.size());
+            Assert::AreEqual(std::wstring(L"ABCDEFGHIJKLMNOPQRSTUBWXYZ"), results[0]);
+            Assert::AreEqual(std::wstring(L"HELLO"), results[1]);
+        }
     };
 
     class PacketBuidler
@@ -112,12 +171,15 @@ namespace abt::comm::simple_pipe::test::serialize
     private:
         SimpleNamedPipeBase::Buffer buffer;
         const DWORD splitSize;
+        //0以外の場合は多重化したパケットを生成する
+        const DWORD streamId;
         bool beginning{ true };
         std::vector<BYTE> work;
     public:
-        PacketBuidler(SimpleNamedPipeBase::Buffer buffer, DWORD splitSize)
+        PacketBuidler(SimpleNamedPipeBase::Buffer buffer, DWORD splitSize, DWORD streamId = 0)
             : buffer(buffer)
             , splitSize(splitSize)
+            , streamId(streamId)
         {}
         const SimpleNamedPipeBase::Packet* Next()
         {
@@ -127,9 +189,15 @@ namespace abt::comm::simple_pipe::test::serialize
             work.clear();
             auto size = (std::min)(static_cast<size_t>(splitSize), buffer.Size());
             auto comsumed = buffer.Consume(size);
-            auto header = SimpleNamedPipeBase::Header::Create(static_cast<DWORD>(size), beginning, buffer.Empty());
+            auto header = streamId == 0
+                ? SimpleNamedPipeBase::Header::Create(static_cast<DWORD>(size), beginning, buffer.Empty())
+                : SimpleNamedPipeBase::Header::CreateStream(static_cast<DWORD>(size), beginning, buffer.Empty());
             auto p = reinterpret_cast<const BYTE*>(&header);
             work.insert(work.end(), p, p + sizeof(header));
+            if (streamId != 0) {
+                auto id = reinterpret_cast<const BYTE*>(&streamId);
+                work.insert(work.end(), id, id + sizeof(streamId));
+            }
             work.insert(work.end(), comsumed.Begin(), comsumed.End());
             beginning = false;
             return reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&work[0]);
@@ -198,6 +266,76 @@ namespace abt::comm::simple_pipe::test::serialize
             Assert::AreEqual(3, progress);
         }
 
+        TEST_METHOD(DeserializeZeroCopy)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+
+            const BYTE* completedPointer = nullptr;
+            SimpleNamedPipeBase::Deserializer deserializer(1024, testBuffer1.Size(), [&](auto buf) {
+                Assert::AreEqual(std::wstring(testData1), StrFromBuffer(buf));
+                completedPointer = buf.Pointer();
+            });
+
+            //1パケットで完結する場合はパケットのデータ領域をそのまま渡す
+            PacketBuidler single(testBuffer1, static_cast<DWORD>(testBuffer1.Size()));
+            auto packet = single.Next();
+            Assert::IsTrue(deserializer.Feed(packet));
+            Assert::IsTrue(packet->Data().Pointer() == completedPointer);
+
+            //複数パケットの場合は結合した領域を渡す
+            completedPointer = nullptr;
+            PacketBuidler multi(testBuffer1, 10 * sizeof(WCHAR));
+            const SimpleNamedPipeBase::Packet* last = nullptr;
+            for (int i = 0; i < 3; ++i) {
+                last = multi.Next();
+                Assert::IsTrue(deserializer.Feed(last));
+            }
+            Assert::IsNotNull(completedPointer);
+            Assert::IsTrue(last->Data().Pointer() != completedPointer);
+
+            //1パケットでも上限サイズを超えたら例外
+            TCHAR testData2[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ!" };
+            SimpleNamedPipeBase::Buffer testBuffer2(testData2, sizeof(testData2) - sizeof(WCHAR));
+            PacketBuidler over(testBuffer2, static_cast<DWORD>(testBuffer2.Size()));
+            Assert::ExpectException<std::length_error>([&]() {
+                deserializer.Feed(over.Next());
+            });
+        }
+
+        TEST_METHOD(DeserializeMessagePool)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+
+            std::vector<PipeMessage> kept;
+            SimpleNamedPipeBase::Deserializer* target = nullptr;
+            SimpleNamedPipeBase::Deserializer deserializer(1024, 1024, [&](auto buf) {
+                //通知中のメッセージハンドルは通知データと同じ領域を指す
+                Assert::IsTrue(target->Message().Data() == buf.Pointer());
+                Assert::AreEqual(buf.Size(), target->Message().Size());
+                kept.push_back(target->Message());
+            });
+            target = &deserializer;
+            Assert::IsTrue(deserializer.Message().Empty());
+            deserializer.SetMessagePool(MessagePool::Create(16, 1024));
+
+            //1パケット、複数パケット(スラブの拡張あり)のいずれもハンドルで受け取る
+            PacketBuidler single(testBuffer1, static_cast<DWORD>(testBuffer1.Size()));
+            Assert::IsTrue(deserializer.Feed(single.Next()));
+            PacketBuidler multi(testBuffer1, 10 * sizeof(WCHAR));
+            for (int i = 0; i < 3; ++i) {
+                Assert::IsTrue(deserializer.Feed(multi.Next()));
+            }
+            Assert::IsTrue(deserializer.Message().Empty());
+
+            //通知後もデータを保持している
+            Assert::AreEqual(static_cast<size_t>(2), kept.size());
+            for (const auto& message : kept) {
+                Assert::AreEqual(std::wstring(testData1), StrFromBuffer(SimpleNamedPipeBase::Buffer(message.Data(), message.Size())));
+            }
+        }
+
         TEST_METHOD(DeserializeCancel)
         {
             TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
@@ -230,5 +368,300 @@ namespace abt::comm::simple_pipe::test::serialize
 
             Assert::AreEqual(3, progress);
         }
+
+        TEST_METHOD(DeserializeStreams)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+            TCHAR testData2[]{ L"abcdefghijklmnopqrstuvwxyz" };
+            SimpleNamedPipeBase::Buffer testBuffer2(testData2, sizeof(testData2) - sizeof(WCHAR));
+            TCHAR testData3[]{ L"0123456789" };
+            SimpleNamedPipeBase::Buffer testBuffer3(testData3, sizeof(testData3) - sizeof(WCHAR));
+
+            std::vector<std::wstring> results;
+            SimpleNamedPipeBase::Deserializer deserializer(1024, 1024, [&](auto buf) {
+                results.push_back(StrFromBuffer(buf));
+            });
+
+            //2つのストリームと多重化していないメッセージを交互に投入
+            PacketBuidler stream1(testBuffer1, 10 * sizeof(WCHAR), 1);
+            PacketBuidler stream2(testBuffer2, 10 * sizeof(WCHAR), 2);
+            PacketBuidler single(testBuffer3, 10 * sizeof(WCHAR));
+            Assert::IsTrue(deserializer.Feed(stream1.Next()));
+            Assert::IsTrue(deserializer.Feed(stream2.Next()));
+            Assert::AreEqual(static_cast<size_t>(2), deserializer.StreamCount());
+            Assert::IsTrue(deserializer.Feed(single.Next()));
+            Assert::IsTrue(deserializer.Feed(stream2.Next()));
+            Assert::IsTrue(deserializer.Feed(stream1.Next()));
+            Assert::IsTrue(deserializer.Feed(stream1.Next()));
+            Assert::AreEqual(static_cast<size_t>(1), deserializer.StreamCount());
+
+            //ストリーム2をキャンセル
+            auto cancelHeader = SimpleNamedPipeBase::Header::CreateStreamCancel();
+            std::vector<BYTE> cancel(reinterpret_cast<const BYTE*>(&cancelHeader), reinterpret_cast<const BYTE*>(&cancelHeader) + sizeof(cancelHeader));
+            DWORD cancelId = 2;
+            cancel.insert(cancel.end(), reinterpret_cast<const BYTE*>(&cancelId), reinterpret_cast<const BYTE*>(&cancelId) + sizeof(cancelId));
+            Assert::IsFalse(deserializer.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&cancel[0])));
+            Assert::AreEqual(static_cast<size_t>(0), deserializer.StreamCount());
+
+            Assert::AreEqual(static_cast<size_t>(2), results.size());
+            Assert::AreEqual(std::wstring(testData3), results[0]);
+            Assert::AreEqual(std::wstring(testData1), results[1]);
+
+            //開始していないストリームの続きはエラー
+            Assert::ExpectException<std::runtime_error>([&]() {
+                deserializer.Feed(stream2.Next());
+            });
+
+            //同時に組み立てるストリーム数の上限
+            std::vector<std::unique_ptr<PacketBuidler>> builders;
+            for (DWORD id = 1; id <= SimpleNamedPipeBase::Deserializer::MAX_STREAMS; ++id) {
+                builders.push_back(std::make_unique<PacketBuidler>(testBuffer1, 10 * sizeof(WCHAR), id));
+                Assert::IsTrue(deserializer.Feed(builders.back()->Next()));
+            }
+            PacketBuidler over(testBuffer1, 10 * sizeof(WCHAR), SimpleNamedPipeBase::Deserializer::MAX_STREAMS + 1);
+            Assert::ExpectException<std::length_error>([&]() {
+                deserializer.Feed(over.Next());
+            });
+        }
+
+        TEST_METHOD(DeserializeMessageSize)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+            constexpr DWORD splitSize = 10 * sizeof(WCHAR);
+
+            //先頭パケットにメッセージ全体のサイズを付加(HeaderV2)してパケット毎に書き出す
+            std::vector<std::vector<BYTE>> writes;
+            SimpleNamedPipeBase::WriteGather gather(1024);
+            SimpleNamedPipeBase::Serializer serializer(testBuffer1, splitSize);
+            while (true) {
+                auto [buffer, header] = serializer.Next();
+                if (buffer.Empty()) {
+                    break;
+                }
+                gather.Append(header, buffer, nullptr, header.IsStart() ? testBuffer1.Size() : 0);
+                std::vector<BYTE> w;
+                for (const auto& segment : gather.Segments()) {
+                    w.insert(w.end(), segment.Begin(), segment.End());
+                }
+                writes.emplace_back(std::move(w));
+                gather.Clear();
+            }
+            Assert::AreEqual(static_cast<size_t>(3), writes.size());
+            auto packetOf = [&](size_t i) { return reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&writes[i][0]); };
+            std::uint64_t messageSize = 0;
+            Assert::AreEqual(SimpleNamedPipeBase::HeaderV2, packetOf(0)->head.Version());
+            Assert::AreEqual(SimpleNamedPipeBase::HeaderSize + SimpleNamedPipeBase::MessageSizeSize + splitSize, static_cast<size_t>(packetOf(0)->head.size));
+            Assert::IsTrue(packetOf(0)->MessageSize(messageSize));
+            Assert::AreEqual(static_cast<std::uint64_t>(testBuffer1.Size()), messageSize);
+            //付加したサイズはdataOffsetで読み飛ばすので、未対応の受信側にも従来と同じデータとなる
+            Assert::AreEqual(std::wstring(L"ABCDEFGHIJ"), StrFromBuffer(packetOf(0)->Data()));
+            Assert::AreEqual(SimpleNamedPipeBase::HeaderV1, packetOf(1)->head.Version());
+            Assert::IsFalse(packetOf(1)->MessageSize(messageSize));
+
+            //受信メッセージプールの有無に関わらず組み立てられる
+            std::vector<std::wstring> results;
+            SimpleNamedPipeBase::Deserializer deserializer(0, 1024, [&](auto buf) {
+                results.push_back(StrFromBuffer(buf));
+            });
+            SimpleNamedPipeBase::Receiver receiver(0, 1024, [&](const SimpleNamedPipeBase::Packet* packet) {
+                deserializer.Feed(packet);
+            });
+            for (const auto& w : writes) {
+                receiver.Feed(w.data(), w.size());
+            }
+            deserializer.SetMessagePool(MessagePool::Create(16, 1024));
+            for (const auto& w : writes) {
+                receiver.Feed(w.data(), w.size());
+            }
+            Assert::AreEqual(static_cast<size_t>(2), results.size());
+            Assert::AreEqual(std::wstring(testData1), results[0]);
+            Assert::AreEqual(std::wstring(testData1), results[1]);
+
+            //上限サイズを超える場合は先頭パケットで例外
+            SimpleNamedPipeBase::Deserializer limited(0, testBuffer1.Size() - 1, [&](auto) {
+                Assert::Fail();
+            });
+            Assert::ExpectException<std::length_error>([&]() {
+                limited.Feed(packetOf(0));
+            });
+
+            //付加したサイズと結合したサイズが異なる場合はエラー
+            auto mismatch = writes[0];
+            const std::uint64_t wrongSize = testBuffer1.Size() + sizeof(WCHAR);
+            std::memcpy(&mismatch[SimpleNamedPipeBase::HeaderSize], &wrongSize, sizeof(wrongSize));
+            SimpleNamedPipeBase::Deserializer inconsistent(0, 1024, [&](auto) {
+                Assert::Fail();
+            });
+            Assert::IsTrue(inconsistent.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&mismatch[0])));
+            Assert::IsTrue(inconsistent.Feed(packetOf(1)));
+            Assert::ExpectException<std::runtime_error>([&]() {
+                inconsistent.Feed(packetOf(2));
+            });
+
+            //申告されたサイズだけでは結合領域を確保しない(偽のヘッダーで大きなメモリーを確保させない)
+            auto forged = writes[0];
+            const std::uint64_t forgedSize = 1024ull * 1024 * 1024;
+            std::memcpy(&forged[SimpleNamedPipeBase::HeaderSize], &forgedSize, sizeof(forgedSize));
+            SimpleNamedPipeBase::Deserializer forgery(0, (std::numeric_limits<size_t>::max)(), [&](auto) {
+                Assert::Fail();
+            });
+            Assert::IsTrue(forgery.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&forged[0])));
+            Assert::IsTrue(forgery.PoolCapacity() <= MAX_PRESIZE);
+
+            //HeaderV2でサイズ分のオフセットが無いヘッダーは不正
+            auto badHeader = SimpleNamedPipeBase::Header::Create(0, true, false);
+            badHeader.info.version = SimpleNamedPipeBase::HeaderV2;
+            SimpleNamedPipeBase::Receiver badReceiver(0, 1024, [&](const SimpleNamedPipeBase::Packet*) {
+                Assert::Fail();
+            });
+            Assert::ExpectException<std::length_error>([&]() {
+                badReceiver.Feed(&badHeader, sizeof(badHeader));
+            });
+        }
+
+        TEST_METHOD(DeserializeSpill)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+            TCHAR testData2[]{ L"abcdefghij" };
+            SimpleNamedPipeBase::Buffer testBuffer2(testData2, sizeof(testData2) - sizeof(WCHAR));
+
+            std::vector<std::wstring> results;
+            std::vector<bool> spilled;
+            std::vector<PipeMessage> taken;
+            SimpleNamedPipeBase::Deserializer deserializer(0, 1024, [&](auto buf) {
+                results.push_back(StrFromBuffer(buf));
+                spilled.push_back(deserializer.Spilled());
+                if (deserializer.Spilled()) {
+                    //一時ファイルのマッピングを引き取り、完了通知後も参照する
+                    auto spill = deserializer.TakeSpill();
+                    Assert::IsTrue(bool{ spill });
+                    auto data = spill->Data();
+                    taken.push_back(MessagePool::Adopt(std::shared_ptr<void>(std::move(spill)), data, buf.Size()));
+                    Assert::IsFalse(bool{ deserializer.TakeSpill() });
+                }
+            });
+            Assert::AreEqual(static_cast<size_t>(0), deserializer.SpillThreshold());
+            deserializer.SetSpillThreshold(15 * sizeof(WCHAR));
+
+            //全体のサイズが不明なメッセージはしきい値に達した時点で一時ファイルへ移す
+            PacketBuidler builder1(testBuffer1, 10 * sizeof(WCHAR));
+            Assert::IsTrue(deserializer.Feed(builder1.Next()));
+            Assert::IsTrue(deserializer.Feed(builder1.Next()));
+            Assert::AreEqual(static_cast<size_t>(0), deserializer.PoolCapacity());
+            Assert::IsTrue(deserializer.Feed(builder1.Next()));
+            //しきい値未満のメッセージは従来どおり
+            PacketBuidler builder2(testBuffer2, 5 * sizeof(WCHAR));
+            Assert::IsTrue(deserializer.Feed(builder2.Next()));
+            Assert::IsTrue(deserializer.Feed(builder2.Next()));
+            Assert::IsFalse(deserializer.Spilled());
+
+            //全体のサイズ(HeaderV2)がしきい値以上のメッセージは先頭パケットから一時ファイルで結合する
+            SimpleNamedPipeBase::WriteGather gather(1024);
+            std::vector<std::vector<BYTE>> writes;
+            SimpleNamedPipeBase::Serializer serializer(testBuffer1, 10 * sizeof(WCHAR));
+            while (true) {
+                auto [buffer, header] = serializer.Next();
+                if (buffer.Empty()) {
+                    break;
+                }
+                gather.Append(header, buffer, nullptr, header.IsStart() ? testBuffer1.Size() : 0);
+                std::vector<BYTE> w;
+                for (const auto& segment : gather.Segments()) {
+                    w.insert(w.end(), segment.Begin(), segment.End());
+                }
+                writes.emplace_back(std::move(w));
+                gather.Clear();
+            }
+            auto capacity = deserializer.PoolCapacity();
+            for (const auto& w : writes) {
+                Assert::IsTrue(deserializer.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&w[0])));
+                Assert::AreEqual(capacity, deserializer.PoolCapacity());
+            }
+
+            //キャンセルで一時ファイルの結合を破棄
+            PacketBuidler builder3(testBuffer1, 10 * sizeof(WCHAR));
+            Assert::IsTrue(deserializer.Feed(builder3.Next()));
+            Assert::IsTrue(deserializer.Feed(builder3.Next()));
+            auto cancel = SimpleNamedPipeBase::Header::CreateCancel();
+            Assert::IsFalse(deserializer.Feed(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&cancel)));
+
+            Assert::AreEqual(static_cast<size_t>(3), results.size());
+            Assert::AreEqual(std::wstring(testData1), results[0]);
+            Assert::AreEqual(std::wstring(testData2), results[1]);
+            Assert::AreEqual(std::wstring(testData1), results[2]);
+            Assert::IsTrue(spilled[0]);
+            Assert::IsFalse(spilled[1]);
+            Assert::IsTrue(spilled[2]);
+            Assert::AreEqual(static_cast<size_t>(2), taken.size());
+            for (const auto& message : taken) {
+                Assert::AreEqual(std::wstring(testData1), StrFromBuffer(SimpleNamedPipeBase::Buffer(message.Data(), message.Size())));
+            }
+
+            //一時ファイルで結合しても上限サイズを超える場合は例外
+            SimpleNamedPipeBase::Deserializer limited(0, testBuffer1.Size() - 1, [&](auto) {
+                Assert::Fail();
+            });
+            limited.SetSpillThreshold(1);
+            PacketBuidler builder4(testBuffer1, 10 * sizeof(WCHAR));
+            Assert::IsTrue(limited.Feed(builder4.Next()));
+            Assert::IsTrue(limited.Feed(builder4.Next()));
+            Assert::ExpectException<std::length_error>([&]() {
+                limited.Feed(builder4.Next());
+            });
+        }
+
+        TEST_METHOD(DeserializePlacement)
+        {
+            TCHAR testData1[]{ L"ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+            SimpleNamedPipeBase::Buffer testBuffer1(testData1, sizeof(testData1) - sizeof(WCHAR));
+            TCHAR testData2[]{ L"abcdefghij" };
+            SimpleNamedPipeBase::Buffer testBuffer2(testData2, sizeof(testData2) - sizeof(WCHAR));
+
+            std::vector<std::wstring> results;
+            SimpleNamedPipeBase::Deserializer deserializer(0, 1024, [&](auto buf) {
+                results.push_back(StrFromBuffer(buf));
+            });
+            //直接配置: 格納先へデータをコピーしてからヘッダーのみで完了を通知する
+            auto place = [&](const SimpleNamedPipeBase::Packet* packet) {
+                auto target = deserializer.Place(packet);
+                if (target == nullptr) {
+                    return false;
+                }
+                auto data = packet->Data();
+                memcpy(target, data.Pointer(), data.Size());
+                std::vector<BYTE> head(reinterpret_cast<const BYTE*>(packet), reinterpret_cast<const BYTE*>(packet) + packet->head.DataOffset());
+                deserializer.FeedPlaced(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(head.data()));
+                return true;
+            };
+
+            //直接配置と通常の受信が混在しても結合できる
+            PacketBuidler builder1(testBuffer1, 10 * sizeof(WCHAR));
+            Assert::IsTrue(place(builder1.Next()));
+            Assert::IsTrue(deserializer.Feed(builder1.Next()));
+            Assert::IsTrue(place(builder1.Next()));
+            //単一パケットのメッセージ
+            PacketBuidler builder2(testBuffer2, 10 * sizeof(WCHAR));
+            Assert::IsTrue(place(builder2.Next()));
+            //多重化したメッセージ
+            PacketBuidler builder3(testBuffer2, 4 * sizeof(WCHAR), 7);
+            Assert::IsTrue(place(builder3.Next()));
+            Assert::IsTrue(place(builder3.Next()));
+            Assert::IsTrue(place(builder3.Next()));
+
+            //開始パケットを受信していないメッセージとキャンセルは直接配置しない
+            PacketBuidler builder4(testBuffer1, 10 * sizeof(WCHAR));
+            builder4.Next();
+            Assert::IsFalse(place(builder4.Next()));
+            auto cancel = SimpleNamedPipeBase::Header::CreateCancel();
+            Assert::IsTrue(deserializer.Place(reinterpret_cast<const SimpleNamedPipeBase::Packet*>(&cancel)) == nullptr);
+
+            Assert::AreEqual(static_cast<size_t>(3), results.size());
+            Assert::AreEqual(std::wstring(testData1), results[0]);
+            Assert::AreEqual(std::wstring(testData2), results[1]);
+            Assert::AreEqual(std::wstring(testData2), results[2]);
+        }
     };
 }
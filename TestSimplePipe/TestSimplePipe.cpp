@@ -8,6 +8,7 @@
 #include <numeric>
 #include <limits>
 #include <algorithm>
+#include <map>
 #include <memory.h>
 #include <ppl.h>
 #include <ppltasks.h>
@@ -65,6 +66,44 @@ namespace abt::comm::simple_pipe::test
         }
     };
 
+    //条件が成立するまで待機する。受信イベントの後に記録される統計の確認に使用する
+    template<typename Pred>
+    bool WaitUntil(Pred condition, unsigned int timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+#ifdef SNP_HAS_COROUTINE
+    //受信メッセージをcount回エコーバックするコルーチン
+    PipeCoroutine EchoCoroutine(SimpleNamedPipeBase& pipe, int count)
+    {
+        for (auto i = 0; i < count; ++i) {
+            //エコーバック中に届いた次のメッセージは保持され、次のAwaitReceiveで受け取る
+            auto message = co_await pipe.AwaitReceive();
+            co_await pipe.AwaitWrite(message.Data(), message.Size());
+        }
+    }
+
+    //送信とエコーバックの受信を繰り返すコルーチン
+    PipeCoroutine RequestCoroutine(SimpleNamedPipeBase& pipe, const std::vector<std::wstring>& requests, std::vector<std::wstring>& responses)
+    {
+        for (const auto& request : requests) {
+            //送信前に受信待ちを登録しておくこともできる
+            auto receive = pipe.AwaitReceive();
+            co_await pipe.AwaitWrite(request.c_str(), request.size() * sizeof(WCHAR));
+            auto message = co_await receive;
+            responses.emplace_back(reinterpret_cast<LPCWSTR>(message.Data()), message.Size() / sizeof(WCHAR));
+        }
+    }
+#endif
+
     //abt::comm::simple_pipe::Receiverテストクラス
     TEST_CLASS(TestSimplePipe)
     {
@@ -893,7 +932,7 @@ namespace abt::comm::simple_pipe::test
             clientErrTask.wait();
         }
 
-        TEST_METHOD(MultiWrite)
+        TEST_METHOD(AdaptiveFragmentTransfer)
         {
             auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
 
@@ -902,7 +941,14 @@ namespace abt::comm::simple_pipe::test
             EventCounter serverDisconnected;
             EventCounter serverClosed;
 
-            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+            constexpr size_t BUFFER_SIZE = 1024;
+            constexpr size_t SAMPLE_SIZE = 1024 * 1024;
+            std::vector<int> expected(SAMPLE_SIZE);
+            for (auto& v : expected) {
+                v = std::rand();
+            }
+
+            SimpleNamedPipeServer<BUFFER_SIZE> server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::CONNECTED:
                     serverConnected.set();
@@ -911,10 +957,9 @@ namespace abt::comm::simple_pipe::test
                     serverDisconnected.set();
                     break;
                 case PipeEventType::RECEIVED:
-                {
+                    //そのまま返す
                     ps.WriteAsync(param.readBuffer, param.readedSize).wait();
-                }
-                break;
+                    break;
                 case PipeEventType::CLOSED:
                     serverClosed.set();
                     break;
@@ -926,27 +971,26 @@ namespace abt::comm::simple_pipe::test
                     break;
                 }
             });
+            //断片サイズの上限はバッファーサイズ以上
+            Assert::ExpectException<std::invalid_argument>([&] { server.EnableAdaptiveFragments(BUFFER_SIZE - 1); });
+            server.EnableAdaptiveFragments();
 
             concurrency::task<void> clientErrTask = concurrency::task_from_result();
             EventCounter echoComplete;
             EventCounter clientDisconnected;
-            std::vector<std::wstring> actual;
 
-            constexpr ULONG REPEAT = 20;
-            auto remain = REPEAT;
+            constexpr size_t SAMPLE_BYTE_SIZE = SAMPLE_SIZE * sizeof(int);
+            std::vector<int> actual(SAMPLE_SIZE);
 
-            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+            SimpleNamedPipeClient<BUFFER_SIZE> client(pipeName.c_str(), [&](auto&, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::DISCONNECTED:
                     clientDisconnected.set();
                     break;
                 case PipeEventType::RECEIVED:
-                    {
-                        std::wstring m(reinterpret_cast<LPCWSTR>(param.readBuffer), 0, param.readedSize / sizeof(WCHAR));
-                        actual.emplace_back(m);;
-                        if (0 == InterlockedDecrement(&remain)) {
-                            echoComplete.set();
-                        }
+                    if (param.readedSize == SAMPLE_BYTE_SIZE) {
+                        memcpy(&actual[0], param.readBuffer, param.readedSize);
+                        echoComplete.set();
                     }
                     break;
                 case PipeEventType::EXCEPTION:
@@ -957,61 +1001,54 @@ namespace abt::comm::simple_pipe::test
                     break;
                 }
             });
-
+            client.EnableAdaptiveFragments();
             Assert::AreEqual(WC(), serverConnected.wait(1000));
 
-            std::vector<std::wstring> expected;
-            for (auto i = 0ul; i < REPEAT; ++i) {
-                std::wostringstream oss;
-                oss << L"HELLO WORLD! [" << std::setw(2) << i << L"]";
-                expected.emplace_back(oss.str());
+            for (int i = 0; i < 3; ++i) {
+                echoComplete.reset();
+                client.WriteAsync(&expected[0], SAMPLE_BYTE_SIZE).wait();
+                Assert::AreEqual(WC(), echoComplete.wait(10000));
+                Assert::AreEqual(0, memcmp(&expected[0], &actual[0], SAMPLE_BYTE_SIZE));
             }
-
-            concurrency::parallel_for_each(expected.begin(), expected.end(), [&](std::wstring m) {
-                client.WriteAsync(m.c_str(), m.size() * sizeof(TCHAR)).wait();
-            });
-
-            Assert::AreEqual(WC(), echoComplete.wait(1000));
+#ifndef SNP_DISABLE_STATS
+            //バッファーサイズ単位で分割するより少ないパケット数で送信する
+            Assert::IsTrue(client.Stats().fragmentsSent < 3 * SAMPLE_BYTE_SIZE / BUFFER_SIZE / 4);
+#endif
 
             client.Close();
             Assert::AreEqual(WC(), clientDisconnected.wait(1000));
-
             Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+
             server.Close();
             Assert::AreEqual(WC(), serverClosed.wait(1000));
 
             serverErrTask.wait();
             clientErrTask.wait();
-            std::sort(actual.begin(), actual.end());
-            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
         }
 
-        BEGIN_TEST_METHOD_ATTRIBUTE(TransferMaxDataSize)
-            TEST_PRIORITY(2)
-        END_TEST_METHOD_ATTRIBUTE()
-        TEST_METHOD(TransferMaxDataSize)
+        TEST_METHOD(ChunkedTransfer)
         {
-            if (4 >= sizeof(INT_PTR)) {
-                //32bitプラットフォームではサイズが大きすぎて実行できないので何もしない
-                return;
-            }
-
             auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
 
             concurrency::task<void> serverErrTask = concurrency::task_from_result();
             EventCounter serverConnected;
             EventCounter serverDisconnected;
             EventCounter serverClosed;
-            EventCounter errEvent;
+            EventCounter receiveComplete;
+            EventCounter receiveCanceled;
 
-            using DataVector = std::vector<unsigned int>;
-
-            auto dataCount = MAX_DATA_SIZE / sizeof(DataVector::value_type);
-            auto expected = DataVector(dataCount);
-            int cnt = 0;
-            std::generate(expected.begin(), expected.end(), [&cnt]() {return cnt++; });
+            constexpr size_t BUFFER_SIZE = 1024;
+            constexpr size_t SAMPLE_BYTE_SIZE = 1024 * 1024 + 123;
+            std::vector<BYTE> expected(SAMPLE_BYTE_SIZE);
+            for (auto& v : expected) {
+                v = static_cast<BYTE>(std::rand());
+            }
 
-            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+            std::vector<BYTE> actual;
+            size_t beginSize = 0;
+            size_t endSize = 0;
+            size_t maxChunk = 0;
+            SimpleNamedPipeServer<BUFFER_SIZE> server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::CONNECTED:
                     serverConnected.set();
@@ -1019,11 +1056,29 @@ namespace abt::comm::simple_pipe::test
                 case PipeEventType::DISCONNECTED:
                     serverDisconnected.set();
                     break;
-                case PipeEventType::RECEIVED:
+                case PipeEventType::RECEIVED_BEGIN:
+                    actual.clear();
+                    beginSize = param.readedSize;
+                    break;
+                case PipeEventType::RECEIVED_CHUNK:
                 {
-                    ps.WriteAsync(param.readBuffer, param.readedSize).wait();
+                    auto chunk = static_cast<const BYTE*>(param.readBuffer);
+                    actual.insert(actual.end(), chunk, chunk + param.readedSize);
+                    maxChunk = (std::max)(maxChunk, param.readedSize);
+                    break;
                 }
-                break;
+                case PipeEventType::RECEIVED_END:
+                    endSize = param.readedSize;
+                    receiveComplete.set();
+                    break;
+                case PipeEventType::RECEIVED_CANCELED:
+                    receiveCanceled.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    //1パケットのメッセージは従来どおり
+                    actual.assign(static_cast<const BYTE*>(param.readBuffer), static_cast<const BYTE*>(param.readBuffer) + param.readedSize);
+                    receiveComplete.set();
+                    break;
                 case PipeEventType::CLOSED:
                     serverClosed.set();
                     break;
@@ -1032,109 +1087,125 @@ namespace abt::comm::simple_pipe::test
                     if (param.errTask) {
                         serverErrTask = param.errTask.value();
                     }
-                    errEvent.set();
                     break;
                 }
             });
+            server.EnableChunkedReceive();
+            //RPCとは併用できない
+            Assert::ExpectException<std::logic_error>([&] { server.EnableRpc(nullptr); });
 
-            auto actual = DataVector(dataCount);
             concurrency::task<void> clientErrTask = concurrency::task_from_result();
-            EventCounter echoComplete;
             EventCounter clientDisconnected;
 
-            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+            SimpleNamedPipeClient<BUFFER_SIZE> client(pipeName.c_str(), [&](auto&, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::DISCONNECTED:
                     clientDisconnected.set();
                     break;
-                case PipeEventType::RECEIVED:
-                {
-                    if (param.readedSize == expected.size() * sizeof(DataVector::value_type)) {
-                        auto p = reinterpret_cast<const DataVector::value_type*>(param.readBuffer);
-                        std::copy(p, p + expected.size(), actual.begin());
-                    }
-                    echoComplete.set();
-                }
-                break;
                 case PipeEventType::EXCEPTION:
                     //監視タスクで例外発生
                     if (param.errTask) {
                         clientErrTask = param.errTask.value();
                     }
-                    errEvent.set();
                     break;
                 }
             });
-
             Assert::AreEqual(WC(), serverConnected.wait(1000));
+            Assert::ExpectException<std::invalid_argument>([&] { client.WriteStreamAsync(ChunkReader()); });
+
+            //読み出し関数から送信する。全体のサイズは不明
+            size_t offset = 0;
+            client.WriteStreamAsync([&](BYTE* buffer, size_t size) {
+                auto readSize = (std::min)({ size, static_cast<size_t>(1000), SAMPLE_BYTE_SIZE - offset });
+                memcpy(buffer, &expected[offset], readSize);
+                offset += readSize;
+                return readSize;
+            }).wait();
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+            Assert::AreEqual(static_cast<size_t>(0), beginSize);
+            Assert::AreEqual(SAMPLE_BYTE_SIZE, endSize);
+            Assert::IsTrue(maxChunk <= BUFFER_SIZE);
+            Assert::IsTrue(expected == actual);
 
-            client.WriteAsync(&expected[0], expected.size() * sizeof(DataVector::value_type)).wait();
-            {
-                concurrency::event* waitEvents[] = { &errEvent.evt, &echoComplete.evt };
-                auto idx = concurrency::event::wait_for_multiple(&waitEvents[0], _countof(waitEvents), false, 180 * 1000);
+            //通常の送信も断片毎に届き、先頭で全体のサイズが分かる
+            receiveComplete.reset();
+            client.WriteAsync(&expected[0], SAMPLE_BYTE_SIZE).wait();
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+            Assert::AreEqual(SAMPLE_BYTE_SIZE, beginSize);
+            Assert::AreEqual(SAMPLE_BYTE_SIZE, endSize);
+            Assert::IsTrue(expected == actual);
 
-                if (concurrency::COOPERATIVE_WAIT_TIMEOUT == idx) {
-                    Assert::Fail(L"'timeout: client.WriteAsync");
-                }
-                if (waitEvents[idx] == &errEvent.evt) {
-                    try {
-                        clientErrTask.wait();
-                    }
-                    catch (winrt::hresult_error& ex) {
-                        Assert::Fail(ex.message().c_str());
-                    }
-                    catch (std::exception& ex) {
-                        Assert::Fail(winrt::to_hstring(ex.what()).c_str());
-                    }
-                    catch (...) {
-                        Assert::Fail(L"error!");
-                    }
+            //1パケットに収まるメッセージ
+            receiveComplete.reset();
+            client.WriteAsync(&expected[0], BUFFER_SIZE).wait();
+            Assert::AreEqual(WC(), receiveComplete.wait(1000));
+            Assert::IsTrue(std::equal(expected.begin(), expected.begin() + BUFFER_SIZE, actual.begin(), actual.end()));
+
+            //読み出し関数の例外で中断したメッセージは受信側でキャンセルとなる
+            size_t sent = 0;
+            auto failed = client.WriteStreamAsync([&](BYTE* buffer, size_t size) -> size_t {
+                if (sent > 8 * BUFFER_SIZE) {
+                    throw std::runtime_error("read error");
                 }
-            }
+                memcpy(buffer, &expected[0], size);
+                sent += size;
+                return size;
+            });
+            Assert::ExpectException<std::runtime_error>([&] { failed.get(); });
+            Assert::AreEqual(WC(), receiveCanceled.wait(1000));
 
             client.Close();
             Assert::AreEqual(WC(), clientDisconnected.wait(1000));
             Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+
             server.Close();
             Assert::AreEqual(WC(), serverClosed.wait(1000));
 
             serverErrTask.wait();
             clientErrTask.wait();
-
-            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
         }
 
-        TEST_METHOD(WatcherTaskException)
+        TEST_METHOD(MultiWrite)
         {
             auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
 
             concurrency::task<void> serverErrTask = concurrency::task_from_result();
-            EventCounter serverErrEvent;
+            EventCounter serverConnected;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
 
             TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::CONNECTED:
+                    serverConnected.set();
                     break;
                 case PipeEventType::DISCONNECTED:
-                    throw std::exception("server exception");
+                    serverDisconnected.set();
+                    break;
                 case PipeEventType::RECEIVED:
                 {
                     ps.WriteAsync(param.readBuffer, param.readedSize).wait();
                 }
                 break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
                 case PipeEventType::EXCEPTION:
                     //監視タスクで例外発生
                     if (param.errTask) {
                         serverErrTask = param.errTask.value();
                     }
-                    serverErrEvent.set();
                     break;
                 }
             });
+
             concurrency::task<void> clientErrTask = concurrency::task_from_result();
-            EventCounter clientErrEvent;
+            EventCounter echoComplete;
             EventCounter clientDisconnected;
-            std::wstring echoMessage;
+            std::vector<std::wstring> actual;
+
+            constexpr ULONG REPEAT = 20;
+            auto remain = REPEAT;
 
             TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
                 switch (param.type) {
@@ -1142,84 +1213,107 @@ namespace abt::comm::simple_pipe::test
                     clientDisconnected.set();
                     break;
                 case PipeEventType::RECEIVED:
-                {
-                    throw std::exception("client exception");
-                }
-                break;
+                    {
+                        std::wstring m(reinterpret_cast<LPCWSTR>(param.readBuffer), 0, param.readedSize / sizeof(WCHAR));
+                        actual.emplace_back(m);;
+                        if (0 == InterlockedDecrement(&remain)) {
+                            echoComplete.set();
+                        }
+                    }
+                    break;
                 case PipeEventType::EXCEPTION:
                     //監視タスクで例外発生
                     if (param.errTask) {
                         clientErrTask = param.errTask.value();
                     }
-                    clientErrEvent.set();
                     break;
                 }
             });
 
-            WCHAR hello[] = L"HELLO ERROR!";
-            client.WriteAsync(&hello[0], sizeof(hello)).wait();
-
-            concurrency::event* events[] {&serverErrEvent.evt, &clientErrEvent.evt };
-            auto res = concurrency::event::wait_for_multiple(&events[0], _countof(events), true, 1000);
-            Assert::AreNotEqual(concurrency::COOPERATIVE_WAIT_TIMEOUT, res);
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
 
-            try {
-                serverErrTask.wait();
-                Assert::Fail();
-            }
-            catch (std::exception& ex) {
-                Assert::AreEqual(std::string("server exception"), std::string(ex.what()));
-            }
-            try {
-                clientErrTask.wait();
-                Assert::Fail();
-            }
-            catch (std::exception& ex) {
-                Assert::AreEqual(std::string("client exception"), std::string(ex.what()));
+            std::vector<std::wstring> expected;
+            for (auto i = 0ul; i < REPEAT; ++i) {
+                std::wostringstream oss;
+                oss << L"HELLO WORLD! [" << std::setw(2) << i << L"]";
+                expected.emplace_back(oss.str());
             }
+
+            concurrency::parallel_for_each(expected.begin(), expected.end(), [&](std::wstring m) {
+                client.WriteAsync(m.c_str(), m.size() * sizeof(TCHAR)).wait();
+            });
+
+            Assert::AreEqual(WC(), echoComplete.wait(1000));
+
             client.Close();
             Assert::AreEqual(WC(), clientDisconnected.wait(1000));
 
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
             server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            std::sort(actual.begin(), actual.end());
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
         }
 
-        TEST_METHOD(LimitSizeException)
+        //WriteBatchAsync: 1回の送信要求で複数メッセージ、受信側はメッセージ毎に受信イベント
+        TEST_METHOD(WriteBatch)
         {
             auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
 
             concurrency::task<void> serverErrTask = concurrency::task_from_result();
-            EventCounter serverErrEvent;
+            EventCounter serverConnected;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
 
-            SimpleNamedPipeServer<1024,8> server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::CONNECTED:
+                    serverConnected.set();
                     break;
                 case PipeEventType::DISCONNECTED:
+                    serverDisconnected.set();
                     break;
                 case PipeEventType::RECEIVED:
                 {
                     ps.WriteAsync(param.readBuffer, param.readedSize).wait();
                 }
                 break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
                 case PipeEventType::EXCEPTION:
                     //監視タスクで例外発生
                     if (param.errTask) {
                         serverErrTask = param.errTask.value();
                     }
-                    serverErrEvent.set();
                     break;
                 }
             });
+
             concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter echoComplete;
             EventCounter clientDisconnected;
-            std::wstring echoMessage;
+            std::vector<std::wstring> actual;
 
-            SimpleNamedPipeClient<1024,18> client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+            constexpr ULONG REPEAT = 200;
+            auto remain = REPEAT;
+
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
                 switch (param.type) {
                 case PipeEventType::DISCONNECTED:
                     clientDisconnected.set();
                     break;
                 case PipeEventType::RECEIVED:
+                    {
+                        std::wstring m(reinterpret_cast<LPCWSTR>(param.readBuffer), param.readedSize / sizeof(WCHAR));
+                        actual.emplace_back(m);
+                        if (0 == InterlockedDecrement(&remain)) {
+                            echoComplete.set();
+                        }
+                    }
                     break;
                 case PipeEventType::EXCEPTION:
                     //監視タスクで例外発生
@@ -1230,33 +1324,1123 @@ namespace abt::comm::simple_pipe::test
                 }
             });
 
-            {
-                WCHAR data[] = L"0123456789";
-                Assert::ExpectException<std::length_error>([&] {
-                    client.WriteAsync(&data[0], sizeof(data)).wait();
-                });
-            }
-            {
-                WCHAR data[] = L"01234567";
-                try {
-                    client.WriteAsync(&data[0], sizeof(data)).wait();
-                }
-                catch (winrt::hresult_error& ) {
-                    //サーバー側の制限にかかって、例外終了
-                    Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //小さなメッセージ中心に、バッファーサイズを超えるメッセージも混在させる
+            std::vector<std::wstring> expected;
+            for (auto i = 0ul; i < REPEAT; ++i) {
+                std::wostringstream oss;
+                oss << L"RECORD [" << std::setw(3) << i << L"]";
+                if (i % 50 == 49) {
+                    oss << std::wstring(TypicalSimpleNamedPipeClient::BUFFER_SIZE, L'x');
                 }
+                expected.emplace_back(oss.str());
             }
-            Assert::AreEqual(WC(), serverErrEvent.wait(1000));
-            try {
-                serverErrTask.wait();
+            std::vector<ConstBuffer> buffers;
+            for (const auto& m : expected) {
+                buffers.push_back({ m.c_str(), m.size() * sizeof(WCHAR) });
             }
-            catch (std::length_error& )
-            {}
+
+            client.WriteBatchAsync(buffers).wait();
+
+            Assert::AreEqual(WC(), echoComplete.wait(5000));
+
             client.Close();
             Assert::AreEqual(WC(), clientDisconnected.wait(1000));
 
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
             server.Close();
-        }
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            //送信順に受信する
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+        }
+
+#ifdef SNP_HAS_COROUTINE
+        TEST_METHOD(CoroutineEcho)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverReceived;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    serverDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    //AwaitReceiveで受け取ったメッセージは通知されない
+                    serverReceived.set();
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            constexpr int REPEAT = 100;
+            auto echo = EchoCoroutine(server, REPEAT).Task();
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //バッファーサイズを超えるメッセージも混在させる
+            std::vector<std::wstring> expected;
+            for (auto i = 0; i < REPEAT; ++i) {
+                std::wostringstream oss;
+                oss << L"REQUEST [" << std::setw(3) << i << L"]";
+                if (i % 10 == 9) {
+                    oss << std::wstring(TypicalSimpleNamedPipeClient::BUFFER_SIZE, L'x');
+                }
+                expected.emplace_back(oss.str());
+            }
+            std::vector<std::wstring> actual;
+            RequestCoroutine(client, expected, actual).Task().wait();
+            echo.wait();
+
+            //切断時は受信待ちが例外で再開する
+            auto pending = EchoCoroutine(server, 1).Task();
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+            Assert::ExpectException<winrt::hresult_error>([&pending]() { pending.wait(); });
+
+            //次の接続ではAwaitReceiveを呼び出すまで受信イベントとなる
+            serverConnected.reset();
+            {
+                TypicalSimpleNamedPipeClient next(pipeName.c_str(), [&](auto&, const auto&) {});
+                Assert::AreEqual(WC(), serverConnected.wait(1000));
+                const WCHAR request[] = L"NEXT";
+                next.Write(request, sizeof(request));
+                Assert::AreEqual(WC(), serverReceived.wait(1000));
+            }
+
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            Assert::AreEqual(1, serverReceived.count());
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+        }
+#endif
+
+        TEST_METHOD(PullReceive)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverReceived;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    serverDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    //受信箱へ追加したメッセージは通知されない
+                    serverReceived.set();
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            server.EnableInbox(16);
+            Assert::ExpectException<std::logic_error>([&server]() { server.EnableInbox(); });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //バッファーサイズを超えるメッセージも混在させる
+            constexpr int REPEAT = 500;
+            std::vector<std::wstring> expected;
+            for (auto i = 0; i < REPEAT; ++i) {
+                std::wostringstream oss;
+                oss << L"RECORD [" << std::setw(3) << i << L"]";
+                if (i % 50 == 49) {
+                    oss << std::wstring(TypicalSimpleNamedPipeClient::BUFFER_SIZE, L'x');
+                }
+                expected.emplace_back(oss.str());
+            }
+            auto sender = concurrency::create_task([&]() {
+                for (const auto& m : expected) {
+                    client.Write(m.c_str(), m.size() * sizeof(WCHAR));
+                }
+            });
+
+            //TryReceive, ReceiveBatch, ReceiveAsyncを混在させて取り出す
+            std::vector<std::wstring> actual;
+            std::vector<PipeMessage> batch;
+            while (actual.size() < expected.size()) {
+                batch.clear();
+                switch (actual.size() % 3) {
+                case 0:
+                    if (auto message = server.TryReceive()) {
+                        batch.emplace_back(std::move(*message));
+                    }
+                    break;
+                case 1:
+                    server.ReceiveBatch(batch, 8);
+                    break;
+                default:
+                    batch.emplace_back(server.ReceiveAsync().get());
+                    break;
+                }
+                for (const auto& message : batch) {
+                    actual.emplace_back(reinterpret_cast<LPCWSTR>(message.Data()), message.Size() / sizeof(WCHAR));
+                }
+            }
+            sender.wait();
+            Assert::IsFalse(server.TryReceive().has_value());
+
+            //切断時は待機中のReceiveAsyncが例外で完了する
+            auto pending = server.ReceiveAsync();
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+            Assert::ExpectException<winrt::hresult_error>([&pending]() { pending.get(); });
+
+            //前の接続で取り出されていないメッセージは次の接続を受け付けた時点で破棄する
+            const WCHAR left[] = L"LEFT";
+            const WCHAR next[] = L"NEXT";
+            serverConnected.reset();
+            serverDisconnected.reset();
+            {
+                TypicalSimpleNamedPipeClient previous(pipeName.c_str(), [&](auto&, const auto&) {});
+                Assert::AreEqual(WC(), serverConnected.wait(1000));
+#ifndef SNP_DISABLE_STATS
+                const auto receivedBefore = server.Stats().messagesReceived;
+#endif
+                previous.Write(left, sizeof(left));
+                previous.Write(left, sizeof(left));
+#ifndef SNP_DISABLE_STATS
+                //受信箱に追加されるまで待ってから切断する
+                Assert::IsTrue(WaitUntil([&] { return server.Stats().messagesReceived == receivedBefore + 2; }, 1000));
+#endif
+            }
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+            serverConnected.reset();
+            {
+                TypicalSimpleNamedPipeClient current(pipeName.c_str(), [&](auto&, const auto&) {});
+                Assert::AreEqual(WC(), serverConnected.wait(1000));
+                current.Write(next, sizeof(next));
+                auto message = server.ReceiveAsync().get();
+                Assert::AreEqual(std::wstring(next), std::wstring(reinterpret_cast<LPCWSTR>(message.Data())));
+                Assert::IsFalse(server.TryReceive().has_value());
+            }
+
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            Assert::AreEqual(0, serverReceived.count());
+            //送信順に受信する
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+        }
+
+        TEST_METHOD(FlowControl)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            constexpr DWORD WINDOW = 8;
+            server.EnableInbox();
+            server.EnableFlowControl(WINDOW);
+            Assert::ExpectException<std::invalid_argument>([&server]() { server.EnableFlowControl(0); });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+            //接続時に送信枠が付与される
+            for (auto i = 0; i < 100 && !client.SendWindow().has_value(); ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            Assert::AreEqual(static_cast<size_t>(WINDOW), client.SendWindow().value());
+            //クライアントは流量制御を有効にしていない
+            Assert::IsFalse(server.SendWindow().has_value());
+
+            //受信側が取り出さなくても、送信キューの長さまではWriteAsyncで待機しない
+            constexpr int REPEAT = static_cast<int>(SEND_QUEUE_SIZE) / 2;
+            std::vector<std::wstring> expected;
+            std::vector<concurrency::task<void>> tasks;
+            for (auto i = 0; i < REPEAT; ++i) {
+                std::wostringstream oss;
+                oss << L"RECORD [" << std::setw(3) << i << L"]";
+                expected.emplace_back(oss.str());
+            }
+            for (const auto& m : expected) {
+                tasks.emplace_back(client.WriteAsync(m.c_str(), m.size() * sizeof(WCHAR)));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            //送信枠の分だけ受信する
+            Assert::AreEqual(static_cast<size_t>(0), client.SendWindow().value());
+            std::vector<PipeMessage> batch;
+            Assert::AreEqual(static_cast<size_t>(WINDOW), server.ReceiveBatch(batch, SEND_QUEUE_SIZE));
+
+            //取り出しに応じて送信枠が付与され、残りを受信する
+            while (batch.size() < expected.size()) {
+                batch.emplace_back(server.ReceiveAsync().get());
+            }
+            concurrency::when_all(tasks.begin(), tasks.end()).wait();
+            std::vector<std::wstring> actual;
+            for (const auto& message : batch) {
+                actual.emplace_back(reinterpret_cast<LPCWSTR>(message.Data()), message.Size() / sizeof(WCHAR));
+            }
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            //送信順に受信する
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+        }
+
+        TEST_METHOD(MultiplexWrite)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+            EventCounter receiveComplete;
+
+            constexpr int SMALL_COUNT = 10;
+            constexpr size_t LARGE_SIZE = 16 * 1024 * 1024;
+            std::vector<size_t> received;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    received.push_back(param.readedSize);
+                    if (received.size() == SMALL_COUNT + 1) {
+                        receiveComplete.set();
+                    }
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            client.EnableMultiplex();
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //大きなメッセージの送信中に小さなメッセージを送信する
+            std::vector<BYTE> large(LARGE_SIZE, 0xAB);
+            auto largeTask = client.WriteAsync(&large[0], large.size());
+            DWORD small = 0;
+            for (auto i = 0; i < SMALL_COUNT; ++i) {
+                client.WriteAsync(&small, sizeof(small)).wait();
+            }
+            largeTask.wait();
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            //小さなメッセージが大きなメッセージを追い越す
+            Assert::AreEqual(LARGE_SIZE, received.back());
+            Assert::IsTrue(std::all_of(received.begin(), received.end() - 1, [](size_t size) { return size == sizeof(DWORD); }));
+        }
+
+        TEST_METHOD(PriorityWrite)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+            EventCounter receiveComplete;
+
+            constexpr int CONTROL_COUNT = 10;
+            constexpr size_t BULK_SIZE = 32 * 1024 * 1024;
+            constexpr size_t URGENT_SIZE = 4 * 1024 * 1024;
+            std::vector<size_t> received;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    received.push_back(param.readedSize);
+                    if (received.size() == CONTROL_COUNT + 2) {
+                        receiveComplete.set();
+                    }
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            client.EnableMultiplex();
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //優先度の低い大量データの後に、優先度の高いメッセージを送信する
+            std::vector<BYTE> bulk(BULK_SIZE, 0xAB);
+            std::vector<BYTE> urgent(URGENT_SIZE, 0xCD);
+            auto bulkTask = client.WriteAsync(&bulk[0], bulk.size(), SendPriority::LOW);
+            auto urgentTask = client.WriteAsync(&urgent[0], urgent.size(), SendPriority::HIGH);
+            DWORD control = 0;
+            for (auto i = 0; i < CONTROL_COUNT; ++i) {
+                client.Write(&control, sizeof(control), SendPriority::HIGH);
+            }
+            urgentTask.wait();
+            bulkTask.wait();
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+
+            auto stats = client.SendStats();
+            for (const auto& lane : stats) {
+                Assert::AreEqual(static_cast<size_t>(0), lane.queued);
+            }
+            Assert::AreEqual(static_cast<std::uint64_t>(CONTROL_COUNT + 1), stats[static_cast<size_t>(SendPriority::HIGH)].sent);
+            Assert::AreEqual(static_cast<std::uint64_t>(0), stats[static_cast<size_t>(SendPriority::NORMAL)].sent);
+            Assert::AreEqual(static_cast<std::uint64_t>(1), stats[static_cast<size_t>(SendPriority::LOW)].sent);
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+            //優先度の高いメッセージが大量データを追い越す
+            Assert::AreEqual(BULK_SIZE, received.back());
+            Assert::AreEqual(static_cast<ptrdiff_t>(1), std::count(received.begin(), received.end(), URGENT_SIZE));
+        }
+
+        TEST_METHOD(RpcCall)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+            std::atomic_int receivedCount{ 0 };
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    receivedCount.fetch_add(1);
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            //偶数は直ちに応答し、奇数は保留して後で逆順に応答する
+            std::mutex heldLock;
+            std::vector<RpcMessage> held;
+            EventCounter allHeld;
+            constexpr DWORD CALL_COUNT = 1000;
+            server.EnableRpc([&](SimpleNamedPipeBase& pipe, const RpcMessage& request) {
+                DWORD value = 0;
+                Assert::AreEqual(sizeof(value), request.Size());
+                std::memcpy(&value, request.Data(), sizeof(value));
+                if (value == (std::numeric_limits<DWORD>::max)()) {
+                    throw std::runtime_error("rpc error");
+                }
+                if (value % 2 == 0) {
+                    value *= 2;
+                    pipe.ReplyAsync(request, &value, sizeof(value));
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(heldLock);
+                held.push_back(request);
+                if (held.size() == CALL_COUNT / 2) {
+                    allHeld.set();
+                }
+            });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            //応答待ちの上限を超える呼び出しはCallAsyncで待機する
+            client.EnableRpc(nullptr, CALL_COUNT);
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            //応答を待たずに連続して呼び出す
+            std::vector<RpcTask> calls;
+            for (DWORD i = 0; i < CALL_COUNT; ++i) {
+                calls.push_back(client.CallAsync(&i, sizeof(i)));
+            }
+            Assert::AreEqual(WC(), allHeld.wait(10000));
+            {
+                std::lock_guard<std::mutex> lock(heldLock);
+                for (auto it = held.rbegin(); it != held.rend(); ++it) {
+                    DWORD value = 0;
+                    std::memcpy(&value, it->Data(), sizeof(value));
+                    value *= 2;
+                    server.ReplyAsync(*it, &value, sizeof(value)).wait();
+                }
+            }
+            for (DWORD i = 0; i < CALL_COUNT; ++i) {
+                auto response = calls[i].get();
+                DWORD value = 0;
+                Assert::AreEqual(sizeof(value), response.Size());
+                std::memcpy(&value, response.Data(), sizeof(value));
+                Assert::AreEqual(i * 2, value);
+            }
+            Assert::AreEqual(static_cast<size_t>(0), client.PendingCalls());
+
+            //ハンドラーの例外はRpcErrorで通知される
+            DWORD failure = (std::numeric_limits<DWORD>::max)();
+            auto failed = client.CallAsync(&failure, sizeof(failure));
+            Assert::ExpectException<RpcError>([&]() { failed.get(); });
+            //RPC有効時は受信イベントに通知しない
+            Assert::AreEqual(0, receivedCount.load());
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+        }
+
+        TEST_METHOD(PipeStatistics)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+            EventCounter receiveComplete;
+
+            constexpr int SMALL_COUNT = 100;
+            std::atomic_int receivedCount{ 0 };
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    if (receivedCount.fetch_add(1) + 1 == SMALL_COUNT + 1) {
+                        receiveComplete.set();
+                    }
+                    break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            std::vector<BYTE> small(100, 0x11);
+            for (auto i = 0; i < SMALL_COUNT; ++i) {
+                client.Write(&small[0], small.size());
+            }
+            //バッファーサイズを超えるメッセージは複数パケットに分割される
+            std::vector<BYTE> large(TypicalSimpleNamedPipeClient::BUFFER_SIZE * 4, 0x22);
+            client.Write(&large[0], large.size());
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+
+            auto sent = client.Stats();
+            auto received = server.Stats();
+#ifdef SNP_DISABLE_STATS
+            Assert::AreEqual(static_cast<std::uint64_t>(0), sent.messagesSent);
+            Assert::AreEqual(static_cast<std::uint64_t>(0), received.messagesReceived);
+#else
+            //処理時間と結合領域は受信イベントから戻った後に記録するので、最後のメッセージの記録まで待つ
+            Assert::IsTrue(WaitUntil([&] {
+                received = server.Stats();
+                return std::accumulate(received.callbackDurations.begin(), received.callbackDurations.end(), std::uint64_t{ 0 }) == static_cast<std::uint64_t>(SMALL_COUNT + 1)
+                    && received.deserializerPoolHighWater >= large.size();
+            }, 1000));
+            Assert::AreEqual(static_cast<std::uint64_t>(SMALL_COUNT + 1), sent.messagesSent);
+            Assert::AreEqual(static_cast<std::uint64_t>(SMALL_COUNT + 1), received.messagesReceived);
+            Assert::AreEqual(sent.bytesSent, received.bytesReceived);
+            Assert::AreEqual(sent.fragmentsSent, received.fragmentsReceived);
+            Assert::IsTrue(sent.fragmentsSent >= static_cast<std::uint64_t>(SMALL_COUNT + 4));
+            Assert::AreEqual(static_cast<std::uint64_t>(0), sent.cancelsSent);
+            Assert::IsTrue(received.readsCompleted + received.readsPending > 0);
+            Assert::IsTrue(received.deserializerPoolHighWater >= large.size());
+            //受信イベント毎に処理時間を記録する
+            Assert::AreEqual(static_cast<std::uint64_t>(SMALL_COUNT + 1), std::accumulate(received.callbackDurations.begin(), received.callbackDurations.end(), std::uint64_t{ 0 }));
+#endif
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+        }
+
+        TEST_METHOD(MessageTracing)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverClosed;
+            EventCounter receiveComplete;
+
+            constexpr int SMALL_COUNT = 10;
+            std::vector<BYTE> small(100, 0x11);
+            //バッファーサイズを超えるメッセージは先頭パケットのみにタイムスタンプを付加する
+            std::vector<BYTE> large(TypicalSimpleNamedPipeClient::BUFFER_SIZE * 4, 0x22);
+            std::atomic_int receivedCount{ 0 };
+            std::atomic_bool corrupted{ false };
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    //タイムスタンプは受信データに含まれない
+                    const auto& expected = receivedCount.load() < SMALL_COUNT ? small : large;
+                    if (param.readedSize != expected.size() || std::memcmp(param.readBuffer, &expected[0], expected.size()) != 0) {
+                        corrupted.store(true);
+                    }
+                    if (receivedCount.fetch_add(1) + 1 == SMALL_COUNT + 1) {
+                        receiveComplete.set();
+                    }
+                    break;
+                }
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            server.EnableTracing();
+            Assert::ExpectException<std::logic_error>([&] { server.EnableTracing(); });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+            client.EnableTracing();
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            std::vector<concurrency::task<void>> tasks;
+            for (auto i = 0; i < SMALL_COUNT; ++i) {
+                tasks.push_back(client.WriteAsync(&small[0], small.size()));
+            }
+            client.Write(&large[0], large.size());
+            for (auto& t : tasks) {
+                t.wait();
+            }
+            Assert::AreEqual(WC(), receiveComplete.wait(10000));
+            Assert::IsFalse(corrupted.load());
+
+            //遅延計測は受信イベントから戻った後に記録するので、最後のメッセージの記録まで待つ
+            auto stats = server.TraceStatistics();
+            Assert::IsTrue(WaitUntil([&] {
+                stats = server.TraceStatistics();
+                return std::all_of(stats.stages.begin(), stats.stages.end(), [](const auto& stage) { return stage.count == static_cast<std::uint64_t>(SMALL_COUNT + 1); })
+                    && server.ChromeTrace().find("\"size\":" + std::to_string(large.size())) != std::string::npos;
+            }, 1000));
+            Assert::AreEqual(static_cast<std::uint64_t>(SMALL_COUNT + 1), stats.messages);
+            for (const auto& stage : stats.stages) {
+                //全メッセージを監視タスクの受信イベントで処理したので全区間を計測する
+                Assert::AreEqual(static_cast<std::uint64_t>(SMALL_COUNT + 1), stage.count);
+                Assert::AreEqual(stage.count, std::accumulate(stage.histogram.begin(), stage.histogram.end(), std::uint64_t{ 0 }));
+                Assert::IsTrue(stage.max <= stage.total);
+            }
+            //送信側は受信していないので計測しない
+            Assert::AreEqual(static_cast<std::uint64_t>(0), client.TraceStatistics().messages);
+
+            auto json = server.ChromeTrace();
+            Assert::AreEqual(static_cast<size_t>(0), json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[{"));
+            Assert::AreNotEqual(std::string::npos, json.find("\"name\":\"transport\""));
+            Assert::AreNotEqual(std::string::npos, json.find("\"size\":" + std::to_string(large.size())));
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+        }
+
+        BEGIN_TEST_METHOD_ATTRIBUTE(TransferMaxDataSize)
+            TEST_PRIORITY(2)
+        END_TEST_METHOD_ATTRIBUTE()
+        TEST_METHOD(TransferMaxDataSize)
+        {
+            if (4 >= sizeof(INT_PTR)) {
+                //32bitプラットフォームではサイズが大きすぎて実行できないので何もしない
+                return;
+            }
+
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
+            EventCounter errEvent;
+
+            using DataVector = std::vector<unsigned int>;
+
+            auto dataCount = MAX_DATA_SIZE / sizeof(DataVector::value_type);
+            auto expected = DataVector(dataCount);
+            int cnt = 0;
+            std::generate(expected.begin(), expected.end(), [&cnt]() {return cnt++; });
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    serverDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    ps.WriteAsync(param.readBuffer, param.readedSize).wait();
+                }
+                break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    errEvent.set();
+                    break;
+                }
+            });
+
+            auto actual = DataVector(dataCount);
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter echoComplete;
+            EventCounter clientDisconnected;
+
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    if (param.readedSize == expected.size() * sizeof(DataVector::value_type)) {
+                        auto p = reinterpret_cast<const DataVector::value_type*>(param.readBuffer);
+                        std::copy(p, p + expected.size(), actual.begin());
+                    }
+                    echoComplete.set();
+                }
+                break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    errEvent.set();
+                    break;
+                }
+            });
+
+            Assert::AreEqual(WC(), serverConnected.wait(1000));
+
+            client.WriteAsync(&expected[0], expected.size() * sizeof(DataVector::value_type)).wait();
+            {
+                concurrency::event* waitEvents[] = { &errEvent.evt, &echoComplete.evt };
+                auto idx = concurrency::event::wait_for_multiple(&waitEvents[0], _countof(waitEvents), false, 180 * 1000);
+
+                if (concurrency::COOPERATIVE_WAIT_TIMEOUT == idx) {
+                    Assert::Fail(L"'timeout: client.WriteAsync");
+                }
+                if (waitEvents[idx] == &errEvent.evt) {
+                    try {
+                        clientErrTask.wait();
+                    }
+                    catch (winrt::hresult_error& ex) {
+                        Assert::Fail(ex.message().c_str());
+                    }
+                    catch (std::exception& ex) {
+                        Assert::Fail(winrt::to_hstring(ex.what()).c_str());
+                    }
+                    catch (...) {
+                        Assert::Fail(L"error!");
+                    }
+                }
+            }
+
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+            server.Close();
+            Assert::AreEqual(WC(), serverClosed.wait(1000));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+
+            Assert::IsTrue(std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()));
+        }
+
+        TEST_METHOD(WatcherTaskException)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverErrEvent;
+
+            TypicalSimpleNamedPipeServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    throw std::exception("server exception");
+                case PipeEventType::RECEIVED:
+                {
+                    ps.WriteAsync(param.readBuffer, param.readedSize).wait();
+                }
+                break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    serverErrEvent.set();
+                    break;
+                }
+            });
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientErrEvent;
+            EventCounter clientDisconnected;
+            std::wstring echoMessage;
+
+            TypicalSimpleNamedPipeClient client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    throw std::exception("client exception");
+                }
+                break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    clientErrEvent.set();
+                    break;
+                }
+            });
+
+            WCHAR hello[] = L"HELLO ERROR!";
+            client.WriteAsync(&hello[0], sizeof(hello)).wait();
+
+            concurrency::event* events[] {&serverErrEvent.evt, &clientErrEvent.evt };
+            auto res = concurrency::event::wait_for_multiple(&events[0], _countof(events), true, 1000);
+            Assert::AreNotEqual(concurrency::COOPERATIVE_WAIT_TIMEOUT, res);
+
+            try {
+                serverErrTask.wait();
+                Assert::Fail();
+            }
+            catch (std::exception& ex) {
+                Assert::AreEqual(std::string("server exception"), std::string(ex.what()));
+            }
+            try {
+                clientErrTask.wait();
+                Assert::Fail();
+            }
+            catch (std::exception& ex) {
+                Assert::AreEqual(std::string("client exception"), std::string(ex.what()));
+            }
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+
+            server.Close();
+        }
+
+        TEST_METHOD(LimitSizeException)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverErrEvent;
+
+            SimpleNamedPipeServer<1024,8> server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    ps.WriteAsync(param.readBuffer, param.readedSize).wait();
+                }
+                break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    serverErrEvent.set();
+                    break;
+                }
+            });
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter clientDisconnected;
+            std::wstring echoMessage;
+
+            SimpleNamedPipeClient<1024,18> client(pipeName.c_str(), [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::DISCONNECTED:
+                    clientDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            });
+
+            {
+                WCHAR data[] = L"0123456789";
+                Assert::ExpectException<std::length_error>([&] {
+                    client.WriteAsync(&data[0], sizeof(data)).wait();
+                });
+            }
+            {
+                WCHAR data[] = L"01234567";
+                try {
+                    client.WriteAsync(&data[0], sizeof(data)).wait();
+                }
+                catch (winrt::hresult_error& ) {
+                    //サーバー側の制限にかかって、例外終了
+                    Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+                }
+            }
+            Assert::AreEqual(WC(), serverErrEvent.wait(1000));
+            try {
+                serverErrTask.wait();
+            }
+            catch (std::length_error& )
+            {}
+            client.Close();
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+
+            server.Close();
+        }
 
         TEST_METHOD(CreateException)
         {
@@ -1427,5 +2611,290 @@ namespace abt::comm::simple_pipe::test
 
             Assert::AreEqual(std::wstring(L"echo: HELLO WORLD!"), echoMessage);
         }
+
+        TEST_METHOD(MultiServerEcho)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
+            concurrency::critical_section sessionCs;
+            std::vector<size_t> receivedSessions;
+
+            //複数クライアントを同時に接続しセッション毎にエコーを返す
+            TypicalSimpleNamedPipeMultiServer server(pipeName.c_str(), nullptr, [&](auto& ps, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::DISCONNECTED:
+                    serverDisconnected.set();
+                    break;
+                case PipeEventType::RECEIVED:
+                {
+                    {
+                        concurrency::critical_section::scoped_lock lock(sessionCs);
+                        receivedSessions.push_back(param.sessionId);
+                    }
+                    std::wstring m(reinterpret_cast<LPCWSTR>(param.readBuffer), 0, param.readedSize / sizeof(WCHAR));
+                    std::wostringstream oss;
+                    oss << L"echo: " << m;
+                    std::wstring echoMessage = oss.str();
+                    ps.WriteAsync(&echoMessage[0], echoMessage.size() * sizeof(WCHAR)).wait();
+                }
+                break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            }, 2);
+
+            Assert::AreEqual(std::wstring(pipeName.c_str()), std::wstring(server.PipeName().c_str()));
+
+            const int CLIENT_COUNT = 8;
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            EventCounter echoComplete;
+            EventCounter clientDisconnected;
+            std::vector<std::wstring> echoMessages(CLIENT_COUNT);
+            std::vector<std::unique_ptr<TypicalSimpleNamedPipeClient>> clients;
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                //プールの待ち受け数を超える接続はサーバー側の補充を待って再試行
+                for (int retry = 0;; ++retry) {
+                    try {
+                        clients.emplace_back(std::make_unique<TypicalSimpleNamedPipeClient>(pipeName.c_str(), [&, i](auto& ps, const auto& param) {
+                            switch (param.type) {
+                            case PipeEventType::DISCONNECTED:
+                                clientDisconnected.set();
+                                break;
+                            case PipeEventType::RECEIVED:
+                                echoMessages[i].assign(reinterpret_cast<LPCWSTR>(param.readBuffer), param.readedSize / sizeof(WCHAR));
+                                echoComplete.set();
+                                break;
+                            case PipeEventType::EXCEPTION:
+                                if (param.errTask) {
+                                    clientErrTask = param.errTask.value();
+                                }
+                                break;
+                            }
+                        }));
+                        break;
+                    }
+                    catch (const winrt::hresult_error& e) {
+                        if (e.code() != HRESULT_FROM_WIN32(ERROR_PIPE_BUSY) || retry >= 100) {
+                            throw;
+                        }
+                        Sleep(10);
+                    }
+                }
+            }
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                Assert::IsFalse(std::get<1>(serverConnected.wait(1000)));
+                if (serverConnected.count() >= CLIENT_COUNT) {
+                    break;
+                }
+                serverConnected.evt.reset();
+            }
+            Assert::AreEqual(CLIENT_COUNT, serverConnected.count());
+            Assert::AreEqual(static_cast<size_t>(CLIENT_COUNT), server.SessionCount());
+
+            //セッションIDは接続毎に一意
+            auto ids = server.SessionIds();
+            std::sort(ids.begin(), ids.end());
+            Assert::IsTrue(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+            Assert::IsTrue(std::find(ids.begin(), ids.end(), 0) == ids.end());
+
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                std::wostringstream oss;
+                oss << L"HELLO " << i;
+                auto hello = oss.str();
+                clients[i]->WriteAsync(&hello[0], hello.size() * sizeof(WCHAR)).wait();
+            }
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                Assert::IsFalse(std::get<1>(echoComplete.wait(1000)));
+                if (echoComplete.count() >= CLIENT_COUNT) {
+                    break;
+                }
+                echoComplete.evt.reset();
+            }
+            Assert::AreEqual(CLIENT_COUNT, echoComplete.count());
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                std::wostringstream oss;
+                oss << L"echo: HELLO " << i;
+                Assert::AreEqual(oss.str(), echoMessages[i]);
+            }
+            std::sort(receivedSessions.begin(), receivedSessions.end());
+            Assert::IsTrue(ids == receivedSessions);
+
+            //セッションIDを指定してサーバーから送信
+            //エコー受信時のシグナルが残っているので待機前にリセット
+            echoComplete.evt.reset();
+            WCHAR notify[] = L"NOTIFY";
+            server.WriteAsync(ids.front(), &notify[0], sizeof(notify)).wait();
+            Assert::AreEqual(WC(CLIENT_COUNT + 1), echoComplete.wait(1000));
+
+            //未接続のセッションIDはERROR_PIPE_NOT_CONNECTED
+            try {
+                server.WriteAsync(ids.back() + 1, &notify[0], sizeof(notify)).wait();
+                Assert::Fail();
+            }
+            catch (const winrt::hresult_error& e) {
+                Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED), static_cast<HRESULT>(e.code()), hresultToStr(e).c_str());
+            }
+
+            //セッション単位で切断
+            server.Disconnect(ids.front());
+            Assert::AreEqual(WC(), serverDisconnected.wait(1000));
+            Assert::AreEqual(WC(), clientDisconnected.wait(1000));
+
+            //切断したセッションIDは次に接続したクライアントを指さない
+            try {
+                server.Write(ids.front(), &notify[0], sizeof(notify));
+                Assert::Fail();
+            }
+            catch (const winrt::hresult_error& e) {
+                Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED), static_cast<HRESULT>(e.code()), hresultToStr(e).c_str());
+            }
+
+            clients.clear();
+            Assert::IsTrue(WaitUntil([&] { return serverDisconnected.count() >= CLIENT_COUNT; }, 1000));
+            //待ち受け数を超えたインスタンスは閉じるが、CLOSEDイベントは通知しない
+            Assert::AreEqual(0, serverClosed.count());
+            server.Close();
+            Assert::IsFalse(std::get<1>(serverClosed.wait(1000)));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+        }
+
+        TEST_METHOD(MultiServerDispatcher)
+        {
+            auto pipeName = std::wstring(L"\\\\.\\pipe\\") + winrt::to_hstring(winrt::Windows::Foundation::GuidHelper::CreateNewGuid());
+
+            concurrency::task<void> serverErrTask = concurrency::task_from_result();
+            EventCounter serverConnected;
+            EventCounter serverDisconnected;
+            EventCounter serverClosed;
+            const int CLIENT_COUNT = 4;
+            const int REPEAT = 200;
+            concurrency::critical_section sessionCs;
+            std::map<size_t, int> nextValues;
+            std::atomic_int outOfOrder{ 0 };
+            std::atomic_int received{ 0 };
+            std::atomic_int running{ 0 };
+            std::atomic_int maxRunning{ 0 };
+            std::atomic_int missingBeforeDisconnect{ 0 };
+
+            //受信イベントはワーカースレッドで実行し、セッション毎に受信順を保つ
+            TypicalSimpleNamedPipeMultiServer server(pipeName.c_str(), nullptr, [&](auto&, const auto& param) {
+                switch (param.type) {
+                case PipeEventType::CONNECTED:
+                    serverConnected.set();
+                    break;
+                case PipeEventType::DISCONNECTED:
+                {
+                    //切断イベントは振り分け済みの受信イベントの後
+                    concurrency::critical_section::scoped_lock lock(sessionCs);
+                    if (nextValues[param.sessionId] != REPEAT) {
+                        missingBeforeDisconnect.fetch_add(1);
+                    }
+                    serverDisconnected.set();
+                }
+                break;
+                case PipeEventType::RECEIVED:
+                {
+                    auto current = running.fetch_add(1) + 1;
+                    auto observed = maxRunning.load();
+                    while (current > observed && !maxRunning.compare_exchange_weak(observed, current)) {}
+                    auto value = *reinterpret_cast<const int*>(param.readBuffer);
+                    {
+                        concurrency::critical_section::scoped_lock lock(sessionCs);
+                        if (nextValues[param.sessionId] != value) {
+                            outOfOrder.fetch_add(1);
+                        }
+                        nextValues[param.sessionId] = value + 1;
+                    }
+                    //重い受信イベント
+                    Sleep(1);
+                    running.fetch_sub(1);
+                    received.fetch_add(1);
+                }
+                break;
+                case PipeEventType::CLOSED:
+                    serverClosed.set();
+                    break;
+                case PipeEventType::EXCEPTION:
+                    //監視タスクで例外発生
+                    if (param.errTask) {
+                        serverErrTask = param.errTask.value();
+                    }
+                    break;
+                }
+            }, CLIENT_COUNT);
+            auto dispatcher = std::make_shared<Dispatcher>(CLIENT_COUNT);
+            server.EnableDispatcher(dispatcher);
+            Assert::ExpectException<std::logic_error>([&]() { server.EnableDispatcher(dispatcher); });
+
+            concurrency::task<void> clientErrTask = concurrency::task_from_result();
+            std::vector<std::unique_ptr<TypicalSimpleNamedPipeClient>> clients;
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                clients.emplace_back(std::make_unique<TypicalSimpleNamedPipeClient>(pipeName.c_str(), [&](auto&, const auto& param) {
+                    if (param.type == PipeEventType::EXCEPTION && param.errTask) {
+                        clientErrTask = param.errTask.value();
+                    }
+                }));
+            }
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                Assert::IsFalse(std::get<1>(serverConnected.wait(1000)));
+                if (serverConnected.count() >= CLIENT_COUNT) {
+                    break;
+                }
+                serverConnected.evt.reset();
+            }
+            Assert::AreEqual(CLIENT_COUNT, serverConnected.count());
+
+            std::vector<concurrency::task<void>> senders;
+            for (auto& client : clients) {
+                senders.emplace_back(concurrency::create_task([&client]() {
+                    for (int value = 0; value < REPEAT; ++value) {
+                        client->Write(&value, sizeof(value));
+                    }
+                }));
+            }
+            concurrency::when_all(senders.begin(), senders.end()).wait();
+            for (auto i = 0; i < 1000 && received.load() < CLIENT_COUNT * REPEAT; ++i) {
+                Sleep(10);
+            }
+            Assert::AreEqual(CLIENT_COUNT * REPEAT, received.load());
+            Assert::AreEqual(0, outOfOrder.load());
+            //異なるセッションの受信イベントは並列に実行される
+            Assert::IsTrue(maxRunning.load() > 1);
+            auto stats = dispatcher->Stats();
+            Assert::AreEqual(static_cast<std::uint64_t>(CLIENT_COUNT * REPEAT), stats.dispatched);
+            Assert::AreEqual(static_cast<size_t>(0), stats.queued);
+            Assert::IsTrue(stats.maxLatency >= stats.totalLatency / static_cast<long long>(stats.dispatched));
+
+            clients.clear();
+            for (int i = 0; i < CLIENT_COUNT; ++i) {
+                Assert::IsFalse(std::get<1>(serverDisconnected.wait(1000)));
+                if (serverDisconnected.count() >= CLIENT_COUNT) {
+                    break;
+                }
+                serverDisconnected.evt.reset();
+            }
+            Assert::AreEqual(0, missingBeforeDisconnect.load());
+            server.Close();
+            Assert::IsFalse(std::get<1>(serverClosed.wait(1000)));
+
+            serverErrTask.wait();
+            clientErrTask.wait();
+        }
     };
 }
@@ -46,7 +46,7 @@ namespace abt::comm::simple_pipe::test::receiver
 
     static std::wstring UnpackMsg(const SimpleNamedPipeBase::Buffer& buffer)
     {
-        return std::wstring(reinterpret_cast<LPCWSTR>(buffer.Pointer()), 0, buffer.Size() / sizeof(WCHAR));
+        return std::wstring(reinterpret_cast<LPCWSTR>(buffer.Pointer()), buffer.Size() / sizeof(WCHAR));
     }
 
     TEST_CLASS(TestReceiver)
@@ -215,6 +215,193 @@ namespace abt::comm::simple_pipe::test::receiver
                 receiver.Feed(&testPacket, testPacket.p.head.size);
             });
         }
+
+        //バッチ通知: 1受信バッファー内の完結パケットは1回のコールバックで通知
+        TEST_METHOD(BatchPackets)
+        {
+            TestPacket<5> testPackets[] = {
+                CreatePacket<5>(L"ABCDE"),
+                CreatePacket<5>(L"FGHIJ"),
+                CreatePacket<5>(L"KLMNO"),
+                CreatePacket<5>(L"PRSTU"),
+                CreatePacket<5>(L"VWXYZ"),
+            };
+            std::vector<std::wstring> expectedValues;
+            size_t totalSize = testPackets[0].header.size * _countof(testPackets);
+            std::unique_ptr<BYTE[]> buffer = std::make_unique<BYTE[]>(totalSize);
+            BYTE* dst = buffer.get();
+            for (const auto& p : testPackets) {
+                auto len = p.header.size;
+                memcpy(dst, &p, len);
+                dst += len;
+                expectedValues.emplace_back(std::wstring(std::begin(p.data), std::end(p.data)));
+            }
+
+            std::vector<size_t> batchSizes;
+            std::vector<std::wstring> actualValues;
+            SimpleNamedPipeBase::Receiver receiver(1024, 1024, SimpleNamedPipeBase::Receiver::Batch{}, [&](SimpleNamedPipeBase::PacketBatch packets) {
+                batchSizes.push_back(packets.size());
+                for (const auto packet : packets) {
+                    actualValues.emplace_back(UnpackMsg(packet->Data()));
+                }
+            });
+            receiver.Feed(buffer.get(), totalSize);
+
+            Assert::AreEqual(size_t(1), batchSizes.size());
+            Assert::AreEqual(size_t(5), batchSizes[0]);
+            Assert::IsTrue(std::equal(expectedValues.begin(), expectedValues.end(), actualValues.begin(), actualValues.end()));
+        }
+
+        //バッチ通知: 受信バッファーの分割位置によらずパケット順序と内容が保たれる
+        TEST_METHOD(BatchComplexPackets)
+        {
+            auto packet1 = CreatePacket<5>(L"ABCDE");
+            auto packet2 = CreatePacket<10>(L"FGHIJKLMNO");
+            auto packet3 = CreatePacket<2>(L"PQ");
+            auto packet4 = CreatePacket<2>(L"RS");
+            auto packet5 = CreatePacket<7>(L"TUVWXYZ");
+
+            auto expected = std::vector<std::wstring>{
+                std::wstring(std::begin(packet1.data), std::end(packet1.data)),
+                std::wstring(std::begin(packet2.data), std::end(packet2.data)),
+                std::wstring(std::begin(packet3.data), std::end(packet3.data)),
+                std::wstring(std::begin(packet4.data), std::end(packet4.data)),
+                std::wstring(std::begin(packet5.data), std::end(packet5.data)),
+            };
+
+            auto totalSize = packet1.header.size + packet2.header.size + packet3.header.size + packet4.header.size + packet5.header.size;
+            auto buffer = std::make_unique<BYTE[]>(totalSize);
+            auto p = &buffer[0];
+            memcpy(p, &packet1.p, packet1.header.size); p += packet1.header.size;
+            memcpy(p, &packet2.p, packet2.header.size); p += packet2.header.size;
+            memcpy(p, &packet3.p, packet3.header.size); p += packet3.header.size;
+            memcpy(p, &packet4.p, packet4.header.size); p += packet4.header.size;
+            memcpy(p, &packet5.p, packet5.header.size);
+
+            for (DWORD feedSize = 1; feedSize <= totalSize; ++feedSize) {
+                std::vector<std::wstring> acutals;
+                SimpleNamedPipeBase::Receiver receiver(1024, 1024, SimpleNamedPipeBase::Receiver::Batch{}, [&](SimpleNamedPipeBase::PacketBatch packets) {
+                    for (const auto packet : packets) {
+                        acutals.emplace_back(UnpackMsg(packet->Data()));
+                    }
+                });
+                auto remain = static_cast<DWORD>(totalSize);
+                p = &buffer[0];
+                while (remain > 0) {
+                    auto size = (std::min)(remain, feedSize);
+                    receiver.Feed(p, size);
+                    remain -= size;
+                    p += size;
+                }
+                Assert::IsTrue(std::equal(expected.begin(), expected.end(), acutals.begin(), acutals.end()));
+            }
+        }
+
+        //バッチ通知: 不正ヘッダーと制限サイズ超過
+        TEST_METHOD(BatchBadPackets)
+        {
+            auto testPacket = CreatePacket<5>(L"ABCDE");
+            SimpleNamedPipeBase::Receiver limited(1024, 8, SimpleNamedPipeBase::Receiver::Batch{}, [&](auto) {});
+            Assert::ExpectException<std::length_error>([&]() {
+                limited.Feed(&testPacket, testPacket.p.head.size);
+            });
+
+            testPacket.header.info.dataOffset = static_cast<WORD>(testPacket.header.size + 1);
+            SimpleNamedPipeBase::Receiver receiver(1024, 1024, SimpleNamedPipeBase::Receiver::Batch{}, [&](auto) {});
+            Assert::ExpectException<std::length_error>([&]() {
+                receiver.Feed(&testPacket, testPacket.p.head.size);
+            });
+        }
+
+        //直接配置: 受信データをまたぐパケットのデータを格納先へ直接配置する
+        TEST_METHOD(PlacementPacket)
+        {
+            auto packet = CreatePacket<15>(L"ABCDEFGHIJKLMNO");
+            auto next = CreatePacket<5>(L"PQRST");
+
+            std::vector<BYTE> storage;
+            std::vector<DWORD> placedSizes;
+            std::wstring actual;
+            SimpleNamedPipeBase::Receiver receiver(1024, 1024, [&](const auto packet) {
+                actual = UnpackMsg(packet->Data());
+            });
+            receiver.EnablePlacement(next.header.size, [&](const SimpleNamedPipeBase::Packet* p) {
+                storage.resize(p->head.DataSize());
+                return storage.data();
+            }, [&](const SimpleNamedPipeBase::Packet* p) {
+                placedSizes.push_back(p->head.size);
+            });
+            Assert::ExpectException<std::logic_error>([&]() {
+                receiver.Placed(1);
+            });
+
+            const BYTE* p = reinterpret_cast<const BYTE*>(&packet);
+            //ヘッダーとデータの一部を受信バッファー経由で受信
+            receiver.Feed(p, 12);
+            auto [target, remain] = receiver.PlacementTarget();
+            Assert::IsTrue(target == storage.data() + 4);
+            Assert::AreEqual(size_t(packet.header.size - 12), remain);
+
+            //格納先への直接受信と受信バッファー経由の受信が混在してもよい
+            memcpy(target, p + 12, 10);
+            receiver.Placed(10);
+            receiver.Feed(p + 22, 6);
+            std::tie(target, remain) = receiver.PlacementTarget();
+            Assert::AreEqual(size_t(packet.header.size - 28), remain);
+            memcpy(target, p + 28, remain);
+            receiver.Placed(remain);
+
+            Assert::AreEqual(size_t(1), placedSizes.size());
+            Assert::AreEqual(packet.header.size, placedSizes[0]);
+            Assert::IsTrue(std::equal(std::begin(packet.data), std::end(packet.data), reinterpret_cast<const WCHAR*>(storage.data())));
+            Assert::IsTrue(std::get<0>(receiver.PlacementTarget()) == nullptr);
+
+            //未受信データが下限未満のパケットは従来通り
+            receiver.Feed(&next, 12);
+            receiver.Feed(reinterpret_cast<const BYTE*>(&next) + 12, next.header.size - 12);
+            Assert::AreEqual(size_t(1), placedSizes.size());
+            Assert::AreEqual(std::wstring(L"PQRST"), actual);
+        }
+
+        //直接配置: 付加情報(HeaderV2のメッセージ全体のサイズ)の途中で区切られたパケットは、付加情報が揃った時点で直接配置する
+        TEST_METHOD(PlacementExtendedHeader)
+        {
+            std::vector<BYTE> data(64, 0x5A);
+            SimpleNamedPipeBase::WriteGather gather(1024);
+            gather.Append(SimpleNamedPipeBase::Header::Create(static_cast<DWORD>(data.size()), true, false), SimpleNamedPipeBase::Buffer(data.data(), data.size()), nullptr, data.size() * 2);
+            std::vector<BYTE> packet;
+            for (const auto& segment : gather.Segments()) {
+                packet.insert(packet.end(), segment.Begin(), segment.End());
+            }
+            const size_t dataOffset = SimpleNamedPipeBase::HeaderSize + SimpleNamedPipeBase::MessageSizeSize;
+
+            std::vector<BYTE> storage;
+            size_t placed = 0;
+            SimpleNamedPipeBase::Receiver receiver(1024, 1024, [&](const auto) {
+                Assert::Fail();
+            });
+            receiver.EnablePlacement(16, [&](const SimpleNamedPipeBase::Packet* p) {
+                storage.resize(p->head.DataSize());
+                return storage.data();
+            }, [&](const SimpleNamedPipeBase::Packet* p) {
+                Assert::AreEqual(packet.size(), static_cast<size_t>(p->head.size));
+                ++placed;
+            });
+
+            //付加情報の途中までは直接配置できない
+            receiver.Feed(packet.data(), dataOffset - 4);
+            Assert::IsTrue(std::get<0>(receiver.PlacementTarget()) == nullptr);
+            //付加情報が揃った時点で直接配置に切り替える
+            receiver.Feed(packet.data() + dataOffset - 4, 12);
+            auto [target, remain] = receiver.PlacementTarget();
+            Assert::IsTrue(target == storage.data() + 8);
+            Assert::AreEqual(packet.size() - dataOffset - 8, remain);
+            memcpy(target, packet.data() + dataOffset + 8, remain);
+            receiver.Placed(remain);
+
+            Assert::AreEqual(size_t(1), placed);
+            Assert::IsTrue(std::equal(data.begin(), data.end(), storage.begin()));
+        }
     };
 
     TEST_CLASS(TestPipePacket)
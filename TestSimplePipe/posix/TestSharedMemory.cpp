@@ -0,0 +1,369 @@
+//共有メモリー転送(POSIX)のテスト
+// Windows版は名前付きパイプで転送するため、TestSimplePipeプロジェクトとは別にLinuxでビルドして実行する。
+//  g++ -std=c++17 -O1 -g -pthread TestSimplePipe/posix/TestSharedMemory.cpp -o test_shm && ./test_shm
+// 失敗したテストがあれば終了コードは1となる。
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <unistd.h>
+
+#define SNP_TEST_MODE   //テストモード有効
+#include "../../inc/SimpleNamedPipe.h"
+
+namespace abt::comm::simple_pipe::test::shared_memory
+{
+    using namespace abt::comm::simple_pipe;
+    using namespace std::chrono_literals;
+
+    using TestServer = SimpleNamedPipeServer<4096>;
+    using TestClient = SimpleNamedPipeClient<4096>;
+    //リングバッファーを何周もさせるため小さくする
+    constexpr size_t RING_SIZE = 16 * 1024;
+
+    struct AssertFailed
+    {
+        std::string message;
+    };
+
+    void IsTrue(bool condition, const std::string& message)
+    {
+        if (!condition) {
+            throw AssertFailed{ message };
+        }
+    }
+
+    std::string PipeName(const char* test)
+    {
+        return std::string("@TestSharedMemory-") + std::to_string(::getpid()) + "-" + test;
+    }
+
+    std::vector<BYTE> Pattern(size_t size, size_t seed)
+    {
+        std::vector<BYTE> data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = static_cast<BYTE>(i * 31 + seed);
+        }
+        return data;
+    }
+
+    std::vector<BYTE> Bytes(const PipeMessage& message)
+    {
+        auto p = static_cast<const BYTE*>(message.Data());
+        return std::vector<BYTE>(p, p + message.Size());
+    }
+
+    /// <summary>
+    /// イベント待ち合わせ
+    /// </summary>
+    struct EventCounter
+    {
+        std::mutex lock;
+        std::condition_variable cv;
+        int cnt{ 0 };
+
+        void set()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ++cnt;
+            }
+            cv.notify_all();
+        }
+
+        int count()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return cnt;
+        }
+
+        bool wait(int n, std::chrono::milliseconds timeout = 5000ms)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            return cv.wait_for(guard, timeout, [&]() { return cnt >= n; });
+        }
+    };
+
+    /// <summary>
+    /// 受信メッセージとイベントを記録するサーバー
+    /// </summary>
+    struct Recorder
+    {
+        EventCounter connected;
+        EventCounter disconnected;
+        EventCounter received;
+        std::mutex lock;
+        std::vector<std::vector<BYTE>> messages;
+
+        void OnEvent(const PipeEventParam& param)
+        {
+            switch (param.type) {
+            case PipeEventType::CONNECTED:
+                connected.set();
+                break;
+            case PipeEventType::DISCONNECTED:
+                disconnected.set();
+                break;
+            case PipeEventType::RECEIVED:
+            {
+                auto p = static_cast<const BYTE*>(param.readBuffer);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    messages.emplace_back(p, p + param.readedSize);
+                }
+                received.set();
+            }
+            break;
+            default:
+                break;
+            }
+        }
+    };
+
+    //リングバッファー単体: 折り返しをまたぐ書き込みは折り返し位置で分割され、データは欠けずに読み出せる
+    void RingWrapAround()
+    {
+        constexpr size_t CAPACITY = 64;
+        std::vector<BYTE> region(SimpleNamedPipeBase::SharedRing::RegionSize(CAPACITY) + alignof(SimpleNamedPipeBase::SharedRing::Control));
+        void* aligned = region.data();
+        size_t space = region.size();
+        std::align(alignof(SimpleNamedPipeBase::SharedRing::Control), SimpleNamedPipeBase::SharedRing::RegionSize(CAPACITY), aligned, space);
+        SimpleNamedPipeBase::SharedRing writer(aligned, CAPACITY, true);
+        SimpleNamedPipeBase::SharedRing reader(aligned, CAPACITY, false);
+
+        //書き込み位置を折り返し直前まで進める
+        auto first = Pattern(48, 1);
+        IsTrue(writer.Write(first.data(), first.size()) == first.size(), "write before wrap");
+        reader.Consume(reader.Readable().Size());
+
+        //残り16バイトの位置から40バイトを書き込むと折り返し位置で分割される
+        auto data = Pattern(40, 2);
+        auto written = writer.Write(data.data(), data.size());
+        IsTrue(written == 16, "write is split at the end of the ring");
+        written += writer.Write(data.data() + written, data.size() - written);
+        IsTrue(written == data.size(), "rest of the write starts at the beginning of the ring");
+
+        std::vector<BYTE> actual;
+        while (actual.size() < data.size()) {
+            auto readable = reader.Readable();
+            IsTrue(!readable.Empty(), "readable data after wrap");
+            actual.insert(actual.end(), readable.Begin(), readable.End());
+            reader.Consume(readable.Size());
+        }
+        IsTrue(actual == data, "data across the wrap is intact");
+        IsTrue(reader.Readable().Empty(), "ring is empty after reading everything");
+
+        //満杯時は書き込めず、書き込み側は待機が必要
+        auto full = Pattern(CAPACITY, 3);
+        IsTrue(writer.Write(full.data(), full.size()) == CAPACITY - 24, "write up to the end of the ring");
+        IsTrue(writer.Write(full.data(), full.size()) == 24, "write the rest after wrap");
+        IsTrue(writer.Write(full.data(), 1) == 0, "full ring accepts nothing");
+        IsTrue(writer.BeginWriterWait(), "writer must wait on a full ring");
+        reader.Consume(reader.Readable().Size());
+        IsTrue(reader.WakeWriter(), "reader wakes the waiting writer");
+        IsTrue(!reader.WakeWriter(), "writer is woken only once");
+        IsTrue(!writer.BeginWriterWait(), "writer does not wait when space is available");
+    }
+
+    //ハンドシェイク: 共有メモリーを受け渡し、リングバッファーより大きなメッセージも欠けずに双方向に転送できる
+    void Handshake()
+    {
+        const auto name = PipeName("Handshake");
+        Recorder serverEvents;
+        TestServer server(name.c_str(), nullptr, [&](auto& ps, const PipeEventParam& param) {
+            serverEvents.OnEvent(param);
+            if (param.type == PipeEventType::RECEIVED) {
+                ps.Write(param.readBuffer, param.readedSize);
+            }
+        }, RING_SIZE);
+        Recorder clientEvents;
+        TestClient client(name.c_str(), [&](auto&, const PipeEventParam& param) {
+            clientEvents.OnEvent(param);
+        }, true);
+        IsTrue(serverEvents.connected.wait(1), "server connected");
+
+        //リングバッファーを何周もするサイズを含める
+        const std::vector<size_t> sizes{ 1, 100, 4096, RING_SIZE - 1, RING_SIZE, RING_SIZE * 3 + 17, 1024 * 1024 };
+        std::vector<std::vector<BYTE>> sent;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            sent.push_back(Pattern(sizes[i], i));
+            client.Write(sent.back().data(), sent.back().size());
+        }
+        IsTrue(clientEvents.received.wait(static_cast<int>(sizes.size())), "echo received");
+        IsTrue(serverEvents.messages == sent, "server received every message intact and in order");
+        IsTrue(clientEvents.messages == sent, "client received every echo intact and in order");
+
+        client.Close();
+        server.Close();
+    }
+
+    //共有メモリー転送に対応していないサーバーへの接続は例外となる
+    void HandshakeRejected()
+    {
+        const auto name = PipeName("HandshakeRejected");
+        Recorder serverEvents;
+        TestServer server(name.c_str(), nullptr, [&](auto&, const PipeEventParam& param) {
+            serverEvents.OnEvent(param);
+        });
+        bool thrown = false;
+        try {
+            TestClient client(name.c_str(), [](auto&, const PipeEventParam&) {}, true);
+        }
+        catch (const std::system_error& e) {
+            thrown = e.code().value() == ETIMEDOUT || e.code().value() == EPROTO;
+        }
+        IsTrue(thrown, "client without shared memory from the server throws ETIMEDOUT or EPROTO");
+        server.Close();
+    }
+
+    //満杯時の背圧: 受信側が読み込まない間は送信が完了せず、読み込みを再開すると全て届く
+    void FullRingBackpressure()
+    {
+        const auto name = PipeName("FullRingBackpressure");
+        Recorder serverEvents;
+        TestServer server(name.c_str(), nullptr, [&](auto&, const PipeEventParam& param) {
+            serverEvents.OnEvent(param);
+        }, RING_SIZE);
+        //受信箱が満杯になると受信を停止し、リングバッファーにデータが残る
+        server.EnableInbox(2);
+        TestClient client(name.c_str(), [](auto&, const PipeEventParam&) {}, true);
+        IsTrue(serverEvents.connected.wait(1), "server connected");
+
+        //受信箱とリングバッファーに収まらない量を送信する
+        constexpr size_t COUNT = 16;
+        constexpr size_t SIZE = 3000;
+        std::vector<std::vector<BYTE>> sent;
+        std::vector<PipeTask> tasks;
+        for (size_t i = 0; i < COUNT; ++i) {
+            sent.push_back(Pattern(SIZE, i));
+        }
+        for (size_t i = 0; i < COUNT; ++i) {
+            tasks.push_back(client.WriteAsync(sent[i].data(), sent[i].size()));
+        }
+        std::this_thread::sleep_for(200ms);
+        IsTrue(!tasks.back().is_done(), "writer waits while the ring is full");
+
+        std::vector<std::vector<BYTE>> received;
+        const auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (received.size() < COUNT && std::chrono::steady_clock::now() < deadline) {
+            if (auto message = server.TryReceive()) {
+                received.push_back(Bytes(*message));
+            }
+            else {
+                std::this_thread::sleep_for(1ms);
+            }
+        }
+        for (auto& task : tasks) {
+            task.wait();
+        }
+        IsTrue(received == sent, "every message arrives after the reader resumes");
+
+        client.Close();
+        server.Close();
+    }
+
+    //相手側の切断: 切断を検知し、満杯で待機中の送信は例外で完了する
+    void PeerDisconnect()
+    {
+        const auto name = PipeName("PeerDisconnect");
+        Recorder serverEvents;
+        TestServer server(name.c_str(), nullptr, [&](auto&, const PipeEventParam& param) {
+            serverEvents.OnEvent(param);
+        }, RING_SIZE);
+        server.EnableInbox(2);
+        Recorder clientEvents;
+        {
+            TestClient client(name.c_str(), [&](auto&, const PipeEventParam& param) {
+                clientEvents.OnEvent(param);
+            }, true);
+            IsTrue(serverEvents.connected.wait(1), "server connected");
+
+            //受信箱を満杯にしてサーバーの受信を停止させると、リングバッファーが満杯になり送信は待機する
+            auto small = Pattern(100, 0);
+            client.Write(small.data(), small.size());
+            client.Write(small.data(), small.size());
+            auto data = Pattern(RING_SIZE * 4, 0);
+            auto pending = client.WriteAsync(data.data(), data.size());
+            std::this_thread::sleep_for(200ms);
+            IsTrue(!pending.is_done(), "writer waits while the ring is full");
+
+            //サーバー側から切断すると待機中の送信は例外で完了する
+            server.Disconnect();
+            IsTrue(clientEvents.disconnected.wait(1), "client detects the disconnect");
+            bool thrown = false;
+            try {
+                pending.wait();
+            }
+            catch (const std::system_error&) {
+                thrown = true;
+            }
+            IsTrue(thrown, "pending write fails after the disconnect");
+
+            //切断前に受信箱へ届いたメッセージは切断後も取り出せる。途中までの大きなメッセージは届かない
+            for (int i = 0; i < 2; ++i) {
+                auto message = server.TryReceive();
+                IsTrue(message && Bytes(*message) == small, "messages received before the disconnect remain in the inbox");
+            }
+            IsTrue(!server.TryReceive(), "partial message is dropped");
+        }
+
+        //サーバーは次の接続を受け付け、新しい共有メモリーで転送する
+        Recorder nextEvents;
+        TestClient next(name.c_str(), [&](auto&, const PipeEventParam& param) {
+            nextEvents.OnEvent(param);
+        }, true);
+        IsTrue(serverEvents.connected.wait(2), "server accepts the next client");
+        auto hello = Pattern(100, 7);
+        next.Write(hello.data(), hello.size());
+        std::optional<PipeMessage> message;
+        const auto deadline = std::chrono::steady_clock::now() + 5s;
+        while (!message && std::chrono::steady_clock::now() < deadline) {
+            message = server.TryReceive();
+            if (!message) {
+                std::this_thread::sleep_for(1ms);
+            }
+        }
+        IsTrue(message && Bytes(*message) == hello, "next session receives its own data");
+
+        //クライアント側から切断するとサーバーが検知する
+        const auto disconnected = serverEvents.disconnected.count();
+        next.Close();
+        IsTrue(serverEvents.disconnected.wait(disconnected + 1), "server detects the client close");
+        server.Close();
+    }
+}
+
+int main()
+{
+    using namespace abt::comm::simple_pipe::test::shared_memory;
+    const std::pair<const char*, std::function<void()>> tests[]{
+        { "RingWrapAround", RingWrapAround },
+        { "Handshake", Handshake },
+        { "HandshakeRejected", HandshakeRejected },
+        { "FullRingBackpressure", FullRingBackpressure },
+        { "PeerDisconnect", PeerDisconnect },
+    };
+    int failed = 0;
+    for (const auto& [name, test] : tests) {
+        try {
+            test();
+            std::cout << "[  PASSED  ] " << name << std::endl;
+        }
+        catch (const AssertFailed& e) {
+            ++failed;
+            std::cout << "[  FAILED  ] " << name << ": " << e.message << std::endl;
+        }
+        catch (const std::exception& e) {
+            ++failed;
+            std::cout << "[  FAILED  ] " << name << ": exception " << e.what() << std::endl;
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
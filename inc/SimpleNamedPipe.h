@@ -1,1304 +1,9449 @@
 ﻿#pragma once
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+#include <future>
+#endif
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
 #include <limits>
 #include <memory>
+#include <utility>
 #include <functional>
 #include <tuple>
 #include <optional>
-#include <winrt/base.h>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <array>
+#include <unordered_map>
+#include <thread>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+//C++20コルーチンAPI(AwaitWrite, AwaitReceive, PipeCoroutine)を利用可能
+#define SNP_HAS_COROUTINE 1
+#endif
+#ifdef _WIN32
+#include <winrt/base.h>
 #include <ppl.h>
 #include <ppltasks.h>
+#endif
 
 namespace abt::comm::simple_pipe
 {
-    //推奨バッファーサイズ
-    constexpr DWORD TYPICAL_BUFFER_SIZE = 64 * 1024;
-    //最少バッファーサイズ
-    constexpr DWORD MIN_BUFFER_SIZE = 40;
-    static_assert(TYPICAL_BUFFER_SIZE >= MIN_BUFFER_SIZE, "TYPICAL_BUFFER_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+#ifdef _WIN32
+    //非同期タスク
+    using PipeTask = concurrency::task<void>;
+    //キャンセルトークン
+    using CancellationToken = concurrency::cancellation_token;
+    //非同期タスクの完了通知
+    using PipeTaskCompletion = concurrency::task_completion_event<void>;
+#else
+    //Win32互換の型定義
+    using BYTE = std::uint8_t;
+    using WORD = std::uint16_t;
+    using DWORD = std::uint32_t;
+    using LPCVOID = const void*;
 
     /// <summary>
-    /// イベント種別
+    /// ファイルディスクリプタのRAIIラッパー（winrt::file_handle 相当）
     /// </summary>
-    enum PipeEventType {
-        //接続（サーバーのみ）
-        CONNECTED,
-        //切断
-        DISCONNECTED,
-        //受信
-        RECEIVED,
-        //破棄（サーバーのみ）
-        CLOSED,
-        //例外発生
-        EXCEPTION,
+    class UniqueFd final
+    {
+    private:
+        int fd{ -1 };
+    public:
+        UniqueFd() = default;
+        explicit UniqueFd(int fd) : fd(fd) {}
+        UniqueFd(const UniqueFd&) = delete;
+        UniqueFd& operator=(const UniqueFd&) = delete;
+        UniqueFd(UniqueFd&& other) noexcept : fd(other.release()) {}
+        UniqueFd& operator=(UniqueFd&& other) noexcept
+        {
+            if (this != &other) {
+                close();
+                fd = other.release();
+            }
+            return *this;
+        }
+        ~UniqueFd() { close(); }
+
+        int get() const noexcept { return fd; }
+        int release() noexcept { return std::exchange(fd, -1); }
+        void close() noexcept
+        {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        explicit operator bool() const noexcept { return fd >= 0; }
     };
 
     /// <summary>
-    /// 受信イベント
+    /// errno値を std::system_error 例外として送出（winrt::throw_hresult 相当）
     /// </summary>
-    struct PipeEventParam {
-        //イベント種別
-        const PipeEventType type;
-        //受信データ。受信データはコールバック中でのみ有効。
-        LPCVOID readBuffer;
-        //受信データサイズ
-        const size_t readedSize;
-        //例外発生時の監視タスク
-        const std::optional<concurrency::task<void>> errTask;
+    [[noreturn]] inline void ThrowErrno(int err)
+    {
+        throw std::system_error(err, std::generic_category());
+    }
+
+    /// <summary>
+    /// 失敗時は現在のerrno値を例外として送出（winrt::check_bool 相当）
+    /// </summary>
+    inline void CheckErrno(bool success)
+    {
+        if (!success) {
+            ThrowErrno(errno);
+        }
+    }
+
+    /// <summary>
+    /// タスクのキャンセル例外（concurrency::task_canceled 相当）
+    /// </summary>
+    class TaskCanceled : public std::runtime_error
+    {
+    public:
+        TaskCanceled() : std::runtime_error("task canceled") {}
     };
 
     /// <summary>
-    /// 名前付きパイプ共通ベースクラス
+    /// キャンセルトークン（concurrency::cancellation_token 相当）
     /// </summary>
-    class SimpleNamedPipeBase
+    class CancellationToken final
     {
+    private:
+        std::shared_ptr<std::atomic_bool> flag;
+        friend class CancellationTokenSource;
+        explicit CancellationToken(std::shared_ptr<std::atomic_bool> flag) : flag(std::move(flag)) {}
     public:
-        SimpleNamedPipeBase() = delete;
-        SimpleNamedPipeBase(SimpleNamedPipeBase&&) = delete;
-        SimpleNamedPipeBase(const SimpleNamedPipeBase&) = delete;
+        CancellationToken() = default;
+        static CancellationToken none() { return CancellationToken(); }
+        bool is_cancelable() const noexcept { return static_cast<bool>(flag); }
+        bool is_canceled() const noexcept { return flag && flag->load(); }
+    };
 
-        SimpleNamedPipeBase& operator=(SimpleNamedPipeBase&&) = delete;
-        SimpleNamedPipeBase& operator=(const SimpleNamedPipeBase&) = delete;
-        virtual ~SimpleNamedPipeBase()
-        {}
+    /// <summary>
+    /// キャンセルトークン発行元（concurrency::cancellation_token_source 相当）
+    /// </summary>
+    class CancellationTokenSource final
+    {
+    private:
+        std::shared_ptr<std::atomic_bool> flag{ std::make_shared<std::atomic_bool>(false) };
+    public:
+        CancellationToken get_token() const { return CancellationToken(flag); }
+        void cancel() const { flag->store(true); }
+    };
 
-#pragma region Receiver
+    /// <summary>
+    /// 非同期タスクの完了通知（concurrency::task_completion_event&lt;void&gt; 相当）
+    /// コピーしたインスタンスは同じタスクを共有する。
+    /// </summary>
+    class PipeTaskCompletion final
+    {
+    private:
+        std::shared_ptr<std::promise<void>> promise{ std::make_shared<std::promise<void>>() };
+        std::shared_future<void> future{ promise->get_future().share() };
+    public:
         /// <summary>
-        /// 受信バッファー管理クラス
+        /// 正常終了を通知
         /// </summary>
-        class Buffer final
+        /// <returns>通知済みの場合はfalse</returns>
+        bool set() const
         {
-        private:
-            const BYTE* sp;
-            const BYTE* ep;
-        public:
-            explicit Buffer(LPCVOID buffer, size_t size)
-                : sp{ reinterpret_cast<const BYTE*>(buffer) }
-                , ep{ reinterpret_cast<const BYTE*>(buffer) + size }
-            {}
-            const BYTE* Begin() const { assert(sp != nullptr); return sp; }
-            const BYTE* End() const { assert(ep != nullptr); return ep; }
-            bool Empty() const { return sp == ep; }
-            const BYTE* Pointer() const { assert(sp != nullptr); return sp; }
-            size_t Size() const { assert(sp != nullptr); return std::distance(sp, ep); }
-            Buffer Consume(size_t size)
-            {
-                if (size > Size()) {
-                    throw std::length_error("size is too large");
-                }
-                auto preSp = sp;
-                sp += size;
-                return Buffer(preSp, size);
+            try {
+                promise->set_value();
+                return true;
             }
-        };
+            catch (const std::future_error&) {
+                return false;
+            }
+        }
 
         /// <summary>
-        /// データパケット
+        /// 例外終了を通知
         /// </summary>
-        struct alignas(4) Header {
-            DWORD size;
-            union {
-                DWORD reserve;
-                struct {
-                    WORD dataOffset;    //パケットの先頭からデータまでのオフセット
-                    WORD startBit : 1;
-                    WORD endBit : 1;
-                    WORD cancelBit : 1;
-                    WORD reserve : 13;
-                } info;
-            };
-            inline size_t DataOffset() const { return info.dataOffset; }
-            inline size_t DataSize() const
-            {
-                assert(size >= info.dataOffset);
-                return size - info.dataOffset;
-            }
-            inline bool IsStart() const { return info.startBit != 0; }
-            inline bool IsEnd() const { return info.endBit != 0; }
-            inline bool IsCancel() const { return info.cancelBit != 0; }
-            static inline Header Create(DWORD dataSize, bool startBit, bool endBit)
-            {
-                Header header{ 0 };
-                header.size = static_cast<DWORD>(dataSize + HeaderSize);
-                header.info.dataOffset = HeaderSize;
-                header.info.startBit = startBit ? 1 : 0;
-                header.info.endBit = endBit ? 1 : 0;
-                return header;
+        /// <returns>通知済みの場合はfalse</returns>
+        bool set_exception(std::exception_ptr ex) const
+        {
+            try {
+                promise->set_exception(ex);
+                return true;
             }
-            static inline Header CreateCancel()
-            {
-                Header header{ 0 };
-                header.size = HeaderSize;
-                header.info.dataOffset = HeaderSize;
-                header.info.cancelBit = 1;
-                return header;
+            catch (const std::future_error&) {
+                return false;
             }
-        };
-        inline static constexpr size_t HeaderSize = sizeof(Header);
-        static_assert((std::numeric_limits<WORD>::max)() >= HeaderSize);
+        }
 
-        struct Packet
-        {
-            //size分も含めた全体のサイズ
-            Header head;
-            BYTE data[1];
-            Buffer Data() const
-            {
-                return Buffer(reinterpret_cast<const BYTE*>(this) + head.DataOffset(), head.DataSize());
-            }
-        };
+        std::shared_future<void> Future() const { return future; }
+    };
 
-        using ReceivedCallback = std::function<void(const Packet*)> ;
+    /// <summary>
+    /// 非同期タスク（concurrency::task&lt;void&gt; の必要最小限の代替）
+    /// </summary>
+    class PipeTask final
+    {
+    private:
+        std::shared_future<void> future;
+    public:
+        PipeTask() : PipeTask(FromResult()) {}
+        explicit PipeTask(std::shared_future<void> future) : future(std::move(future)) {}
+        explicit PipeTask(const PipeTaskCompletion& completion) : future(completion.Future()) {}
 
         /// <summary>
-        /// 受信データ復号クラス
+        /// 完了済みタスク（concurrency::task_from_result 相当）
         /// </summary>
-        class Receiver final
+        static PipeTask FromResult()
         {
-        private:
-            class Idle;
-            class Continuation;
-            class Insufficient;
+            std::promise<void> promise;
+            promise.set_value();
+            return PipeTask(promise.get_future().share());
+        }
 
-            /// <summary>
-            /// 受信ステート基底クラス
-            /// </summary>
-            class StateBase
-            {
-            protected:
-                Receiver* owner;
-                StateBase() : owner(nullptr) {}
-                StateBase(Receiver* owner) : owner{ owner } {}
+        /// <summary>
+        /// 例外で終了したタスク
+        /// </summary>
+        static PipeTask FromException(std::exception_ptr ex)
+        {
+            std::promise<void> promise;
+            promise.set_exception(ex);
+            return PipeTask(promise.get_future().share());
+        }
 
-            protected:
-                inline DWORD Limit() const { return owner->limitSize; }
-                inline std::vector<BYTE>& Pool() { return owner->pool; }
-                inline Idle& Idle() { return owner->idle; }
-                inline Continuation& Continuation() { return owner->continuation; }
-                inline Insufficient& Insufficient() { return owner->insufficient; }
-                inline void TrhowIfBadHeader(const Header *head) const
-                {
-                    if (head->size < HeaderSize || head->info.dataOffset < HeaderSize) {
-                        throw std::length_error("bad packet header");
-                    }
-                    if ((head->size - HeaderSize) > Limit()) {
-                        throw std::length_error("too long packet size");
-                    }
+        /// <summary>
+        /// 別スレッドで関数を実行（concurrency::create_task 相当）
+        /// </summary>
+        template<typename Func>
+        static PipeTask Run(Func func)
+        {
+            auto promise = std::make_shared<std::promise<void>>();
+            PipeTask task(promise->get_future().share());
+            std::thread([promise, func = std::move(func)]() mutable {
+                try {
+                    func();
+                    promise->set_value();
                 }
-
-            public:
-                /// <summary>
-                /// 受信データ処理
-                /// </summary>
-                /// <param name="buffer">入力受信データ</param>
-                /// <returns>{次のステート, 出力パケット(Empty()==true時は取得パケットなし) }</returns>
-                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) = 0;
-                virtual ~StateBase() {}
-            };
-
-            /// <summary>
-            /// パケットが受信データをまたがない状態
-            /// </summary>
-            class Idle final : public StateBase
-            {
-            public:
-                Idle(Receiver* owner) : StateBase(owner) {}
-                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
-                {
-                    if (buffer.Size() < HeaderSize) {
-                        //ヘッダー部を完全に受信できていない
-                        // Insufficientステートをセットアップして次回以降に続きを受信
-                        Insufficient().Continue(buffer.Consume(buffer.Size()));
-                        return { &Insufficient(), Buffer(buffer.End(),0) };
-                    }
-                    const Packet* packet = reinterpret_cast<const Packet*>(buffer.Pointer());
-                    TrhowIfBadHeader(&packet->head);
-                    if (packet->head.size > buffer.Size()) {
-                        //パケットサイズが受信バッファー残サイズより大きい場合
-                        // Continuationをセットアップして続きは次回以降に取得
-                        Continuation().Continue(buffer.Consume(buffer.Size()), packet->head.size - buffer.Size());
-                        return { &Continuation(), Buffer(buffer.End(),0) };
-                    }
-                    //1パケット受信。パケットサイズ分を受信データから切り出し。
-                    return { this, buffer.Consume(packet->head.size) };
+                catch (...) {
+                    promise->set_exception(std::current_exception());
                 }
-            };
+            }).detach();
+            return task;
+        }
 
-            /// <summary>
-            /// 連続した受信をまたぐ状態
-            /// </summary>
-            class Continuation final : public StateBase
-            {
-            private:
-                size_t remain{ 0 };
-            public:
-                Continuation(Receiver* owner) : StateBase(owner) {}
+        /// <summary>
+        /// 完了を待機。タスクが例外で終了していた場合は再送出する。
+        /// </summary>
+        void wait() const { future.get(); }
+        void get() const { future.get(); }
+        bool is_done() const { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    };
 
-                /// <summary>
-                /// 受信済みデータをプール領域にセットアップ
-                /// </summary>
-                /// <param name="buffer">プール領域へ保存するバッファー</param>
-                /// <param name="totalRemain">未受信データサイズ</param>
-                void Continue(Buffer buffer, size_t totalRemain)
-                {
-                    Pool().clear();
-                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
-                    this->remain = totalRemain;
-                }
+    /// <summary>
+    /// ソケットファイルのアクセス権（SECURITY_ATTRIBUTES の代替）
+    /// </summary>
+    struct SocketSecurityAttributes {
+        //ソケットファイルのパーミッション
+        mode_t mode;
+    };
+    using LPSOCKET_SECURITY_ATTRIBUTES = const SocketSecurityAttributes*;
 
-                /// <summary>
-                /// 未受信データサイズをセットアップ。プール領域にはすでに受信済みデータが存在することが前提。
-                /// </summary>
-                /// <param name="totalRemain">未受信データサイズ</param>
-                void Continue(size_t totalRemain)
-                {
-                    this->remain = totalRemain;
-                }
+    /// <summary>
+    /// パイプ名称からUNIXドメインソケットのアドレスを生成
+    /// 先頭が'@'の場合はLinuxの抽象名前空間とする。
+    /// </summary>
+    /// <param name="name">パイプ名称（ソケットファイルのパス）</param>
+    /// <param name="addr">出力アドレス</param>
+    /// <returns>アドレス長</returns>
+    inline socklen_t MakeSocketAddress(const char* name, sockaddr_un& addr)
+    {
+        if (name == nullptr || name[0] == '\0') {
+            ThrowErrno(EINVAL);
+        }
+        addr = {};
+        addr.sun_family = AF_UNIX;
+        auto length = std::strlen(name);
+        if (length >= sizeof(addr.sun_path)) {
+            ThrowErrno(ENAMETOOLONG);
+        }
+        std::memcpy(addr.sun_path, name, length);
+        if (name[0] == '@') {
+            addr.sun_path[0] = '\0';
+            return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + length);
+        }
+        return static_cast<socklen_t>(sizeof(addr));
+    }
 
-                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
-                {
-                    auto appendSize = (std::min)(buffer.Size(), remain);
-                    auto appendBuf = buffer.Consume(appendSize);
-                    Pool().insert(Pool().end(), appendBuf.Begin(), appendBuf.End());
-                    remain -= appendSize;
-                    if (0 == remain) {
-                        //分割されたパケットを結合したものを戻り値とする
-                        return { &Idle(), Buffer(&Pool()[0], Pool().size()) };
-                    }
-                    //まだ必要サイズに満たないので受信処理を継続。
-                    return { this, Buffer(buffer.End(),0) };
+    /// <summary>
+    /// 待ち受けソケット。破棄時にソケットファイルを削除する。
+    /// 複数インスタンスのサーバーで共有する。
+    /// </summary>
+    struct ListenSocket final
+    {
+        UniqueFd handle;
+        const std::string path;
+
+        ListenSocket(UniqueFd handle, const char* path) : handle(std::move(handle)), path(path) {}
+        ListenSocket(const ListenSocket&) = delete;
+        ListenSocket& operator=(const ListenSocket&) = delete;
+        ~ListenSocket()
+        {
+            if (handle) {
+                handle.close();
+                if (path[0] != '@') {
+                    ::unlink(path.c_str());
                 }
-            };
+            }
+        }
+    };
+#endif
 
-            /// <summary>
-            /// ヘッダー領域途中で分割されている場合
-            /// </summary>
-            class Insufficient final : public StateBase
-            {
-            public:
-                Insufficient(Receiver* owner) : StateBase(owner) {}
+    //推奨バッファーサイズ
+    constexpr DWORD TYPICAL_BUFFER_SIZE = 64 * 1024;
+    //最少バッファーサイズ
+    constexpr DWORD MIN_BUFFER_SIZE = 40;
+    static_assert(TYPICAL_BUFFER_SIZE >= MIN_BUFFER_SIZE, "TYPICAL_BUFFER_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+    //送信キューの長さ(2のべき乗)。満杯の場合は送信要求元を空きができるまで待機させる。
+    constexpr size_t SEND_QUEUE_SIZE = 64;
+    //送信ループが送信要求を処理し終えた後、次の送信要求を待機する時間
+    constexpr std::chrono::milliseconds WRITE_LOOP_LINGER{ 100 };
+    //送信枠(EnableFlowControl)の付与待ち中にキャンセル、切断を確認する間隔
+    constexpr std::chrono::milliseconds CREDIT_WAIT_INTERVAL{ 10 };
+    //多重化(EnableMultiplex)で同時に断片を送信する大きなメッセージ数
+    constexpr size_t MULTIPLEX_STREAMS = 8;
+    //適応的な断片サイズ(EnableAdaptiveFragments)の断片サイズの上限の既定値
+    //これより大きくしても書き込み回数の削減効果は小さく、受信側で断片を結合する領域がキャッシュに収まらなくなる。
+    constexpr size_t DEFAULT_MAX_FRAGMENT_SIZE = 256 * 1024;
+    //適応的な断片サイズで1断片の書き込みにかける時間の目安。送信中のキャンセルの応答性を保つ。
+    constexpr std::chrono::microseconds ADAPTIVE_FRAGMENT_TARGET{ 2000 };
+    //メッセージ全体のサイズ(HeaderV2)から受信前に確保する結合領域の上限(バッファーサイズの4倍がこれより大きければそちら)
+    //申告されたサイズだけで大きなメモリーを確保しないよう、超える分は受信に合わせて倍々に確保する。
+    constexpr size_t MAX_PRESIZE = 1024 * 1024;
+    //送信優先度の段階数(SendPriority)
+    constexpr size_t SEND_PRIORITIES = 3;
+    //優先度の低い送信要求が待機するとこの時間毎に1段階ずつ優先度を引き上げる(飢餓防止)
+    constexpr std::chrono::milliseconds SEND_PRIORITY_AGING{ 50 };
+#ifndef _WIN32
+    //共有メモリー転送のリングバッファーサイズ(方向毎、2のべき乗)
+    constexpr size_t DEFAULT_SHARED_RING_SIZE = 4 * 1024 * 1024;
+    //共有メモリー転送の接続時ハンドシェイクのタイムアウト(ミリ秒)
+    constexpr int SHARED_MEMORY_HANDSHAKE_TIMEOUT = 5000;
+#endif
+    //一時ファイルへの退避(EnableSpill)の既定のしきい値。これ以上のメッセージは一時ファイルのマッピングで結合する。
+    constexpr size_t DEFAULT_SPILL_THRESHOLD = 64 * 1024 * 1024;
+    //受信メッセージプールがサイズクラス毎に保持する未使用スラブの合計サイズの上限
+    constexpr size_t MESSAGE_POOL_CACHE_BYTES = 16 * 1024 * 1024;
+    //受信箱(EnableInbox)の既定の長さ(2のべき乗)
+    constexpr size_t DEFAULT_INBOX_SIZE = 1024;
+    //受信イベントの振り分け(EnableDispatcher)で接続毎に未処理として保持するメッセージ数。超えると受信を停止する。
+    constexpr size_t DISPATCH_QUEUE_SIZE = 1024;
+    //RPC(EnableRpc)で応答待ちにできる呼び出し数の既定値。超えるとCallAsyncは空きができるまで待機する。
+    constexpr size_t DEFAULT_RPC_PENDING_CALLS = 4096;
+    //受信イベントの処理時間のヒストグラム(PipeStats::callbackDurations)の区間数
+    constexpr size_t STATS_HISTOGRAM_BUCKETS = 16;
+    //遅延計測(EnableTracing)でChrome trace形式の出力用に保持する直近のメッセージ数
+    constexpr size_t TRACE_RECORDS = 1024;
 
-                /// <summary>
-                /// 受信済みデータをプール領域にセットアップ
-                /// </summary>
-                /// <param name="buffer">プール領域へ保存するバッファー</param>
-                void Continue(Buffer buffer)
-                {
-                    Pool().clear();
-                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
-                }
+#pragma region MessagePool
+    class MessagePool;
 
-                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
-                {
-                    auto prevSize = static_cast<DWORD>(Pool().size());
-                    //パケットサイズが分からないので、受信データ全てをプール領域へコピーする
-                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
-                    if (Pool().size() < HeaderSize) {
-                        //ヘッダー領域が受信できていない
-                        auto consumed = buffer.Consume(buffer.Size());
-                        return { this, Buffer(buffer.End(),0) };
-                    }
-                    const Packet* packet = reinterpret_cast<const Packet*>(&Pool()[0]);
-                    TrhowIfBadHeader(&packet->head);
-                    const DWORD remain = packet->head.size - prevSize;
-                    if (remain > buffer.Size()) {
-                        //パケットサイズが受信バッファー残サイズより大きい場合
-                        Continuation().Continue(remain - buffer.Size());
-                        buffer.Consume(buffer.Size());
-                        //足らないパケットデータは次回以降で受信する
-                        return { &Continuation(), Buffer(buffer.End(),0) };
-                    }
-                    //完全なパケットが取得できた
-                    buffer.Consume(remain);
-                    return { &Idle(),  Buffer(&Pool()[0], packet->head.size) };
-                }
+    /// <summary>
+    /// 受信メッセージを格納するスラブ。ヘッダーの直後にデータ領域が続く。
+    /// </summary>
+    struct MessageSlab {
+        //参照カウント
+        std::atomic_size_t refs;
+        //貸し出し中のみ所属するプールを保持する
+        std::shared_ptr<MessagePool> owner;
+        //サイズクラス
+        const size_t sizeClass;
+        //データ領域のサイズ
+        const size_t capacity;
+        //格納済みのデータサイズ
+        size_t size;
+        //プール外の領域(MessagePool::Adopt)。nullptrの場合はヘッダー直後のデータ領域
+        BYTE* external{ nullptr };
+        //プール外の領域の所有者
+        std::shared_ptr<void> backing{};
 
-            };
+        BYTE* Data() { return external != nullptr ? external : reinterpret_cast<BYTE*>(this + 1); }
+    };
 
-            //受信バッファーをまたいだ場合の一時保存領域
-            std::vector<BYTE> pool;
+    /// <summary>
+    /// 参照カウント付きの受信メッセージハンドル
+    /// コピーしてコールバックの外や別スレッドへ持ち出せる。最後のハンドルの破棄でスラブはプールへ返却される。
+    /// </summary>
+    class PipeMessage final
+    {
+        friend class MessagePool;
+    private:
+        MessageSlab* slab{ nullptr };
 
-            //受信コールバック
-            ReceivedCallback callback;
+        explicit PipeMessage(MessageSlab* slab) noexcept : slab(slab) {}
+        inline void Release() noexcept;
+    public:
+        PipeMessage() noexcept = default;
+        PipeMessage(const PipeMessage& other) noexcept
+            : slab(other.slab)
+        {
+            if (slab != nullptr) {
+                slab->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        PipeMessage(PipeMessage&& other) noexcept
+            : slab(std::exchange(other.slab, nullptr))
+        {}
+        PipeMessage& operator=(const PipeMessage& other) noexcept
+        {
+            PipeMessage(other).Swap(*this);
+            return *this;
+        }
+        PipeMessage& operator=(PipeMessage&& other) noexcept
+        {
+            PipeMessage(std::move(other)).Swap(*this);
+            return *this;
+        }
+        ~PipeMessage()
+        {
+            Release();
+        }
 
-            Idle idle;
-            Continuation continuation;
-            Insufficient insufficient;
-            StateBase* state;
+        void Swap(PipeMessage& other) noexcept { std::swap(slab, other.slab); }
+        LPCVOID Data() const { return slab != nullptr ? slab->Data() : nullptr; }
+        size_t Size() const { return slab != nullptr ? slab->size : 0; }
+        bool Empty() const { return slab == nullptr; }
+        explicit operator bool() const { return slab != nullptr; }
+    };
 
-            const DWORD limitSize;
+    /// <summary>
+    /// 受信メッセージ用のスラブを再利用するプール
+    /// スラブはバッファーサイズを基準に2倍ずつのサイズクラスに分け、上限サイズのクラスまで用意する。
+    /// 返却されたスラブはサイズクラス毎にMESSAGE_POOL_CACHE_BYTESまで保持し、定常状態ではメモリー確保を行わない。
+    /// </summary>
+    class MessagePool final : public std::enable_shared_from_this<MessagePool>
+    {
+        friend class PipeMessage;
+    private:
+        struct PrivateTag {};
+        //サイズクラス毎のデータ領域のサイズ
+        std::vector<size_t> classSizes;
+        //サイズクラス毎の未使用スラブ
+        std::vector<std::vector<MessageSlab*>> freeLists;
+        const size_t cacheBytes;
+        std::mutex lock;
 
-        public:
-            Receiver() = delete;
-            Receiver(Receiver&&) = delete;
-            Receiver(const Receiver&) = delete;
+        size_t ClassOf(size_t size) const
+        {
+            auto it = std::lower_bound(classSizes.begin(), classSizes.end(), size);
+            if (it == classSizes.end()) {
+                throw std::length_error("size is too long");
+            }
+            return static_cast<size_t>(std::distance(classSizes.begin(), it));
+        }
 
-            Receiver& operator=(Receiver&&) = delete;
-            Receiver& operator=(const Receiver&) = delete;
+        static void Destroy(MessageSlab* slab) noexcept
+        {
+            slab->~MessageSlab();
+            ::operator delete(slab);
+        }
 
-            /// <summary>
-            /// コンストラクタ
-            /// </summary>
-            /// <param name="reserveSize">受信バッファー初期リザーブサイズ</param>
-            /// <param name="callback">受信コールバック</param>
-            Receiver(size_t reserveSize, DWORD limitSize, ReceivedCallback callback)
-                : limitSize(limitSize)
-                , callback(callback)
-                , idle(this)
-                , continuation(this)
-                , insufficient(this)
-                , state(&idle)
+        /// <summary>
+        /// 参照が無くなったスラブを返却
+        /// </summary>
+        void Recycle(MessageSlab* slab) noexcept
+        {
             {
-                if (!callback) {
-                    throw std::invalid_argument("bad callback error");
+                std::lock_guard<std::mutex> guard(lock);
+                auto& freeList = freeLists[slab->sizeClass];
+                if ((freeList.size() + 1) * slab->capacity <= cacheBytes) {
+                    freeList.push_back(slab);
+                    return;
                 }
-                pool.reserve(reserveSize);
             }
+            Destroy(slab);
+        }
 
-            /// <summary>
-            /// 受信データ処理
-            /// </summary>
-            /// <param name="p">受信バッファー</param>
-            /// <param name="size">サイズ</param>
-            void Feed(LPCVOID p, size_t size)
-            {
-                auto buffer = Buffer(p, size);
-                //バッファー内をすべて処理するまで繰り返し
-                while (!buffer.Empty()) {
-                    std::tuple<StateBase*, Buffer> res = state->Feed(buffer);
-                    state = std::get<0>(res);
-                    if (!std::get<1>(res).Empty()) {
-                        //受信パケットデータが存在したら受信コールバクを実行
-                        const BYTE* ptr = std::get<1>(res).Pointer();
-                        const Packet* packet = reinterpret_cast<const Packet*>(ptr);
-                        callback(packet);
-                    }
+    public:
+        MessagePool() = delete;
+        MessagePool(MessagePool&&) = delete;
+        MessagePool(const MessagePool&) = delete;
+        MessagePool& operator=(MessagePool&&) = delete;
+        MessagePool& operator=(const MessagePool&) = delete;
+
+        MessagePool(PrivateTag, size_t slabSize, size_t limitSize, size_t cacheBytes)
+            : cacheBytes(cacheBytes)
+        {
+            if (slabSize == 0 || limitSize == 0) {
+                throw std::invalid_argument("bad slab size");
+            }
+            auto size = (std::min)(slabSize, limitSize);
+            while (true) {
+                classSizes.push_back(size);
+                if (size >= limitSize) {
+                    break;
                 }
+                size = (size > limitSize / 2) ? limitSize : size * 2;
+            }
+            freeLists.resize(classSizes.size());
+            for (size_t i = 0; i < classSizes.size(); ++i) {
+                //返却時にメモリー確保しないように予約しておく
+                freeLists[i].reserve(cacheBytes / classSizes[i]);
             }
+        }
 
-            /// <summary>
-            /// 初期状態にリセット
-            /// </summary>
-            void Reset()
-            {
-                state = &idle;
+        ~MessagePool()
+        {
+            for (auto& freeList : freeLists) {
+                for (auto slab : freeList) {
+                    Destroy(slab);
+                }
             }
-        };
+        }
 
         /// <summary>
-        /// データを複数パケットに変換
+        /// プールの生成
         /// </summary>
-        class Serializer final
+        /// <param name="slabSize">最小のサイズクラス(バッファーサイズ)</param>
+        /// <param name="limitSize">最大のサイズクラス(受信上限サイズ)</param>
+        /// <param name="cacheBytes">サイズクラス毎に保持する未使用スラブの合計サイズの上限</param>
+        static std::shared_ptr<MessagePool> Create(size_t slabSize, size_t limitSize, size_t cacheBytes = MESSAGE_POOL_CACHE_BYTES)
         {
-        private:
-            Buffer buffer;
-            const DWORD splitSize;
-            bool beginning{ true };
-        public:
-            Serializer() = delete;
-            Serializer(Serializer&&) = delete;
-            Serializer(const Serializer&) = delete;
-            Serializer& operator=(Serializer&&) = delete;
-            Serializer& operator=(const Serializer&) = delete;
-            explicit Serializer(Buffer buffer, DWORD splitSize)
-                : buffer{ buffer }, splitSize{ splitSize } {};
+            return std::make_shared<MessagePool>(PrivateTag{}, slabSize, limitSize, cacheBytes);
+        }
 
-            std::tuple<Buffer, Header> Next()
+        /// <summary>
+        /// 空のメッセージを貸し出す
+        /// </summary>
+        /// <param name="capacity">必要なデータ領域のサイズ</param>
+        /// <returns>capacity以上のデータ領域を持つサイズ0のメッセージ</returns>
+        PipeMessage Acquire(size_t capacity)
+        {
+            auto sizeClass = ClassOf(capacity);
+            MessageSlab* slab = nullptr;
             {
-                if (buffer.Empty()) {
-                    return { buffer, {0} };
+                std::lock_guard<std::mutex> guard(lock);
+                auto& freeList = freeLists[sizeClass];
+                if (!freeList.empty()) {
+                    slab = freeList.back();
+                    freeList.pop_back();
                 }
-                auto size = (std::min)(static_cast<size_t>(splitSize), buffer.Size());
-                auto fragment = buffer.Consume(size);
-                auto header = Header::Create(static_cast<DWORD>(size), beginning, buffer.Empty());
-                beginning = buffer.Empty();
-                return { fragment, header };
             }
-        };
+            if (slab == nullptr) {
+                auto classSize = classSizes[sizeClass];
+                slab = new (::operator new(sizeof(MessageSlab) + classSize)) MessageSlab{ {0}, nullptr, sizeClass, classSize, 0 };
+            }
+            slab->refs.store(1, std::memory_order_relaxed);
+            slab->size = 0;
+            slab->owner = shared_from_this();
+            return PipeMessage(slab);
+        }
 
         /// <summary>
-        /// 複数パケットからデータに変換
+        /// プール外の領域を参照するメッセージを作成
+        /// 領域は最後のハンドルの破棄まで所有者ごと維持し、スラブはプールへ返却せずに破棄する。
         /// </summary>
-        class Deserializer final
+        /// <param name="backing">領域の所有者</param>
+        /// <param name="data">領域の先頭</param>
+        /// <param name="size">データサイズ</param>
+        static PipeMessage Adopt(std::shared_ptr<void> backing, BYTE* data, size_t size)
         {
-        private:
-            bool beginning{ true };
-            std::vector<BYTE> pool;
-            const size_t limitSize;
-            std::function<void(Buffer)> completed;
-        public:
-            Deserializer() = delete;
-            Deserializer(Deserializer&&) = delete;
-            Deserializer(const Deserializer&) = delete;
-            Deserializer& operator=(Serializer&&) = delete;
-            Deserializer& operator=(const Deserializer&) = delete;
-            Deserializer(size_t reserveSize, size_t limitSize, std::function<void(Buffer)> completed)
-                : limitSize(limitSize)
-                , completed(completed)
-            {
-                if (!completed) {
-                    throw std::invalid_argument("bad callback error");
-                }
-                pool.reserve(reserveSize);
-            }
+            auto slab = new (::operator new(sizeof(MessageSlab))) MessageSlab{ {1}, nullptr, 0, size, size, data, std::move(backing) };
+            return PipeMessage(slab);
+        }
 
-            void Reset()
-            {
-                beginning = true;
+        /// <summary>
+        /// 組み立て中(他に参照が無い)のメッセージへデータを追加
+        /// データ領域が足りない場合は上位のサイズクラスへ移し替える。
+        /// </summary>
+        /// <param name="message">組み立て中のメッセージ。空の場合は新たに貸し出す。</param>
+        /// <param name="data">追加データ</param>
+        /// <param name="size">追加データサイズ</param>
+        void Append(PipeMessage& message, LPCVOID data, size_t size)
+        {
+            std::memcpy(Extend(message, size), data, size);
+        }
+
+        /// <summary>
+        /// 組み立て中(他に参照が無い)のメッセージのデータ領域を拡張
+        /// データ領域が足りない場合は上位のサイズクラスへ移し替える。
+        /// </summary>
+        /// <param name="message">組み立て中のメッセージ。空の場合は新たに貸し出す。</param>
+        /// <param name="size">拡張するサイズ</param>
+        /// <returns>拡張した領域の先頭。呼び出し側でデータを書き込むこと。</returns>
+        BYTE* Extend(PipeMessage& message, size_t size)
+        {
+            if (!message) {
+                message = Acquire(size);
             }
+            else if (message.slab->capacity - message.slab->size < size) {
+                auto grown = Acquire(message.slab->size + size);
+                std::memcpy(grown.slab->Data(), message.slab->Data(), message.slab->size);
+                grown.slab->size = message.slab->size;
+                message = std::move(grown);
+            }
+            auto extended = message.slab->Data() + message.slab->size;
+            message.slab->size += size;
+            return extended;
+        }
 
-            bool Feed(const Packet* packet)
-            {
-                if (packet->head.IsCancel()) {
-                    beginning = true;
-                    pool.clear();
-                    return false;
-                }
-                if (beginning) {
-                    pool.clear();
-                    //最初のパケット
-                    if (!packet->head.IsStart()) {
-                        //データに矛盾
-                        throw std::runtime_error("inconsistent feed data");
-                    }
-                    beginning = false;
-                }
-                auto packetData = packet->Data();
-                if(limitSize < pool.size() + packetData.Size()){
-                    throw std::length_error("size is too long");
-                }
-                pool.insert(pool.end(), packetData.Begin(), packetData.End());
-                if (packet->head.IsEnd()) {
-                    beginning = true;
-                    completed(Buffer(&pool[0], pool.size()));
-                }
-                return true;
+        size_t ClassCount() const { return classSizes.size(); }
+        size_t ClassSize(size_t sizeClass) const { return classSizes.at(sizeClass); }
+
+        /// <summary>
+        /// プールに保持している未使用スラブ数
+        /// </summary>
+        size_t CachedCount()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            size_t count = 0;
+            for (const auto& freeList : freeLists) {
+                count += freeList.size();
             }
-        };
+            return count;
+        }
+    };
 
-#pragma endregion
+    inline void PipeMessage::Release() noexcept
+    {
+        auto released = std::exchange(slab, nullptr);
+        if (released == nullptr || released->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        //返却中にプールが破棄されないように参照を移しておく
+        auto owner = std::move(released->owner);
+        if (!owner) {
+            //プール外の領域を参照するメッセージ
+            MessagePool::Destroy(released);
+            return;
+        }
+        owner->Recycle(released);
+    }
+#pragma endregion
+
+#ifdef _WIN32
+    //受信メッセージの非同期タスク(ReceiveAsync)
+    using PipeMessageTask = concurrency::task<PipeMessage>;
+#else
+    //受信メッセージの非同期タスク(ReceiveAsync)
+    using PipeMessageTask = std::future<PipeMessage>;
+#endif
+
+#pragma region Rpc
+    /// <summary>
+    /// RPCメッセージの種別
+    /// </summary>
+    enum class RpcKind : DWORD {
+        //要求
+        REQUEST = 1,
+        //応答
+        RESPONSE = 2,
+        //エラー応答。データ部はエラーメッセージ
+        FAILURE = 3,
+    };
+
+    /// <summary>
+    /// RPC(EnableRpc)のメッセージの先頭に付ける識別情報
+    /// </summary>
+    struct RpcEnvelope {
+        //呼び出しID。応答は要求と同じIDを返す
+        DWORD id;
+        //RpcKind
+        DWORD kind;
+    };
+
+    /// <summary>
+    /// RPCの要求、応答メッセージ。識別情報を除いたデータ部を参照する。
+    /// 受信メッセージのハンドルを保持するので、コピーしてコールバックの外や別スレッドへ持ち出せる。
+    /// </summary>
+    class RpcMessage final
+    {
     private:
-        //パイプハンドル
-        winrt::file_handle handlePipe;
-        //受信用オーバーラップ構造体
-        std::unique_ptr<OVERLAPPED> readOverlap;
-        //受信バッファー
-        std::unique_ptr<BYTE[]> readBuffer;
-        //Closeイベント
-        winrt::handle closeEvent;
-        //受信イベント
-        winrt::handle readEvent;
-        //カスタムイベント
-        std::vector<winrt::handle> customEvents;
-        //監視タスク
-        concurrency::task<void> watcherTask{concurrency::task_from_result() };
-        //受信パケット処理
-        Receiver receiver;
-        //デシリアライズ処理
-        Deserializer deserializer;
-        //送信バッファーロック
-        concurrency::critical_section writeCs;
-        //送受信バッファーサイズ
-        const DWORD bufferSize;
-        //送受信上限サイズ
-        const DWORD limitSize;
+        PipeMessage message;
+    public:
+        RpcMessage() = default;
+        explicit RpcMessage(PipeMessage message) : message(std::move(message)) {}
 
         /// <summary>
-        /// RAIIヘルパー
+        /// 呼び出しID
         /// </summary>
-        struct Defer {
-            std::function<void(void)> func;
-            Defer(std::function<void(void)> func) : func(func) {}
-            virtual ~Defer() { if (func) func(); }
+        DWORD Id() const
+        {
+            RpcEnvelope envelope{};
+            if (message.Size() >= sizeof(envelope)) {
+                std::memcpy(&envelope, message.Data(), sizeof(envelope));
+            }
+            return envelope.id;
+        }
+        LPCVOID Data() const { return message.Size() >= sizeof(RpcEnvelope) ? static_cast<const BYTE*>(message.Data()) + sizeof(RpcEnvelope) : nullptr; }
+        size_t Size() const { return message.Size() >= sizeof(RpcEnvelope) ? message.Size() - sizeof(RpcEnvelope) : 0; }
+        /// <summary>
+        /// 識別情報を含む受信メッセージ
+        /// </summary>
+        const PipeMessage& Message() const { return message; }
+    };
+
+    /// <summary>
+    /// 相手のRPCハンドラーが例外で終了した場合に、CallAsyncのタスクが送出する例外
+    /// </summary>
+    class RpcError : public std::runtime_error
+    {
+    public:
+        explicit RpcError(const std::string& what) : std::runtime_error(what) {}
+    };
+
+#ifdef _WIN32
+    //RPCの応答の非同期タスク(CallAsync)
+    using RpcTask = concurrency::task<RpcMessage>;
+#else
+    //RPCの応答の非同期タスク(CallAsync)
+    using RpcTask = std::future<RpcMessage>;
+#endif
+#pragma endregion
+
+#ifdef SNP_HAS_COROUTINE
+    /// <summary>
+    /// AwaitWrite, AwaitReceive を co_await するコルーチンの戻り値型
+    /// 生成直後に実行を開始し、完了はTask()で取得した非同期タスクで待機できる。スレッドプールは利用しない。
+    /// </summary>
+    class PipeCoroutine final
+    {
+    private:
+        PipeTaskCompletion completion;
+        explicit PipeCoroutine(PipeTaskCompletion completion) : completion(std::move(completion)) {}
+    public:
+        struct promise_type {
+            PipeTaskCompletion completion;
+
+            PipeCoroutine get_return_object() { return PipeCoroutine(completion); }
+            std::suspend_never initial_suspend() const noexcept { return {}; }
+            std::suspend_never final_suspend() const noexcept { return {}; }
+            void return_void() { completion.set(); }
+            void unhandled_exception() { completion.set_exception(std::current_exception()); }
         };
 
         /// <summary>
-        /// 非同期Write用のワーク領域
+        /// コルーチンの完了を通知する非同期タスク
         /// </summary>
-        struct WriteOverlapTag {
-            //呼び出し元のポインター
-            SimpleNamedPipeBase* owner;
-            //書き込みバッファー
-            Buffer buffer;
-            //Win32システムエラー
-            DWORD lastErr;
-            //成功フラグ
-            bool success;
-            //書き込み完了チェック
-            bool Completed() const { return buffer.Empty(); }
+        PipeTask Task() const
+        {
+#ifdef _WIN32
+            return concurrency::create_task(completion);
+#else
+            return PipeTask(completion);
+#endif
+        }
+    };
+#endif
+
+#pragma region Dispatcher
+    /// <summary>
+    /// 受信イベントの振り分け統計
+    /// </summary>
+    struct DispatchStats {
+        //未処理のメッセージ数(全接続の合計)
+        size_t queued{ 0 };
+        //未処理のメッセージ数の最大値
+        size_t maxQueued{ 0 };
+        //処理済みのメッセージ数
+        std::uint64_t dispatched{ 0 };
+        //受信から受信イベント開始までの待ち時間の合計
+        std::chrono::nanoseconds totalLatency{ 0 };
+        //受信から受信イベント開始までの待ち時間の最大値
+        std::chrono::nanoseconds maxLatency{ 0 };
+    };
+
+    /// <summary>
+    /// 受信イベントを監視タスクから切り離して実行するワーカースレッドプール
+    /// 接続毎のストランドで受信順に1つずつ実行し、異なる接続のストランドは並列に実行する。
+    /// 複数のパイプ(SimpleNamedPipeMultiServerのセッションなど)で共有できる。
+    /// </summary>
+    class Dispatcher final
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Handler = std::function<void(PipeMessage&)>;
+
+        /// <summary>
+        /// 接続毎の直列実行キュー
+        /// </summary>
+        class Strand final
+        {
+            friend class Dispatcher;
+        private:
+            struct Item {
+                PipeMessage message;
+                Clock::time_point queued;
+            };
+
+            Dispatcher& dispatcher;
+            const Handler handler;
+            //以下はdispatcher.lockで保護
+            std::deque<Item> items;
+            //ワーカーの実行待ち、または実行中
+            bool scheduled{ false };
+            //実行中のワーカースレッド
+            std::thread::id runner;
+            std::condition_variable idle;
+            //未処理のメッセージ数(実行中を含む)
+            std::atomic_size_t depth{ 0 };
+
+        public:
+            Strand(Dispatcher& dispatcher, Handler handler) : dispatcher(dispatcher), handler(std::move(handler)) {}
+            Strand(const Strand&) = delete;
+            Strand& operator=(const Strand&) = delete;
+            ~Strand()
+            {
+                Wait();
+            }
+
+            /// <summary>
+            /// メッセージを追加。受信順に実行する。
+            /// </summary>
+            /// <param name="message">受信メッセージ</param>
+            void Post(PipeMessage message)
+            {
+                depth.fetch_add(1);
+                std::lock_guard<std::mutex> lock(dispatcher.lock);
+                items.push_back(Item{ std::move(message), Clock::now() });
+                dispatcher.stats.queued += 1;
+                dispatcher.stats.maxQueued = (std::max)(dispatcher.stats.maxQueued, dispatcher.stats.queued);
+                if (!scheduled) {
+                    scheduled = true;
+                    dispatcher.ready.push_back(this);
+                    dispatcher.cv.notify_one();
+                }
+            }
+
+            /// <summary>
+            /// 未処理のメッセージ数(実行中を含む)
+            /// </summary>
+            size_t Depth() const { return depth.load(); }
+
+            /// <summary>
+            /// 呼び出し元のスレッドでこのストランドのメッセージを実行中か
+            /// </summary>
+            bool RunningInThisThread() const
+            {
+                std::lock_guard<std::mutex> lock(dispatcher.lock);
+                return scheduled && runner == std::this_thread::get_id();
+            }
+
+            /// <summary>
+            /// 追加済みのメッセージを全て実行し終えるまで待機
+            /// 実行中のハンドラーから呼び出した場合は待機しない。
+            /// </summary>
+            void Wait()
+            {
+                std::unique_lock<std::mutex> lock(dispatcher.lock);
+                if (scheduled && runner == std::this_thread::get_id()) {
+                    return;
+                }
+                idle.wait(lock, [this]() { return !scheduled; });
+            }
         };
 
-        // 非同期書き込み用コールバック関数
-        // https://learn.microsoft.com/ja-jp/windows/win32/api/minwinbase/nc-minwinbase-lpoverlapped_completion_routine
-        static void WriteOverlapComplete(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped)
+    private:
+        mutable std::mutex lock;
+        std::condition_variable cv;
+        //実行待ちのストランド。1回に1メッセージずつ実行して末尾へ戻し、接続間で公平に実行する。
+        std::deque<Strand*> ready;
+        bool stop{ false };
+        DispatchStats stats;
+        std::vector<std::thread> workers;
+
+        void Work() noexcept
         {
-            WriteOverlapTag* tag = reinterpret_cast<WriteOverlapTag*>(lpOverlapped->hEvent);
-            tag->lastErr = dwErrorCode;
-            if (ERROR_SUCCESS != tag->lastErr) {
-                //Win32エラー発生
-                tag->success = false;
-                return;
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                cv.wait(guard, [this]() { return stop || !ready.empty(); });
+                if (ready.empty()) {
+                    //停止時も追加済みのメッセージは実行する
+                    return;
+                }
+                auto strand = ready.front();
+                ready.pop_front();
+                auto item = std::move(strand->items.front());
+                strand->items.pop_front();
+                strand->runner = std::this_thread::get_id();
+                auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - item.queued);
+                stats.queued -= 1;
+                stats.dispatched += 1;
+                stats.totalLatency += latency;
+                stats.maxLatency = (std::max)(stats.maxLatency, latency);
+                guard.unlock();
+                //例外はハンドラー側で処理する
+                strand->handler(item.message);
+                item.message = PipeMessage();
+                strand->depth.fetch_sub(1);
+                guard.lock();
+                strand->runner = std::thread::id();
+                if (strand->items.empty()) {
+                    strand->scheduled = false;
+                    strand->idle.notify_all();
+                }
+                else {
+                    ready.push_back(strand);
+                }
             }
-            try {
-                //書き込み済み領域を消費
-                tag->buffer.Consume(dwNumberOfBytesTransfered);
+        }
+
+    public:
+        /// <summary>
+        /// ワーカースレッドを開始
+        /// </summary>
+        /// <param name="threads">ワーカースレッド数</param>
+        explicit Dispatcher(size_t threads = (std::max)(std::thread::hardware_concurrency(), 1u))
+        {
+            if (threads == 0) {
+                throw std::invalid_argument("bad thread count");
             }
-            catch (std::length_error&)
+            workers.reserve(threads);
+            for (size_t i = 0; i < threads; ++i) {
+                workers.emplace_back([this]() { Work(); });
+            }
+        }
+        Dispatcher(const Dispatcher&) = delete;
+        Dispatcher& operator=(const Dispatcher&) = delete;
+
+        /// <summary>
+        /// 追加済みのメッセージを実行し終えてからワーカースレッドを終了
+        /// ワーカースレッド(ハンドラー内)から破棄しないこと。
+        /// </summary>
+        ~Dispatcher()
+        {
             {
-                //書き込み済み領域と書き込んだバイト数に不整合あり
-                tag->success = false;
-                return;
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+                cv.notify_all();
+            }
+            for (auto& worker : workers) {
+                worker.join();
             }
-            //書き込み成功
-            tag->success = true;
-            return;
         }
 
         /// <summary>
-        /// 非同期書き込みを同期的に実行
+        /// ストランドを作成。ストランドはディスパッチャーより先に破棄すること。
         /// </summary>
-        /// <param name="buffer">書き込みバッファー</param>
-        /// <param name="size">バッファーサイズ</param>
-        /// <param name="ct">キャンセルトークン</param>
-        /// <returns>キャンセル時はfalse</returns>
-        bool WriteRaw(LPCVOID buffer, DWORD size, winrt::handle& cancelEvent)
+        /// <param name="handler">メッセージ毎にワーカースレッドで呼び出す処理</param>
+        std::unique_ptr<Strand> CreateStrand(Handler handler)
         {
-            //オーバーラップ構造体の設定
-            WriteOverlapTag tag{ this, Buffer(buffer, size), ERROR_SUCCESS, true};
-            auto overlapped = std::make_unique<OVERLAPPED>();
-            while (!tag.Completed() && tag.success) {
-                //一度に送信するサイズをコンストラクタ引数のbufferSizeまでに制限
-                DWORD writeSize = (std::min)(static_cast<DWORD>(tag.buffer.Size()), bufferSize);
-                //WriteFileExはhEventは利用しないので、ワーク領域のポインターを格納する
-                // https://learn.microsoft.com/ja-jp/windows/win32/api/fileapi/nf-fileapi-writefileex
-                *overlapped = { 0 };
-                overlapped->hEvent = reinterpret_cast<HANDLE>(&tag);
-                winrt::check_bool(WriteFileEx(handlePipe.get(), tag.buffer.Pointer(), writeSize, overlapped.get(), &SimpleNamedPipeBase::WriteOverlapComplete));
-                auto res = WaitForSingleObjectEx(cancelEvent.get(), INFINITE, true);
-                if (WAIT_OBJECT_0 == res) {
-                    //非同期書き込みをキャンセル
-                    CancelIoEx(handlePipe.get(), overlapped.get());
-                }
-                else if (WAIT_IO_COMPLETION == res) {
-                    // I/O完了
-                    if (!tag.success) {
-                        if (ERROR_OPERATION_ABORTED == tag.lastErr) {
-                            return false;
-                        }
-                        else if (ERROR_SUCCESS != tag.lastErr) {
-                            //Win32エラーが発生していたら例外送出
-                            winrt::throw_hresult(HRESULT_FROM_WIN32(tag.lastErr));
-                        }
-                        //不明なエラーの場合
-                        throw std::logic_error("WriteRaw logic error");
-                    }
-                }
-                else {
-                    winrt::throw_last_error();
+            return std::make_unique<Strand>(*this, std::move(handler));
+        }
+
+        /// <summary>
+        /// 未処理のメッセージ数と待ち時間の統計
+        /// </summary>
+        DispatchStats Stats() const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return stats;
+        }
+
+        /// <summary>
+        /// ワーカースレッド数
+        /// </summary>
+        size_t ThreadCount() const { return workers.size(); }
+    };
+#pragma endregion
+
+    /// <summary>
+    /// イベント種別
+    /// </summary>
+    enum PipeEventType {
+        //接続（サーバーのみ）
+        CONNECTED,
+        //切断
+        DISCONNECTED,
+        //受信
+        RECEIVED,
+        //破棄（サーバーのみ）
+        CLOSED,
+        //例外発生
+        EXCEPTION,
+        //分割受信(EnableChunkedReceive)のメッセージの開始。readedSizeはメッセージ全体のサイズ(不明な場合は0)
+        RECEIVED_BEGIN,
+        //分割受信のメッセージの断片。readBuffer, readedSizeはパケットのデータ
+        RECEIVED_CHUNK,
+        //分割受信のメッセージの終了。readedSizeは受信したメッセージ全体のサイズ
+        RECEIVED_END,
+        //分割受信のメッセージが送信側のキャンセルで途中で終了した
+        RECEIVED_CANCELED,
+    };
+
+    /// <summary>
+    /// 送信優先度(WriteAsync, Write用)
+    /// 優先度毎の送信キューのうち、最も優先度の高い空でないキューから次の送信要求を取り出す。
+    /// </summary>
+    enum class SendPriority : int {
+        //制御メッセージなど、大量データの送信中も直ちに送信する
+        HIGH = 0,
+        //既定
+        NORMAL = 1,
+        //一括転送など、他の送信の合間に送信する
+        LOW = 2,
+    };
+
+    /// <summary>
+    /// 送信優先度毎の送信キューの統計(SimpleNamedPipeBase::SendStats)
+    /// </summary>
+    struct SendLaneStats {
+        //送信開始前の送信要求数
+        size_t queued{ 0 };
+        //送信開始前の送信要求数の最大値
+        size_t maxQueued{ 0 };
+        //送信を開始した送信要求数
+        std::uint64_t sent{ 0 };
+        //送信キューへの追加から送信開始までの待ち時間の合計
+        std::chrono::nanoseconds totalWait{ 0 };
+        //送信キューへの追加から送信開始までの待ち時間の最大値
+        std::chrono::nanoseconds maxWait{ 0 };
+    };
+
+    /// <summary>
+    /// パイプインスタンスの統計(SimpleNamedPipeBase::Stats)
+    /// SNP_DISABLE_STATS を定義してビルドした場合は計数せず、全て0となる。
+    /// </summary>
+    struct PipeStats {
+        //送信、受信したバイト数(ヘッダーを含む)
+        std::uint64_t bytesSent{ 0 };
+        std::uint64_t bytesReceived{ 0 };
+        //送信完了したメッセージ数、受信したメッセージ数
+        std::uint64_t messagesSent{ 0 };
+        std::uint64_t messagesReceived{ 0 };
+        //送信、受信したパケット数(送信枠の付与、キャンセルを含む)
+        std::uint64_t fragmentsSent{ 0 };
+        std::uint64_t fragmentsReceived{ 0 };
+        //送信、受信したキャンセルパケット数
+        std::uint64_t cancelsSent{ 0 };
+        std::uint64_t cancelsReceived{ 0 };
+        //受信開始時に同期的に完了した読み込み数、完了待ち(非同期)となった読み込み数
+        std::uint64_t readsCompleted{ 0 };
+        std::uint64_t readsPending{ 0 };
+        //一時ファイル(EnableSpill)で結合した受信メッセージ数
+        std::uint64_t messagesSpilled{ 0 };
+        //パケットの結合領域(Receiver)、メッセージの結合領域(Deserializer)の最大サイズ
+        size_t receiverPoolHighWater{ 0 };
+        size_t deserializerPoolHighWater{ 0 };
+        //送信キューが満杯で送信要求元が待機した回数、待機時間の合計、最大値
+        std::uint64_t writeWaits{ 0 };
+        std::chrono::nanoseconds writeWaitTime{ 0 };
+        std::chrono::nanoseconds maxWriteWait{ 0 };
+        //受信イベント(RPCハンドラーを含む)の処理時間のヒストグラム
+        //[0]は1μs未満、[i]は2^(i-1)μs以上2^iμs未満。最後の区間は上限なし。
+        std::array<std::uint64_t, STATS_HISTOGRAM_BUCKETS> callbackDurations{};
+    };
+
+    /// <summary>
+    /// メッセージ毎の遅延計測(SimpleNamedPipeBase::EnableTracing)の区間
+    /// </summary>
+    enum class TraceStage : size_t {
+        //送信キューへの追加から送信開始まで
+        QUEUED,
+        //送信開始から先頭パケットの書き込みまで(送信枠の付与待ちを含む)
+        SENDING,
+        //先頭パケットの書き込みから受信側での先頭パケットの受信まで
+        TRANSPORT,
+        //先頭パケットの受信からメッセージの組み立て完了まで
+        REASSEMBLY,
+        //組み立て完了から受信イベントの開始まで
+        DISPATCH,
+        //受信イベント
+        HANDLER,
+    };
+    //遅延計測の区間数
+    constexpr size_t TRACE_STAGES = 6;
+
+    /// <summary>
+    /// 遅延計測の区間毎の集計
+    /// </summary>
+    struct TraceStageStats {
+        //計測したメッセージ数
+        std::uint64_t count{ 0 };
+        //所要時間の合計、最大値
+        std::chrono::nanoseconds total{ 0 };
+        std::chrono::nanoseconds max{ 0 };
+        //所要時間のヒストグラム(区間はPipeStats::callbackDurationsと同じ)
+        std::array<std::uint64_t, STATS_HISTOGRAM_BUCKETS> histogram{};
+    };
+
+    /// <summary>
+    /// 遅延計測の集計(SimpleNamedPipeBase::TraceStatistics)
+    /// </summary>
+    struct TraceStats {
+        //タイムスタンプ付きで受信したメッセージ数
+        std::uint64_t messages{ 0 };
+        //TraceStageの値をインデックスとした区間毎の集計
+        std::array<TraceStageStats, TRACE_STAGES> stages{};
+    };
+
+    /// <summary>
+    /// 送信バッファー(WriteBatchAsync用)
+    /// </summary>
+    struct ConstBuffer {
+        LPCVOID buffer;
+        size_t size;
+    };
+
+    /// <summary>
+    /// 分割送信(WriteStreamAsync用)のデータの読み出し関数
+    /// bufferへ最大size分のデータを書き込み、書き込んだサイズを返す。0を返すとメッセージの終端とする。
+    /// </summary>
+    using ChunkReader = std::function<size_t(BYTE* buffer, size_t size)>;
+
+    /// <summary>
+    /// 受信イベント
+    /// </summary>
+    struct PipeEventParam {
+        //イベント種別
+        const PipeEventType type;
+        //受信データ。受信データはコールバック中でのみ有効。
+        LPCVOID readBuffer;
+        //受信データサイズ
+        const size_t readedSize;
+        //例外発生時の監視タスク
+        const std::optional<PipeTask> errTask;
+        //セッションID（SimpleNamedPipeMultiServerのみ。接続毎に1から採番）
+        const size_t sessionId{ 0 };
+        //受信メッセージのハンドル（EnableMessagePool時のみ）。コピーしてコールバックの外へ持ち出せる。
+        const PipeMessage message{};
+    };
+
+    /// <summary>
+    /// 名前付きパイプ共通ベースクラス
+    /// </summary>
+    class SimpleNamedPipeBase
+    {
+    public:
+        SimpleNamedPipeBase() = delete;
+        SimpleNamedPipeBase(SimpleNamedPipeBase&&) = delete;
+        SimpleNamedPipeBase(const SimpleNamedPipeBase&) = delete;
+
+        SimpleNamedPipeBase& operator=(SimpleNamedPipeBase&&) = delete;
+        SimpleNamedPipeBase& operator=(const SimpleNamedPipeBase&) = delete;
+        virtual ~SimpleNamedPipeBase()
+        {}
+
+#pragma region Receiver
+        /// <summary>
+        /// 受信バッファー管理クラス
+        /// </summary>
+        class Buffer final
+        {
+        private:
+            const BYTE* sp;
+            const BYTE* ep;
+        public:
+            explicit Buffer(LPCVOID buffer, size_t size)
+                : sp{ reinterpret_cast<const BYTE*>(buffer) }
+                , ep{ reinterpret_cast<const BYTE*>(buffer) + size }
+            {}
+            const BYTE* Begin() const { assert(sp != nullptr); return sp; }
+            const BYTE* End() const { assert(ep != nullptr); return ep; }
+            bool Empty() const { return sp == ep; }
+            const BYTE* Pointer() const { assert(sp != nullptr); return sp; }
+            size_t Size() const { assert(sp != nullptr); return std::distance(sp, ep); }
+            Buffer Consume(size_t size)
+            {
+                if (size > Size()) {
+                    throw std::length_error("size is too large");
+                }
+                auto preSp = sp;
+                sp += size;
+                return Buffer(preSp, size);
+            }
+        };
+
+        /// <summary>
+        /// データパケット
+        /// </summary>
+        struct alignas(4) Header {
+            DWORD size;
+            union {
+                DWORD reserve;
+                struct {
+                    WORD dataOffset;    //パケットの先頭からデータまでのオフセット
+                    WORD startBit : 1;
+                    WORD endBit : 1;
+                    WORD cancelBit : 1;
+                    WORD creditBit : 1; //送信枠の付与(データ部は付与するメッセージ数のDWORD)
+                    WORD streamBit : 1; //多重化したメッセージの断片(ヘッダーの直後にストリームIDのDWORD)
+                    WORD traceBit : 1;  //遅延計測のタイムスタンプ付き(データの直前にTraceStamp)
+                    WORD version : 2;   //ヘッダーの版(HeaderV2以降は先頭パケットのストリームIDの直後にメッセージ全体のサイズ)
+                    WORD uncreditedBit : 1; //送信枠を消費せずに送信したメッセージ(先頭パケットのみ)
+                    WORD reserve : 7;
+                } info;
+            };
+            inline size_t DataOffset() const { return info.dataOffset; }
+            inline size_t DataSize() const
+            {
+                assert(size >= info.dataOffset);
+                return size - info.dataOffset;
+            }
+            inline bool IsStart() const { return info.startBit != 0; }
+            inline bool IsEnd() const { return info.endBit != 0; }
+            inline bool IsCancel() const { return info.cancelBit != 0; }
+            inline bool IsCredit() const { return info.creditBit != 0; }
+            inline bool IsStream() const { return info.streamBit != 0; }
+            inline bool IsTraced() const { return info.traceBit != 0; }
+            inline bool IsUncredited() const { return info.uncreditedBit != 0; }
+            inline WORD Version() const { return info.version; }
+            /// <summary>
+            /// 付加情報(ストリームID、メッセージ全体のサイズ、タイムスタンプ)を含めたデータの最小オフセット
+            /// </summary>
+            inline size_t MinDataOffset() const
+            {
+                return HeaderSize
+                    + (info.streamBit ? StreamIdSize : 0)
+                    + (info.version >= HeaderV2 ? MessageSizeSize : 0)
+                    + (info.traceBit ? TraceStampSize : 0);
+            }
+            /// <summary>
+            /// メッセージ全体のサイズを付加する(HeaderV2)。ストリームIDの直後に置くので、未対応の受信側はdataOffsetにより読み飛ばす。
+            /// AddTraceより先に呼び出すこと。
+            /// </summary>
+            inline void AddMessageSize()
+            {
+                info.version = HeaderV2;
+                info.dataOffset = static_cast<WORD>(info.dataOffset + MessageSizeSize);
+                size = static_cast<DWORD>(size + MessageSizeSize);
+            }
+            /// <summary>
+            /// 遅延計測のタイムスタンプを付加する。データの直前に置くので、未対応の受信側はdataOffsetにより読み飛ばす。
+            /// </summary>
+            inline void AddTrace()
+            {
+                info.traceBit = 1;
+                info.dataOffset = static_cast<WORD>(info.dataOffset + TraceStampSize);
+                size = static_cast<DWORD>(size + TraceStampSize);
+            }
+            static inline Header Create(DWORD dataSize, bool startBit, bool endBit)
+            {
+                Header header{ 0 };
+                header.size = static_cast<DWORD>(dataSize + HeaderSize);
+                header.info.dataOffset = HeaderSize;
+                header.info.startBit = startBit ? 1 : 0;
+                header.info.endBit = endBit ? 1 : 0;
+                return header;
+            }
+            static inline Header CreateCancel()
+            {
+                Header header{ 0 };
+                header.size = HeaderSize;
+                header.info.dataOffset = HeaderSize;
+                header.info.cancelBit = 1;
+                return header;
+            }
+            static inline Header CreateCredit()
+            {
+                Header header{ 0 };
+                header.size = static_cast<DWORD>(HeaderSize + sizeof(DWORD));
+                header.info.dataOffset = HeaderSize;
+                header.info.creditBit = 1;
+                return header;
+            }
+            static inline Header CreateStream(DWORD dataSize, bool startBit, bool endBit)
+            {
+                Header header{ 0 };
+                header.size = static_cast<DWORD>(dataSize + sizeof(Header) + sizeof(DWORD));
+                header.info.dataOffset = static_cast<WORD>(sizeof(Header) + sizeof(DWORD));
+                header.info.startBit = startBit ? 1 : 0;
+                header.info.endBit = endBit ? 1 : 0;
+                header.info.streamBit = 1;
+                return header;
+            }
+            static inline Header CreateStreamCancel()
+            {
+                auto header = CreateStream(0, false, false);
+                header.info.cancelBit = 1;
+                return header;
+            }
+        };
+        inline static constexpr size_t HeaderSize = sizeof(Header);
+        //多重化したパケットのストリームIDのサイズ
+        inline static constexpr size_t StreamIdSize = sizeof(DWORD);
+        //ヘッダーの版(Header::info.version)。付加情報の無い従来の形式
+        inline static constexpr WORD HeaderV1 = 0;
+        //複数パケットのメッセージの先頭パケットにメッセージ全体の64bitサイズを付加する形式
+        inline static constexpr WORD HeaderV2 = 1;
+        //メッセージ全体のサイズのサイズ
+        inline static constexpr size_t MessageSizeSize = sizeof(std::uint64_t);
+
+        /// <summary>
+        /// 遅延計測のタイムスタンプ。steady_clockのエポックからのナノ秒で、同一マシン上のプロセス間で比較できる。
+        /// </summary>
+        struct TraceStamp {
+            //送信キューへの追加時刻
+            std::int64_t enqueued;
+            //送信開始時刻
+            std::int64_t started;
+            //先頭パケットの書き込み時刻
+            std::int64_t written;
+        };
+        inline static constexpr size_t TraceStampSize = sizeof(TraceStamp);
+
+        /// <summary>
+        /// 受信したメッセージの遅延計測の記録
+        /// </summary>
+        struct MessageTrace {
+            //送信側のタイムスタンプ
+            TraceStamp sent{};
+            //先頭パケットの受信時刻
+            std::int64_t received{ 0 };
+            //メッセージの組み立て完了時刻
+            std::int64_t assembled{ 0 };
+            //受信イベントの開始、終了時刻。受信イベントを監視タスクで呼び出さない場合は0
+            std::int64_t handlerStart{ 0 };
+            std::int64_t handlerEnd{ 0 };
+            //メッセージサイズ
+            size_t size{ 0 };
+        };
+        static_assert((std::numeric_limits<WORD>::max)() >= HeaderSize);
+        //1パケットのデータサイズの上限。パケットサイズ(Header::size)は32bitなので、大きなメッセージは断片に分けて送る
+        inline static constexpr size_t MaxPacketDataSize = (std::numeric_limits<DWORD>::max)() - HeaderSize - StreamIdSize - MessageSizeSize - TraceStampSize;
+
+        struct Packet
+        {
+            //size分も含めた全体のサイズ
+            Header head;
+            BYTE data[1];
+            Buffer Data() const
+            {
+                return Buffer(reinterpret_cast<const BYTE*>(this) + head.DataOffset(), head.DataSize());
+            }
+            /// <summary>
+            /// ストリームID。多重化していないパケットは0
+            /// </summary>
+            DWORD StreamId() const
+            {
+                if (!head.IsStream()) {
+                    return 0;
+                }
+                DWORD id = 0;
+                std::memcpy(&id, reinterpret_cast<const BYTE*>(this) + HeaderSize, sizeof(id));
+                return id;
+            }
+            /// <summary>
+            /// 先頭パケットに付加されたメッセージ全体のサイズ(HeaderV2)
+            /// </summary>
+            /// <returns>付加されていない場合はfalse</returns>
+            bool MessageSize(std::uint64_t& size) const
+            {
+                if (head.Version() < HeaderV2) {
+                    return false;
+                }
+                std::memcpy(&size, reinterpret_cast<const BYTE*>(this) + HeaderSize + (head.IsStream() ? StreamIdSize : 0), MessageSizeSize);
+                return true;
+            }
+            /// <summary>
+            /// 遅延計測のタイムスタンプ
+            /// </summary>
+            /// <returns>タイムスタンプが付加されていない場合はfalse</returns>
+            bool Trace(TraceStamp& stamp) const
+            {
+                if (!head.IsTraced()) {
+                    return false;
+                }
+                std::memcpy(&stamp, reinterpret_cast<const BYTE*>(this) + head.DataOffset() - TraceStampSize, TraceStampSize);
+                return true;
+            }
+        };
+
+        using ReceivedCallback = std::function<void(const Packet*)> ;
+
+        /// <summary>
+        /// 受信データ1回分から取り出した受信パケットの並び(参照のみ。コールバック中のみ有効)
+        /// </summary>
+        class PacketBatch final
+        {
+        private:
+            const Packet* const* first;
+            size_t count;
+        public:
+            PacketBatch(const Packet* const* first, size_t count) : first{ first }, count{ count } {}
+            const Packet* const* begin() const { return first; }
+            const Packet* const* end() const { return first + count; }
+            size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+            const Packet* operator[](size_t index) const { assert(index < count); return first[index]; }
+        };
+
+        using ReceivedBatchCallback = std::function<void(PacketBatch)>;
+
+        //直接配置するパケットのデータの格納先の取得。引数はヘッダーと付加情報(dataOffsetまで)のみ。nullptr時は直接配置しない
+        using PlaceCallback = std::function<BYTE*(const Packet*)>;
+        //直接配置したパケットの受信完了。引数はヘッダーと付加情報(dataOffsetまで)のみ
+        using PlacedCallback = std::function<void(const Packet*)>;
+
+        /// <summary>
+        /// 受信データ復号クラス
+        /// </summary>
+        class Receiver final
+        {
+        private:
+            class Idle;
+            class Continuation;
+            class Insufficient;
+            class Placement;
+
+            /// <summary>
+            /// 受信ステート基底クラス
+            /// </summary>
+            class StateBase
+            {
+            protected:
+                Receiver* owner;
+                StateBase() : owner(nullptr) {}
+                StateBase(Receiver* owner) : owner{ owner } {}
+
+            protected:
+                inline size_t Limit() const { return owner->limitSize; }
+                inline std::vector<BYTE>& Pool() { return owner->pool; }
+                inline Idle& IdleState() { return owner->idle; }
+                inline Continuation& ContinuationState() { return owner->continuation; }
+                inline Insufficient& InsufficientState() { return owner->insufficient; }
+                inline void TrhowIfBadHeader(const Header *head) const
+                {
+                    owner->TrhowIfBadHeader(head);
+                }
+                inline StateBase* TryPlace(Buffer received, size_t remain)
+                {
+                    return owner->TryPlace(received, remain);
+                }
+
+            public:
+                /// <summary>
+                /// 受信データ処理
+                /// </summary>
+                /// <param name="buffer">入力受信データ</param>
+                /// <returns>{次のステート, 出力パケット(Empty()==true時は取得パケットなし) }</returns>
+                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) = 0;
+                virtual ~StateBase() {}
+            };
+
+            /// <summary>
+            /// パケットが受信データをまたがない状態
+            /// </summary>
+            class Idle final : public StateBase
+            {
+            public:
+                Idle(Receiver* owner) : StateBase(owner) {}
+                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
+                {
+                    if (buffer.Size() < HeaderSize) {
+                        //ヘッダー部を完全に受信できていない
+                        // Insufficientステートをセットアップして次回以降に続きを受信
+                        InsufficientState().Continue(buffer.Consume(buffer.Size()));
+                        return { &InsufficientState(), Buffer(buffer.End(),0) };
+                    }
+                    const Packet* packet = reinterpret_cast<const Packet*>(buffer.Pointer());
+                    TrhowIfBadHeader(&packet->head);
+                    if (packet->head.size > buffer.Size()) {
+                        //パケットサイズが受信バッファー残サイズより大きい場合
+                        const size_t remain = packet->head.size - buffer.Size();
+                        if (auto placement = TryPlace(buffer, remain)) {
+                            //続きは結合領域へ直接受信する
+                            buffer.Consume(buffer.Size());
+                            return { placement, Buffer(buffer.End(),0) };
+                        }
+                        // Continuationをセットアップして続きは次回以降に取得
+                        ContinuationState().Continue(buffer.Consume(buffer.Size()), remain);
+                        return { &ContinuationState(), Buffer(buffer.End(),0) };
+                    }
+                    //1パケット受信。パケットサイズ分を受信データから切り出し。
+                    return { this, buffer.Consume(packet->head.size) };
+                }
+            };
+
+            /// <summary>
+            /// 連続した受信をまたぐ状態
+            /// </summary>
+            class Continuation final : public StateBase
+            {
+            private:
+                size_t remain{ 0 };
+            public:
+                Continuation(Receiver* owner) : StateBase(owner) {}
+
+                /// <summary>
+                /// 受信済みデータをプール領域にセットアップ
+                /// </summary>
+                /// <param name="buffer">プール領域へ保存するバッファー</param>
+                /// <param name="totalRemain">未受信データサイズ</param>
+                void Continue(Buffer buffer, size_t totalRemain)
+                {
+                    Pool().clear();
+                    //大きなパケットでも追加毎の再確保が起きないように全体分を確保
+                    Pool().reserve(buffer.Size() + totalRemain);
+                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
+                    this->remain = totalRemain;
+                }
+
+                /// <summary>
+                /// 未受信データサイズをセットアップ。プール領域にはすでに受信済みデータが存在することが前提。
+                /// </summary>
+                /// <param name="totalRemain">未受信データサイズ</param>
+                void Continue(size_t totalRemain)
+                {
+                    this->remain = totalRemain;
+                }
+
+                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
+                {
+                    const size_t prevSize = Pool().size();
+                    auto appendSize = (std::min)(buffer.Size(), remain);
+                    auto appendBuf = buffer.Consume(appendSize);
+                    Pool().insert(Pool().end(), appendBuf.Begin(), appendBuf.End());
+                    remain -= appendSize;
+                    if (0 == remain) {
+                        //分割されたパケットを結合したものを戻り値とする
+                        return { &IdleState(), Buffer(&Pool()[0], Pool().size()) };
+                    }
+                    //付加情報が揃っていないため直接配置できなかったパケットは、揃った時点で直接配置を再試行する
+                    const size_t dataOffset = reinterpret_cast<const Packet*>(&Pool()[0])->head.DataOffset();
+                    if (prevSize < dataOffset && Pool().size() >= dataOffset) {
+                        if (auto placement = TryPlace(Buffer(&Pool()[0], Pool().size()), remain)) {
+                            return { placement, Buffer(buffer.End(),0) };
+                        }
+                    }
+                    //まだ必要サイズに満たないので受信処理を継続。
+                    return { this, Buffer(buffer.End(),0) };
+                }
+            };
+
+            /// <summary>
+            /// ヘッダー領域途中で分割されている場合
+            /// </summary>
+            class Insufficient final : public StateBase
+            {
+            public:
+                Insufficient(Receiver* owner) : StateBase(owner) {}
+
+                /// <summary>
+                /// 受信済みデータをプール領域にセットアップ
+                /// </summary>
+                /// <param name="buffer">プール領域へ保存するバッファー</param>
+                void Continue(Buffer buffer)
+                {
+                    Pool().clear();
+                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
+                }
+
+                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
+                {
+                    const size_t prevSize = Pool().size();
+                    //パケットサイズが分からないので、受信データ全てをプール領域へコピーする
+                    Pool().insert(Pool().end(), buffer.Begin(), buffer.End());
+                    if (Pool().size() < HeaderSize) {
+                        //ヘッダー領域が受信できていない
+                        auto consumed = buffer.Consume(buffer.Size());
+                        return { this, Buffer(buffer.End(),0) };
+                    }
+                    const Packet* packet = reinterpret_cast<const Packet*>(&Pool()[0]);
+                    TrhowIfBadHeader(&packet->head);
+                    const size_t remain = packet->head.size - prevSize;
+                    if (remain > buffer.Size()) {
+                        //パケットサイズが受信バッファー残サイズより大きい場合
+                        auto received = Buffer(&Pool()[0], Pool().size());
+                        if (auto placement = TryPlace(received, remain - buffer.Size())) {
+                            //続きは結合領域へ直接受信する
+                            buffer.Consume(buffer.Size());
+                            return { placement, Buffer(buffer.End(),0) };
+                        }
+                        ContinuationState().Continue(remain - buffer.Size());
+                        buffer.Consume(buffer.Size());
+                        //足らないパケットデータは次回以降で受信する
+                        return { &ContinuationState(), Buffer(buffer.End(),0) };
+                    }
+                    //完全なパケットが取得できた
+                    buffer.Consume(remain);
+                    return { &IdleState(),  Buffer(&Pool()[0], packet->head.size) };
+                }
+
+            };
+
+            /// <summary>
+            /// パケットのデータを結合領域へ直接配置する状態
+            /// 受信データを経由した分はコピーし、Receiver::Placedで直接受信した分はそのまま確定する。
+            /// </summary>
+            class Placement final : public StateBase
+            {
+            private:
+                BYTE* target{ nullptr };
+                size_t remain{ 0 };
+            public:
+                Placement(Receiver* owner) : StateBase(owner) {}
+
+                /// <summary>
+                /// 直接配置の開始
+                /// </summary>
+                /// <param name="target">未受信データの格納先</param>
+                /// <param name="totalRemain">未受信データサイズ</param>
+                void Continue(BYTE* target, size_t totalRemain)
+                {
+                    this->target = target;
+                    this->remain = totalRemain;
+                }
+
+                BYTE* Target() const { return target; }
+                size_t Remain() const { return remain; }
+
+                /// <summary>
+                /// 格納先へ受信したデータを確定
+                /// </summary>
+                /// <returns>パケット全体を受信した場合はtrue</returns>
+                bool Advance(size_t size)
+                {
+                    assert(size <= remain);
+                    target += size;
+                    remain -= size;
+                    return remain == 0;
+                }
+
+                virtual std::tuple<StateBase*, Buffer> Feed(Buffer& buffer) override
+                {
+                    auto appendSize = (std::min)(buffer.Size(), remain);
+                    auto appendBuf = buffer.Consume(appendSize);
+                    std::memcpy(target, appendBuf.Pointer(), appendSize);
+                    if (Advance(appendSize)) {
+                        //データは格納先にあるので、ヘッダーのみ通知する
+                        owner->EmitPlaced();
+                        return { &IdleState(), Buffer(buffer.End(),0) };
+                    }
+                    return { this, Buffer(buffer.End(),0) };
+                }
+            };
+
+            //受信バッファーをまたいだ場合の一時保存領域
+            std::vector<BYTE> pool;
+
+            //受信コールバック
+            ReceivedCallback callback;
+
+            //受信コールバック(バッチ通知)
+            ReceivedBatchCallback batchCallback;
+
+            //バッチ通知用のパケット位置一覧(再利用して受信ごとの確保を避ける)
+            std::vector<const Packet*> batch;
+
+            Idle idle;
+            Continuation continuation;
+            Insufficient insufficient;
+            Placement placement;
+            StateBase* state;
+
+            const size_t limitSize;
+
+            //直接配置(EnablePlacement)
+            PlaceCallback placeCallback;
+            PlacedCallback placedCallback;
+            //直接配置する未受信データサイズの下限
+            size_t placementMinSize{ 0 };
+            //直接配置中のパケットのヘッダーと付加情報
+            std::vector<BYTE> placedHeader;
+
+            inline void TrhowIfBadHeader(const Header* head) const
+            {
+                if (head->size < HeaderSize || head->info.dataOffset < HeaderSize || head->info.dataOffset > head->size) {
+                    throw std::length_error("bad packet header");
+                }
+                //HeaderV2より新しい版も付加情報の配置は同じで、追加の情報はdataOffsetにより読み飛ばす
+                if (head->info.dataOffset < head->MinDataOffset()) {
+                    throw std::length_error("bad packet header");
+                }
+                if ((head->size - HeaderSize) > limitSize) {
+                    throw std::length_error("too long packet size");
+                }
+            }
+
+            /// <summary>
+            /// 受信データをまたぐパケットの直接配置を試みる
+            /// </summary>
+            /// <param name="received">受信済みのパケットの先頭部分</param>
+            /// <param name="remain">未受信データサイズ</param>
+            /// <returns>直接配置する場合は次のステート、しない場合はnullptr</returns>
+            StateBase* TryPlace(Buffer received, size_t remain)
+            {
+                if (!placeCallback || remain < placementMinSize) {
+                    return nullptr;
+                }
+                const Packet* packet = reinterpret_cast<const Packet*>(received.Pointer());
+                const size_t dataOffset = packet->head.DataOffset();
+                if (received.Size() < dataOffset) {
+                    //付加情報が揃っていない
+                    return nullptr;
+                }
+                //receivedはプール領域を指す場合があるので、別の領域へ保存する
+                placedHeader.assign(received.Begin(), received.Begin() + dataOffset);
+                BYTE* target = placeCallback(reinterpret_cast<const Packet*>(placedHeader.data()));
+                if (target == nullptr) {
+                    return nullptr;
+                }
+                const size_t partial = received.Size() - dataOffset;
+                if (partial != 0) {
+                    std::memcpy(target, received.Begin() + dataOffset, partial);
+                }
+                placement.Continue(target + partial, remain);
+                return &placement;
+            }
+
+            /// <summary>
+            /// 直接配置したパケットの受信完了を通知
+            /// </summary>
+            void EmitPlaced()
+            {
+                placedCallback(reinterpret_cast<const Packet*>(placedHeader.data()));
+            }
+
+            /// <summary>
+            /// ステートマシンで得たパケットを通知
+            /// </summary>
+            void Emit(const Packet* packet)
+            {
+                if (batchCallback) {
+                    batch.push_back(packet);
+                }
+                else {
+                    callback(packet);
+                }
+            }
+
+            /// <summary>
+            /// 受信データ内の完結したパケットを先頭から連続して切り出す
+            /// 途中で途切れているパケットは呼び出し側でステートマシンへ渡す
+            /// </summary>
+            /// <param name="buffer">受信データ。完結したパケット分を消費する</param>
+            void Scan(Buffer& buffer)
+            {
+                const BYTE* cur = buffer.Begin();
+                const BYTE* const end = buffer.End();
+                while (static_cast<size_t>(end - cur) >= HeaderSize) {
+                    const Packet* packet = reinterpret_cast<const Packet*>(cur);
+                    TrhowIfBadHeader(&packet->head);
+                    const size_t packetSize = packet->head.size;
+                    if (packetSize > static_cast<size_t>(end - cur)) {
+                        break;
+                    }
+                    batch.push_back(packet);
+                    cur += packetSize;
+                }
+                buffer.Consume(static_cast<size_t>(cur - buffer.Begin()));
+            }
+
+        public:
+            /// <summary>
+            /// バッチ通知コンストラクタの指定タグ
+            /// </summary>
+            struct Batch {};
+
+            Receiver() = delete;
+            Receiver(Receiver&&) = delete;
+            Receiver(const Receiver&) = delete;
+
+            Receiver& operator=(Receiver&&) = delete;
+            Receiver& operator=(const Receiver&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="reserveSize">受信バッファー初期リザーブサイズ</param>
+            /// <param name="callback">受信コールバック</param>
+            Receiver(size_t reserveSize, size_t limitSize, ReceivedCallback callback)
+                : limitSize(limitSize)
+                , callback(callback)
+                , idle(this)
+                , continuation(this)
+                , insufficient(this)
+                , placement(this)
+                , state(&idle)
+            {
+                if (!callback) {
+                    throw std::invalid_argument("bad callback error");
+                }
+                pool.reserve(reserveSize);
+            }
+
+            /// <summary>
+            /// コンストラクタ(バッチ通知)
+            /// 受信データ1回分に含まれる完結したパケットをまとめて1回のコールバックで通知する
+            /// </summary>
+            /// <param name="reserveSize">受信バッファー初期リザーブサイズ</param>
+            /// <param name="batchCallback">受信コールバック</param>
+            Receiver(size_t reserveSize, size_t limitSize, Batch, ReceivedBatchCallback batchCallback)
+                : limitSize(limitSize)
+                , batchCallback(batchCallback)
+                , idle(this)
+                , continuation(this)
+                , insufficient(this)
+                , placement(this)
+                , state(&idle)
+            {
+                if (!batchCallback) {
+                    throw std::invalid_argument("bad callback error");
+                }
+                pool.reserve(reserveSize);
+                //受信データ1回分に入りうる最大パケット数
+                batch.reserve(reserveSize / HeaderSize + 1);
+            }
+
+            /// <summary>
+            /// 受信データ処理
+            /// </summary>
+            /// <param name="p">受信バッファー</param>
+            /// <param name="size">サイズ</param>
+            void Feed(LPCVOID p, size_t size)
+            {
+                auto buffer = Buffer(p, size);
+                if (batchCallback) {
+                    FeedBatch(buffer);
+                    return;
+                }
+                //バッファー内をすべて処理するまで繰り返し
+                while (!buffer.Empty()) {
+                    std::tuple<StateBase*, Buffer> res = state->Feed(buffer);
+                    state = std::get<0>(res);
+                    if (!std::get<1>(res).Empty()) {
+                        //受信パケットデータが存在したら受信コールバクを実行
+                        const BYTE* ptr = std::get<1>(res).Pointer();
+                        const Packet* packet = reinterpret_cast<const Packet*>(ptr);
+                        callback(packet);
+                    }
+                }
+            }
+
+            /// <summary>
+            /// 初期状態にリセット
+            /// </summary>
+            void Reset()
+            {
+                state = &idle;
+            }
+
+            /// <summary>
+            /// 受信データを跨ぐパケットの結合領域のサイズ
+            /// </summary>
+            size_t PoolCapacity() const noexcept { return pool.capacity(); }
+
+            /// <summary>
+            /// 直接配置を有効化
+            /// 受信データをまたぐパケットの未受信データがminSize以上の場合、placeで得た格納先(メッセージの結合領域)へデータを配置し、
+            /// プール領域での結合を省く。PlacementTargetの領域へ受信データを直接読み込めば受信バッファーからのコピーも省ける。
+            /// </summary>
+            /// <param name="minSize">直接配置する未受信データサイズの下限</param>
+            /// <param name="place">格納先の取得</param>
+            /// <param name="placed">直接配置したパケットの受信完了</param>
+            void EnablePlacement(size_t minSize, PlaceCallback place, PlacedCallback placed)
+            {
+                if (!place || !placed) {
+                    throw std::invalid_argument("bad callback error");
+                }
+                placementMinSize = minSize;
+                placeCallback = std::move(place);
+                placedCallback = std::move(placed);
+            }
+
+            /// <summary>
+            /// 直接配置中のパケットの未受信データの格納先
+            /// </summary>
+            /// <returns>{格納先, 未受信データサイズ}。直接配置中でない場合は{nullptr, 0}</returns>
+            std::tuple<BYTE*, size_t> PlacementTarget() const
+            {
+                if (state != &placement) {
+                    return { nullptr, 0 };
+                }
+                return { placement.Target(), placement.Remain() };
+            }
+
+            /// <summary>
+            /// PlacementTargetの格納先へ直接読み込んだデータを確定
+            /// </summary>
+            /// <param name="size">読み込んだサイズ</param>
+            void Placed(size_t size)
+            {
+                if (state != &placement || size > placement.Remain()) {
+                    throw std::logic_error("bad placement");
+                }
+                if (placement.Advance(size)) {
+                    state = &idle;
+                    EmitPlaced();
+                }
+            }
+
+        private:
+            /// <summary>
+            /// 受信データ処理(バッチ通知)
+            /// ステートマシンは受信データをまたぐパケットの前後のみで使用し、
+            /// 完結したパケットはヘッダーを辿るだけのループで切り出す
+            /// </summary>
+            void FeedBatch(Buffer& buffer)
+            {
+                batch.clear();
+                //前回の受信から継続しているパケットを完結させる
+                while (state != &idle && !buffer.Empty()) {
+                    std::tuple<StateBase*, Buffer> res = state->Feed(buffer);
+                    state = std::get<0>(res);
+                    if (!std::get<1>(res).Empty()) {
+                        Emit(reinterpret_cast<const Packet*>(std::get<1>(res).Pointer()));
+                    }
+                }
+                Scan(buffer);
+                if (!batch.empty()) {
+                    //プール領域のパケットも含むため、末尾の不完全パケットをプール領域へ保存する前に通知
+                    batchCallback(PacketBatch(batch.data(), batch.size()));
+                }
+                if (!buffer.Empty()) {
+                    //末尾の不完全パケットは次回以降に続きを受信
+                    state = std::get<0>(state->Feed(buffer));
+                    assert(buffer.Empty());
+                }
+            }
+        };
+
+        /// <summary>
+        /// データを複数パケットに変換
+        /// </summary>
+        class Serializer final
+        {
+        private:
+            Buffer buffer;
+            const DWORD splitSize;
+            bool beginning{ true };
+        public:
+            Serializer() = delete;
+            Serializer(Serializer&&) = delete;
+            Serializer(const Serializer&) = delete;
+            Serializer& operator=(Serializer&&) = delete;
+            Serializer& operator=(const Serializer&) = delete;
+            explicit Serializer(Buffer buffer, DWORD splitSize)
+                : buffer{ buffer }, splitSize{ splitSize } {};
+
+            std::tuple<Buffer, Header> Next()
+            {
+                return Next(splitSize);
+            }
+
+            /// <summary>
+            /// 断片サイズを指定して次のパケットを切り出す
+            /// </summary>
+            /// <param name="fragmentSize">断片サイズ。残りが収まる場合は分割しない</param>
+            std::tuple<Buffer, Header> Next(size_t fragmentSize)
+            {
+                if (buffer.Empty()) {
+                    return { buffer, {0} };
+                }
+                auto size = (std::min)(fragmentSize, buffer.Size());
+                auto fragment = buffer.Consume(size);
+                auto header = Header::Create(static_cast<DWORD>(size), beginning, buffer.Empty());
+                beginning = buffer.Empty();
+                return { fragment, header };
+            }
+        };
+
+        /// <summary>
+        /// 適応的な断片サイズの決定
+        /// 断片の書き込みの実測スループットから、1断片の書き込みがADAPTIVE_FRAGMENT_TARGET程度となるサイズを選ぶ。
+        /// 送信中のスレッドのみで利用する。
+        /// </summary>
+        class FragmentSizer final
+        {
+        private:
+            //断片サイズの下限(バッファーサイズ)
+            const size_t minSize;
+            size_t current;
+        public:
+            explicit FragmentSizer(size_t minSize) : minSize(minSize), current(minSize) {}
+
+            /// <summary>
+            /// 次の断片サイズ
+            /// </summary>
+            /// <param name="limit">断片サイズの上限</param>
+            size_t Size(size_t limit) const noexcept
+            {
+                return (std::max)(minSize, (std::min)(current, limit));
+            }
+
+            /// <summary>
+            /// 全体のサイズが分かるメッセージの次の断片サイズ。上限以下のメッセージは実測によらず分割しない。
+            /// </summary>
+            /// <param name="limit">断片サイズの上限</param>
+            /// <param name="messageSize">メッセージ全体のサイズ</param>
+            size_t Size(size_t limit, size_t messageSize) const noexcept
+            {
+                return messageSize <= limit ? limit : Size(limit);
+            }
+
+            /// <summary>
+            /// 断片の書き込み時間を記録
+            /// </summary>
+            /// <param name="bytes">書き込んだ断片のサイズ</param>
+            /// <param name="elapsed">書き込み時間</param>
+            /// <param name="limit">断片サイズの上限</param>
+            void Record(size_t bytes, std::chrono::nanoseconds elapsed, size_t limit) noexcept
+            {
+                if (bytes < minSize) {
+                    //小さな書き込みは固定の処理時間が支配的なので使わない
+                    return;
+                }
+                const auto nanos = (std::max)(elapsed.count(), static_cast<std::chrono::nanoseconds::rep>(1));
+                const auto target = std::chrono::duration_cast<std::chrono::nanoseconds>(ADAPTIVE_FRAGMENT_TARGET).count();
+                const auto desired = static_cast<double>(bytes) * static_cast<double>(target) / static_cast<double>(nanos);
+                const auto bounded = (std::max)(static_cast<double>(minSize), (std::min)(desired, static_cast<double>(limit)));
+                //一時的な遅延で大きく変動しないよう現在値との中間へ寄せる。
+                //中間を取るだけでは上限、下限に届かないため、差が下限サイズ未満となれば目標値とする
+                const auto next = (static_cast<double>(current) + bounded) / 2;
+                const auto gap = bounded > next ? bounded - next : next - bounded;
+                current = static_cast<size_t>(gap < static_cast<double>(minSize) ? bounded : next);
+            }
+        };
+
+        /// <summary>
+        /// ヘッダーとパケットデータを1回の書き込みにまとめる集約クラス
+        /// 容量内であれば連続する複数パケット(複数メッセージ)もまとめて書き込める。
+        /// 保持するのはデータへの参照のみなので、書き込み完了まで元データを維持すること。
+        /// </summary>
+        class WriteGather final
+        {
+        public:
+            //1回の書き込みにまとめるパケット数の上限
+            inline static constexpr size_t MAX_PACKETS = 128;
+        private:
+            Header headers[MAX_PACKETS];
+            //多重化したパケットのストリームID
+            DWORD streamIds[MAX_PACKETS];
+            //先頭パケットに付加するメッセージ全体のサイズ
+            std::uint64_t messageSizes[MAX_PACKETS];
+            //遅延計測のタイムスタンプ
+            TraceStamp traces[MAX_PACKETS];
+            //ヘッダー(とストリームID、メッセージ全体のサイズ、タイムスタンプ)とデータを交互に格納
+            std::vector<Buffer> segments;
+            size_t packetCount{ 0 };
+            size_t totalSize{ 0 };
+            const size_t capacity;
+
+            static size_t ExtensionSize(const TraceStamp* trace, std::uint64_t messageSize)
+            {
+                return (messageSize != 0 ? MessageSizeSize : 0) + (trace != nullptr ? TraceStampSize : 0);
+            }
+
+            void AppendMessageSize(std::uint64_t messageSize)
+            {
+                if (messageSize == 0) {
+                    return;
+                }
+                headers[packetCount].AddMessageSize();
+                messageSizes[packetCount] = messageSize;
+                segments.emplace_back(&messageSizes[packetCount], MessageSizeSize);
+                totalSize += MessageSizeSize;
+            }
+
+            void AppendTrace(const TraceStamp* trace)
+            {
+                if (trace == nullptr) {
+                    return;
+                }
+                headers[packetCount].AddTrace();
+                traces[packetCount] = *trace;
+                segments.emplace_back(&traces[packetCount], TraceStampSize);
+                totalSize += TraceStampSize;
+            }
+
+            void AppendData(Buffer data)
+            {
+                if (!data.Empty()) {
+                    segments.emplace_back(data);
+                }
+                ++packetCount;
+                totalSize += HeaderSize + data.Size();
+            }
+        public:
+            WriteGather() = delete;
+            WriteGather(WriteGather&&) = delete;
+            WriteGather(const WriteGather&) = delete;
+            WriteGather& operator=(WriteGather&&) = delete;
+            WriteGather& operator=(const WriteGather&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="capacity">1回の書き込みの上限サイズ。ヘッダーを含む。</param>
+            explicit WriteGather(size_t capacity)
+                : capacity(capacity)
+            {
+                segments.reserve(MAX_PACKETS * 4);
+            }
+
+            /// <summary>
+            /// パケットを追加できるか
+            /// </summary>
+            /// <param name="dataSize">パケットデータサイズ</param>
+            /// <param name="trace">付加する遅延計測のタイムスタンプ</param>
+            /// <param name="messageSize">付加するメッセージ全体のサイズ</param>
+            /// <returns>空の場合は容量に関わらず追加可能</returns>
+            bool CanAppend(size_t dataSize, const TraceStamp* trace = nullptr, std::uint64_t messageSize = 0) const
+            {
+                if (packetCount == 0) {
+                    return true;
+                }
+                return packetCount < MAX_PACKETS && totalSize + HeaderSize + ExtensionSize(trace, messageSize) + dataSize <= capacity;
+            }
+
+            /// <summary>
+            /// パケットを追加
+            /// </summary>
+            /// <param name="header">ヘッダー</param>
+            /// <param name="data">パケットデータ</param>
+            /// <param name="trace">付加する遅延計測のタイムスタンプ。nullptr時は付加しない</param>
+            /// <param name="messageSize">複数パケットのメッセージの先頭パケットに付加するメッセージ全体のサイズ(HeaderV2)。0の場合は付加しない</param>
+            void Append(const Header& header, Buffer data, const TraceStamp* trace = nullptr, std::uint64_t messageSize = 0)
+            {
+                if (!CanAppend(data.Size(), trace, messageSize)) {
+                    throw std::length_error("gather is full");
+                }
+                headers[packetCount] = header;
+                segments.emplace_back(&headers[packetCount], HeaderSize);
+                AppendMessageSize(messageSize);
+                AppendTrace(trace);
+                AppendData(data);
+            }
+
+            /// <summary>
+            /// 多重化したメッセージのパケットを追加
+            /// </summary>
+            /// <param name="header">ヘッダー(Header::CreateStream)</param>
+            /// <param name="streamId">ストリームID</param>
+            /// <param name="data">パケットデータ</param>
+            /// <param name="trace">付加する遅延計測のタイムスタンプ。nullptr時は付加しない</param>
+            /// <param name="messageSize">先頭パケットに付加するメッセージ全体のサイズ(HeaderV2)。0の場合は付加しない</param>
+            void AppendStream(const Header& header, DWORD streamId, Buffer data, const TraceStamp* trace = nullptr, std::uint64_t messageSize = 0)
+            {
+                if (!CanAppend(StreamIdSize + data.Size(), trace, messageSize)) {
+                    throw std::length_error("gather is full");
+                }
+                headers[packetCount] = header;
+                streamIds[packetCount] = streamId;
+                segments.emplace_back(&headers[packetCount], HeaderSize);
+                segments.emplace_back(&streamIds[packetCount], StreamIdSize);
+                totalSize += StreamIdSize;
+                AppendMessageSize(messageSize);
+                AppendTrace(trace);
+                AppendData(data);
+            }
+
+            void Clear()
+            {
+                segments.clear();
+                packetCount = 0;
+                totalSize = 0;
+            }
+
+            bool Empty() const { return packetCount == 0; }
+            size_t Size() const { return totalSize; }
+            size_t PacketCount() const { return packetCount; }
+            size_t Capacity() const { return capacity; }
+            const std::vector<Buffer>& Segments() const { return segments; }
+        };
+
+        /// <summary>
+        /// メッセージの結合領域(ヒープ)
+        /// std::vector<BYTE>と異なり拡張した領域を初期化しない。直接配置で拡張した領域は直後に受信データで上書きするため、ゼロ埋めを省く。
+        /// </summary>
+        class AssemblyBuffer final
+        {
+        private:
+            std::unique_ptr<BYTE[]> data;
+            size_t capacity{ 0 };
+            size_t size{ 0 };
+        public:
+            AssemblyBuffer() = default;
+            AssemblyBuffer(AssemblyBuffer&&) = delete;
+            AssemblyBuffer(const AssemblyBuffer&) = delete;
+            AssemblyBuffer& operator=(AssemblyBuffer&&) = delete;
+            AssemblyBuffer& operator=(const AssemblyBuffer&) = delete;
+
+            /// <summary>
+            /// 容量の確保。確保済みのデータは新しい領域へコピーする。
+            /// </summary>
+            void Reserve(size_t newCapacity)
+            {
+                if (newCapacity <= capacity) {
+                    return;
+                }
+                std::unique_ptr<BYTE[]> extended(new BYTE[newCapacity]);
+                if (size != 0) {
+                    memcpy(extended.get(), data.get(), size);
+                }
+                data = std::move(extended);
+                capacity = newCapacity;
+            }
+
+            /// <summary>
+            /// データを追加。容量が足りなければ倍々に拡張する。
+            /// </summary>
+            void Append(const BYTE* source, size_t dataSize)
+            {
+                auto extended = Extend(dataSize);
+                if (dataSize != 0) {
+                    memcpy(extended, source, dataSize);
+                }
+            }
+
+            /// <summary>
+            /// データ領域を拡張。容量が足りなければ倍々に拡張する。
+            /// </summary>
+            /// <returns>拡張した領域の先頭。初期化しないので呼び出し側でデータを書き込むこと。</returns>
+            BYTE* Extend(size_t dataSize)
+            {
+                if (capacity - size < dataSize) {
+                    Reserve((std::max)(size + dataSize, capacity * 2));
+                }
+                auto extended = data.get() + size;
+                size += dataSize;
+                return extended;
+            }
+
+            /// <summary>
+            /// データを破棄。容量は維持する。
+            /// </summary>
+            void Clear() noexcept { size = 0; }
+
+            /// <summary>
+            /// データを破棄して領域を解放
+            /// </summary>
+            void Release() noexcept
+            {
+                data.reset();
+                capacity = 0;
+                size = 0;
+            }
+
+            BYTE* Data() const noexcept { return data.get(); }
+            size_t Size() const noexcept { return size; }
+            size_t Capacity() const noexcept { return capacity; }
+        };
+
+        /// <summary>
+        /// 大きなメッセージの結合領域とする一時ファイルのマッピング
+        /// 一時ファイルはクローズ時に削除する。ページはファイルを背景とするため、参照されない部分はカーネルがメモリーから追い出せる。
+        /// ただし、一時ファイルの場所がtmpfsの場合はページがメモリー(スワップ)を背景とする。
+        /// </summary>
+        class SpillFile final
+        {
+        private:
+#ifdef _WIN32
+            winrt::file_handle file;
+            winrt::handle mapping;
+#else
+            UniqueFd file;
+#endif
+            BYTE* view{ nullptr };
+            size_t capacity{ 0 };
+            size_t size{ 0 };
+
+            void Unmap() noexcept
+            {
+                if (view == nullptr) {
+                    return;
+                }
+#ifdef _WIN32
+                UnmapViewOfFile(view);
+                mapping.close();
+#else
+                ::munmap(view, capacity);
+#endif
+                view = nullptr;
+            }
+
+            /// <summary>
+            /// ファイルを拡張してマッピングし直す。書き込み済みのデータはファイルに残るのでコピーしない。
+            /// </summary>
+            void Map(size_t newCapacity)
+            {
+#ifndef _WIN32
+                //疎なファイルのままだとディスクの空きが無い時にマッピングへの書き込みでSIGBUSとなるため、拡張分の領域を先に確保する
+                Allocate(newCapacity);
+#endif
+                Unmap();
+#ifdef _WIN32
+                const auto fileSize = static_cast<std::uint64_t>(newCapacity);
+                mapping.attach(CreateFileMappingW(file.get(), nullptr, PAGE_READWRITE, static_cast<DWORD>(fileSize >> 32), static_cast<DWORD>(fileSize), nullptr));
+                winrt::check_bool(bool{ mapping });
+                view = static_cast<BYTE*>(MapViewOfFile(mapping.get(), FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, newCapacity));
+                winrt::check_bool(view != nullptr);
+#else
+                auto p = ::mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, file.get(), 0);
+                CheckErrno(p != MAP_FAILED);
+                view = static_cast<BYTE*>(p);
+#endif
+                capacity = newCapacity;
+            }
+
+#ifndef _WIN32
+            /// <summary>
+            /// ファイルを拡張し、拡張分のディスク領域を確保する。確保できない場合は例外(ENOSPC等)。
+            /// </summary>
+            void Allocate(size_t newCapacity)
+            {
+                if (newCapacity <= capacity) {
+                    return;
+                }
+#ifdef __APPLE__
+                //posix_fallocateが無いため、F_PREALLOCATEで確保してからファイルサイズを伸ばす
+                fstore_t store{ F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(newCapacity - capacity), 0 };
+                CheckErrno(::fcntl(file.get(), F_PREALLOCATE, &store) != -1);
+                CheckErrno(::ftruncate(file.get(), static_cast<off_t>(newCapacity)) == 0);
+#else
+                //posix_fallocateはerrnoを設定せずエラー番号を返す
+                const auto result = ::posix_fallocate(file.get(), static_cast<off_t>(capacity), static_cast<off_t>(newCapacity - capacity));
+                if (result != 0) {
+                    ThrowErrno(result);
+                }
+#endif
+            }
+#endif
+
+            static auto CreateTemporary()
+            {
+#ifdef _WIN32
+                WCHAR dir[MAX_PATH + 1];
+                auto length = GetTempPathW(MAX_PATH + 1, dir);
+                winrt::check_bool(length != 0 && length <= MAX_PATH);
+                WCHAR path[MAX_PATH];
+                winrt::check_bool(GetTempFileNameW(dir, L"snp", 0, path) != 0);
+                HANDLE handle = CreateFileW(
+                    path,
+                    GENERIC_READ | GENERIC_WRITE,
+                    0,
+                    nullptr,
+                    CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                    nullptr);
+                if (INVALID_HANDLE_VALUE == handle) {
+                    DeleteFileW(path);
+                    winrt::throw_last_error();
+                }
+                return winrt::file_handle(handle);
+#else
+                const char* dir = ::getenv("TMPDIR");
+                std::string path = (dir != nullptr && *dir != '\0') ? dir : "/tmp";
+                UniqueFd file;
+#ifdef O_TMPFILE
+                //名前の無い一時ファイル
+                file = UniqueFd{ ::open(path.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600) };
+                if (file) {
+                    return file;
+                }
+#endif
+                //O_TMPFILEに対応しないファイルシステムでは作成直後に名前を削除する
+                path += "/SimpleNamedPipe.XXXXXX";
+                file = UniqueFd{ ::mkstemp(&path[0]) };
+                CheckErrno(bool{ file });
+                ::unlink(path.c_str());
+                ::fcntl(file.get(), F_SETFD, FD_CLOEXEC);
+                return file;
+#endif
+            }
+        public:
+            SpillFile() = delete;
+            SpillFile(SpillFile&&) = delete;
+            SpillFile(const SpillFile&) = delete;
+            SpillFile& operator=(SpillFile&&) = delete;
+            SpillFile& operator=(const SpillFile&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="capacity">初期のマッピングサイズ。メッセージ全体のサイズが分かる場合はそのサイズ</param>
+            explicit SpillFile(size_t capacity)
+                : file(CreateTemporary())
+            {
+                Map((std::max)(capacity, static_cast<size_t>(1)));
+            }
+
+            ~SpillFile()
+            {
+                Unmap();
+            }
+
+            /// <summary>
+            /// データを追加。容量が足りなければ倍々に拡張する。
+            /// </summary>
+            /// <param name="maxCapacity">拡張するマッピングサイズの上限</param>
+            void Append(const BYTE* data, size_t dataSize, size_t maxCapacity)
+            {
+                auto extended = Extend(dataSize, maxCapacity);
+                if (dataSize != 0) {
+                    memcpy(extended, data, dataSize);
+                }
+            }
+
+            /// <summary>
+            /// データ領域を拡張。容量が足りなければ倍々に拡張する。
+            /// </summary>
+            /// <param name="maxCapacity">拡張するマッピングサイズの上限</param>
+            /// <returns>拡張した領域の先頭。呼び出し側でデータを書き込むこと。</returns>
+            BYTE* Extend(size_t dataSize, size_t maxCapacity)
+            {
+                if (capacity - size < dataSize) {
+                    const auto grown = capacity > maxCapacity / 2 ? maxCapacity : capacity * 2;
+                    Map((std::max)(size + dataSize, grown));
+                }
+                auto extended = view + size;
+                size += dataSize;
+                return extended;
+            }
+
+            BYTE* Data() const noexcept { return view; }
+            size_t Size() const noexcept { return size; }
+            size_t Capacity() const noexcept { return capacity; }
+        };
+
+        /// <summary>
+        /// 複数パケットからデータに変換
+        /// 多重化したパケット(Header::IsStream)はストリームID毎に組み立てる。
+        /// </summary>
+        class Deserializer final
+        {
+        private:
+            /// <summary>
+            /// 組み立て中のメッセージ
+            /// </summary>
+            struct Assembly {
+                bool beginning{ true };
+                AssemblyBuffer pool;
+                //組み立て中のメッセージプール
+                std::shared_ptr<MessagePool> activePool;
+                //組み立て中のメッセージ
+                PipeMessage message;
+                //先頭パケットに付加された遅延計測のタイムスタンプ
+                MessageTrace trace;
+                bool traced{ false };
+                //先頭パケットに付加されたメッセージ全体のサイズ(HeaderV2)。0の場合は不明
+                size_t expected{ 0 };
+                //結合せずに断片毎に通知中(分割受信)
+                bool chunked{ false };
+                //分割受信で通知済みのサイズ
+                size_t received{ 0 };
+                //しきい値を超えたメッセージの結合領域(一時ファイル)
+                std::unique_ptr<SpillFile> spill;
+            };
+            //多重化していないパケットのメッセージ
+            Assembly primary;
+            //多重化したパケットのメッセージ(ストリームID毎)
+            std::vector<std::pair<DWORD, std::unique_ptr<Assembly>>> streams;
+            const size_t reserveSize;
+            const size_t limitSize;
+            std::function<void(Buffer)> completed;
+        public:
+            //分割受信の通知(イベント種別, データ, サイズ)
+            using ChunkCallback = std::function<void(PipeEventType, LPCVOID, size_t)>;
+        private:
+            ChunkCallback chunk;
+            //分割受信の有効化(SetChunked)。次のメッセージから有効
+            std::atomic_bool chunking{ false };
+            //受信メッセージプール。nullptr時はpoolで結合する
+            std::shared_ptr<MessagePool> messagePool;
+            //完了通知中のメッセージ
+            const PipeMessage* notifying{ nullptr };
+            inline static const PipeMessage emptyMessage{};
+            //受信時刻(SetReadTime)
+            std::int64_t readTime{ 0 };
+            //完了通知中のメッセージの遅延計測の記録
+            const MessageTrace* tracing{ nullptr };
+            //一時ファイルへ退避するメッセージサイズ(SetSpillThreshold)。0の場合は退避しない
+            std::atomic_size_t spillThreshold{ 0 };
+            //完了通知中のメッセージを一時ファイルで結合した
+            bool spilled{ false };
+            //完了通知中のメッセージの一時ファイル(TakeSpill)
+            std::unique_ptr<SpillFile>* notifyingSpill{ nullptr };
+
+            /// <summary>
+            /// 組み立てたメッセージの完了通知
+            /// </summary>
+            void Complete(Assembly& assembly, Buffer data)
+            {
+                assembly.beginning = true;
+                notifying = &assembly.message;
+                tracing = assembly.traced ? &assembly.trace : nullptr;
+                spilled = assembly.spill != nullptr;
+                notifyingSpill = &assembly.spill;
+                try {
+                    completed(data);
+                }
+                catch (...) {
+                    notifying = nullptr;
+                    tracing = nullptr;
+                    spilled = false;
+                    notifyingSpill = nullptr;
+                    assembly.message = PipeMessage();
+                    assembly.spill.reset();
+                    throw;
+                }
+                notifying = nullptr;
+                tracing = nullptr;
+                spilled = false;
+                notifyingSpill = nullptr;
+                assembly.message = PipeMessage();
+                assembly.spill.reset();
+            }
+
+            /// <summary>
+            /// ストリームIDの組み立て中メッセージ
+            /// </summary>
+            /// <param name="id">ストリームID</param>
+            /// <param name="create">無い場合に追加する</param>
+            Assembly* FindStream(DWORD id, bool create)
+            {
+                for (auto& stream : streams) {
+                    if (stream.first == id) {
+                        return stream.second.get();
+                    }
+                }
+                if (!create) {
+                    return nullptr;
+                }
+                if (streams.size() >= MAX_STREAMS) {
+                    throw std::length_error("too many streams");
+                }
+                streams.emplace_back(id, std::make_unique<Assembly>());
+                streams.back().second->pool.Reserve(reserveSize);
+                return streams.back().second.get();
+            }
+
+            /// <summary>
+            /// 組み立て中のメッセージの上限サイズ
+            /// </summary>
+            size_t LimitOf(const Assembly& assembly) const
+            {
+                return assembly.expected != 0 ? assembly.expected : limitSize;
+            }
+
+            /// <summary>
+            /// 最終パケットまで結合したメッセージのサイズを検証
+            /// </summary>
+            static void ThrowIfIncomplete(const Assembly& assembly, size_t size)
+            {
+                if (assembly.expected != 0 && assembly.expected != size) {
+                    //データに矛盾
+                    throw std::runtime_error("inconsistent feed data");
+                }
+            }
+
+            void EraseStream(DWORD id)
+            {
+                streams.erase(std::remove_if(streams.begin(), streams.end(), [id](const auto& stream) { return stream.first == id; }), streams.end());
+            }
+
+            /// <summary>
+            /// 一時ファイルへ退避するサイズか
+            /// </summary>
+            bool ShouldSpill(size_t size) const noexcept
+            {
+                auto threshold = spillThreshold.load(std::memory_order_relaxed);
+                return threshold != 0 && size >= threshold;
+            }
+
+            /// <summary>
+            /// 分割受信のパケットを結合せずに通知
+            /// </summary>
+            void FeedChunk(Assembly& assembly, const Packet* packet)
+            {
+                auto packetData = packet->Data();
+                if (LimitOf(assembly) - assembly.received < packetData.Size()) {
+                    throw std::length_error("size is too long");
+                }
+                assembly.received += packetData.Size();
+                if (!packetData.Empty()) {
+                    chunk(PipeEventType::RECEIVED_CHUNK, packetData.Pointer(), packetData.Size());
+                }
+                if (packet->head.IsEnd()) {
+                    ThrowIfIncomplete(assembly, assembly.received);
+                    assembly.beginning = true;
+                    assembly.chunked = false;
+                    chunk(PipeEventType::RECEIVED_END, nullptr, assembly.received);
+                }
+            }
+
+            /// <summary>
+            /// 最初のパケットの共通処理。組み立て中のメッセージを破棄し、付加情報を取り出す。
+            /// </summary>
+            void Begin(Assembly& assembly, const Packet* packet)
+            {
+                assembly.pool.Clear();
+                assembly.message = PipeMessage();
+                assembly.spill.reset();
+                if (!packet->head.IsStart()) {
+                    //データに矛盾
+                    throw std::runtime_error("inconsistent feed data");
+                }
+                assembly.traced = packet->Trace(assembly.trace.sent);
+                assembly.trace.received = readTime;
+                std::uint64_t messageSize = 0;
+                if (packet->MessageSize(messageSize) && messageSize > limitSize) {
+                    //全体を受信する前に上限サイズを超えることが分かる
+                    throw std::length_error("size is too long");
+                }
+                assembly.expected = static_cast<size_t>(messageSize);
+                assembly.activePool = std::atomic_load(&messagePool);
+            }
+
+            /// <summary>
+            /// 分割受信で通知するメッセージの先頭パケットか
+            /// 分割受信は多重化していない複数パケットのメッセージのみ
+            /// </summary>
+            bool StartsChunk(const Assembly& assembly, const Packet* packet) const
+            {
+                return &assembly == &primary && !packet->head.IsEnd() && chunk && chunking.load(std::memory_order_relaxed);
+            }
+
+            /// <summary>
+            /// 受信前に確保する結合領域のサイズ。申告されたメッセージ全体のサイズをMAX_PRESIZEで制限する。
+            /// </summary>
+            size_t PresizeOf(const Assembly& assembly) const noexcept
+            {
+                return (std::min)(assembly.expected, (std::max)(MAX_PRESIZE, reserveSize * 4));
+            }
+
+            /// <summary>
+            /// 結合領域の確保
+            /// </summary>
+            void Prepare(Assembly& assembly)
+            {
+                if (!assembly.activePool && ShouldSpill(assembly.expected)) {
+                    //しきい値以上のメッセージは一時ファイルで結合する。全体のサイズまでは受信に合わせて拡張する
+                    assembly.spill = std::make_unique<SpillFile>(PresizeOf(assembly));
+                }
+                else if (assembly.expected != 0) {
+                    //メッセージ全体のサイズが分かる場合は結合領域を先に確保し、追加毎の再確保とコピーを避ける
+                    if (assembly.activePool) {
+                        assembly.message = assembly.activePool->Acquire(PresizeOf(assembly));
+                    }
+                    else {
+                        assembly.pool.Reserve(PresizeOf(assembly));
+                    }
+                }
+                assembly.beginning = false;
+            }
+
+            /// <summary>
+            /// 結合済みのサイズ
+            /// </summary>
+            static size_t Assembled(const Assembly& assembly)
+            {
+                if (assembly.activePool) {
+                    return assembly.message.Size();
+                }
+                if (assembly.spill) {
+                    return assembly.spill->Size();
+                }
+                return assembly.pool.Size();
+            }
+
+            /// <summary>
+            /// データを追加する前の上限サイズの確認
+            /// 全体のサイズが不明なメッセージはしきい値に達した時点で結合済みのデータを一時ファイルへ移す
+            /// </summary>
+            /// <param name="size">追加するデータサイズ</param>
+            void Grow(Assembly& assembly, size_t size)
+            {
+                if (LimitOf(assembly) - Assembled(assembly) < size) {
+                    throw std::length_error("size is too long");
+                }
+                if (!assembly.activePool && !assembly.spill && ShouldSpill(assembly.pool.Size() + size)) {
+                    auto spill = std::make_unique<SpillFile>(assembly.pool.Size());
+                    spill->Append(assembly.pool.Data(), assembly.pool.Size(), LimitOf(assembly));
+                    assembly.pool.Release();
+                    assembly.pool.Reserve(reserveSize);
+                    assembly.spill = std::move(spill);
+                }
+                else if (!assembly.activePool && !assembly.spill && assembly.expected != 0 && assembly.pool.Capacity() - assembly.pool.Size() < size) {
+                    //全体のサイズが分かる場合は全体のサイズを上限に倍々に確保する
+                    assembly.pool.Reserve((std::min)(assembly.expected, (std::max)(assembly.pool.Capacity() * 2, assembly.pool.Size() + size)));
+                }
+            }
+
+            /// <summary>
+            /// 最終パケットであれば組み立てたメッセージを完了通知
+            /// </summary>
+            void Finish(Assembly& assembly, const Packet* packet)
+            {
+                if (!packet->head.IsEnd()) {
+                    return;
+                }
+                const auto size = Assembled(assembly);
+                ThrowIfIncomplete(assembly, size);
+                if (assembly.activePool) {
+                    Complete(assembly, Buffer(assembly.message.Data(), size));
+                }
+                else if (assembly.spill) {
+                    Complete(assembly, Buffer(assembly.spill->Data(), size));
+                }
+                else {
+                    Complete(assembly, Buffer(assembly.pool.Data(), size));
+                }
+            }
+
+            bool Feed(Assembly& assembly, const Packet* packet)
+            {
+                if (packet->head.IsCancel()) {
+                    if (assembly.chunked && !assembly.beginning) {
+                        assembly.chunked = false;
+                        chunk(PipeEventType::RECEIVED_CANCELED, nullptr, assembly.received);
+                    }
+                    assembly.beginning = true;
+                    assembly.pool.Clear();
+                    assembly.message = PipeMessage();
+                    assembly.spill.reset();
+                    return false;
+                }
+                auto packetData = packet->Data();
+                if (assembly.beginning) {
+                    //最初のパケット
+                    Begin(assembly, packet);
+                    if (StartsChunk(assembly, packet)) {
+                        assembly.chunked = true;
+                        assembly.received = 0;
+                        assembly.beginning = false;
+                        chunk(PipeEventType::RECEIVED_BEGIN, nullptr, assembly.expected);
+                        FeedChunk(assembly, packet);
+                        return true;
+                    }
+                    if (!assembly.activePool && packet->head.IsEnd()) {
+                        //1パケットで完結する場合は結合不要なので、プール領域へコピーせずに受信バッファーを直接渡す
+                        if (limitSize < packetData.Size()) {
+                            throw std::length_error("size is too long");
+                        }
+                        tracing = assembly.traced ? &assembly.trace : nullptr;
+                        try {
+                            completed(packetData);
+                        }
+                        catch (...) {
+                            tracing = nullptr;
+                            throw;
+                        }
+                        tracing = nullptr;
+                        return true;
+                    }
+                    Prepare(assembly);
+                }
+                if (assembly.chunked) {
+                    FeedChunk(assembly, packet);
+                    return true;
+                }
+                Grow(assembly, packetData.Size());
+                if (assembly.activePool) {
+                    //プールのスラブに直接結合し、ハンドルの所有権を受信側へ渡す
+                    assembly.activePool->Append(assembly.message, packetData.Pointer(), packetData.Size());
+                }
+                else if (assembly.spill) {
+                    assembly.spill->Append(packetData.Pointer(), packetData.Size(), LimitOf(assembly));
+                }
+                else {
+                    assembly.pool.Append(packetData.Pointer(), packetData.Size());
+                }
+                Finish(assembly, packet);
+                return true;
+            }
+
+            /// <summary>
+            /// 直接配置するパケットのデータの格納先を結合領域に確保
+            /// </summary>
+            /// <returns>格納先。分割受信などで直接配置しない場合はnullptr</returns>
+            BYTE* Place(Assembly& assembly, const Packet* packet)
+            {
+                if (assembly.beginning) {
+                    if (!packet->head.IsStart() || StartsChunk(assembly, packet)) {
+                        //Feedで処理する
+                        return nullptr;
+                    }
+                    Begin(assembly, packet);
+                    Prepare(assembly);
+                }
+                if (assembly.chunked) {
+                    return nullptr;
+                }
+                const size_t size = packet->head.DataSize();
+                Grow(assembly, size);
+                if (assembly.activePool) {
+                    return assembly.activePool->Extend(assembly.message, size);
+                }
+                if (assembly.spill) {
+                    return assembly.spill->Extend(size, LimitOf(assembly));
+                }
+                return assembly.pool.Extend(size);
+            }
+
+        public:
+            //同時に組み立てる多重化メッセージ数の上限
+            inline static constexpr size_t MAX_STREAMS = 64;
+
+            Deserializer() = delete;
+            Deserializer(Deserializer&&) = delete;
+            Deserializer(const Deserializer&) = delete;
+            Deserializer& operator=(Serializer&&) = delete;
+            Deserializer& operator=(const Deserializer&) = delete;
+            Deserializer(size_t reserveSize, size_t limitSize, std::function<void(Buffer)> completed)
+                : reserveSize(reserveSize)
+                , limitSize(limitSize)
+                , completed(completed)
+            {
+                if (!completed) {
+                    throw std::invalid_argument("bad callback error");
+                }
+                primary.pool.Reserve(reserveSize);
+            }
+
+            /// <summary>
+            /// コンストラクタ(分割受信対応)
+            /// </summary>
+            /// <param name="chunk">分割受信(SetChunked)時の通知</param>
+            Deserializer(size_t reserveSize, size_t limitSize, std::function<void(Buffer)> completed, ChunkCallback chunk)
+                : Deserializer(reserveSize, limitSize, std::move(completed))
+            {
+                if (!chunk) {
+                    throw std::invalid_argument("bad callback error");
+                }
+                this->chunk = std::move(chunk);
+            }
+
+            void Reset()
+            {
+                primary.beginning = true;
+                primary.chunked = false;
+                primary.message = PipeMessage();
+                primary.spill.reset();
+                streams.clear();
+            }
+
+            /// <summary>
+            /// 一時ファイルへの退避の設定。次のメッセージから有効。
+            /// 受信メッセージプールを使わない結合で、メッセージ全体のサイズ(HeaderV2)か結合中のサイズがしきい値に達したメッセージを一時ファイルのマッピングで結合する。
+            /// </summary>
+            /// <param name="threshold">しきい値。0の場合は無効化</param>
+            void SetSpillThreshold(size_t threshold) noexcept { spillThreshold.store(threshold); }
+
+            size_t SpillThreshold() const noexcept { return spillThreshold.load(); }
+
+            /// <summary>
+            /// 完了通知中のメッセージを一時ファイルで結合したか
+            /// </summary>
+            bool Spilled() const noexcept { return spilled; }
+
+            /// <summary>
+            /// 完了通知中のメッセージの一時ファイルを引き取る。完了通知後もマッピングは引き取った側で維持する。
+            /// </summary>
+            /// <returns>一時ファイルで結合していない、または引き取り済みの場合はnullptr</returns>
+            std::unique_ptr<SpillFile> TakeSpill() noexcept
+            {
+                return notifyingSpill != nullptr ? std::move(*notifyingSpill) : nullptr;
+            }
+
+            /// <summary>
+            /// 分割受信の設定。次のメッセージから有効。
+            /// 複数パケットのメッセージ(多重化したメッセージを除く)を結合せずに、開始、パケット毎のデータ、終了をChunkCallbackで通知する。
+            /// </summary>
+            void SetChunked(bool enable) noexcept { chunking.store(enable); }
+
+            bool Chunked() const noexcept { return chunking.load(); }
+
+            /// <summary>
+            /// 受信メッセージプールの設定。次のメッセージから有効。
+            /// </summary>
+            /// <param name="pool">受信メッセージプール。nullptr時は無効化</param>
+            void SetMessagePool(std::shared_ptr<MessagePool> pool)
+            {
+                std::atomic_store(&messagePool, std::move(pool));
+            }
+
+            /// <summary>
+            /// 完了通知中のメッセージ。受信メッセージプールが無効の場合は空
+            /// </summary>
+            const PipeMessage& Message() const { return notifying != nullptr ? *notifying : emptyMessage; }
+
+            /// <summary>
+            /// 以降に供給するパケットの受信時刻。遅延計測時に監視タスクから設定する。
+            /// </summary>
+            /// <param name="time">steady_clockのエポックからのナノ秒</param>
+            void SetReadTime(std::int64_t time) noexcept { readTime = time; }
+
+            /// <summary>
+            /// 完了通知中のメッセージの遅延計測の記録。タイムスタンプが付加されていない場合はnullptr
+            /// </summary>
+            const MessageTrace* Trace() const { return tracing; }
+
+            /// <summary>
+            /// 組み立て中の多重化メッセージ数
+            /// </summary>
+            size_t StreamCount() const { return streams.size(); }
+
+            /// <summary>
+            /// 複数パケットのメッセージの結合領域のサイズ(組み立て中の多重化メッセージを含む)
+            /// </summary>
+            size_t PoolCapacity() const noexcept
+            {
+                auto size = primary.pool.Capacity();
+                for (const auto& stream : streams) {
+                    size += stream.second->pool.Capacity();
+                }
+                return size;
+            }
+
+            /// <summary>
+            /// パケットのメッセージを組み立て中(先頭パケットを受信済み)か
+            /// </summary>
+            bool Started(const Packet* packet)
+            {
+                if (!packet->head.IsStream()) {
+                    return !primary.beginning;
+                }
+                return FindStream(packet->StreamId(), false) != nullptr;
+            }
+
+            bool Feed(const Packet* packet)
+            {
+                auto id = packet->StreamId();
+                if (!packet->head.IsStream()) {
+                    return Feed(primary, packet);
+                }
+                //多重化したパケットは先頭パケットでストリームを開始し、最終パケットかキャンセルで破棄する
+                auto assembly = FindStream(id, packet->head.IsStart());
+                if (assembly == nullptr) {
+                    if (packet->head.IsCancel()) {
+                        return false;
+                    }
+                    throw std::runtime_error("inconsistent feed data");
+                }
+                bool result = false;
+                try {
+                    result = Feed(*assembly, packet);
+                }
+                catch (...) {
+                    EraseStream(id);
+                    throw;
+                }
+                if (assembly->beginning) {
+                    EraseStream(id);
+                }
+                return result;
+            }
+
+            /// <summary>
+            /// 直接配置(Receiver::EnablePlacement)するパケットのデータの格納先
+            /// 結合領域にパケットのデータサイズ分を確保する。受信完了後にFeedPlacedを呼び出すこと。
+            /// </summary>
+            /// <param name="packet">ヘッダーと付加情報(dataOffsetまで)のみのパケット</param>
+            /// <returns>格納先。直接配置しない場合はnullptr</returns>
+            BYTE* Place(const Packet* packet)
+            {
+                if (packet->head.IsCancel() || packet->head.IsCredit() || packet->head.DataSize() == 0) {
+                    return nullptr;
+                }
+                if (!packet->head.IsStream()) {
+                    return Place(primary, packet);
+                }
+                auto id = packet->StreamId();
+                auto assembly = FindStream(id, packet->head.IsStart());
+                if (assembly == nullptr) {
+                    return nullptr;
+                }
+                try {
+                    return Place(*assembly, packet);
+                }
+                catch (...) {
+                    EraseStream(id);
+                    throw;
+                }
+            }
+
+            /// <summary>
+            /// 直接配置したパケットの受信完了。最終パケットであれば組み立てたメッセージを完了通知する。
+            /// </summary>
+            /// <param name="packet">ヘッダーと付加情報(dataOffsetまで)のみのパケット</param>
+            void FeedPlaced(const Packet* packet)
+            {
+                if (!packet->head.IsStream()) {
+                    Finish(primary, packet);
+                    return;
+                }
+                auto id = packet->StreamId();
+                auto assembly = FindStream(id, false);
+                if (assembly == nullptr) {
+                    throw std::runtime_error("inconsistent feed data");
+                }
+                try {
+                    Finish(*assembly, packet);
+                }
+                catch (...) {
+                    EraseStream(id);
+                    throw;
+                }
+                if (assembly->beginning) {
+                    EraseStream(id);
+                }
+            }
+        };
+
+#pragma endregion
+
+#pragma region SendQueue
+        /// <summary>
+        /// 固定長のマルチプロデューサー・シングルコンシューマーキュー
+        /// 追加はロックフリーで複数スレッドから同時に行える。取り出しは同時に1スレッドのみとすること。
+        /// </summary>
+        template<typename T>
+        class SendQueue final
+        {
+        private:
+            struct Cell {
+                //追加側と取り出し側の進行状況
+                std::atomic_size_t sequence;
+                std::optional<T> value;
+            };
+            std::unique_ptr<Cell[]> cells;
+            const size_t mask;
+            std::atomic_size_t enqueuePos{ 0 };
+            //取り出しは1スレッドのみなのでアトミック不要
+            size_t dequeuePos{ 0 };
+        public:
+            SendQueue() = delete;
+            SendQueue(SendQueue&&) = delete;
+            SendQueue(const SendQueue&) = delete;
+            SendQueue& operator=(SendQueue&&) = delete;
+            SendQueue& operator=(const SendQueue&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="capacity">キューの長さ。2のべき乗であること。</param>
+            explicit SendQueue(size_t capacity)
+                : cells(std::make_unique<Cell[]>(capacity))
+                , mask(capacity - 1)
+            {
+                if (capacity < 2 || (capacity & mask) != 0) {
+                    throw std::invalid_argument("capacity must be a power of 2");
+                }
+                for (size_t i = 0; i < capacity; ++i) {
+                    cells[i].sequence.store(i, std::memory_order_relaxed);
+                }
+            }
+
+            /// <summary>
+            /// 要素を追加
+            /// </summary>
+            /// <param name="value">追加する要素。追加できた場合のみムーブする。</param>
+            /// <returns>キューが満杯の場合はfalse</returns>
+            bool TryPush(T& value)
+            {
+                auto pos = enqueuePos.load(std::memory_order_relaxed);
+                Cell* cell;
+                while (true) {
+                    cell = &cells[pos & mask];
+                    auto seq = cell->sequence.load(std::memory_order_acquire);
+                    auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+                    if (diff == 0) {
+                        //空きセルを確保
+                        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    }
+                    else if (diff < 0) {
+                        //満杯
+                        return false;
+                    }
+                    else {
+                        //他のスレッドが先に確保した
+                        pos = enqueuePos.load(std::memory_order_relaxed);
+                    }
+                }
+                cell->value.emplace(std::move(value));
+                cell->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            /// <summary>
+            /// 先頭の要素を取り出し
+            /// </summary>
+            /// <returns>キューが空の場合は無効値</returns>
+            std::optional<T> TryPop()
+            {
+                auto& cell = cells[dequeuePos & mask];
+                if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+                    return std::nullopt;
+                }
+                std::optional<T> value(std::move(cell.value));
+                cell.value.reset();
+                cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+                ++dequeuePos;
+                return value;
+            }
+
+            /// <summary>
+            /// 先頭の要素を参照。取り出し側のスレッドから呼び出すこと。
+            /// </summary>
+            /// <returns>キューが空の場合はnullptr。次の取り出しまで有効。</returns>
+            T* Peek()
+            {
+                auto& cell = cells[dequeuePos & mask];
+                if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+                    return nullptr;
+                }
+                return &*cell.value;
+            }
+
+            /// <summary>
+            /// 取り出し可能な要素がないか。取り出し側のスレッドから呼び出すこと。
+            /// </summary>
+            bool Empty() const
+            {
+                return cells[dequeuePos & mask].sequence.load(std::memory_order_acquire) != dequeuePos + 1;
+            }
+
+            /// <summary>
+            /// 満杯か。追加側の待機判定用で、結果は呼び出し直後に変化しうる。
+            /// </summary>
+            bool Full() const
+            {
+                auto pos = enqueuePos.load(std::memory_order_acquire);
+                return cells[pos & mask].sequence.load(std::memory_order_acquire) < pos;
+            }
+
+            size_t Capacity() const { return mask + 1; }
+        };
+
+        /// <summary>
+        /// 送信完了の通知先。通知まで送信要求元が維持する。
+        /// </summary>
+        struct WriteNotify {
+            /// <summary>
+            /// 送信完了通知。送信ループのスレッドで呼び出される。
+            /// </summary>
+            /// <param name="error">エラー時の例外。正常終了時はnullptr</param>
+            virtual void Complete(std::exception_ptr error) noexcept = 0;
+        protected:
+            ~WriteNotify() = default;
+        };
+
+        /// <summary>
+        /// 同期送信の完了待ち
+        /// 呼び出し元のスタック上に配置し、送信ごとのヒープ確保を避ける。
+        /// </summary>
+        struct WriteWaiter final : WriteNotify {
+            std::mutex lock;
+            std::condition_variable cv;
+            bool done{ false };
+            std::exception_ptr error;
+
+            virtual void Complete(std::exception_ptr exception) noexcept override
+            {
+                //待機側はロック解放後に破棄されるため、通知はロック内で行う
+                std::lock_guard<std::mutex> guard(lock);
+                error = exception;
+                done = true;
+                cv.notify_all();
+            }
+        };
+
+        /// <summary>
+        /// 送信要求
+        /// </summary>
+        struct WriteRequest {
+            //送信データ。完了通知まで呼び出し元が維持する。
+            Buffer buffer;
+            //まとめて送信するメッセージ(WriteBatchAsync時のみ)。空の場合はbufferを送信する。
+            std::vector<Buffer> batch;
+            //キャンセルトークン
+            CancellationToken ct;
+            //完了通知(WriteAsync時)
+            std::optional<PipeTaskCompletion> completion;
+            //完了通知(Write, AwaitWrite時)。nullptr時はcompletionで通知する。
+            WriteNotify* notify{ nullptr };
+            //送信枠の付与のみを送信する制御要求。完了通知は行わない。
+            bool grant{ false };
+            //送信優先度
+            SendPriority priority{ SendPriority::NORMAL };
+            //送信キューへの追加時刻。送信キューを経由しない送信要求は既定値
+            std::chrono::steady_clock::time_point enqueued{};
+            //送信データの読み出し関数(WriteStreamAsync時のみ)。空の場合はbuffer, batchを送信する。
+            ChunkReader source{};
+            //受け付けた時点の接続の世代。送信開始時に世代が変わっていれば送信しない
+            size_t connection{ 0 };
+        };
+#pragma endregion
+
+#pragma region Inbox
+        /// <summary>
+        /// プル型受信の受信箱
+        /// 追加は監視タスクのみ、取り出しは複数スレッドから行える。キューへの追加はロックフリー。
+        /// キューが満杯の場合は溢れたメッセージを監視タスク側で保持し、監視タスクは受信を停止する。
+        /// </summary>
+        class Inbox final
+        {
+        private:
+#ifdef _WIN32
+            using Completion = concurrency::task_completion_event<PipeMessage>;
+#else
+            using Completion = std::promise<PipeMessage>;
+#endif
+            SendQueue<PipeMessage> queue;
+            //キュー内のメッセージ数
+            std::atomic_size_t count{ 0 };
+            //取り出し側の排他(SendQueueの取り出しは1スレッドのみのため)
+            std::mutex popLock;
+            //ReceiveAsyncの待機(popLockで保護)
+            std::deque<Completion> waiters;
+            std::atomic_size_t waiterCount{ 0 };
+            //キューに入らなかったメッセージ(監視タスクのみで利用)
+            std::vector<PipeMessage> overflow;
+
+            /// <summary>
+            /// キューのメッセージを待機中のReceiveAsyncへ渡す
+            /// </summary>
+            size_t ServeWaiters()
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                size_t served = 0;
+                while (!waiters.empty()) {
+                    auto message = queue.TryPop();
+                    if (!message) {
+                        break;
+                    }
+                    count.fetch_sub(1);
+                    auto waiter = std::move(waiters.front());
+                    waiters.pop_front();
+                    waiterCount.fetch_sub(1);
+#ifdef _WIN32
+                    waiter.set(std::move(*message));
+#else
+                    waiter.set_value(std::move(*message));
+#endif
+                    ++served;
+                }
+                return served;
+            }
+        public:
+            Inbox() = delete;
+            Inbox(Inbox&&) = delete;
+            Inbox(const Inbox&) = delete;
+            Inbox& operator=(Inbox&&) = delete;
+            Inbox& operator=(const Inbox&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="capacity">受信箱の長さ。2のべき乗であること。</param>
+            explicit Inbox(size_t capacity)
+                : queue(capacity)
+            {}
+
+            /// <summary>
+            /// メッセージを追加。監視タスクから呼び出す。
+            /// </summary>
+            /// <param name="message">受信メッセージ</param>
+            /// <returns>待機中のReceiveAsyncへ渡したメッセージ数</returns>
+            size_t Push(PipeMessage message)
+            {
+                //溢れたメッセージがある間は順序を保つためにキューへ追加しない
+                if (!overflow.empty() || !queue.TryPush(message)) {
+                    overflow.emplace_back(std::move(message));
+                    return 0;
+                }
+                count.fetch_add(1);
+                if (waiterCount.load() != 0) {
+                    return ServeWaiters();
+                }
+                return 0;
+            }
+
+            /// <summary>
+            /// 溢れたメッセージをキューへ移す。監視タスクから呼び出す。
+            /// </summary>
+            /// <returns>待機中のReceiveAsyncへ渡したメッセージ数</returns>
+            size_t Drain()
+            {
+                size_t moved = 0;
+                while (moved < overflow.size() && queue.TryPush(overflow[moved])) {
+                    count.fetch_add(1);
+                    ++moved;
+                }
+                overflow.erase(overflow.begin(), overflow.begin() + static_cast<std::ptrdiff_t>(moved));
+                if (moved != 0 && waiterCount.load() != 0) {
+                    return ServeWaiters();
+                }
+                return 0;
+            }
+
+            /// <summary>
+            /// 受信を停止すべきか。監視タスクから呼び出す。
+            /// </summary>
+            bool Blocked() const { return !overflow.empty() || count.load() >= queue.Capacity(); }
+
+            /// <summary>
+            /// 受信を再開できるか。キューが半分まで空いた時点で再開する。
+            /// </summary>
+            bool LowWater() const { return count.load() <= queue.Capacity() / 2; }
+
+            /// <summary>
+            /// キュー内のメッセージ数
+            /// </summary>
+            size_t Count() const { return count.load(); }
+
+            /// <summary>
+            /// 先頭のメッセージを取り出し
+            /// </summary>
+            /// <returns>受信箱が空の場合は無効値</returns>
+            std::optional<PipeMessage> TryPop()
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                auto message = queue.TryPop();
+                if (message) {
+                    count.fetch_sub(1);
+                }
+                return message;
+            }
+
+            /// <summary>
+            /// 先頭から複数のメッセージをまとめて取り出し
+            /// </summary>
+            /// <param name="messages">取り出したメッセージの追加先</param>
+            /// <param name="maxCount">取り出す最大数</param>
+            /// <returns>取り出した数</returns>
+            size_t PopBatch(std::vector<PipeMessage>& messages, size_t maxCount)
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                size_t popped = 0;
+                while (popped < maxCount) {
+                    auto message = queue.TryPop();
+                    if (!message) {
+                        break;
+                    }
+                    messages.emplace_back(std::move(*message));
+                    ++popped;
+                }
+                count.fetch_sub(popped);
+                return popped;
+            }
+
+            /// <summary>
+            /// 先頭のメッセージを非同期に取り出し。空の場合は次のメッセージの追加で完了する。
+            /// </summary>
+            /// <param name="popped">直ちに取り出した場合はtrue</param>
+            PipeMessageTask PopAsync(bool& popped)
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                //追加側は追加後に待機数を確認するため、待機数を増やしてから取り出しを試みる
+                waiterCount.fetch_add(1);
+                popped = false;
+                if (auto message = queue.TryPop()) {
+                    waiterCount.fetch_sub(1);
+                    count.fetch_sub(1);
+                    popped = true;
+#ifdef _WIN32
+                    return concurrency::task_from_result(std::move(*message));
+#else
+                    std::promise<PipeMessage> promise;
+                    promise.set_value(std::move(*message));
+                    return promise.get_future();
+#endif
+                }
+                waiters.emplace_back();
+#ifdef _WIN32
+                return concurrency::create_task(waiters.back());
+#else
+                return waiters.back().get_future();
+#endif
+            }
+
+            /// <summary>
+            /// 全てのメッセージを破棄。監視タスクから呼び出す。
+            /// </summary>
+            void Clear()
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                overflow.clear();
+                while (queue.TryPop()) {
+                    count.fetch_sub(1);
+                }
+            }
+
+            /// <summary>
+            /// 待機中のReceiveAsyncを全てエラーで完了させる
+            /// </summary>
+            /// <param name="error">例外</param>
+            void FailWaiters(std::exception_ptr error)
+            {
+                std::lock_guard<std::mutex> lock(popLock);
+                for (auto& waiter : waiters) {
+                    waiter.set_exception(error);
+                }
+                waiterCount.fetch_sub(waiters.size());
+                waiters.clear();
+            }
+        };
+#pragma endregion
+
+#pragma region RpcTable
+        /// <summary>
+        /// RPCの応答待ちの呼び出し表
+        /// 呼び出しは呼び出し元のスレッドで追加し、送信完了を送信ループで、応答を監視タスクで記録する。
+        /// 送信データは呼び出しが保持するので、送信完了と応答(エラーを含む)の両方が揃ってから削除する。
+        /// </summary>
+        class RpcTable final
+        {
+        public:
+            //要求を受け取るRPCハンドラー。応答はReplyAsyncで返す。例外を送出した場合はエラー応答を返す。
+            using Handler = std::function<void(SimpleNamedPipeBase&, const RpcMessage&)>;
+#ifdef _WIN32
+            using Completion = concurrency::task_completion_event<RpcMessage>;
+#else
+            using Completion = std::promise<RpcMessage>;
+#endif
+            /// <summary>
+            /// 応答待ちの呼び出し
+            /// </summary>
+            struct Call final : WriteNotify {
+                RpcTable& table;
+                const DWORD id;
+                //識別情報と引数を連結した送信データ
+                std::vector<BYTE> frame;
+                Completion completion;
+                //送信完了済み(tableのlockで保護)
+                bool written{ false };
+                //応答済み、エラー終了済み(tableのlockで保護)
+                bool done{ false };
+
+                Call(RpcTable& table, DWORD id) : table(table), id(id) {}
+                virtual void Complete(std::exception_ptr error) noexcept override
+                {
+                    table.OnWritten(*this, error);
+                }
+            };
+        private:
+            const Handler handler;
+            const size_t capacity;
+            std::unordered_map<DWORD, std::unique_ptr<Call>> calls;
+            DWORD lastId{ 0 };
+            //応答待ちの呼び出し数
+            std::atomic_size_t pending{ 0 };
+            mutable std::mutex lock;
+            std::condition_variable cv;
+
+            static void Resolve(Completion& completion, RpcMessage&& message, std::exception_ptr error)
+            {
+                if (error) {
+                    completion.set_exception(error);
+                }
+                else {
+#ifdef _WIN32
+                    completion.set(std::move(message));
+#else
+                    completion.set_value(std::move(message));
+#endif
+                }
+            }
+
+            /// <summary>
+            /// 送信完了の記録。送信ループのスレッドで呼び出される。
+            /// </summary>
+            void OnWritten(Call& call, std::exception_ptr error) noexcept
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                call.written = true;
+                if (!call.done && !error) {
+                    //応答待ち
+                    return;
+                }
+                auto node = calls.extract(call.id);
+                guard.unlock();
+                cv.notify_all();
+                if (!node.mapped()->done) {
+                    //送信に失敗した呼び出しは応答を待たずにエラー終了
+                    pending.fetch_sub(1);
+                    Resolve(node.mapped()->completion, RpcMessage(), error);
+                }
+            }
+        public:
+            RpcTable() = delete;
+            RpcTable(RpcTable&&) = delete;
+            RpcTable(const RpcTable&) = delete;
+            RpcTable& operator=(RpcTable&&) = delete;
+            RpcTable& operator=(const RpcTable&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="handler">RPCハンドラー。nullptr時は要求にエラー応答を返す</param>
+            /// <param name="capacity">応答待ちにできる呼び出し数</param>
+            RpcTable(Handler handler, size_t capacity)
+                : handler(std::move(handler))
+                , capacity(capacity)
+            {
+                if (capacity == 0) {
+                    throw std::invalid_argument("capacity must be greater than 0");
+                }
+                calls.reserve(capacity);
+            }
+
+            /// <summary>
+            /// 呼び出しを追加。満杯の場合は空きができるまで待機する。
+            /// </summary>
+            /// <param name="data">引数</param>
+            /// <param name="size">引数のサイズ</param>
+            /// <param name="task">応答の非同期タスク</param>
+            /// <returns>追加した呼び出し。送信完了の通知までは有効。</returns>
+            Call& Add(LPCVOID data, size_t size, RpcTask& task)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [this]() { return calls.size() < capacity; });
+                //未使用のIDを採番(0は使用しない)
+                do {
+                    if (++lastId == 0) {
+                        lastId = 1;
+                    }
+                } while (calls.find(lastId) != calls.end());
+                auto call = std::make_unique<Call>(*this, lastId);
+                RpcEnvelope envelope{ lastId, static_cast<DWORD>(RpcKind::REQUEST) };
+                call->frame.resize(sizeof(envelope) + size);
+                std::memcpy(call->frame.data(), &envelope, sizeof(envelope));
+                if (size != 0) {
+                    std::memcpy(call->frame.data() + sizeof(envelope), data, size);
+                }
+#ifdef _WIN32
+                task = concurrency::create_task(call->completion);
+#else
+                task = call->completion.get_future();
+#endif
+                auto& added = *call;
+                calls.emplace(lastId, std::move(call));
+                pending.fetch_add(1);
+                return added;
+            }
+
+            /// <summary>
+            /// 応答と照合して呼び出しを完了。監視タスクから呼び出す。
+            /// </summary>
+            /// <param name="id">呼び出しID</param>
+            /// <param name="message">応答</param>
+            /// <param name="error">エラー応答の例外</param>
+            /// <returns>該当する応答待ちの呼び出しが無い場合はfalse</returns>
+            bool Respond(DWORD id, RpcMessage&& message, std::exception_ptr error)
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                auto it = calls.find(id);
+                if (it == calls.end() || it->second->done) {
+                    return false;
+                }
+                auto& call = *it->second;
+                call.done = true;
+                pending.fetch_sub(1);
+                if (!call.written) {
+                    //送信完了の通知より先に応答が届いた。送信データは送信完了まで残す。
+                    auto completion = std::move(call.completion);
+                    guard.unlock();
+                    Resolve(completion, std::move(message), error);
+                    return true;
+                }
+                auto node = calls.extract(it);
+                guard.unlock();
+                cv.notify_all();
+                Resolve(node.mapped()->completion, std::move(message), error);
+                return true;
+            }
+
+            /// <summary>
+            /// 応答待ちの呼び出しを全てエラーで完了させる
+            /// </summary>
+            /// <param name="error">例外</param>
+            void FailAll(std::exception_ptr error)
+            {
+                std::vector<Completion> failed;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    for (auto it = calls.begin(); it != calls.end();) {
+                        auto& call = *it->second;
+                        if (call.done) {
+                            ++it;
+                            continue;
+                        }
+                        call.done = true;
+                        pending.fetch_sub(1);
+                        failed.emplace_back(std::move(call.completion));
+                        if (!call.written) {
+                            //送信データは送信完了の通知まで残す
+                            ++it;
+                            continue;
+                        }
+                        it = calls.erase(it);
+                    }
+                }
+                cv.notify_all();
+                for (auto& completion : failed) {
+                    Resolve(completion, RpcMessage(), error);
+                }
+            }
+
+            /// <summary>
+            /// 応答待ちの呼び出し数
+            /// </summary>
+            size_t Pending() const { return pending.load(); }
+
+            const Handler& RequestHandler() const { return handler; }
+        };
+
+        /// <summary>
+        /// RPCの応答の送信データ。送信完了の通知で破棄する。
+        /// </summary>
+        struct RpcReply final : WriteNotify {
+            //識別情報と戻り値を連結した送信データ
+            std::vector<BYTE> frame;
+            PipeTaskCompletion completion;
+
+            virtual void Complete(std::exception_ptr error) noexcept override
+            {
+                if (error) {
+                    completion.set_exception(error);
+                }
+                else {
+                    completion.set();
+                }
+                delete this;
+            }
+        };
+#pragma endregion
+
+#pragma region Stats
+        /// <summary>
+        /// 統計の計数
+        /// 監視タスク、送信ループ、送信要求元のスレッドからrelaxedなアトミック操作のみで更新し、Snapshotは任意のスレッドから読み込む。
+        /// SNP_DISABLE_STATS 定義時は何もしない。
+        /// </summary>
+        class StatsCounters final
+        {
+        public:
+            enum Counter : size_t {
+                BYTES_SENT,
+                BYTES_RECEIVED,
+                MESSAGES_SENT,
+                MESSAGES_RECEIVED,
+                FRAGMENTS_SENT,
+                FRAGMENTS_RECEIVED,
+                CANCELS_SENT,
+                CANCELS_RECEIVED,
+                READS_COMPLETED,
+                READS_PENDING,
+                WRITE_WAITS,
+                MESSAGES_SPILLED,
+                COUNTERS,
+            };
+            using TimePoint = std::chrono::steady_clock::time_point;
+
+            template<typename T>
+            static void UpdateMax(std::atomic<T>& max, T value) noexcept
+            {
+                for (auto current = max.load(std::memory_order_relaxed); current < value && !max.compare_exchange_weak(current, value, std::memory_order_relaxed);) {
+                }
+            }
+
+            /// <summary>
+            /// 所要時間のヒストグラムの区間。[0]は1μs未満、[i]は2^(i-1)μs以上2^iμs未満。
+            /// </summary>
+            static size_t Bucket(std::chrono::nanoseconds elapsed) noexcept
+            {
+                auto micros = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+                size_t bucket = 0;
+                while (micros != 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+                    micros >>= 1;
+                    ++bucket;
+                }
+                return bucket;
+            }
+#ifndef SNP_DISABLE_STATS
+        private:
+            std::array<std::atomic<std::uint64_t>, COUNTERS> counters{};
+            std::atomic_size_t receiverPoolHighWater{ 0 };
+            std::atomic_size_t deserializerPoolHighWater{ 0 };
+            //ナノ秒
+            std::atomic<std::int64_t> writeWaitTime{ 0 };
+            std::atomic<std::int64_t> maxWriteWait{ 0 };
+            std::array<std::atomic<std::uint64_t>, STATS_HISTOGRAM_BUCKETS> callbackDurations{};
+        public:
+            void Add(Counter counter, std::uint64_t value = 1) noexcept
+            {
+                counters[counter].fetch_add(value, std::memory_order_relaxed);
+            }
+
+            /// <summary>
+            /// 結合領域のサイズの最大値を更新。監視タスクから呼び出す。
+            /// </summary>
+            void RecordPools(size_t receiverPool, size_t deserializerPool) noexcept
+            {
+                UpdateMax(receiverPoolHighWater, receiverPool);
+                UpdateMax(deserializerPoolHighWater, deserializerPool);
+            }
+
+            /// <summary>
+            /// 計測開始時刻
+            /// </summary>
+            TimePoint Start() const noexcept { return std::chrono::steady_clock::now(); }
+
+            /// <summary>
+            /// 送信キューの空き待ちを記録
+            /// </summary>
+            /// <param name="start">待機開始時刻</param>
+            void RecordWriteWait(TimePoint start) noexcept
+            {
+                auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                counters[WRITE_WAITS].fetch_add(1, std::memory_order_relaxed);
+                writeWaitTime.fetch_add(elapsed, std::memory_order_relaxed);
+                UpdateMax(maxWriteWait, static_cast<std::int64_t>(elapsed));
+            }
+
+            /// <summary>
+            /// 受信イベントの処理時間を記録
+            /// </summary>
+            /// <param name="start">処理開始時刻</param>
+            void RecordCallback(TimePoint start) noexcept
+            {
+                callbackDurations[Bucket(std::chrono::steady_clock::now() - start)].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            PipeStats Snapshot() const noexcept
+            {
+                PipeStats stats;
+                stats.bytesSent = counters[BYTES_SENT].load(std::memory_order_relaxed);
+                stats.bytesReceived = counters[BYTES_RECEIVED].load(std::memory_order_relaxed);
+                stats.messagesSent = counters[MESSAGES_SENT].load(std::memory_order_relaxed);
+                stats.messagesReceived = counters[MESSAGES_RECEIVED].load(std::memory_order_relaxed);
+                stats.fragmentsSent = counters[FRAGMENTS_SENT].load(std::memory_order_relaxed);
+                stats.fragmentsReceived = counters[FRAGMENTS_RECEIVED].load(std::memory_order_relaxed);
+                stats.cancelsSent = counters[CANCELS_SENT].load(std::memory_order_relaxed);
+                stats.cancelsReceived = counters[CANCELS_RECEIVED].load(std::memory_order_relaxed);
+                stats.readsCompleted = counters[READS_COMPLETED].load(std::memory_order_relaxed);
+                stats.readsPending = counters[READS_PENDING].load(std::memory_order_relaxed);
+                stats.messagesSpilled = counters[MESSAGES_SPILLED].load(std::memory_order_relaxed);
+                stats.receiverPoolHighWater = receiverPoolHighWater.load(std::memory_order_relaxed);
+                stats.deserializerPoolHighWater = deserializerPoolHighWater.load(std::memory_order_relaxed);
+                stats.writeWaits = counters[WRITE_WAITS].load(std::memory_order_relaxed);
+                stats.writeWaitTime = std::chrono::nanoseconds(writeWaitTime.load(std::memory_order_relaxed));
+                stats.maxWriteWait = std::chrono::nanoseconds(maxWriteWait.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+                    stats.callbackDurations[i] = callbackDurations[i].load(std::memory_order_relaxed);
+                }
+                return stats;
+            }
+#else
+            void Add(Counter, std::uint64_t = 1) noexcept {}
+            void RecordPools(size_t, size_t) noexcept {}
+            TimePoint Start() const noexcept { return TimePoint(); }
+            void RecordWriteWait(TimePoint) noexcept {}
+            void RecordCallback(TimePoint) noexcept {}
+            PipeStats Snapshot() const noexcept { return PipeStats(); }
+#endif
+        };
+#pragma endregion
+
+#pragma region Trace
+        /// <summary>
+        /// メッセージ毎の遅延計測の集計
+        /// 区間毎の集計は監視タスクからrelaxedなアトミック操作で更新する。Chrome trace形式の出力用に直近のメッセージをlockで保護したリングに保持する。
+        /// </summary>
+        class MessageTracer final
+        {
+        private:
+            struct StageCounters {
+                std::atomic<std::uint64_t> count{ 0 };
+                //ナノ秒
+                std::atomic<std::int64_t> total{ 0 };
+                std::atomic<std::int64_t> max{ 0 };
+                std::array<std::atomic<std::uint64_t>, STATS_HISTOGRAM_BUCKETS> histogram{};
+            };
+            std::array<StageCounters, TRACE_STAGES> stages;
+            std::atomic<std::uint64_t> messages{ 0 };
+            mutable std::mutex lock;
+            //以下はlockで保護
+            std::vector<MessageTrace> records;
+            std::uint64_t recorded{ 0 };
+
+            void AddStage(TraceStage stage, std::int64_t from, std::int64_t to) noexcept
+            {
+                auto& counters = stages[static_cast<size_t>(stage)];
+                //送信側と受信側の計時の誤差で負になる場合は0とする
+                const auto elapsed = (std::max)(to - from, std::int64_t{ 0 });
+                counters.count.fetch_add(1, std::memory_order_relaxed);
+                counters.total.fetch_add(elapsed, std::memory_order_relaxed);
+                StatsCounters::UpdateMax(counters.max, elapsed);
+                counters.histogram[StatsCounters::Bucket(std::chrono::nanoseconds(elapsed))].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            /// <summary>
+            /// ナノ秒をマイクロ秒(小数点以下3桁)の文字列で追加
+            /// </summary>
+            static void AppendMicros(std::string& out, std::int64_t nanos)
+            {
+                nanos = (std::max)(nanos, std::int64_t{ 0 });
+                auto fraction = std::to_string(nanos % 1000);
+                out += std::to_string(nanos / 1000);
+                out += '.';
+                out.append(3 - fraction.size(), '0');
+                out += fraction;
+            }
+        public:
+            MessageTracer() : records(TRACE_RECORDS) {}
+            MessageTracer(const MessageTracer&) = delete;
+            MessageTracer& operator=(const MessageTracer&) = delete;
+
+            /// <summary>
+            /// 現在時刻(steady_clockのエポックからのナノ秒)
+            /// </summary>
+            static std::int64_t Now() noexcept
+            {
+                return ToTime(std::chrono::steady_clock::now());
+            }
+
+            static std::int64_t ToTime(std::chrono::steady_clock::time_point time) noexcept
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+            }
+
+            /// <summary>
+            /// 受信したメッセージの遅延を記録
+            /// </summary>
+            void Record(const MessageTrace& trace) noexcept
+            {
+                messages.fetch_add(1, std::memory_order_relaxed);
+                AddStage(TraceStage::QUEUED, trace.sent.enqueued, trace.sent.started);
+                AddStage(TraceStage::SENDING, trace.sent.started, trace.sent.written);
+                AddStage(TraceStage::TRANSPORT, trace.sent.written, trace.received);
+                AddStage(TraceStage::REASSEMBLY, trace.received, trace.assembled);
+                if (trace.handlerStart != 0) {
+                    AddStage(TraceStage::DISPATCH, trace.assembled, trace.handlerStart);
+                    AddStage(TraceStage::HANDLER, trace.handlerStart, trace.handlerEnd);
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                records[static_cast<size_t>(recorded % TRACE_RECORDS)] = trace;
+                ++recorded;
+            }
+
+            TraceStats Snapshot() const noexcept
+            {
+                TraceStats stats;
+                stats.messages = messages.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < TRACE_STAGES; ++i) {
+                    const auto& counters = stages[i];
+                    auto& stage = stats.stages[i];
+                    stage.count = counters.count.load(std::memory_order_relaxed);
+                    stage.total = std::chrono::nanoseconds(counters.total.load(std::memory_order_relaxed));
+                    stage.max = std::chrono::nanoseconds(counters.max.load(std::memory_order_relaxed));
+                    for (size_t j = 0; j < STATS_HISTOGRAM_BUCKETS; ++j) {
+                        stage.histogram[j] = counters.histogram[j].load(std::memory_order_relaxed);
+                    }
+                }
+                return stats;
+            }
+
+            /// <summary>
+            /// 直近のメッセージをChrome trace形式(JSON)で出力
+            /// メッセージ毎にスレッド(tid)を分け、区間をCompleteイベントとする。時刻は最も古い送信キューへの追加時刻からの相対値。
+            /// </summary>
+            std::string ChromeTrace() const
+            {
+                static constexpr const char* names[TRACE_STAGES] = { "queued", "sending", "transport", "reassembly", "dispatch", "handler" };
+                std::vector<MessageTrace> copied;
+                std::uint64_t first = 0;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    const auto count = (std::min)(recorded, static_cast<std::uint64_t>(TRACE_RECORDS));
+                    first = recorded - count;
+                    copied.reserve(static_cast<size_t>(count));
+                    for (auto i = first; i < recorded; ++i) {
+                        copied.push_back(records[static_cast<size_t>(i % TRACE_RECORDS)]);
+                    }
+                }
+                std::int64_t origin = 0;
+                for (size_t i = 0; i < copied.size(); ++i) {
+                    if (i == 0 || copied[i].sent.enqueued < origin) {
+                        origin = copied[i].sent.enqueued;
+                    }
+                }
+                std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+                bool separator = false;
+                for (size_t i = 0; i < copied.size(); ++i) {
+                    const auto& trace = copied[i];
+                    const std::int64_t bounds[TRACE_STAGES + 1] = {
+                        trace.sent.enqueued, trace.sent.started, trace.sent.written, trace.received, trace.assembled, trace.handlerStart, trace.handlerEnd
+                    };
+                    //受信イベントを監視タスクで呼び出していない場合は組み立て完了まで
+                    const size_t stageCount = trace.handlerStart != 0 ? TRACE_STAGES : static_cast<size_t>(TraceStage::REASSEMBLY) + 1;
+                    for (size_t stage = 0; stage < stageCount; ++stage) {
+                        if (separator) {
+                            json += ',';
+                        }
+                        separator = true;
+                        json += "{\"name\":\"";
+                        json += names[stage];
+                        json += "\",\"cat\":\"simple_pipe\",\"ph\":\"X\",\"pid\":1,\"tid\":";
+                        json += std::to_string(first + i);
+                        json += ",\"ts\":";
+                        AppendMicros(json, bounds[stage] - origin);
+                        json += ",\"dur\":";
+                        AppendMicros(json, bounds[stage + 1] - bounds[stage]);
+                        json += ",\"args\":{\"size\":";
+                        json += std::to_string(trace.size);
+                        json += "}}";
+                    }
+                }
+                json += "]}";
+                return json;
+            }
+        };
+#pragma endregion
+
+#ifndef _WIN32
+#pragma region SharedMemory
+        /// <summary>
+        /// 共有メモリー上の1方向分のSPSCリングバッファー
+        /// 書き込み側と読み込み側は別プロセスでも良い。位置は折り返さない累積値で管理する。
+        /// </summary>
+        class SharedRing final
+        {
+        public:
+            /// <summary>
+            /// 共有メモリー上の制御領域
+            /// </summary>
+            struct Control {
+                //書き込み位置
+                alignas(64) std::atomic<std::uint64_t> head;
+                //読み込み位置
+                alignas(64) std::atomic<std::uint64_t> tail;
+                //読み込み側がデータ待ち(通知が必要)
+                alignas(64) std::atomic<std::uint32_t> readerWaiting;
+                //書き込み側が空き待ち(通知が必要)
+                std::atomic<std::uint32_t> writerWaiting;
+            };
+            //プロセス間で共有するためロックフリーであること
+            static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+            static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+
+            /// <summary>
+            /// 制御領域を含むリングバッファー1つ分のサイズ
+            /// </summary>
+            static constexpr size_t RegionSize(size_t capacity) { return sizeof(Control) + capacity; }
+
+        private:
+            Control* control;
+            BYTE* data;
+            const size_t capacity;
+        public:
+            SharedRing() = delete;
+            SharedRing(SharedRing&&) = delete;
+            SharedRing(const SharedRing&) = delete;
+            SharedRing& operator=(SharedRing&&) = delete;
+            SharedRing& operator=(const SharedRing&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="region">RegionSize分の共有メモリー</param>
+            /// <param name="capacity">データ領域のサイズ。2のべき乗であること。</param>
+            /// <param name="initialize">制御領域を初期化する(共有メモリーの作成側)</param>
+            SharedRing(void* region, size_t capacity, bool initialize)
+                : control(initialize ? new (region) Control{} : static_cast<Control*>(region))
+                , data(static_cast<BYTE*>(region) + sizeof(Control))
+                , capacity(capacity)
+            {
+                if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+                    throw std::invalid_argument("capacity must be a power of 2");
+                }
+                if (initialize) {
+                    //読み込み側は初回のデータから通知を受ける
+                    control->readerWaiting.store(1);
+                }
+            }
+
+            /// <summary>
+            /// 書き込み可能な分だけ書き込み、読み込み側へ公開する
+            /// </summary>
+            /// <returns>書き込んだサイズ。満杯時は0</returns>
+            size_t Write(const BYTE* p, size_t size)
+            {
+                auto head = control->head.load(std::memory_order_relaxed);
+                auto tail = control->tail.load(std::memory_order_acquire);
+                auto free = capacity - static_cast<size_t>(head - tail);
+                auto offset = static_cast<size_t>(head & (capacity - 1));
+                //折り返しをまたがない範囲で書き込む
+                auto writeSize = (std::min)({ size, free, capacity - offset });
+                if (writeSize == 0) {
+                    return 0;
+                }
+                std::memcpy(data + offset, p, writeSize);
+                control->head.store(head + writeSize, std::memory_order_release);
+                return writeSize;
+            }
+
+            /// <summary>
+            /// 読み込み可能な連続領域
+            /// </summary>
+            /// <returns>空の場合はEmpty()==true</returns>
+            Buffer Readable() const
+            {
+                auto tail = control->tail.load(std::memory_order_relaxed);
+                auto head = control->head.load(std::memory_order_acquire);
+                auto offset = static_cast<size_t>(tail & (capacity - 1));
+                auto size = (std::min)(static_cast<size_t>(head - tail), capacity - offset);
+                return Buffer(data + offset, size);
+            }
+
+            /// <summary>
+            /// 読み込み済みとして書き込み側へ領域を返す
+            /// </summary>
+            void Consume(size_t size)
+            {
+                control->tail.store(control->tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+            }
+
+            /// <summary>
+            /// 読み込み側の待機開始。待機フラグを立てた後にデータの有無を再確認する。
+            /// </summary>
+            /// <returns>待機不要(データあり)の場合はfalse</returns>
+            bool BeginReaderWait()
+            {
+                control->readerWaiting.store(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return control->head.load(std::memory_order_acquire) == control->tail.load(std::memory_order_relaxed);
+            }
+
+            /// <summary>
+            /// 書き込み側の待機開始。待機フラグを立てた後に空きの有無を再確認する。
+            /// </summary>
+            /// <returns>待機不要(空きあり)の場合はfalse</returns>
+            bool BeginWriterWait()
+            {
+                control->writerWaiting.store(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto head = control->head.load(std::memory_order_relaxed);
+                return static_cast<size_t>(head - control->tail.load(std::memory_order_acquire)) == capacity;
+            }
+
+            /// <summary>
+            /// 書き込み後、読み込み側が待機中であれば待機を解除
+            /// </summary>
+            /// <returns>相手側への通知が必要な場合はtrue</returns>
+            bool WakeReader()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return control->readerWaiting.load() != 0 && control->readerWaiting.exchange(0) != 0;
+            }
+
+            /// <summary>
+            /// 読み込み後、書き込み側が待機中であれば待機を解除
+            /// </summary>
+            /// <returns>相手側への通知が必要な場合はtrue</returns>
+            bool WakeWriter()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return control->writerWaiting.load() != 0 && control->writerWaiting.exchange(0) != 0;
+            }
+
+            size_t Capacity() const { return capacity; }
+        };
+
+        /// <summary>
+        /// 共有メモリー転送の1接続分の状態
+        /// 共有メモリーには送信方向毎にリングバッファーを1つずつ配置し、ソケットは受信側の起床通知と切断検知に利用する。
+        /// 送信側の空き待ちは受信側の監視タスクに依存しないよう、プロセス間で共有するeventfdで起床させる。
+        /// </summary>
+        class SharedMemoryTransport final
+        {
+        private:
+            void* mapping;
+            const size_t mappingSize;
+            //送信側の空き待ち解除イベント(eventfd) 相手側が受信データを読み込むとシグナル
+            UniqueFd txSpaceEvent;
+            //相手側の空き待ち解除イベント(eventfd)
+            UniqueFd rxSpaceEvent;
+        public:
+            //送信用リングバッファー
+            SharedRing tx;
+            //受信用リングバッファー
+            SharedRing rx;
+
+            SharedMemoryTransport() = delete;
+            SharedMemoryTransport(SharedMemoryTransport&&) = delete;
+            SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+            SharedMemoryTransport& operator=(SharedMemoryTransport&&) = delete;
+            SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+
+            /// <summary>
+            /// コンストラクタ
+            /// </summary>
+            /// <param name="memory">共有メモリー</param>
+            /// <param name="capacity">リングバッファー1つ分のデータ領域サイズ</param>
+            /// <param name="owner">共有メモリーの作成側(サーバー)の場合はtrue</param>
+            /// <param name="spaceEvents">空き待ち解除イベント。作成側の送信用、受信側の送信用の順。</param>
+            SharedMemoryTransport(const UniqueFd& memory, size_t capacity, bool owner, std::array<UniqueFd, 2> spaceEvents)
+                : mapping(Map(memory, SharedRing::RegionSize(capacity) * 2))
+                , mappingSize(SharedRing::RegionSize(capacity) * 2)
+                , txSpaceEvent(std::move(spaceEvents[owner ? 0 : 1]))
+                , rxSpaceEvent(std::move(spaceEvents[owner ? 1 : 0]))
+                //作成側は前半を送信、後半を受信に使う
+                , tx(Region(owner ? 0 : 1, capacity), capacity, owner)
+                , rx(Region(owner ? 1 : 0, capacity), capacity, owner)
+            {
+            }
+
+            ~SharedMemoryTransport()
+            {
+                ::munmap(mapping, mappingSize);
+            }
+
+            /// <summary>
+            /// 共有メモリーの生成
+            /// </summary>
+            /// <param name="capacity">リングバッファー1つ分のデータ領域サイズ</param>
+            /// <returns>共有メモリー</returns>
+            static UniqueFd CreateMemory(size_t capacity)
+            {
+#ifdef __linux__
+                UniqueFd memory{ ::memfd_create("SimpleNamedPipe", MFD_CLOEXEC) };
+                CheckErrno(bool{ memory });
+#else
+                //memfd_createが無い環境では名前を即座に削除した共有メモリーで代用する
+                auto name = "/SimpleNamedPipe." + std::to_string(::getpid()) + "." + std::to_string(reinterpret_cast<std::uintptr_t>(&capacity));
+                UniqueFd memory{ ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) };
+                CheckErrno(bool{ memory });
+                ::shm_unlink(name.c_str());
+#endif
+                CheckErrno(::ftruncate(memory.get(), static_cast<off_t>(SharedRing::RegionSize(capacity) * 2)) == 0);
+                return memory;
+            }
+
+            /// <summary>
+            /// 相手側から受け取った共有メモリーのリングバッファーサイズ
+            /// </summary>
+            static size_t CapacityOf(const UniqueFd& memory)
+            {
+                struct stat st {};
+                CheckErrno(::fstat(memory.get(), &st) == 0);
+                auto size = static_cast<size_t>(st.st_size);
+                if (size % 2 != 0 || size / 2 <= sizeof(SharedRing::Control)) {
+                    ThrowErrno(EPROTO);
+                }
+                auto capacity = size / 2 - sizeof(SharedRing::Control);
+                if ((capacity & (capacity - 1)) != 0) {
+                    ThrowErrno(EPROTO);
+                }
+                return capacity;
+            }
+
+            int SpaceEvent() const { return txSpaceEvent.get(); }
+
+            /// <summary>
+            /// 空き待ちの自身の送信側を起床(切断時)
+            /// </summary>
+            void NotifySpace() noexcept
+            {
+                Notify(txSpaceEvent.get());
+            }
+
+            /// <summary>
+            /// 空き待ちの相手側の送信側を起床(受信データ読み込み時)
+            /// </summary>
+            void NotifyPeerSpace() noexcept
+            {
+                Notify(rxSpaceEvent.get());
+            }
+
+        private:
+            static void Notify(int fd) noexcept
+            {
+                uint64_t value = 1;
+                auto res = ::write(fd, &value, sizeof(value));
+                (void)res;
+            }
+
+            static void* Map(const UniqueFd& memory, size_t size)
+            {
+                auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory.get(), 0);
+                CheckErrno(p != MAP_FAILED);
+                return p;
+            }
+
+            void* Region(int index, size_t capacity) const
+            {
+                return static_cast<BYTE*>(mapping) + SharedRing::RegionSize(capacity) * index;
+            }
+        };
+#pragma endregion
+#endif
+    private:
+#ifdef _WIN32
+        //パイプハンドル
+        winrt::file_handle handlePipe;
+        //受信用オーバーラップ構造体
+        std::unique_ptr<OVERLAPPED> readOverlap;
+        //受信バッファー(ReadBufferSize)
+        std::unique_ptr<BYTE[]> readBuffer;
+        //発行中の読み込み先。readBufferか直接配置の格納先
+        BYTE* readTarget{ nullptr };
+        //Closeイベント
+        winrt::handle closeEvent;
+        //受信イベント
+        winrt::handle readEvent;
+        //受信箱の空き通知イベント
+        winrt::handle inboxEvent;
+        //カスタムイベント
+        std::vector<winrt::handle> customEvents;
+        //監視タスク
+        concurrency::task<void> watcherTask{concurrency::task_from_result() };
+#else
+        //接続済みソケット。未接続時は-1
+        std::atomic_int socketFd{ -1 };
+        //socketFdを参照して送受信中の数(SocketRef)
+        std::atomic_int socketUsers{ 0 };
+        //ソケットをepollに登録済みか
+        std::atomic_bool socketWatched{ false };
+        //Close済みフラグ
+        std::atomic_bool closed{ false };
+        //受信バッファー(ReadBufferSize)
+        std::unique_ptr<BYTE[]> readBuffer;
+        //イベント監視用epoll
+        UniqueFd epollFd;
+        //Closeイベント(eventfd)
+        UniqueFd closeEvent;
+        //受信箱の空き通知イベント(eventfd)
+        UniqueFd inboxEvent;
+        //カスタムイベント(eventfd)
+        std::vector<UniqueFd> customEvents;
+        //監視タスク
+        PipeTask watcherTask;
+        //共有メモリー転送時の接続毎の状態。ソケット転送時はnullptr
+        std::shared_ptr<SharedMemoryTransport> sharedMemory;
+#endif
+        //Close要求済みフラグ。切断イベント中のCloseで次の接続を待ち受けない
+        std::atomic_bool closeRequested{ false };
+        //接続の世代。切断時と次の接続時に加算し、前の接続で受け付けた送信要求を次の接続へ送信しない
+        std::atomic_size_t connection{ 0 };
+        //受信パケット処理
+        Receiver receiver;
+        //デシリアライズ処理
+        Deserializer deserializer;
+        /// <summary>
+        /// 送信優先度毎の送信キュー
+        /// </summary>
+        struct SendLane {
+            SendQueue<WriteRequest> queue{ SEND_QUEUE_SIZE };
+            //送信開始前の送信要求数
+            std::atomic_size_t queued{ 0 };
+            std::atomic_size_t maxQueued{ 0 };
+            //以下は送信中のスレッドのみで更新
+            std::atomic<std::uint64_t> sent{ 0 };
+            std::atomic<std::int64_t> totalWait{ 0 };
+            std::atomic<std::int64_t> maxWait{ 0 };
+        };
+        //送信キュー(SendPriorityの値がインデックス)
+        std::array<SendLane, SEND_PRIORITIES> sendLanes;
+        //送信ループ実行中フラグ(送信要求の待機中も含む)
+        std::atomic_bool writerActive{ false };
+        //未処理の送信要求数
+        std::atomic_size_t pendingWrites{ 0 };
+        //待機中の送信ループへの再開要求(sendQueueLockで保護)
+        bool writerWake{ false };
+        //送信ループの停止要求(sendQueueLockで保護)
+        bool writerStop{ false };
+        //送信キューの空き待ち数
+        std::atomic_int sendQueueWaiters{ 0 };
+        //送信キューの空き待ち、送信ループ終了待ち用
+        std::mutex sendQueueLock;
+        std::condition_variable sendQueueCv;
+        //送信パケットの集約(送信中のスレッドのみで利用)
+        WriteGather writeGather;
+#ifdef _WIN32
+        //集約したパケットを1回で書き込むための送信バッファー(送信中のスレッドのみで利用)
+        std::vector<BYTE> writeStaging;
+        //送信完了待ちイベント(送信中のスレッドのみで利用)
+        winrt::handle writeWaitEvent;
+        //書き込み用オーバーラップ構造体(送信中のスレッドのみで利用)
+        OVERLAPPED writeOverlap{};
+#endif
+        //受信メッセージプールが無効の場合にAwaitReceive、受信箱の受信データを保持するプール(監視タスクのみで利用)
+        std::shared_ptr<MessagePool> receivePool;
+        //プル型受信の受信箱(EnableInbox時のみ)。一度設定したら変更しない。
+        std::unique_ptr<Inbox> inboxStorage;
+        std::atomic<Inbox*> inbox{ nullptr };
+        //受信イベントの振り分け先(EnableDispatcher時のみ)。一度設定したら変更しない。
+        std::shared_ptr<Dispatcher> dispatcher;
+        std::unique_ptr<Dispatcher::Strand> strandStorage;
+        std::atomic<Dispatcher::Strand*> strand{ nullptr };
+        //ワーカースレッドで通知中の受信メッセージ(ストランド内のみで利用)
+        PipeMessage dispatchedMessage;
+        //受信箱または振り分け先が満杯のため受信を停止中
+        std::atomic_bool readPaused{ false };
+        //相手へ付与する送信枠(EnableFlowControl時のみ)。0は流量制御なし
+        std::atomic<DWORD> flowWindow{ 0 };
+        //接続中。接続時の送信枠の付与に使用する
+        std::atomic_bool flowSession{ false };
+        //接続時の送信枠を付与済み
+        std::atomic_bool initialGranted{ false };
+        //相手へ未付与の送信枠(取り出し済みメッセージ数)
+        std::atomic_size_t pendingGrant{ 0 };
+        //送信枠を消費せずに送信された受信メッセージのうち、取り出し時の再付与から除く残り数
+        std::atomic_size_t uncreditedReceived{ 0 };
+        //送信枠の付与要求を送信キューへ追加済み
+        std::atomic_bool grantQueued{ false };
+        //相手から送信枠を付与されている(最初の付与で有効)
+        std::atomic_bool sendFlowActive{ false };
+        //相手から付与された残りの送信枠
+        std::atomic_size_t sendCredits{ 0 };
+        //送信枠の付与待ち用
+        std::mutex creditLock;
+        std::condition_variable creditCv;
+        //送信枠の付与パケットのデータ部(送信中のスレッドのみで利用)
+        DWORD grantPayload{ 0 };
+        //統計(Stats)
+        StatsCounters pipeStats;
+        //RPCの呼び出し表(EnableRpc時のみ)。一度設定したら変更しない。
+        std::unique_ptr<RpcTable> rpcStorage;
+        std::atomic<RpcTable*> rpc{ nullptr };
+        //遅延計測(EnableTracing時のみ)。一度設定したら変更しない。
+        std::unique_ptr<MessageTracer> tracerStorage;
+        std::atomic<MessageTracer*> tracer{ nullptr };
+        //送信中のメッセージの遅延計測のタイムスタンプ(送信中のスレッドのみで利用)
+        TraceStamp sendTrace{};
+        bool sendTraced{ false };
+        //大きなメッセージを断片毎に他の送信と交互に送信する(EnableMultiplex時のみ)
+        std::atomic_bool multiplex{ false };
+        //適応的な断片サイズの上限。0は断片サイズをバッファーサイズに固定(EnableAdaptiveFragments)
+        std::atomic_size_t maxFragmentSize{ 0 };
+        //適応的な断片サイズ(送信中のスレッドのみで利用)
+        FragmentSizer fragmentSizer;
+        //分割送信で読み出した断片(送信中のスレッドのみで利用)
+        std::vector<BYTE> sourceChunk;
+
+        /// <summary>
+        /// 多重化して送信中のメッセージ
+        /// </summary>
+        struct OutgoingStream {
+            WriteRequest request;
+            //未送信のデータ
+            Buffer rest;
+            DWORD id;
+            //送信枠を確保済み
+            bool started{ false };
+            //相手から付与された送信枠を消費した
+            bool credited{ false };
+            //断片を送信済み
+            bool sent{ false };
+            //送信ループの呼び出し元で送信要求数を減算する要求
+            bool borrowed{ false };
+            std::exception_ptr error{};
+            //最後に断片を送信した時刻(送信前は送信キューへの追加時刻)
+            std::chrono::steady_clock::time_point lastSent{};
+            //遅延計測のタイムスタンプ
+            TraceStamp trace{};
+            bool traced{ false };
+        };
+        static_assert(MULTIPLEX_STREAMS <= Deserializer::MAX_STREAMS, "MULTIPLEX_STREAMS must be less than or equal to Deserializer::MAX_STREAMS");
+        //以下は送信中のスレッドのみで利用
+        std::vector<OutgoingStream> outgoingStreams;
+        std::deque<WriteRequest> waitingStreams;
+        DWORD lastStreamId{ 0 };
+#ifdef SNP_HAS_COROUTINE
+    public:
+        class ReceiveOperation;
+    private:
+        //AwaitReceiveの受信待ち(receiveLockで更新)
+        std::atomic<ReceiveOperation*> pendingReceive{ nullptr };
+        std::mutex receiveLock;
+        //現在の接続でAwaitReceiveを呼び出したか。次の接続(DiscardUnclaimed)で解除する
+        std::atomic_bool awaitReceiving{ false };
+        //受信待ちが無い間に届いたメッセージ(receiveLockで保護)。次のAwaitReceiveで渡す。
+        std::deque<PipeMessage> unclaimedReceives;
+        //unclaimedReceivesのメッセージ数。DEFAULT_INBOX_SIZEに達すると受信を停止する
+        std::atomic_size_t unclaimedCount{ 0 };
+#endif
+        //送受信バッファーサイズ
+        const DWORD bufferSize;
+        //送受信上限サイズ
+        const size_t limitSize;
+
+        /// <summary>
+        /// 受信バッファーサイズ。最大サイズのパケットをヘッダー込みで1回で読み込めるサイズとする。
+        /// </summary>
+        DWORD ReadBufferSize() const { return bufferSize + static_cast<DWORD>(HeaderSize); }
+
+        /// <summary>
+        /// RAIIヘルパー
+        /// </summary>
+        struct Defer {
+            std::function<void(void)> func;
+            Defer(std::function<void(void)> func) : func(func) {}
+            virtual ~Defer() { if (func) func(); }
+        };
+
+#ifdef _WIN32
+        /// <summary>
+        /// 非同期Write用のワーク領域
+        /// </summary>
+        struct WriteOverlapTag {
+            //呼び出し元のポインター
+            SimpleNamedPipeBase* owner;
+            //書き込みバッファー
+            Buffer buffer;
+            //Win32システムエラー
+            DWORD lastErr;
+            //成功フラグ
+            bool success;
+            //書き込み完了チェック
+            bool Completed() const { return buffer.Empty(); }
+        };
+
+        // 非同期書き込み用コールバック関数
+        // https://learn.microsoft.com/ja-jp/windows/win32/api/minwinbase/nc-minwinbase-lpoverlapped_completion_routine
+        static void WriteOverlapComplete(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped)
+        {
+            WriteOverlapTag* tag = reinterpret_cast<WriteOverlapTag*>(lpOverlapped->hEvent);
+            tag->lastErr = dwErrorCode;
+            if (ERROR_SUCCESS != tag->lastErr) {
+                //Win32エラー発生
+                tag->success = false;
+                return;
+            }
+            try {
+                //書き込み済み領域を消費
+                tag->buffer.Consume(dwNumberOfBytesTransfered);
+            }
+            catch (std::length_error&)
+            {
+                //書き込み済み領域と書き込んだバイト数に不整合あり
+                tag->success = false;
+                return;
+            }
+            //書き込み成功
+            tag->success = true;
+            return;
+        }
+
+        /// <summary>
+        /// 非同期書き込みを同期的に実行
+        /// </summary>
+        /// <param name="buffer">書き込みバッファー</param>
+        /// <param name="size">バッファーサイズ</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteRaw(LPCVOID buffer, DWORD size, winrt::handle& cancelEvent)
+        {
+            //オーバーラップ構造体の設定
+            WriteOverlapTag tag{ this, Buffer(buffer, size), ERROR_SUCCESS, true};
+            OVERLAPPED* overlapped = &writeOverlap;
+            while (!tag.Completed() && tag.success) {
+                //一度に送信するサイズを集約バッファーの容量(bufferSize + ヘッダー)、適応的な断片サイズの場合は断片サイズの上限までに制限
+                DWORD writeSize = (std::min)(static_cast<DWORD>(tag.buffer.Size()), static_cast<DWORD>((std::max)(writeGather.Capacity(), maxFragmentSize.load(std::memory_order_relaxed))));
+                //WriteFileExはhEventは利用しないので、ワーク領域のポインターを格納する
+                // https://learn.microsoft.com/ja-jp/windows/win32/api/fileapi/nf-fileapi-writefileex
+                *overlapped = { 0 };
+                overlapped->hEvent = reinterpret_cast<HANDLE>(&tag);
+                winrt::check_bool(WriteFileEx(handlePipe.get(), tag.buffer.Pointer(), writeSize, overlapped, &SimpleNamedPipeBase::WriteOverlapComplete));
+                auto res = WaitForSingleObjectEx(cancelEvent.get(), INFINITE, true);
+                if (WAIT_OBJECT_0 == res) {
+                    //非同期書き込みをキャンセル
+                    CancelIoEx(handlePipe.get(), overlapped);
+                }
+                else if (WAIT_IO_COMPLETION == res) {
+                    // I/O完了
+                    if (!tag.success) {
+                        if (ERROR_OPERATION_ABORTED == tag.lastErr) {
+                            return false;
+                        }
+                        else if (ERROR_SUCCESS != tag.lastErr) {
+                            //Win32エラーが発生していたら例外送出
+                            winrt::throw_hresult(HRESULT_FROM_WIN32(tag.lastErr));
+                        }
+                        //不明なエラーの場合
+                        throw std::logic_error("WriteRaw logic error");
+                    }
+                }
+                else {
+                    winrt::throw_last_error();
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// 集約したパケットを送信バッファーにまとめて1回で書き込む
+        /// </summary>
+        /// <param name="gather">集約したパケット。書き込み後にクリアする。</param>
+        /// <param name="cancelEvent">キャンセルイベント</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteGathered(WriteGather& gather, winrt::handle& cancelEvent)
+        {
+            Defer clear([&gather]() { gather.Clear(); });
+            const auto& segments = gather.Segments();
+            if (segments.size() == 1) {
+                //ヘッダーのみの場合はコピー不要
+                return WriteRaw(segments[0].Pointer(), static_cast<DWORD>(segments[0].Size()), cancelEvent);
+            }
+            if (gather.Size() > gather.Capacity()) {
+                //容量を超えるのは適応的な断片サイズの大きな断片1つのみ。データ部はコピーせずに直接書き込む
+                const auto& data = segments.back();
+                writeStaging.resize(gather.Size() - data.Size());
+                auto p = writeStaging.data();
+                for (size_t i = 0; i + 1 < segments.size(); ++i) {
+                    p = std::copy(segments[i].Begin(), segments[i].End(), p);
+                }
+                return WriteRaw(writeStaging.data(), static_cast<DWORD>(writeStaging.size()), cancelEvent)
+                    && WriteRaw(data.Pointer(), static_cast<DWORD>(data.Size()), cancelEvent);
+            }
+            writeStaging.resize(gather.Size());
+            auto p = writeStaging.data();
+            for (const auto& segment : segments) {
+                p = std::copy(segment.Begin(), segment.End(), p);
+            }
+            return WriteRaw(writeStaging.data(), static_cast<DWORD>(writeStaging.size()), cancelEvent);
+        }
+
+        //監視タスクのスレッドID
+        DWORD watchThreadId{ 0 };
+
+        /// <summary>
+        /// イベント監視タスク
+        /// </summary>
+        /// <returns>非同期タスク</returns>
+        concurrency::task<void> WatchAsync()
+        {
+            //タスクを実行
+            return concurrency::create_task([this](){
+                //再入チェックのためにスレッドIDを保存
+                watchThreadId = GetCurrentThreadId();
+                //既知のイベント登録 Close要求イベント, 非同期I/Oの読み込み完了イベント, 受信箱の空き通知イベント
+                std::vector<HANDLE> handles {closeEvent.get(), readEvent.get(), inboxEvent.get()};
+                //派生クラスで利用するイベントを追加
+                std::vector<HANDLE> customEventHandels;
+                std::transform(customEvents.begin(), customEvents.end(), std::back_inserter(customEventHandels), [](const auto& e) {return e.get(); });
+                handles.insert(handles.end(), customEventHandels.begin(), customEventHandels.end());
+
+                Defer defer([this]() {
+                    //関数から抜ける前に必ず実行する
+                    ClosePipeHandle();
+                    //終了時のイベント通知の例外は無視する
+                    try{ NotifyDisconnected(); }
+                    catch (...) {}
+                    try { OnClosed(); }
+                    catch (...) {}
+                });
+                while (true) {
+                    //接続、受信イベントを監視
+                    auto res = WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], false, INFINITE);
+                    if (res == WAIT_FAILED) {
+                        //エラー
+                        winrt::throw_last_error();
+                    }
+                    if (!Valid()) {
+                        //ハンドルが破棄されていたら終了
+                        break;
+                    }
+                    auto index = res - WAIT_OBJECT_0;
+                    if (index < handles.size()) {
+                        auto signaled = handles[index];
+                        if (closeEvent.get() == signaled) {
+                            //Close要求イベント
+                            break;
+                        }
+                        else if (readEvent.get() == signaled) {
+                            //受信イベント
+                            winrt::check_bool(ResetEvent(signaled));
+                            auto state = OnSignalRead();
+                            if(state.IsDisconn()){
+                                if (!NotifyDisconnected()) {
+                                    //クローズ要求時
+                                    break;
+                                }
+                            }
+                        }
+                        else if (inboxEvent.get() == signaled) {
+                            //受信箱の空き通知
+                            winrt::check_bool(ResetEvent(signaled));
+                            auto state = ResumeRead();
+                            if (state.IsDisconn()) {
+                                if (!NotifyDisconnected()) {
+                                    //クローズ要求時
+                                    break;
+                                }
+                            }
+                        } else {
+                            //継承先のイベントハンドラを呼び出し
+                            if (!OnFireEvent(signaled)) {
+                                //クローズ要求時
+                                break;
+                            }
+                        }
+                    }
+                    else {
+                        //いずれかのハンドルが破棄されたのならインスタンスが破棄されている
+                        break;
+                    }
+                }
+            });
+        }
+
+#else
+        /// <summary>
+        /// 送受信中のソケットの参照
+        /// 参照中はCloseSocketがソケットを閉じないため、閉じた番号が次の接続で再利用されても別の接続へ送受信しない。
+        /// 参照はシステムコールの間のみ保持し、コールバックを呼び出す間は保持しないこと。
+        /// </summary>
+        class SocketRef final
+        {
+        private:
+            std::atomic_int& users;
+            int fd;
+        public:
+            SocketRef() = delete;
+            SocketRef(SocketRef&&) = delete;
+            SocketRef(const SocketRef&) = delete;
+            SocketRef& operator=(SocketRef&&) = delete;
+            SocketRef& operator=(const SocketRef&) = delete;
+
+            SocketRef(std::atomic_int& users, const std::atomic_int& socketFd)
+                : users(users)
+            {
+                //参照数の加算を先に行い、CloseSocketが閉じる前のソケットを取得した場合は必ず待機させる
+                users.fetch_add(1);
+                fd = socketFd.load();
+            }
+
+            ~SocketRef()
+            {
+                users.fetch_sub(1);
+            }
+
+            /// <summary>
+            /// 参照したソケット。未接続時、Close後は-1
+            /// </summary>
+            int Get() const noexcept { return fd; }
+        };
+
+        /// <summary>
+        /// 送信可能になるまで待機
+        /// </summary>
+        /// <param name="fd">ソケット</param>
+        void WaitWritable(int fd)
+        {
+            pollfd fds[]{ { fd, POLLOUT, 0 }, { closeEvent.get(), POLLIN, 0 } };
+            while (::poll(fds, 2, -1) < 0) {
+                if (errno != EINTR) {
+                    ThrowErrno(errno);
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                //Close要求時はハンドル破棄済みとする
+                ThrowErrno(EBADF);
+            }
+            //POLLERR,POLLHUPの場合は次回のsendでエラーを検知する
+        }
+
+        /// <summary>
+        /// 送信可能になるまで待機しながら全データを書き込み
+        /// </summary>
+        /// <param name="buffer">書き込みバッファー</param>
+        /// <param name="size">バッファーサイズ</param>
+        void WriteRaw(LPCVOID buffer, size_t size)
+        {
+            Buffer remain(buffer, size);
+            while (!remain.Empty()) {
+                SocketRef socket(socketUsers, socketFd);
+                int fd = socket.Get();
+                if (fd < 0) {
+                    //Close済みか未接続
+                    ThrowErrno(closed.load() ? EBADF : ENOTCONN);
+                }
+                //一度に送信するサイズをコンストラクタ引数のbufferSizeまでに制限
+                auto writeSize = (std::min)(remain.Size(), static_cast<size_t>(bufferSize));
+                auto written = ::send(fd, remain.Pointer(), writeSize, MSG_NOSIGNAL);
+                if (written >= 0) {
+                    remain.Consume(static_cast<size_t>(written));
+                    continue;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    ThrowErrno(errno);
+                }
+                WaitWritable(fd);
+            }
+        }
+
+        /// <summary>
+        /// 集約したパケットをベクター書き込み(sendmsg)で1回で書き込む
+        /// </summary>
+        /// <param name="gather">集約したパケット。書き込み後にクリアする。</param>
+        void WriteGathered(WriteGather& gather)
+        {
+            Defer clear([&gather]() { gather.Clear(); });
+            if (auto shm = std::atomic_load(&sharedMemory)) {
+                //共有メモリー転送
+                WriteSharedMemory(*shm, gather);
+                return;
+            }
+            const auto& segments = gather.Segments();
+            iovec iov[WriteGather::MAX_PACKETS * 2];
+            size_t count = 0;
+            for (const auto& segment : segments) {
+                iov[count++] = iovec{ const_cast<BYTE*>(segment.Pointer()), segment.Size() };
+            }
+            iovec* remain = iov;
+            while (count > 0) {
+                SocketRef socket(socketUsers, socketFd);
+                int fd = socket.Get();
+                if (fd < 0) {
+                    //Close済みか未接続
+                    ThrowErrno(closed.load() ? EBADF : ENOTCONN);
+                }
+                msghdr msg{};
+                msg.msg_iov = remain;
+                msg.msg_iovlen = count;
+                auto written = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        ThrowErrno(errno);
+                    }
+                    WaitWritable(fd);
+                    continue;
+                }
+                //書き込めた分だけ読み進める
+                auto size = static_cast<size_t>(written);
+                while (count > 0 && size >= remain->iov_len) {
+                    size -= remain->iov_len;
+                    ++remain;
+                    --count;
+                }
+                if (count > 0) {
+                    remain->iov_base = static_cast<BYTE*>(remain->iov_base) + size;
+                    remain->iov_len -= size;
+                }
+            }
+        }
+
+        /// <summary>
+        /// 相手側へ起床通知(1バイト)を送信。送信できない場合は未読の通知があるか切断済みなので無視する。
+        /// </summary>
+        void SendNotification() noexcept
+        {
+            SocketRef socket(socketUsers, socketFd);
+            int fd = socket.Get();
+            if (fd >= 0) {
+                BYTE notification = 0;
+                ::send(fd, &notification, sizeof(notification), MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+        }
+
+        /// <summary>
+        /// 集約したパケットを共有メモリーのリングバッファーへ書き込む
+        /// 満杯の場合は相手側が読み込むまで待機する。
+        /// </summary>
+        /// <param name="shm">共有メモリー転送の状態</param>
+        /// <param name="gather">集約したパケット</param>
+        void WriteSharedMemory(SharedMemoryTransport& shm, WriteGather& gather)
+        {
+            for (auto remain : gather.Segments()) {
+                while (!remain.Empty()) {
+                    if (socketFd.load() < 0) {
+                        //Close済みか切断済み
+                        ThrowErrno(closed.load() ? EBADF : ENOTCONN);
+                    }
+                    auto written = shm.tx.Write(remain.Pointer(), remain.Size());
+                    if (written > 0) {
+                        remain.Consume(written);
+                        continue;
+                    }
+                    //満杯。書き込み済みのデータを読み込んでもらうため、先に相手側を起床させる
+                    if (shm.tx.WakeReader()) {
+                        SendNotification();
+                    }
+                    ResetEventFd(shm.SpaceEvent());
+                    if (!shm.tx.BeginWriterWait()) {
+                        //待機中に空きができた
+                        continue;
+                    }
+                    pollfd fds[]{ { shm.SpaceEvent(), POLLIN, 0 }, { closeEvent.get(), POLLIN, 0 } };
+                    while (::poll(fds, 2, -1) < 0) {
+                        if (errno != EINTR) {
+                            ThrowErrno(errno);
+                        }
+                    }
+                    if (fds[1].revents & POLLIN) {
+                        //Close要求時はハンドル破棄済みとする
+                        ThrowErrno(EBADF);
+                    }
+                }
+            }
+            if (shm.tx.WakeReader()) {
+                SendNotification();
+            }
+        }
+
+        //監視タスクのスレッドID
+        std::atomic<std::thread::id> watchThreadId;
+
+        /// <summary>
+        /// epollにファイルディスクリプタを登録
+        /// </summary>
+        /// <param name="fd">ファイルディスクリプタ</param>
+        /// <param name="exclusive">複数のepollで共有するfdの場合に1つの監視タスクのみ起床させる</param>
+        void AddWatch(int fd, bool exclusive = false)
+        {
+            epoll_event ev{};
+            ev.events = exclusive ? (EPOLLIN | EPOLLEXCLUSIVE) : EPOLLIN;
+            ev.data.fd = fd;
+            CheckErrno(::epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &ev) == 0);
+        }
+
+        /// <summary>
+        /// イベント監視ループ
+        /// </summary>
+        void Watch()
+        {
+            //再入チェックのためにスレッドIDを保存
+            watchThreadId.store(std::this_thread::get_id());
+
+            Defer defer([this]() {
+                //関数から抜ける前に必ず実行する
+                ClosePipeHandle();
+                //終了時のイベント通知の例外は無視する
+                try { NotifyDisconnected(); }
+                catch (...) {}
+                try { OnClosed(); }
+                catch (...) {}
+            });
+            //epollはハンドル数の上限がなく、待機毎のハンドル配列の再構築も不要
+            epoll_event events[16];
+            while (true) {
+                //接続、受信イベントを監視
+                auto count = ::epoll_wait(epollFd.get(), events, static_cast<int>(std::size(events)), -1);
+                if (count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    //エラー
+                    ThrowErrno(errno);
+                }
+                if (!Valid()) {
+                    //ハンドルが破棄されていたら終了
+                    break;
+                }
+                bool exit = false;
+                for (int i = 0; i < count && !exit; ++i) {
+                    auto signaled = events[i].data.fd;
+                    if (closeEvent.get() == signaled) {
+                        //Close要求イベント
+                        exit = true;
+                    }
+                    else if (socketFd.load() == signaled) {
+                        //受信イベント
+                        auto state = OnSignalRead();
+                        if (state.IsDisconn()) {
+                            if (!NotifyDisconnected()) {
+                                //クローズ要求時
+                                exit = true;
+                            }
+                        }
+                    }
+                    else if (inboxEvent.get() == signaled) {
+                        //受信箱の空き通知
+                        ResetEventFd(signaled);
+                        auto state = ResumeRead();
+                        if (state.IsDisconn()) {
+                            if (!NotifyDisconnected()) {
+                                //クローズ要求時
+                                exit = true;
+                            }
+                        }
+                    }
+                    else {
+                        //継承先のイベントハンドラを呼び出し
+                        if (!OnFireEvent(signaled)) {
+                            //クローズ要求時
+                            exit = true;
+                        }
+                    }
+                }
+                if (exit) {
+                    break;
+                }
+            }
+        }
+#endif
+
+        /// <summary>
+        /// 受信データをパケットに切り出す。監視タスクから呼び出す。
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        /// <param name="size">受信サイズ</param>
+        void FeedReceiver(LPCVOID buffer, size_t size)
+        {
+            pipeStats.Add(StatsCounters::BYTES_RECEIVED, size);
+            if (tracer.load(std::memory_order_relaxed) != nullptr) {
+                deserializer.SetReadTime(MessageTracer::Now());
+            }
+            receiver.Feed(buffer, size);
+            pipeStats.RecordPools(receiver.PoolCapacity(), deserializer.PoolCapacity());
+        }
+
+        /// <summary>
+        /// 直接配置の格納先(Receiver::PlacementTarget)へ読み込んだデータを確定
+        /// </summary>
+        /// <param name="size">読み込んだサイズ</param>
+        void FeedPlacement(size_t size)
+        {
+            pipeStats.Add(StatsCounters::BYTES_RECEIVED, size);
+            receiver.Placed(size);
+            pipeStats.RecordPools(receiver.PoolCapacity(), deserializer.PoolCapacity());
+        }
+
+        /// <summary>
+        /// 次の読み込み先。直接配置中で未受信データが受信バッファーに収まらない場合は格納先へ直接読み込む。
+        /// </summary>
+        /// <returns>{読み込み先, 読み込みサイズ}</returns>
+        std::tuple<BYTE*, size_t> NextReadTarget() const
+        {
+            auto [target, remain] = receiver.PlacementTarget();
+            if (remain >= ReadBufferSize()) {
+                return { target, remain };
+            }
+            return { readBuffer.get(), ReadBufferSize() };
+        }
+
+        /// <summary>
+        /// 受信バッファーをまたぐパケットのデータの格納先(Receiver::EnablePlacement)
+        /// </summary>
+        BYTE* PlacePacket(const Packet* packet)
+        {
+            return deserializer.Place(packet);
+        }
+
+        /// <summary>
+        /// 直接配置したパケットの受信完了(Receiver::EnablePlacement)
+        /// </summary>
+        void OnPlacedPacket(const Packet* packet)
+        {
+            pipeStats.Add(StatsCounters::FRAGMENTS_RECEIVED);
+            CountCredits(packet);
+            deserializer.FeedPlaced(packet);
+        }
+
+        void OnReceivedPackets(PacketBatch packets)
+        {
+            pipeStats.Add(StatsCounters::FRAGMENTS_RECEIVED, packets.size());
+            //受信したパケットをデシリアライズ処理
+            for (const Packet* packet : packets) {
+                if (packet->head.IsCancel()) {
+                    pipeStats.Add(StatsCounters::CANCELS_RECEIVED);
+                }
+                if (packet->head.IsCredit()) {
+                    //送信枠の付与はメッセージに含めない
+                    OnCreditPacket(packet);
+                    continue;
+                }
+                const auto canceled = CountCredits(packet);
+                deserializer.Feed(packet);
+                if (canceled) {
+                    ConsumeCredits(1);
+                }
+            }
+        }
+
+        /// <summary>
+        /// パイプハンドルを閉じる
+        /// </summary>
+         void ClosePipeHandle() noexcept
+        {
+#ifdef _WIN32
+            if (handlePipe) {
+                FlushFileBuffers(handlePipe.get());
+                handlePipe.close();
+            }
+#else
+            closed.store(true);
+            CloseSocket();
+#endif
+        }
+    protected:
+        /// <summary>
+        /// 名前付きパイプのGetLastError値のラッパークラス
+        /// </summary>
+        class WrapReadState
+        {
+        private:
+            DWORD lastErr;
+        public:
+#ifdef _WIN32
+            static constexpr DWORD SUCCESSES[]
+            { ERROR_SUCCESS, ERROR_PIPE_LISTENING, ERROR_IO_INCOMPLETE ,ERROR_IO_PENDING , ERROR_PIPE_CONNECTED,ERROR_OPERATION_ABORTED };
+            static constexpr DWORD DISCONNECT[]
+            { ERROR_PIPE_NOT_CONNECTED, ERROR_PIPE_LISTENING, ERROR_NO_DATA, ERROR_BROKEN_PIPE };
+#else
+            //POSIX版はerrno値を保持する
+            static constexpr DWORD SUCCESSES[]
+            { 0, EAGAIN, EWOULDBLOCK, EINTR, EINPROGRESS };
+            static constexpr DWORD DISCONNECT[]
+            { ENOTCONN, EPIPE, ECONNRESET, ECONNABORTED, ESHUTDOWN };
+#endif
+
+            WrapReadState() = delete;
+            inline WrapReadState(DWORD lastErr) : lastErr(lastErr) {}
+            inline const DWORD LastErr() const noexcept { return lastErr; }
+
+            /// <summary>
+            /// エラー値であったらwinrt::hresult_error例外を送出
+            /// </summary>
+            inline void ThrowIfInvalid() {
+                if (IsInvalid()) {
+#ifdef _WIN32
+                    winrt::throw_hresult(HRESULT_FROM_WIN32(lastErr));
+#else
+                    ThrowErrno(static_cast<int>(lastErr));
+#endif
+                }
+            }
+            inline bool IsSuccess() const noexcept { return std::find(std::begin(SUCCESSES), std::end(SUCCESSES), lastErr) != std::end(SUCCESSES); }
+            inline bool IsDisconn() const noexcept { return std::find(std::begin(DISCONNECT), std::end(DISCONNECT), lastErr) != std::end(DISCONNECT); }
+            inline bool IsInvalid() const noexcept { return !IsSuccess() && !IsDisconn(); }
+        };
+
+#ifdef _WIN32
+        /// <summary>
+        /// コンストラクタ
+        /// </summary>
+        /// <param name="handle">パイプハンドル</param>
+        /// <param name="bufferSize">送信・受信バッファーサイズ</param>
+        /// <param name="limitSize">送信・受信上限サイズ</param>
+        /// <param name="costomEventCount">継承先のOnFireEvent呼び出し対象のイベント作成数。作成したイベントハンドルはCustomEventsで取得する。</param>
+        SimpleNamedPipeBase(HANDLE handle, DWORD bufferSize, size_t limitSize, size_t costomEventCount = 0)
+            : handlePipe(handle)
+            , bufferSize(bufferSize)
+            , limitSize(limitSize)
+            , readOverlap(std::make_unique<OVERLAPPED>())
+            , readBuffer(std::make_unique<BYTE[]>(bufferSize + HeaderSize))
+            , receiver(bufferSize, limitSize, Receiver::Batch{}, std::bind(&SimpleNamedPipeBase::OnReceivedPackets, this, std::placeholders::_1))
+            , deserializer(bufferSize, limitSize, std::bind(&SimpleNamedPipeBase::DispatchReceived, this, std::placeholders::_1)
+                , std::bind(&SimpleNamedPipeBase::DispatchChunk, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3))
+            , writeGather(bufferSize + HeaderSize + MessageSizeSize)
+            , fragmentSizer(bufferSize)
+        {
+            if( bufferSize < MIN_BUFFER_SIZE) {
+                throw std::invalid_argument("BUF_SIZE is too short");
+            }
+            if (!handle) {
+                throw std::invalid_argument("handle is invalid");
+            }
+            readTarget = readBuffer.get();
+            //受信バッファーに収まらないパケットの続きは結合領域へ直接受信する
+            receiver.EnablePlacement(ReadBufferSize(), std::bind(&SimpleNamedPipeBase::PlacePacket, this, std::placeholders::_1)
+                , std::bind(&SimpleNamedPipeBase::OnPlacedPacket, this, std::placeholders::_1));
+
+            //受信イベント
+            *readOverlap = { 0 };
+            readEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
+            winrt::check_bool(bool{ readEvent });
+            readOverlap->hEvent = readEvent.get();
+
+            //Close要求イベント
+            closeEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
+            winrt::check_bool(bool{ closeEvent });
+
+            //受信箱の空き通知イベント
+            inboxEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
+            winrt::check_bool(bool{ inboxEvent });
+
+            //送信完了待ちイベント。シグナルせずに送信ループのアラート可能な待機にのみ使用する。
+            writeWaitEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
+            winrt::check_bool(bool{ writeWaitEvent });
+
+            //引数で指定された継承クラス用のカスタムイベント
+            for (size_t i = 0; i < costomEventCount; ++i) {
+                winrt::handle h({ CreateEventW(nullptr, true , false, nullptr) });
+                winrt::check_bool(bool{ h });
+                customEvents.emplace_back(std::move(h));
+            }
+
+            //監視タスク開始
+            watcherTask = WatchAsync().then([this](concurrency::task<void> prevTask) {
+                try {
+                    prevTask.wait();
+                }
+                catch (...)
+                {
+                    //監視タスクが例外発生で終了していた場合
+                    OnTrapException(prevTask);
+                }
+            });
+        }
+
+        /// <summary>
+        /// パイプハンドル
+        /// </summary>
+        /// <returns>パイプハンドル</returns>
+        const HANDLE Handle() const { return handlePipe.get(); }
+
+        /// <summary>
+        /// 継承クラスで指定したカスタムイベントのリスト
+        /// </summary>
+        /// <returns>継承クラスで指定したカスタムイベントのリスト</returns>
+        const std::vector<winrt::handle>& CustomEvents() const { return customEvents; }
+#else
+        /// <summary>
+        /// コンストラクタ
+        /// </summary>
+        /// <param name="handle">接続済みソケット。サーバーの場合は未接続(無効値)で構わない。</param>
+        /// <param name="bufferSize">送信・受信バッファーサイズ</param>
+        /// <param name="limitSize">送信・受信上限サイズ</param>
+        /// <param name="costomEventCount">継承先のOnFireEvent呼び出し対象のイベント作成数。作成したイベントハンドルはCustomEventsで取得する。</param>
+        SimpleNamedPipeBase(UniqueFd handle, DWORD bufferSize, size_t limitSize, size_t costomEventCount = 0)
+            : readBuffer(std::make_unique<BYTE[]>(bufferSize + HeaderSize))
+            , receiver(bufferSize, limitSize, Receiver::Batch{}, std::bind(&SimpleNamedPipeBase::OnReceivedPackets, this, std::placeholders::_1))
+            , deserializer(bufferSize, limitSize, std::bind(&SimpleNamedPipeBase::DispatchReceived, this, std::placeholders::_1)
+                , std::bind(&SimpleNamedPipeBase::DispatchChunk, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3))
+            , writeGather(bufferSize + HeaderSize + MessageSizeSize)
+            , fragmentSizer(bufferSize)
+            , bufferSize(bufferSize)
+            , limitSize(limitSize)
+        {
+            if (bufferSize < MIN_BUFFER_SIZE) {
+                throw std::invalid_argument("BUF_SIZE is too short");
+            }
+            //受信バッファーに収まらないパケットの続きは結合領域へ直接受信する
+            receiver.EnablePlacement(ReadBufferSize(), std::bind(&SimpleNamedPipeBase::PlacePacket, this, std::placeholders::_1)
+                , std::bind(&SimpleNamedPipeBase::OnPlacedPacket, this, std::placeholders::_1));
+
+            epollFd = UniqueFd{ ::epoll_create1(EPOLL_CLOEXEC) };
+            CheckErrno(bool{ epollFd });
+
+            //Close要求イベント
+            closeEvent = CreateEventFd();
+            AddWatch(closeEvent.get());
+
+            //受信箱の空き通知イベント
+            inboxEvent = CreateEventFd();
+            AddWatch(inboxEvent.get());
+
+            //引数で指定された継承クラス用のカスタムイベント
+            for (size_t i = 0; i < costomEventCount; ++i) {
+                auto h = CreateEventFd();
+                AddWatch(h.get());
+                customEvents.emplace_back(std::move(h));
+            }
+
+            socketFd.store(handle.release());
+
+            //監視タスク開始
+            watcherTask = PipeTask::Run([this]() {
+                try {
+                    Watch();
+                }
+                catch (...)
+                {
+                    //監視タスクが例外発生で終了していた場合
+                    OnTrapException(PipeTask::FromException(std::current_exception()));
+                }
+            });
+        }
+
+        /// <summary>
+        /// イベントオブジェクト相当のeventfdを生成
+        /// </summary>
+        static UniqueFd CreateEventFd()
+        {
+            UniqueFd h{ ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+            CheckErrno(bool{ h });
+            return h;
+        }
+
+        /// <summary>
+        /// eventfdをシグナル状態にする（SetEvent 相当）
+        /// </summary>
+        static void SetEventFd(int fd)
+        {
+            uint64_t value = 1;
+            CheckErrno(::write(fd, &value, sizeof(value)) == sizeof(value));
+        }
+
+        /// <summary>
+        /// eventfdを非シグナル状態にする（ResetEvent 相当）
+        /// </summary>
+        static void ResetEventFd(int fd)
+        {
+            uint64_t value = 0;
+            if (::read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                ThrowErrno(errno);
+            }
+        }
+
+        /// <summary>
+        /// 接続済みソケット
+        /// </summary>
+        /// <returns>接続済みソケット。未接続時は-1</returns>
+        int Handle() const { return socketFd.load(); }
+
+        /// <summary>
+        /// 継承クラスで指定したカスタムイベントのリスト
+        /// </summary>
+        /// <returns>継承クラスで指定したカスタムイベントのリスト</returns>
+        const std::vector<UniqueFd>& CustomEvents() const { return customEvents; }
+
+        /// <summary>
+        /// 継承クラスのファイルディスクリプタを監視対象に追加。受信可能時にOnFireEventを呼び出す。
+        /// </summary>
+        /// <param name="fd">ファイルディスクリプタ</param>
+        /// <param name="exclusive">複数インスタンスで共有するfdの場合はtrue</param>
+        void WatchHandle(int fd, bool exclusive = false) { AddWatch(fd, exclusive); }
+
+        /// <summary>
+        /// 継承クラスのファイルディスクリプタを監視対象から除外
+        /// </summary>
+        /// <param name="fd">ファイルディスクリプタ</param>
+        void UnwatchHandle(int fd)
+        {
+            CheckErrno(::epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr) == 0 || errno == ENOENT);
+        }
+
+        /// <summary>
+        /// 接続済みソケットを設定。受信開始はOverappedReadで行う。
+        /// </summary>
+        /// <param name="handle">接続済みソケット</param>
+        void AttachSocket(UniqueFd handle)
+        {
+            CloseSocket();
+            socketFd.store(handle.release());
+        }
+
+        /// <summary>
+        /// 接続済みソケットを切断して閉じる
+        /// </summary>
+        void CloseSocket() noexcept
+        {
+            int fd = socketFd.exchange(-1);
+            if (auto shm = std::atomic_exchange(&sharedMemory, std::shared_ptr<SharedMemoryTransport>())) {
+                //空き待ちの送信を中断させる
+                shm->NotifySpace();
+            }
+            if (fd < 0) {
+                return;
+            }
+            if (socketWatched.exchange(false)) {
+                ::epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+            }
+            //送信済みデータは相手側で受信可能なまま切断を通知する
+            //shutdownで送受信中、送信待機中のシステムコールは即座に戻る
+            ::shutdown(fd, SHUT_RDWR);
+            //参照中のスレッドが手放すまで閉じない。閉じた番号は次の接続で再利用されうる
+            while (socketUsers.load() != 0) {
+                std::this_thread::yield();
+            }
+            ::close(fd);
+        }
+
+        /// <summary>
+        /// 共有メモリーを生成して接続したクライアントへ渡す(サーバー側ハンドシェイク)
+        /// AttachSocketの後、OverappedReadの前に呼び出すこと。
+        /// </summary>
+        /// <param name="capacity">方向毎のリングバッファーサイズ</param>
+        void OfferSharedMemory(size_t capacity)
+        {
+            SocketRef socketRef(socketUsers, socketFd);
+            int socket = socketRef.Get();
+            auto memory = SharedMemoryTransport::CreateMemory(capacity);
+            std::array<UniqueFd, 2> spaceEvents{ CreateEventFd(), CreateEventFd() };
+            int fds[]{ memory.get(), spaceEvents[0].get(), spaceEvents[1].get() };
+            auto shm = std::make_shared<SharedMemoryTransport>(memory, capacity, true, std::move(spaceEvents));
+            //1バイトのデータに共有メモリーと空き待ち解除イベントのファイルディスクリプタを添付
+            BYTE handshake = 0;
+            iovec iov{ &handshake, sizeof(handshake) };
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))]{};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+            while (::sendmsg(socket, &msg, MSG_NOSIGNAL) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    ThrowErrno(errno);
+                }
+                WaitWritable(socket);
+            }
+            std::atomic_store(&sharedMemory, shm);
+        }
+
+        /// <summary>
+        /// サーバーから共有メモリーを受け取る(クライアント側ハンドシェイク)
+        /// OverappedReadの前に呼び出すこと。
+        /// </summary>
+        /// <returns>受け取る前にサーバーが切断した場合はfalse</returns>
+        bool AcceptSharedMemory()
+        {
+            SocketRef socketRef(socketUsers, socketFd);
+            int socket = socketRef.Get();
+            pollfd pfd{ socket, POLLIN, 0 };
+            while (true) {
+                auto res = ::poll(&pfd, 1, SHARED_MEMORY_HANDSHAKE_TIMEOUT);
+                if (res > 0) {
+                    break;
+                }
+                if (res == 0) {
+                    //共有メモリー転送に対応していないサーバー
+                    ThrowErrno(ETIMEDOUT);
+                }
+                if (errno != EINTR) {
+                    ThrowErrno(errno);
+                }
+            }
+            BYTE handshake = 0;
+            iovec iov{ &handshake, sizeof(handshake) };
+            int fds[3];
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))]{};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t readSize;
+            while ((readSize = ::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                auto state = WrapReadState{ static_cast<DWORD>(errno) };
+                state.ThrowIfInvalid();
+                if (state.IsDisconn()) {
+                    return false;
+                }
+                ThrowErrno(errno);
+            }
+            if (readSize == 0) {
+                //接続直後に切断された
+                return false;
+            }
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                //共有メモリー転送に対応していないサーバー
+                ThrowErrno(EPROTO);
+            }
+            auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::memcpy(fds, CMSG_DATA(cmsg), (std::min)(count, std::size(fds)) * sizeof(int));
+            std::vector<UniqueFd> received;
+            for (size_t i = 0; i < count && i < std::size(fds); ++i) {
+                received.emplace_back(fds[i]);
+            }
+            if (received.size() != std::size(fds) || (msg.msg_flags & MSG_CTRUNC) != 0) {
+                ThrowErrno(EPROTO);
+            }
+            auto capacity = SharedMemoryTransport::CapacityOf(received[0]);
+            std::array<UniqueFd, 2> spaceEvents{ std::move(received[1]), std::move(received[2]) };
+            std::atomic_store(&sharedMemory, std::make_shared<SharedMemoryTransport>(received[0], capacity, false, std::move(spaceEvents)));
+            return true;
+        }
+#endif
+
+        /// <summary>
+        /// レシーバーを初期化
+        /// </summary>
+        void ResetReceiver() {
+#ifdef _WIN32
+            if (readTarget != readBuffer.get()) {
+                //直接配置の格納先への読み込みが完了待ちであれば、格納先を解放する前に完了させる
+                CancelIoEx(handlePipe.get(), readOverlap.get());
+                DWORD readSize = 0;
+                GetOverlappedResult(handlePipe.get(), readOverlap.get(), &readSize, TRUE);
+                readTarget = readBuffer.get();
+            }
+#endif
+            receiver.Reset();
+            deserializer.Reset();
+            //前の接続で停止した受信は再開しない。切断後に受信箱から取り出してもソケットを読み込まない
+            readPaused.store(false);
+            ResetFlowControl();
+        }
+
+        /// <summary>
+        /// 接続毎の送信枠の状態を初期化
+        /// </summary>
+        void ResetFlowControl()
+        {
+            flowSession.store(false);
+            initialGranted.store(false);
+            pendingGrant.store(0);
+            uncreditedReceived.store(0);
+            {
+                std::lock_guard<std::mutex> lock(creditLock);
+                sendFlowActive.store(false);
+                sendCredits.store(0);
+            }
+            //付与待ちの送信は流量制御なしで続行させる(切断済みであれば送信エラーとなる)
+            creditCv.notify_all();
+        }
+
+        /// <summary>
+        /// Closeを要求済みか
+        /// </summary>
+        bool CloseRequested() const { return closeRequested.load(); }
+
+        /// <summary>
+        /// 前の接続で受信して取り出されていないメッセージを破棄する。切断後も次の接続までは取り出せる。
+        /// 未接続の間に受け付けた送信要求も次の接続へ送信しない。
+        /// 派生クラスは次の接続の直後、接続イベントと受信開始の前に呼び出すこと。
+        /// </summary>
+        void DiscardUnclaimed()
+        {
+            connection.fetch_add(1);
+            if (auto box = inbox.load()) {
+                box->Clear();
+            }
+#ifdef SNP_HAS_COROUTINE
+            //AwaitReceiveで保持したメッセージも破棄し、次の接続はAwaitReceiveを呼び出すまで受信イベントとする(接続前からの受信待ちは維持)
+            std::lock_guard<std::mutex> lock(receiveLock);
+            unclaimedReceives.clear();
+            unclaimedCount.store(0);
+            awaitReceiving.store(pendingReceive.load() != nullptr);
+#endif
+        }
+
+        /// <summary>
+        /// 接続時の処理。流量制御が有効であれば相手へ送信枠を付与する。
+        /// 派生クラスは接続直後、接続イベントと受信開始の前に呼び出すこと。
+        /// </summary>
+        void BeginFlowControl()
+        {
+            flowSession.store(true);
+            GrantInitialCredits();
+        }
+
+        /// <summary>
+        /// 接続中であれば接続時の送信枠を付与。接続時とEnableFlowControlのどちらか先に揃った側で1回のみ送る。
+        /// </summary>
+        void GrantInitialCredits()
+        {
+            auto window = flowWindow.load();
+            if (window != 0 && flowSession.load() && !initialGranted.exchange(true)) {
+                pendingGrant.fetch_add(window);
+                RequestGrantWrite();
+            }
+        }
+
+        /// <summary>
+        /// 受信メッセージの取り出し完了。送信枠の半分に達したら相手へ付与する。
+        /// 相手が送信枠を消費せずに送信したメッセージ分は付与しない(最初の付与の前に送信されたメッセージで送信枠が増えないように)。
+        /// </summary>
+        /// <param name="count">取り出したメッセージ数</param>
+        void ConsumeCredits(size_t count)
+        {
+            auto uncredited = uncreditedReceived.load();
+            while (uncredited != 0 && count != 0) {
+                const auto skip = (std::min)(uncredited, count);
+                if (uncreditedReceived.compare_exchange_weak(uncredited, uncredited - skip)) {
+                    count -= skip;
+                    break;
+                }
+            }
+            auto window = flowWindow.load();
+            if (window == 0 || count == 0 || !flowSession.load()) {
+                return;
+            }
+            auto pending = pendingGrant.fetch_add(count) + count;
+            if (pending >= (std::max)(static_cast<size_t>(window / 2), size_t{ 1 })) {
+                RequestGrantWrite();
+            }
+        }
+
+        /// <summary>
+        /// 送信枠の付与を送信させる。送信中であれば次の送信に含める。
+        /// 送信キューが満杯でも待機しない(送信枠待ちの相手と互いに待機しないため)。
+        /// </summary>
+        void RequestGrantWrite()
+        {
+            if (!grantQueued.exchange(true)) {
+                WriteRequest request{ Buffer(nullptr, 0), {}, CancellationToken::none(), std::nullopt, nullptr, true, SendPriority::HIGH };
+                if (sendLanes[static_cast<size_t>(SendPriority::HIGH)].queue.TryPush(request)) {
+                    if (pendingWrites.fetch_add(1) == 0) {
+                        StartWriter();
+                    }
+                }
+                else {
+                    //満杯であれば送信ループは後続の送信要求の先頭で付与を送る
+                    grantQueued.store(false);
+                }
+            }
+            //送信枠待ちの送信ループにも付与を送らせる
+            std::lock_guard<std::mutex> lock(creditLock);
+            creditCv.notify_all();
+        }
+
+        /// <summary>
+        /// 相手へ未付与の送信枠があれば、付与パケットを集約バッファーへ追加。送信中のスレッドから呼び出す。
+        /// </summary>
+        /// <returns>追加した場合はtrue</returns>
+        bool AppendGrant()
+        {
+            if (pendingGrant.load() == 0 || !writeGather.CanAppend(sizeof(DWORD))) {
+                return false;
+            }
+            auto pending = pendingGrant.exchange(0);
+            constexpr size_t MAX_GRANT = (std::numeric_limits<DWORD>::max)();
+            if (pending > MAX_GRANT) {
+                //1パケットで付与できない分は次回に回す
+                pendingGrant.fetch_add(pending - MAX_GRANT);
+                pending = MAX_GRANT;
+            }
+            grantPayload = static_cast<DWORD>(pending);
+            writeGather.Append(Header::CreateCredit(), Buffer(&grantPayload, sizeof(grantPayload)));
+            return true;
+        }
+
+        /// <summary>
+        /// 送信枠の付与パケットの受信
+        /// </summary>
+        /// <param name="packet">付与パケット</param>
+        void OnCreditPacket(const Packet* packet)
+        {
+            auto data = packet->Data();
+            if (data.Size() != sizeof(DWORD)) {
+                throw std::length_error("bad credit packet");
+            }
+            DWORD credits = 0;
+            std::memcpy(&credits, data.Pointer(), sizeof(credits));
+            {
+                std::lock_guard<std::mutex> lock(creditLock);
+                sendCredits.fetch_add(credits);
+                sendFlowActive.store(true);
+            }
+            creditCv.notify_all();
+        }
+
+        /// <summary>
+        /// 1メッセージ分の送信枠を確保。送信枠が無ければ付与まで待機する。送信中のスレッドから呼び出す。
+        /// 流量制御が無効(相手から付与を受けていない)場合は直ちに戻る。
+        /// </summary>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <param name="credited">相手から付与された送信枠を消費した場合はtrue</param>
+        /// <returns>待機中にキャンセルされた場合はfalse</returns>
+        bool AcquireCredit(const CancellationToken& ct, bool& credited)
+        {
+            credited = false;
+            while (sendFlowActive.load()) {
+                if (sendCredits.load() > 0) {
+                    //減算は送信中のスレッドのみ
+                    sendCredits.fetch_sub(1);
+                    credited = true;
+                    return true;
+                }
+                //待機前に集約済みのパケットと相手への付与を送る
+                if (!writeGather.Empty()) {
+                    FlushGathered();
+                }
+                if (AppendGrant()) {
+                    FlushGathered();
+                }
+                if (ct.is_canceled()) {
+                    return false;
+                }
+                if (!Valid()) {
+#ifdef _WIN32
+                    winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+#else
+                    ThrowErrno(EBADF);
+#endif
+                }
+                //付与を送った後に取り出されたメッセージ分は待機中に付与する
+                std::unique_lock<std::mutex> lock(creditLock);
+                creditCv.wait_for(lock, CREDIT_WAIT_INTERVAL, [this]() {
+                    return sendCredits.load() > 0 || !sendFlowActive.load() || pendingGrant.load() > 0;
+                });
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// 確保したが1パケットも送信しなかったメッセージの送信枠を戻す。送信中のスレッドから呼び出す。
+        /// </summary>
+        /// <param name="credited">AcquireCreditで送信枠を消費した場合はtrue</param>
+        void ReleaseCredit(bool credited)
+        {
+            if (!credited) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(creditLock);
+                //切断で初期化済みであれば戻さない
+                if (sendFlowActive.load()) {
+                    sendCredits.fetch_add(1);
+                }
+            }
+            creditCv.notify_all();
+        }
+
+        /// <summary>
+        /// 送信枠を消費せずに送信するメッセージの先頭パケットに印を付ける。受信側は取り出し時の再付与から除く。
+        /// </summary>
+        /// <param name="header">送信するパケットのヘッダー</param>
+        /// <param name="credited">AcquireCreditで送信枠を消費した場合はtrue</param>
+        static void MarkUncredited(Header& header, bool credited) noexcept
+        {
+            if (!credited && header.IsStart()) {
+                header.info.uncreditedBit = 1;
+            }
+        }
+
+        /// <summary>
+        /// 受信パケットの送信枠の扱い。送信枠を消費せずに送信されたメッセージの開始を数え、
+        /// 送信途中でキャンセルされたメッセージは送信枠を消費しているので再付与する。監視タスクから呼び出す。
+        /// </summary>
+        /// <param name="packet">受信パケット(ヘッダーと付加情報のみの場合を含む)</param>
+        /// <returns>送信途中のメッセージのキャンセルの場合はtrue。組み立てを破棄した後にConsumeCreditsを呼び出すこと。</returns>
+        bool CountCredits(const Packet* packet)
+        {
+            if (packet->head.IsCancel()) {
+                return deserializer.Started(packet);
+            }
+            if (packet->head.IsStart() && packet->head.IsUncredited()) {
+                uncreditedReceived.fetch_add(1);
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// 受信イベントで通知中のメッセージハンドル。受信メッセージプール、振り分けが無効の場合は空
+        /// </summary>
+        const PipeMessage& ReceivedMessage() const
+        {
+            return strand.load() != nullptr ? dispatchedMessage : deserializer.Message();
+        }
+
+        /// <summary>
+        /// 受信メッセージの通知。AwaitReceiveを利用中であれば受信待ちへ渡すか、次のAwaitReceiveのために保持する。
+        /// 受信箱が有効であれば受信箱へ追加し、振り分けが有効であればワーカースレッドの受信イベントとする。
+        /// いずれも無ければ監視タスクで受信イベントとする。
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        void DispatchReceived(Buffer buffer)
+        {
+            pipeStats.Add(StatsCounters::MESSAGES_RECEIVED);
+            if (deserializer.Spilled()) {
+                pipeStats.Add(StatsCounters::MESSAGES_SPILLED);
+            }
+            auto trace = TraceReceived(buffer);
+            if (auto table = rpc.load()) {
+                DispatchRpc(*table, buffer);
+                RecordTrace(trace);
+                return;
+            }
+#ifdef SNP_HAS_COROUTINE
+            if (awaitReceiving.load() && CompleteReceive(buffer, nullptr)) {
+                RecordTrace(trace);
+                return;
+            }
+#endif
+            if (auto box = inbox.load()) {
+                ConsumeCredits(box->Push(TakeMessage(buffer)));
+                RecordTrace(trace);
+                return;
+            }
+            if (auto s = strand.load()) {
+                s->Post(TakeMessage(buffer));
+                RecordTrace(trace);
+                return;
+            }
+            if (trace) {
+                trace->handlerStart = MessageTracer::Now();
+            }
+            auto start = pipeStats.Start();
+            OnReceived(buffer);
+            pipeStats.RecordCallback(start);
+            if (trace) {
+                trace->handlerEnd = MessageTracer::Now();
+                RecordTrace(trace);
+            }
+            ConsumeCredits(1);
+        }
+
+        /// <summary>
+        /// 分割受信のイベントの通知。監視タスクで受信イベントとする。
+        /// メッセージの終了で受信メッセージ数と送信枠の再付与を数える。
+        /// </summary>
+        /// <param name="type">イベント種別</param>
+        /// <param name="data">断片のデータ(RECEIVED_CHUNKのみ)</param>
+        /// <param name="size">データサイズ</param>
+        void DispatchChunk(PipeEventType type, LPCVOID data, size_t size)
+        {
+            auto start = pipeStats.Start();
+            OnReceivedChunk(type, data, size);
+            pipeStats.RecordCallback(start);
+            if (type == PipeEventType::RECEIVED_END) {
+                pipeStats.Add(StatsCounters::MESSAGES_RECEIVED);
+                ConsumeCredits(1);
+            }
+        }
+
+        /// <summary>
+        /// 組み立てが完了したメッセージの遅延計測の記録
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        /// <returns>遅延計測が無効か、タイムスタンプが付加されていない場合はnullopt</returns>
+        std::optional<MessageTrace> TraceReceived(Buffer buffer) const noexcept
+        {
+            if (tracer.load(std::memory_order_relaxed) == nullptr || deserializer.Trace() == nullptr) {
+                return std::nullopt;
+            }
+            auto trace = *deserializer.Trace();
+            trace.assembled = MessageTracer::Now();
+            trace.size = buffer.Size();
+            return trace;
+        }
+
+        void RecordTrace(const std::optional<MessageTrace>& trace) noexcept
+        {
+            if (!trace) {
+                return;
+            }
+            if (auto t = tracer.load(std::memory_order_relaxed)) {
+                t->Record(*trace);
+            }
+        }
+
+        /// <summary>
+        /// 送信要求の遅延計測を開始
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <param name="stamp">送信開始時刻までを設定するタイムスタンプ</param>
+        /// <returns>遅延計測が無効の場合はfalse</returns>
+        bool StartTrace(const WriteRequest& request, TraceStamp& stamp) const noexcept
+        {
+            if (tracer.load(std::memory_order_relaxed) == nullptr) {
+                return false;
+            }
+            stamp.started = MessageTracer::Now();
+            //送信キューを経由しない送信要求は送信開始時刻とする
+            stamp.enqueued = request.enqueued == std::chrono::steady_clock::time_point{} ? stamp.started : MessageTracer::ToTime(request.enqueued);
+            return true;
+        }
+
+        /// <summary>
+        /// パケットに付加する遅延計測のタイムスタンプ。メッセージの先頭パケットのみに付加する。
+        /// </summary>
+        /// <param name="traced">StartTraceの戻り値</param>
+        /// <param name="stamp">StartTraceで設定したタイムスタンプ。書き込み時刻を設定する</param>
+        /// <param name="header">パケットのヘッダー</param>
+        /// <returns>付加しない場合はnullptr</returns>
+        static const TraceStamp* StampTrace(bool traced, TraceStamp& stamp, const Header& header) noexcept
+        {
+            if (!traced || !header.IsStart()) {
+                return nullptr;
+            }
+            stamp.written = MessageTracer::Now();
+            return &stamp;
+        }
+
+        /// <summary>
+        /// ワーカースレッドでの受信イベント。ストランドから受信順に呼び出される。
+        /// </summary>
+        /// <param name="message">受信メッセージ</param>
+        void RunDispatched(PipeMessage& message) noexcept
+        {
+            dispatchedMessage = message;
+            try {
+                auto start = pipeStats.Start();
+                if (auto table = rpc.load()) {
+                    HandleRpcRequest(*table, message);
+                }
+                else {
+                    OnReceived(Buffer(message.Data(), message.Size()));
+                }
+                pipeStats.RecordCallback(start);
+            }
+            catch (...) {
+                //監視タスクは継続し、例外のみ通知する
+                try {
+#ifdef _WIN32
+                    OnTrapException(concurrency::task_from_exception<void>(std::current_exception()));
+#else
+                    OnTrapException(PipeTask::FromException(std::current_exception()));
+#endif
+                }
+                catch (...) {}
+            }
+            dispatchedMessage = PipeMessage();
+            try {
+                ConsumeCredits(1);
+            }
+            catch (...) {}
+            auto s = strand.load();
+            //実行中の1件を除いて半分まで空いたら停止中の受信を再開させる
+            if (readPaused.load() && s->Depth() <= DISPATCH_QUEUE_SIZE / 2 + 1) {
+                NotifyReadSpace();
+            }
+        }
+
+        /// <summary>
+        /// 受信データを受信後も参照できるメッセージハンドルとして取得
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        /// <returns>受信メッセージプールが有効であれば組み立て済みのハンドル、一時ファイルで結合していればマッピングを引き取ったハンドル、いずれでもなければプールへコピーしたハンドル</returns>
+        PipeMessage TakeMessage(Buffer buffer)
+        {
+            if (deserializer.Message()) {
+                return deserializer.Message();
+            }
+            if (auto spill = deserializer.TakeSpill()) {
+                //一時ファイルのマッピングをメッセージに移し、ヒープへコピーしない
+                auto data = spill->Data();
+                return MessagePool::Adopt(std::shared_ptr<void>(std::move(spill)), data, buffer.Size());
+            }
+            //受信バッファーはコールバック中のみ有効なので、プールのスラブへコピーする
+            if (!receivePool) {
+                receivePool = MessagePool::Create(bufferSize, limitSize);
+            }
+            auto message = receivePool->Acquire(buffer.Size());
+            receivePool->Append(message, buffer.Pointer(), buffer.Size());
+            return message;
+        }
+
+        /// <summary>
+        /// RPCメッセージの振り分け。応答は呼び出しと照合し、要求はRPCハンドラーで処理する。
+        /// 受信イベントの振り分け(EnableDispatcher)時は要求のみワーカースレッドで処理する。
+        /// </summary>
+        /// <param name="table">呼び出し表</param>
+        /// <param name="buffer">受信データ</param>
+        void DispatchRpc(RpcTable& table, Buffer buffer)
+        {
+            RpcEnvelope envelope{};
+            if (buffer.Size() < sizeof(envelope)) {
+                throw std::runtime_error("bad rpc message");
+            }
+            std::memcpy(&envelope, buffer.Pointer(), sizeof(envelope));
+            switch (static_cast<RpcKind>(envelope.kind)) {
+            case RpcKind::REQUEST:
+            {
+                if (auto s = strand.load()) {
+                    s->Post(TakeMessage(buffer));
+                    return;
+                }
+                auto start = pipeStats.Start();
+                HandleRpcRequest(table, TakeMessage(buffer));
+                pipeStats.RecordCallback(start);
+            }
+            break;
+            case RpcKind::RESPONSE:
+                table.Respond(envelope.id, RpcMessage(TakeMessage(buffer)), nullptr);
+                break;
+            case RpcKind::FAILURE:
+            {
+                buffer.Consume(sizeof(envelope));
+                table.Respond(envelope.id, RpcMessage(), std::make_exception_ptr(RpcError(std::string(reinterpret_cast<const char*>(buffer.Pointer()), buffer.Size()))));
+            }
+            break;
+            default:
+                throw std::runtime_error("bad rpc message");
+            }
+            ConsumeCredits(1);
+        }
+
+        /// <summary>
+        /// RPCの要求をハンドラーで処理する。ハンドラーの例外はエラー応答として呼び出し元へ返す。
+        /// </summary>
+        /// <param name="table">呼び出し表</param>
+        /// <param name="message">要求</param>
+        void HandleRpcRequest(RpcTable& table, const PipeMessage& message)
+        {
+            RpcMessage request(message);
+            std::string failure;
+            try {
+                if (!table.RequestHandler()) {
+                    throw std::logic_error("rpc handler is not set");
+                }
+                table.RequestHandler()(*this, request);
+                return;
+            }
+            catch (const std::exception& e) {
+                failure = e.what();
+            }
+            catch (...) {
+                failure = "unknown rpc handler error";
+            }
+            WriteRpcReply(request.Id(), RpcKind::FAILURE, failure.data(), failure.size());
+        }
+
+        /// <summary>
+        /// RPCの応答を送信キューへ追加
+        /// </summary>
+        /// <param name="id">呼び出しID</param>
+        /// <param name="kind">応答種別</param>
+        /// <param name="buffer">戻り値</param>
+        /// <param name="size">戻り値のサイズ</param>
+        /// <returns>送信完了を通知する非同期タスク</returns>
+        PipeTask WriteRpcReply(DWORD id, RpcKind kind, LPCVOID buffer, size_t size)
+        {
+            std::unique_ptr<RpcReply> reply(new RpcReply());
+            RpcEnvelope envelope{ id, static_cast<DWORD>(kind) };
+            reply->frame.resize(sizeof(envelope) + size);
+            std::memcpy(reply->frame.data(), &envelope, sizeof(envelope));
+            if (size != 0) {
+                std::memcpy(reply->frame.data() + sizeof(envelope), buffer, size);
+            }
+            PipeTask task(reply->completion);
+            WriteRequest request{ Buffer(reply->frame.data(), reply->frame.size()), {}, CancellationToken::none(), std::nullopt, reply.get() };
+            PushWrite(request);
+            //以降は送信完了の通知で破棄される
+            reply.release();
+            return task;
+        }
+
+        /// <summary>
+        /// 有効化済みのRPCの呼び出し表
+        /// </summary>
+        RpcTable& RpcOrThrow()
+        {
+            auto table = rpc.load();
+            if (table == nullptr) {
+                throw std::logic_error("rpc is not enabled");
+            }
+            return *table;
+        }
+
+        /// <summary>
+        /// 受信箱が満杯で受信を停止すべきか。監視タスクから呼び出す。
+        /// </summary>
+        bool ReadBlocked() const
+        {
+#ifdef SNP_HAS_COROUTINE
+            if (unclaimedCount.load() >= DEFAULT_INBOX_SIZE) {
+                return true;
+            }
+#endif
+            if (auto box = inbox.load()) {
+                return box->Blocked();
+            }
+            auto s = strand.load();
+            return s != nullptr && s->Depth() >= DISPATCH_QUEUE_SIZE;
+        }
+
+        /// <summary>
+        /// 受信箱または振り分け先が満杯であれば受信を停止する。監視タスクから呼び出す。
+        /// </summary>
+        /// <returns>受信を停止した場合はtrue</returns>
+        bool PauseRead()
+        {
+            if (!ReadBlocked()) {
+                return false;
+            }
+            //取り出し側は停止中フラグを見て空き通知するため、フラグを立ててから再確認する
+            readPaused.store(true);
+            if (auto box = inbox.load()) {
+                ConsumeCredits(box->Drain());
+            }
+            if (!ReadBlocked()) {
+                readPaused.store(false);
+                return false;
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// 有効化済みの受信箱
+        /// </summary>
+        Inbox& InboxOrThrow()
+        {
+            auto box = inbox.load();
+            if (box == nullptr) {
+                throw std::logic_error("inbox is not enabled");
+            }
+            return *box;
+        }
+
+        /// <summary>
+        /// 受信箱の空き通知で受信を再開する。監視タスクから呼び出す。
+        /// </summary>
+        /// <returns>パイプデータ読み込みステータス</returns>
+        WrapReadState ResumeRead()
+        {
+            if (!readPaused.exchange(false)) {
+#ifdef _WIN32
+                return WrapReadState{ ERROR_IO_PENDING };
+#else
+                return WrapReadState{ EAGAIN };
+#endif
+            }
+            if (auto box = inbox.load()) {
+                ConsumeCredits(box->Drain());
+            }
+            return OverappedRead();
+        }
+
+        /// <summary>
+        /// 受信箱から取り出した後の処理。半分まで空いたら停止中の受信を再開させる。
+        /// </summary>
+        /// <param name="box">受信箱</param>
+        void NotifyInboxSpace(const Inbox& box)
+        {
+            if (readPaused.load() && box.LowWater()) {
+                NotifyReadSpace();
+            }
+        }
+
+        /// <summary>
+        /// 停止中の受信を監視タスクで再開させる
+        /// </summary>
+        void NotifyReadSpace()
+        {
+#ifdef _WIN32
+            winrt::check_bool(SetEvent(inboxEvent.get()));
+#else
+            SetEventFd(inboxEvent.get());
+#endif
+        }
+
+        /// <summary>
+        /// 切断の通知。AwaitReceiveの受信待ちはエラーで再開させる。
+        /// </summary>
+        /// <returns>OnDisconnectedの戻り値</returns>
+        bool NotifyDisconnected()
+        {
+            //送信待ちの要求は切断した接続の後に送信しない
+            connection.fetch_add(1);
+            auto error = BrokenPipeError();
+            if (auto box = inbox.load()) {
+                //受信済みのメッセージは受信箱に残す
+                box->FailWaiters(error);
+            }
+            if (auto table = rpc.load()) {
+                //切断後に応答は届かない
+                table->FailAll(error);
+            }
+            ResetFlowControl();
+#ifdef SNP_HAS_COROUTINE
+            if (pendingReceive.load() != nullptr) {
+                CompleteReceive(Buffer(nullptr, 0), error);
+            }
+#endif
+            if (auto s = strand.load()) {
+                //切断イベントは振り分け済みの受信イベントの後
+                s->Wait();
+            }
+            return OnDisconnected();
+        }
+
+#ifdef SNP_HAS_COROUTINE
+        /// <summary>
+        /// AwaitReceiveの受信待ちを完了させ、待機中のコルーチンを呼び出し元のスレッドで再開する。
+        /// 受信待ちが無ければ受信メッセージは次のAwaitReceiveのために保持する。送信枠はAwaitReceiveで受け取った時点で再付与する。
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        /// <param name="error">エラー時の例外</param>
+        /// <returns>受信待ちが無くエラーの場合はfalse</returns>
+        bool CompleteReceive(Buffer buffer, std::exception_ptr error)
+        {
+            std::unique_lock<std::mutex> lock(receiveLock);
+            auto operation = pendingReceive.exchange(nullptr);
+            if (operation == nullptr) {
+                if (error) {
+                    return false;
+                }
+                unclaimedReceives.emplace_back(TakeMessage(buffer));
+                unclaimedCount.fetch_add(1);
+                return true;
+            }
+            if (!error) {
+                try {
+                    operation->message = TakeMessage(buffer);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            operation->error = error;
+            //受信待ちの破棄と競合しないようにロック内で状態を更新し、再開はロック外で行う
+            auto suspended = operation->state.exchange(ReceiveOperation::READY) == ReceiveOperation::SUSPENDED;
+            lock.unlock();
+            if (!error) {
+                ConsumeCredits(1);
+            }
+            if (suspended) {
+                operation->handle.resume();
+            }
+            return true;
+        }
+#endif
+
+        /// 受信イベント
+        /// </summary>
+        /// <param name="buffer">受信データ</param>
+        virtual void OnReceived(Buffer buffer) = 0;
+
+        /// <summary>
+        /// 分割受信のイベント。既定では何もしない(EnableChunkedReceiveを使う派生クラスで実装する)。
+        /// </summary>
+        /// <param name="type">RECEIVED_BEGIN, RECEIVED_CHUNK, RECEIVED_END, RECEIVED_CANCELED</param>
+        /// <param name="data">断片のデータ。RECEIVED_CHUNK以外はnullptr</param>
+        /// <param name="size">データサイズ</param>
+        virtual void OnReceivedChunk(PipeEventType /*type*/, LPCVOID /*data*/, size_t /*size*/)
+        {
+        }
+
+        /// <summary>
+        /// 切断イベント
+        /// </summary>
+        /// <returns>false:時はハンドルを閉じて以降は利用不可能とする。</returns>
+        virtual bool OnDisconnected() = 0;
+
+        /// <summary>
+        /// 監視タスクでの捕捉例外通知
+        /// </summary>
+        /// <param name="errTask">エラーが発生したタスクオブジェクト</param>
+        virtual void OnTrapException(PipeTask errTask) = 0;
+
+        /// <summary>
+        /// 継承クラスで設定したイベント発生通知
+        /// </summary>
+        /// <param name="handle">イベントハンドル</param>
+        /// <returns>false:時はハンドルを閉じて以降は利用不可能とする。</returns>
+#ifdef _WIN32
+        virtual bool OnFireEvent(HANDLE handle) = 0;
+#else
+        virtual bool OnFireEvent(int handle) = 0;
+#endif
+
+        /// <summary>
+        /// Close後のイベント
+        /// </summary>
+        virtual void OnClosed() = 0;
+
+#ifdef _WIN32
+        /// <summary>
+        /// 非同期受信完了時の処理
+        /// </summary>
+        /// <returns>パイプデータ読み込みステータス</returns>
+        virtual WrapReadState OnRead()
+        {
+            DWORD readSize = 0;
+            auto target = std::exchange(readTarget, readBuffer.get());
+            if (!GetOverlappedResult(handlePipe.get(), readOverlap.get(), &readSize, FALSE)) {
+                auto state = WrapReadState{ GetLastError() };
+                state.ThrowIfInvalid();
+                return state;
+            }
+            //データ受信
+            if (target != readBuffer.get()) {
+                //直接配置の格納先へ受信した
+                FeedPlacement(readSize);
+            }
+            else {
+                FeedReceiver(readBuffer.get(), readSize);
+            }
+            return WrapReadState{ ERROR_SUCCESS };
+        }
+
+        /// <summary>
+        /// 次の読み込み先へ読み込みを発行
+        /// </summary>
+        /// <returns>同期的に完了した場合はtrue</returns>
+        bool IssueRead()
+        {
+            auto [target, size] = NextReadTarget();
+            readTarget = target;
+            return ReadFile(handlePipe.get(), target, static_cast<DWORD>((std::min)(size, static_cast<size_t>((std::numeric_limits<DWORD>::max)()))), nullptr, readOverlap.get());
+        }
+
+        /// <summary>
+        /// 非同期受信開始
+        /// </summary>
+        /// <returns>パイプデータ読み込みステータス</returns>
+        virtual WrapReadState OverappedRead()
+        {
+            if (PauseRead()) {
+                //受信箱に空きができるまで次の受信を発行しない
+                return WrapReadState{ ERROR_IO_PENDING };
+            }
+            //受信イベントリセット
+            readOverlap->Offset = 0;
+            readOverlap->OffsetHigh = 0;
+            //受信処理
+            // 同期的の受信できる限りは受信処理を継続
+            while (IssueRead()) {
+                pipeStats.Add(StatsCounters::READS_COMPLETED);
+                auto state = OnRead();
+                if(state.IsDisconn()) {
+                    //切断状態となった
+                    return state;
+                }
+                if (PauseRead()) {
+                    return WrapReadState{ ERROR_IO_PENDING };
+                }
+                readOverlap->Offset = 0;
+                readOverlap->OffsetHigh = 0;
+            }
+            //同期的に受信データを取得できないかエラーの場合
+            auto state = WrapReadState{ GetLastError() };
+            if (state.LastErr() != ERROR_IO_PENDING) {
+                //完了待ちとならなかった読み込みの格納先は参照されない
+                readTarget = readBuffer.get();
+            }
+            state.ThrowIfInvalid();
+            if (state.LastErr() == ERROR_IO_PENDING) {
+                pipeStats.Add(StatsCounters::READS_PENDING);
+            }
+            return state;
+        }
+
+        /// <summary>
+        /// 受信イベントシグナル時の処理
+        /// </summary>
+        /// <returns>false時は切断状態</returns>
+        virtual WrapReadState OnSignalRead()
+        {
+            //非同期受信完了時処理実行
+            auto state = OnRead();
+            if (!state.IsDisconn()) {
+                //切断していなければ、次回分の非同期受信処理を実行
+                state = OverappedRead();
+            }
+            return state;
+        }
+#else
+        /// <summary>
+        /// ソケットから1回分の受信処理
+        /// </summary>
+        /// <returns>ソケット読み込みステータス</returns>
+        virtual WrapReadState OnRead()
+        {
+            if (auto shm = std::atomic_load(&sharedMemory)) {
+                //共有メモリー転送
+                return ReadSharedMemory(*shm);
+            }
+            auto [target, size] = NextReadTarget();
+            ssize_t readSize = 0;
+            {
+                SocketRef socket(socketUsers, socketFd);
+                readSize = ::read(socket.Get(), target, size);
+            }
+            if (readSize < 0) {
+                auto state = WrapReadState{ static_cast<DWORD>(errno) };
+                state.ThrowIfInvalid();
+                return state;
+            }
+            if (readSize == 0) {
+                //相手側が切断した
+                return WrapReadState{ EPIPE };
+            }
+            //データ受信
+            if (target != readBuffer.get()) {
+                //直接配置の格納先へ受信した
+                FeedPlacement(static_cast<size_t>(readSize));
+            }
+            else {
+                FeedReceiver(readBuffer.get(), static_cast<size_t>(readSize));
+            }
+            return WrapReadState{ 0 };
+        }
+
+        /// <summary>
+        /// 共有メモリー転送時の受信処理
+        /// ソケットの起床通知を読み捨て、リングバッファーのデータが無くなるまで処理する。
+        /// </summary>
+        /// <param name="shm">共有メモリー転送の状態</param>
+        /// <returns>ソケット読み込みステータス。データ処理後は常にEAGAIN</returns>
+        WrapReadState ReadSharedMemory(SharedMemoryTransport& shm)
+        {
+            bool disconnected = false;
+            while (true) {
+                ssize_t readSize = 0;
+                {
+                    SocketRef socket(socketUsers, socketFd);
+                    readSize = ::read(socket.Get(), readBuffer.get(), ReadBufferSize());
+                }
+                if (readSize > 0) {
+                    continue;
+                }
+                if (readSize == 0) {
+                    //相手側が切断した。書き込み済みのデータは処理する。
+                    disconnected = true;
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                auto state = WrapReadState{ static_cast<DWORD>(errno) };
+                state.ThrowIfInvalid();
+                if (state.IsDisconn()) {
+                    disconnected = true;
+                }
+                break;
+            }
+            bool blocked = false;
+            do {
+                while (true) {
+                    if (ReadBlocked()) {
+                        //受信箱または振り分け先が満杯。残りはリングバッファーに残し、送信側を待機させる
+                        blocked = true;
+                        break;
+                    }
+                    auto readable = shm.rx.Readable();
+                    if (readable.Empty()) {
+                        break;
+                    }
+                    //リングバッファー上のデータを直接処理。受信停止の判定はソケットの読み込みと同じ単位で行う
+                    auto feedSize = (std::min)(readable.Size(), static_cast<size_t>(ReadBufferSize()));
+                    FeedReceiver(readable.Pointer(), feedSize);
+                    shm.rx.Consume(feedSize);
+                    if (shm.rx.WakeWriter()) {
+                        shm.NotifyPeerSpace();
+                    }
+                }
+            } while (!blocked && !shm.rx.BeginReaderWait());
+            //受信停止中はリングバッファーに残ったデータを処理し終えるまで切断としない(再開時の読み込みで再検知する)
+            return WrapReadState{ static_cast<DWORD>(disconnected && !blocked ? EPIPE : EAGAIN) };
+        }
+
+        /// <summary>
+        /// 受信開始。受信可能な限り同期的に受信し、以降は監視タスクで受信する。
+        /// </summary>
+        /// <returns>ソケット読み込みステータス</returns>
+        virtual WrapReadState OverappedRead()
+        {
+            while (true) {
+                if (PauseRead()) {
+                    //受信箱に空きができるまでソケットの監視を止める
+                    if (socketWatched.exchange(false)) {
+                        SocketRef socket(socketUsers, socketFd);
+                        UnwatchHandle(socket.Get());
+                    }
+                    return WrapReadState{ EAGAIN };
+                }
+                auto state = OnRead();
+                if (state.IsDisconn()) {
+                    //切断状態となった
+                    return state;
+                }
+                if (state.LastErr() == 0) {
+                    pipeStats.Add(StatsCounters::READS_COMPLETED);
+                }
+                else if (!ReadBlocked()) {
+                    //同期的に受信データを取得できない
+                    pipeStats.Add(StatsCounters::READS_PENDING);
+                    break;
+                }
+            }
+            //登録後は監視タスクが即座に受信処理を行うため、登録前にフラグを立てる
+            if (!socketWatched.exchange(true)) {
+                SocketRef socket(socketUsers, socketFd);
+                AddWatch(socket.Get());
+            }
+            return WrapReadState{ EAGAIN };
+        }
+
+        /// <summary>
+        /// 受信可能時の処理
+        /// </summary>
+        /// <returns>false時は切断状態</returns>
+        virtual WrapReadState OnSignalRead()
+        {
+            return OverappedRead();
+        }
+#endif
+
+        /// <summary>
+        /// 集約したパケットを書き込む
+        /// </summary>
+        void FlushGathered()
+        {
+            const auto packets = writeGather.PacketCount();
+            const auto bytes = writeGather.Size();
+#ifdef _WIN32
+            WriteGathered(writeGather, writeWaitEvent);
+#else
+            WriteGathered(writeGather);
+#endif
+            pipeStats.Add(StatsCounters::FRAGMENTS_SENT, packets);
+            pipeStats.Add(StatsCounters::BYTES_SENT, bytes);
+#ifdef SNP_TEST_MODE
+            //テスト用の定義
+            if (onWritePacket) {
+                onWritePacket();
+            }
+#endif
+        }
+
+        /// <summary>
+        /// 先頭パケットに付加するメッセージ全体のサイズ(HeaderV2)
+        /// 1パケットで完結するメッセージはパケットサイズで分かるので付加しない。
+        /// </summary>
+        /// <param name="header">送信するパケットのヘッダー</param>
+        /// <param name="data">メッセージ全体</param>
+        /// <returns>付加しない場合は0</returns>
+        static std::uint64_t AnnouncedSize(const Header& header, Buffer data)
+        {
+            return header.IsStart() && !header.IsEnd() ? static_cast<std::uint64_t>(data.Size()) : 0;
+        }
+
+        /// <summary>
+        /// キャンセル発生を送信
+        /// </summary>
+        void WriteCancel()
+        {
+            auto cancelHeader = Header::CreateCancel();
+            writeGather.Append(cancelHeader, Buffer(&cancelHeader, 0));
+            const auto packets = writeGather.PacketCount();
+            const auto bytes = writeGather.Size();
+#ifdef _WIN32
+            WriteGathered(writeGather, writeWaitEvent);
+#else
+            WriteGathered(writeGather);
+#endif
+            pipeStats.Add(StatsCounters::CANCELS_SENT);
+            pipeStats.Add(StatsCounters::FRAGMENTS_SENT, packets);
+            pipeStats.Add(StatsCounters::BYTES_SENT, bytes);
+        }
+
+        /// <summary>
+        /// 1メッセージ分をバッファーサイズ単位に分割して送信
+        /// </summary>
+        /// <param name="data">送信データ</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteMessage(Buffer data, const CancellationToken& ct)
+        {
+            bool credited = false;
+            if (!AcquireCredit(ct, credited)) {
+                //送信前なので受信側への通知は不要
+                if (!writeGather.Empty()) {
+                    FlushGathered();
+                }
+                return false;
+            }
+            Serializer serialier(data, bufferSize);
+            const auto fragmentLimit = maxFragmentSize.load(std::memory_order_relaxed);
+            bool started = false;
+            while (!ct.is_canceled()) {
+                auto [packetData, header] = fragmentLimit != 0 ? serialier.Next(fragmentSizer.Size(fragmentLimit, data.Size())) : serialier.Next();
+                if (packetData.Empty()) {
+                    //完了。データが無く何も送信しなかった場合は送信枠を戻す
+                    if (!started) {
+                        ReleaseCredit(credited);
+                    }
+                    return true;
+                }
+                MarkUncredited(header, credited);
+                auto trace = StampTrace(sendTraced, sendTrace, header);
+                const auto messageSize = AnnouncedSize(header, data);
+                if (!writeGather.CanAppend(packetData.Size(), trace, messageSize)) {
+                    //先行する送信枠の付与を送る
+                    FlushGathered();
+                }
+                //ヘッダーとデータ本体をまとめて送信
+                writeGather.Append(header, packetData, trace, messageSize);
+                started = true;
+                if (fragmentLimit == 0) {
+                    FlushGathered();
+                    continue;
+                }
+                //書き込み時間から次の断片サイズを決める
+                const auto start = std::chrono::steady_clock::now();
+                FlushGathered();
+                fragmentSizer.Record(packetData.Size(), std::chrono::steady_clock::now() - start, fragmentLimit);
+            }
+            if (!started) {
+                //送信前なので受信側への通知は不要
+                ReleaseCredit(credited);
+                if (!writeGather.Empty()) {
+                    FlushGathered();
+                }
+                return false;
+            }
+            //キャンセル発生を送信
+            WriteCancel();
+            return false;
+        }
+
+        /// <summary>
+        /// 複数メッセージのパケットを連続して集約し、できるだけ少ない書き込み回数で送信
+        /// 受信側では通常の送信と同じくメッセージ毎に受信イベントとなる。
+        /// </summary>
+        /// <param name="messages">送信データ</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteBatch(const std::vector<Buffer>& messages, const CancellationToken& ct)
+        {
+            for (const auto& data : messages) {
+                if (ct.is_canceled()) {
+                    //メッセージの境界なので、集約済みのメッセージは送信して終了
+                    if (!writeGather.Empty()) {
+                        FlushGathered();
+                    }
+                    return false;
+                }
+                bool credited = false;
+                if (!AcquireCredit(ct, credited)) {
+                    if (!writeGather.Empty()) {
+                        FlushGathered();
+                    }
+                    return false;
+                }
+                Serializer serialier(data, bufferSize);
+                const auto fragmentLimit = maxFragmentSize.load(std::memory_order_relaxed);
+                bool started = false;
+                while (true) {
+                    auto [packetData, header] = fragmentLimit != 0 ? serialier.Next(fragmentSizer.Size(fragmentLimit, data.Size())) : serialier.Next();
+                    if (packetData.Empty()) {
+                        if (!started) {
+                            ReleaseCredit(credited);
+                        }
+                        break;
+                    }
+                    MarkUncredited(header, credited);
+                    auto trace = StampTrace(sendTraced, sendTrace, header);
+                    const auto messageSize = AnnouncedSize(header, data);
+                    if (!writeGather.CanAppend(packetData.Size(), trace, messageSize)) {
+                        FlushGathered();
+                        if (ct.is_canceled()) {
+                            if (started) {
+                                //送信途中のメッセージは受信側で破棄させる
+                                WriteCancel();
+                            }
+                            else {
+                                ReleaseCredit(credited);
+                            }
+                            return false;
+                        }
+                    }
+                    writeGather.Append(header, packetData, trace, messageSize);
+                    started = true;
+                }
+            }
+            if (!writeGather.Empty()) {
+                FlushGathered();
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// 読み出し関数から順に得たデータを1メッセージとして送信
+        /// 全体のサイズは分からないので、断片サイズ分を読み出す毎にパケットとして書き込み、読み出しが終端となったパケットを最終パケットとする。
+        /// データがちょうど断片サイズの倍数の場合はデータの無い最終パケットを送る。
+        /// </summary>
+        /// <param name="source">読み出し関数</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteSource(const ChunkReader& source, const CancellationToken& ct)
+        {
+            bool credited = false;
+            if (!AcquireCredit(ct, credited)) {
+                if (!writeGather.Empty()) {
+                    FlushGathered();
+                }
+                return false;
+            }
+            const auto fragmentLimit = maxFragmentSize.load(std::memory_order_relaxed);
+            bool beginning = true;
+            size_t total = 0;
+            while (true) {
+                if (ct.is_canceled()) {
+                    break;
+                }
+                bool end = false;
+                sourceChunk.resize(fragmentLimit != 0 ? fragmentSizer.Size(fragmentLimit) : bufferSize);
+                size_t filled = 0;
+                try {
+                    //断片サイズを満たすか終端まで読み出す
+                    while (filled < sourceChunk.size()) {
+                        auto read = source(sourceChunk.data() + filled, sourceChunk.size() - filled);
+                        if (read == 0) {
+                            end = true;
+                            break;
+                        }
+                        if (read > sourceChunk.size() - filled) {
+                            throw std::length_error("size is too large");
+                        }
+                        filled += read;
+                    }
+                    if (limitSize - total < filled) {
+                        throw std::length_error("size is too long");
+                    }
+                }
+                catch (...) {
+                    if (!beginning) {
+                        //送信途中のメッセージは受信側で破棄させる
+                        WriteCancel();
+                    }
+                    else {
+                        ReleaseCredit(credited);
+                        if (!writeGather.Empty()) {
+                            FlushGathered();
+                        }
+                    }
+                    throw;
+                }
+                total += filled;
+                auto header = Header::Create(static_cast<DWORD>(filled), beginning, end);
+                MarkUncredited(header, credited);
+                auto trace = StampTrace(sendTraced, sendTrace, header);
+                if (!writeGather.CanAppend(filled, trace)) {
+                    FlushGathered();
+                }
+                writeGather.Append(header, Buffer(sourceChunk.data(), filled), trace);
+                const auto start = std::chrono::steady_clock::now();
+                FlushGathered();
+                if (fragmentLimit != 0) {
+                    fragmentSizer.Record(filled, std::chrono::steady_clock::now() - start, fragmentLimit);
+                }
+                if (end) {
+                    return true;
+                }
+                beginning = false;
+            }
+            //キャンセル発生を送信
+            if (!beginning) {
+                WriteCancel();
+            }
+            else {
+                ReleaseCredit(credited);
+                if (!writeGather.Empty()) {
+                    FlushGathered();
+                }
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// 送信要求の種類に応じて送信
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <returns>キャンセル時はfalse</returns>
+        bool WriteRequested(WriteRequest& request)
+        {
+            if (request.source) {
+                return WriteSource(request.source, request.ct);
+            }
+            return request.batch.empty() ? WriteMessage(request.buffer, request.ct) : WriteBatch(request.batch, request.ct);
+        }
+
+        /// <summary>
+        /// 送信要求を処理して完了を通知
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        void ProcessWrite(WriteRequest& request) noexcept
+        {
+            NotifyWrite(request, ExecuteWrite(request));
+        }
+
+        /// <summary>
+        /// 送信要求の完了を通知
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <param name="error">エラー、キャンセル時の例外。正常終了時はnullptr</param>
+        void NotifyWrite(WriteRequest& request, std::exception_ptr error) noexcept
+        {
+            if (request.notify != nullptr) {
+                request.notify->Complete(error);
+            }
+            else if (!request.completion) {
+                //送信枠の付与など通知先の無い制御要求
+            }
+            else if (error) {
+                request.completion->set_exception(error);
+            }
+            else {
+                request.completion->set();
+            }
+        }
+
+        /// <summary>
+        /// 送信要求を送信
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <returns>エラー、キャンセル時の例外。正常終了時はnullptr</returns>
+        std::exception_ptr ExecuteWrite(WriteRequest& request) noexcept
+        {
+            std::exception_ptr error;
+            try {
+                if (request.grant) {
+                    //送信枠の付与のみ
+                    grantQueued.store(false);
+                    if (AppendGrant()) {
+                        FlushGathered();
+                    }
+                    return error;
+                }
+                RecordSendStart(request);
+                if (request.connection != connection.load()) {
+                    //前の接続で受け付けた送信要求
+                    return BrokenPipeError();
+                }
+                sendTraced = StartTrace(request, sendTrace);
+                //未付与の送信枠があればメッセージと同時に送る
+                AppendGrant();
+                //開始前にキャンセル済みの場合は何も送信しない
+                if (request.ct.is_canceled() || !WriteRequested(request)) {
+                    error = CanceledError();
+                }
+                else {
+                    pipeStats.Add(StatsCounters::MESSAGES_SENT, request.batch.empty() ? 1 : request.batch.size());
+                }
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            return error;
+        }
+
+        /// <summary>
+        /// 送信ループ。未処理の送信要求がなくなるまで順に送信する。
+        /// 同時に実行されるのは1つのみ。
+        /// 送信要求がなくなっても WRITE_LOOP_LINGER の間は次の送信要求を待機し、連続した送信でタスクを再生成しない。
+        /// </summary>
+        void WriteLoop() noexcept
+        {
+            while (true) {
+                do {
+                    auto request = PopWrite();
+                    while (!request) {
+                        //送信要求数の加算は追加後なので、追加の完了を待つ
+                        std::this_thread::yield();
+                        request = PopWrite();
+                    }
+                    WakeSendQueueWaiters();
+                    if (IsStreamWrite(*request)) {
+                        WriteStreams(*request);
+                    }
+                    else {
+                        ProcessWrite(*request);
+                    }
+                } while (pendingWrites.fetch_sub(1) > 1);
+
+                std::unique_lock<std::mutex> lock(sendQueueLock);
+                sendQueueCv.wait_for(lock, WRITE_LOOP_LINGER, [this]() { return writerWake || writerStop; });
+                if (writerWake) {
+                    //待機中に送信要求が追加された
+                    writerWake = false;
+                    continue;
+                }
+                //ロック内で停止を通知し、以降はインスタンスに触れない
+                writerActive.store(false);
+                sendQueueCv.notify_all();
+                return;
+            }
+        }
+
+        /// <summary>
+        /// 送信キューの空き待ちの送信要求元を起床
+        /// </summary>
+        void WakeSendQueueWaiters()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (sendQueueWaiters.load() > 0) {
+                std::lock_guard<std::mutex> lock(sendQueueLock);
+                sendQueueCv.notify_all();
+            }
+        }
+
+        /// <summary>
+        /// 待ち時間に応じて引き上げた優先度。SEND_PRIORITY_AGING 毎に1段階引き上げる。
+        /// </summary>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="since">待機開始時刻</param>
+        /// <param name="now">現在時刻</param>
+        /// <returns>引き上げ後の優先度(0が最優先)</returns>
+        static size_t AgedRank(SendPriority priority, std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now)
+        {
+            auto rank = static_cast<size_t>(priority);
+            auto steps = (now - since) / SEND_PRIORITY_AGING;
+            return steps >= static_cast<decltype(steps)>(rank) ? 0 : rank - static_cast<size_t>(steps);
+        }
+
+        /// <summary>
+        /// 次に取り出す送信キューを選択(送信中のスレッドのみ)
+        /// 引き上げ後の優先度が最も高い先頭要素を選び、同じ優先度では待ち時間の長い方を選ぶ。
+        /// </summary>
+        /// <param name="now">現在時刻</param>
+        /// <param name="rank">選択した送信要求の引き上げ後の優先度</param>
+        /// <returns>送信キューのインデックス。全て空の場合は SEND_PRIORITIES</returns>
+        size_t SelectLane(std::chrono::steady_clock::time_point now, size_t& rank)
+        {
+            size_t selected = SEND_PRIORITIES;
+            std::chrono::steady_clock::time_point oldest;
+            for (size_t lane = 0; lane < SEND_PRIORITIES; ++lane) {
+                auto head = sendLanes[lane].queue.Peek();
+                if (head == nullptr) {
+                    continue;
+                }
+                auto headRank = AgedRank(head->priority, head->enqueued, now);
+                if (selected == SEND_PRIORITIES || headRank < rank || (headRank == rank && head->enqueued < oldest)) {
+                    selected = lane;
+                    rank = headRank;
+                    oldest = head->enqueued;
+                }
+            }
+            return selected;
+        }
+
+        /// <summary>
+        /// 次の送信要求を取り出す(送信中のスレッドのみ)
+        /// </summary>
+        /// <returns>全ての送信キューが空の場合は無効値</returns>
+        std::optional<WriteRequest> PopWrite()
+        {
+            size_t rank = 0;
+            auto lane = SelectLane(std::chrono::steady_clock::now(), rank);
+            if (lane == SEND_PRIORITIES) {
+                return std::nullopt;
+            }
+            return sendLanes[lane].queue.TryPop();
+        }
+
+        /// <summary>
+        /// 送信開始を送信キューの統計に記録(送信中のスレッドのみ)
+        /// 送信キューを経由しない送信要求(直接送信、送信枠の付与)は対象外。
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        void RecordSendStart(const WriteRequest& request)
+        {
+            if (request.enqueued == std::chrono::steady_clock::time_point{}) {
+                return;
+            }
+            auto& lane = sendLanes[static_cast<size_t>(request.priority)];
+            auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - request.enqueued).count();
+            lane.queued.fetch_sub(1);
+            lane.sent.fetch_add(1, std::memory_order_relaxed);
+            lane.totalWait.fetch_add(wait, std::memory_order_relaxed);
+            if (lane.maxWait.load(std::memory_order_relaxed) < wait) {
+                lane.maxWait.store(wait, std::memory_order_relaxed);
+            }
+        }
+
+        /// <summary>
+        /// 多重化して送信する送信要求か。1パケットに収まらないメッセージが対象。
+        /// </summary>
+        bool IsStreamWrite(const WriteRequest& request) const
+        {
+            return multiplex.load() && !request.grant && !request.source && request.batch.empty() && request.buffer.Size() > StreamFragmentSize();
+        }
+
+        /// <summary>
+        /// 多重化したパケットのデータサイズの上限。ストリームIDを含めてバッファーサイズに収める。
+        /// </summary>
+        size_t StreamFragmentSize() const { return bufferSize - StreamIdSize; }
+
+        /// <summary>
+        /// 多重化して送信するメッセージを追加
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <param name="borrowed">送信要求数を呼び出し元で減算する場合はtrue</param>
+        void AddStream(WriteRequest&& request, bool borrowed) noexcept
+        {
+            if (++lastStreamId == 0) {
+                lastStreamId = 1;
+            }
+            auto rest = request.buffer;
+            auto enqueued = request.enqueued;
+            outgoingStreams.push_back(OutgoingStream{ std::move(request), rest, lastStreamId });
+            outgoingStreams.back().borrowed = borrowed;
+            outgoingStreams.back().lastSent = enqueued;
+        }
+
+        /// <summary>
+        /// 次に断片を送信するメッセージを選択
+        /// 引き上げ後の優先度が最も高いメッセージを選び、同じ優先度では最後の送信が古い方を選ぶ(ラウンドロビン)。
+        /// </summary>
+        /// <param name="now">現在時刻</param>
+        /// <param name="rank">選択したメッセージの引き上げ後の優先度</param>
+        /// <returns>outgoingStreamsのインデックス</returns>
+        size_t SelectStream(std::chrono::steady_clock::time_point now, size_t& rank) const
+        {
+            size_t selected = 0;
+            for (size_t i = 0; i < outgoingStreams.size(); ++i) {
+                const auto& stream = outgoingStreams[i];
+                auto streamRank = AgedRank(stream.request.priority, stream.lastSent, now);
+                if (i == 0 || streamRank < rank || (streamRank == rank && stream.lastSent < outgoingStreams[selected].lastSent)) {
+                    selected = i;
+                    rank = streamRank;
+                }
+            }
+            return selected;
+        }
+
+        /// <summary>
+        /// 送信待ちの大きなメッセージのうち、最も優先度の高いものを送信中へ移す
+        /// </summary>
+        void ActivateWaitingStream() noexcept
+        {
+            if (waitingStreams.empty()) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            auto best = waitingStreams.begin();
+            for (auto it = waitingStreams.begin(); it != waitingStreams.end(); ++it) {
+                if (AgedRank(it->priority, it->enqueued, now) < AgedRank(best->priority, best->enqueued, now)) {
+                    best = it;
+                }
+            }
+            AddStream(std::move(*best), false);
+            waitingStreams.erase(best);
+        }
+
+        /// <summary>
+        /// 大きなメッセージを断片毎に交互に送信する。断片を1つ送信する毎に送信キューを確認し、
+        /// 次の断片より優先度の高い送信要求を先に処理するので、大きなメッセージの送信中も遅延しない。
+        /// 送信中の大きなメッセージが全て完了するまで戻らない。
+        /// </summary>
+        /// <param name="first">最初の大きなメッセージの送信要求。送信要求数は呼び出し元で減算する。</param>
+        void WriteStreams(WriteRequest& first) noexcept
+        {
+            try {
+                //追加で再確保しないように確保しておく
+                outgoingStreams.reserve(MULTIPLEX_STREAMS);
+            }
+            catch (...) {
+                RecordSendStart(first);
+                NotifyWrite(first, std::current_exception());
+                return;
+            }
+            AddStream(std::move(first), true);
+            while (!outgoingStreams.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                size_t streamRank = 0;
+                SelectStream(now, streamRank);
+                //次の断片と同じか高い優先度の送信要求を取り出す。送信中の要求数は最初の要求分が残るので0にはならない。
+                size_t rank = 0;
+                for (auto lane = SelectLane(now, rank); lane != SEND_PRIORITIES && rank <= streamRank; lane = SelectLane(now, rank)) {
+                    auto next = sendLanes[lane].queue.TryPop();
+                    WakeSendQueueWaiters();
+                    if (!IsStreamWrite(*next)) {
+                        ProcessWrite(*next);
+                        pendingWrites.fetch_sub(1);
+                        continue;
+                    }
+                    if (outgoingStreams.size() < MULTIPLEX_STREAMS) {
+                        AddStream(std::move(*next), false);
+                        continue;
+                    }
+                    try {
+                        waitingStreams.emplace_back(std::move(*next));
+                    }
+                    catch (...) {
+                        RecordSendStart(*next);
+                        NotifyWrite(*next, std::current_exception());
+                        pendingWrites.fetch_sub(1);
+                    }
+                }
+                //選択したメッセージの断片を1つ送信
+                auto index = SelectStream(now, streamRank);
+                auto& stream = outgoingStreams[index];
+                if (!WriteStreamFragment(stream)) {
+                    stream.lastSent = std::chrono::steady_clock::now();
+                    continue;
+                }
+                auto borrowed = stream.borrowed;
+                if (!stream.error) {
+                    pipeStats.Add(StatsCounters::MESSAGES_SENT);
+                }
+                NotifyWrite(stream.request, stream.error);
+                outgoingStreams.erase(outgoingStreams.begin() + static_cast<std::ptrdiff_t>(index));
+                if (!borrowed) {
+                    pendingWrites.fetch_sub(1);
+                }
+                //完了したメッセージの代わりに追加
+                ActivateWaitingStream();
+            }
+        }
+
+        /// <summary>
+        /// 多重化したメッセージの断片を1つ送信
+        /// </summary>
+        /// <param name="stream">送信中のメッセージ</param>
+        /// <returns>完了(エラー、キャンセルを含む)した場合はtrue</returns>
+        bool WriteStreamFragment(OutgoingStream& stream) noexcept
+        {
+            try {
+                const auto& ct = stream.request.ct;
+                if (stream.request.connection != connection.load()) {
+                    //前の接続で受け付けた、または送信途中で切断したメッセージは次の接続へ送信しない
+                    if (!stream.started) {
+                        RecordSendStart(stream.request);
+                    }
+                    stream.error = BrokenPipeError();
+                    return true;
+                }
+                if (!stream.started) {
+                    RecordSendStart(stream.request);
+                    stream.traced = StartTrace(stream.request, stream.trace);
+                    //開始前にキャンセル済みの場合は何も送信しない
+                    if (ct.is_canceled() || !AcquireCredit(ct, stream.credited)) {
+                        stream.error = CanceledError();
+                        return true;
+                    }
+                    stream.started = true;
+                }
+                else if (ct.is_canceled() && !stream.sent) {
+                    //断片を送信する前であれば受信側への通知は不要
+                    ReleaseCredit(stream.credited);
+                    stream.error = CanceledError();
+                    return true;
+                }
+                else if (ct.is_canceled()) {
+                    //送信途中のメッセージは受信側で破棄させる
+                    if (!writeGather.Empty()) {
+                        FlushGathered();
+                    }
+                    writeGather.AppendStream(Header::CreateStreamCancel(), stream.id, Buffer(&stream.id, 0));
+                    FlushGathered();
+                    pipeStats.Add(StatsCounters::CANCELS_SENT);
+                    stream.error = CanceledError();
+                    return true;
+                }
+                //未付与の送信枠があれば断片と同時に送る
+                AppendGrant();
+                const auto total = stream.rest.Size();
+                auto fragment = stream.rest.Consume((std::min)(StreamFragmentSize(), stream.rest.Size()));
+                auto header = Header::CreateStream(static_cast<DWORD>(fragment.Size()), !stream.sent, stream.rest.Empty());
+                MarkUncredited(header, stream.credited);
+                auto trace = StampTrace(stream.traced, stream.trace, header);
+                const auto messageSize = AnnouncedSize(header, Buffer(fragment.Pointer(), total));
+                if (!writeGather.CanAppend(StreamIdSize + fragment.Size(), trace, messageSize)) {
+                    FlushGathered();
+                }
+                writeGather.AppendStream(header, stream.id, fragment, trace, messageSize);
+                FlushGathered();
+                stream.sent = true;
+                return stream.rest.Empty();
+            }
+            catch (...) {
+                stream.error = std::current_exception();
+                return true;
+            }
+        }
+
+        /// <summary>
+        /// 切断時の例外
+        /// </summary>
+        static std::exception_ptr BrokenPipeError()
+        {
+#ifdef _WIN32
+            return std::make_exception_ptr(winrt::hresult_error(HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE)));
+#else
+            return std::make_exception_ptr(std::system_error(EPIPE, std::generic_category()));
+#endif
+        }
+
+        /// <summary>
+        /// キャンセル時の例外
+        /// </summary>
+        static std::exception_ptr CanceledError()
+        {
+#ifdef _WIN32
+            return std::make_exception_ptr(concurrency::task_canceled());
+#else
+            return std::make_exception_ptr(TaskCanceled());
+#endif
+        }
+
+        /// <summary>
+        /// 送信要求を送信キューへ追加し、送信ループが停止していれば開始する
+        /// </summary>
+        /// <param name="request">送信要求。追加後はムーブ済み。</param>
+        void PushWrite(WriteRequest& request)
+        {
+            request.connection = connection.load();
+            auto& lane = sendLanes[static_cast<size_t>(request.priority)];
+            //送信開始時に減算するので追加前に加算する
+            auto queued = lane.queued.fetch_add(1) + 1;
+            for (auto max = lane.maxQueued.load(); max < queued && !lane.maxQueued.compare_exchange_weak(max, queued);) {
+            }
+            request.enqueued = std::chrono::steady_clock::now();
+            if (!lane.queue.TryPush(request)) {
+                //満杯の場合は送信ループが取り出すまで待機
+                auto start = pipeStats.Start();
+                std::unique_lock<std::mutex> lock(sendQueueLock);
+                sendQueueWaiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                sendQueueCv.wait(lock, [&]() { return lane.queue.TryPush(request); });
+                sendQueueWaiters.fetch_sub(1);
+                pipeStats.RecordWriteWait(start);
+            }
+            if (pendingWrites.fetch_add(1) != 0) {
+                //送信ループが処理中
+                return;
+            }
+            StartWriter();
+        }
+
+        /// <summary>
+        /// 送信ループを開始。待機中の送信ループがあれば再開する。
+        /// 未処理の送信要求数を0から増やした側が呼び出す。
+        /// </summary>
+        void StartWriter()
+        {
+            std::lock_guard<std::mutex> lock(sendQueueLock);
+            if (writerActive.load()) {
+                //送信要求待機中の送信ループを再開
+                writerWake = true;
+                sendQueueCv.notify_all();
+                return;
+            }
+            writerActive.store(true);
+            //送信ループは送信要求がある間のみ実行する
+#ifdef _WIN32
+            concurrency::create_task([this]() { WriteLoop(); });
+#else
+            PipeTask::Run([this]() { WriteLoop(); });
+#endif
+        }
+
+        /// <summary>
+        /// 送信キューへ追加し、送信ループが停止していれば開始する
+        /// </summary>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>送信完了を通知する非同期タスク</returns>
+        PipeTask EnqueueWrite(LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
+        {
+            return EnqueueWrite(WriteRequest{ Buffer(buffer, size), {}, ct, PipeTaskCompletion(), nullptr, false, priority });
+        }
+
+        /// <summary>
+        /// 送信キューへ追加し、送信ループが停止していれば開始する
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <returns>送信完了を通知する非同期タスク</returns>
+        PipeTask EnqueueWrite(WriteRequest request)
+        {
+            PipeTaskCompletion completion = *request.completion;
+            PushWrite(request);
+            return PipeTask(completion);
+        }
+
+        /// <summary>
+        /// 送信キューへ追加し、送信完了まで待機
+        /// </summary>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        void EnqueueWriteAndWait(LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
+        {
+            WriteWaiter waiter;
+            WriteRequest request{ Buffer(buffer, size), {}, ct, std::nullopt, &waiter, false, priority };
+            if (TryWriteInline(request, waiter.error)) {
+                //呼び出し元のスレッドで送信済み
+                if (waiter.error) {
+                    std::rethrow_exception(waiter.error);
+                }
+                return;
+            }
+            PushWrite(request);
+            std::unique_lock<std::mutex> lock(waiter.lock);
+            waiter.cv.wait(lock, [&waiter]() { return waiter.done; });
+            if (waiter.error) {
+                std::rethrow_exception(waiter.error);
+            }
+        }
+
+        /// <summary>
+        /// 送信ループが処理中でなければ、呼び出し元のスレッドで直接送信する
+        /// 送信キューとスレッドの切り替えを省略する。バッファーサイズを超えるメッセージは送信ループに任せる。
+        /// </summary>
+        /// <param name="request">送信要求</param>
+        /// <param name="error">送信した場合のエラー、キャンセル時の例外</param>
+        /// <returns>送信した場合はtrue</returns>
+        bool TryWriteInline(WriteRequest& request, std::exception_ptr& error)
+        {
+            if (request.buffer.Size() > bufferSize || !request.batch.empty()) {
+                return false;
+            }
+            request.connection = connection.load();
+            if (sendFlowActive.load() && sendCredits.load() == 0) {
+                //送信枠の付与待ちで呼び出し元を止めない
+                return false;
+            }
+            size_t expected = 0;
+            if (!pendingWrites.compare_exchange_strong(expected, 1)) {
+                //送信ループが処理中
+                return false;
+            }
+            error = ExecuteWrite(request);
+            if (pendingWrites.fetch_sub(1) > 1) {
+                //送信中に追加された送信要求は送信ループで処理する
+                StartWriter();
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// 送信ループの終了を待機
+        /// 送信要求待機中の送信ループは直ちに終了させる。
+        /// </summary>
+        void WaitWriteLoop()
+        {
+            std::unique_lock<std::mutex> lock(sendQueueLock);
+            writerStop = true;
+            sendQueueCv.notify_all();
+            sendQueueCv.wait(lock, [this]() { return !writerActive.load(); });
+        }
+
+    public:
+        /// <summary>
+        /// 非同期送信処理
+        /// 送信要求は送信優先度毎の送信キューに追加し、1つの送信ループが優先度の高い順に送信する。
+        /// 同じ優先度の送信要求は追加順に送信する。
+        /// 送信完了まで送信バッファーを維持すること。
+        /// </summary>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>非同期タスク</returns>
+#ifdef _WIN32
+        virtual concurrency::task<void> WriteAsync(LPCVOID buffer, size_t size, SendPriority priority, concurrency::cancellation_token ct)
+        {
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+            if (size > limitSize) {
+                throw std::length_error("size is too long");
+            }
+            return EnqueueWrite(buffer, size, priority, ct);
+        }
+#else
+        virtual PipeTask WriteAsync(LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
+        {
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+            if (size > limitSize) {
+                throw std::length_error("size is too long");
+            }
+            return EnqueueWrite(buffer, size, priority, ct);
+        }
+#endif
+
+        virtual PipeTask WriteAsync(LPCVOID buffer, size_t size, SendPriority priority)
+        {
+            return WriteAsync(buffer, size, priority, CancellationToken::none());
+        }
+
+        virtual PipeTask WriteAsync(LPCVOID buffer, size_t size, CancellationToken ct)
+        {
+            return WriteAsync(buffer, size, SendPriority::NORMAL, ct);
+        }
+
+        virtual PipeTask WriteAsync(LPCVOID buffer, size_t size)
+        {
+            return WriteAsync(buffer, size, SendPriority::NORMAL, CancellationToken::none());
+        }
+
+        /// <summary>
+        /// 同期送信処理
+        /// WriteAsync(...).wait() と同じ動作だが、タスクを生成しないため定常状態ではヒープ確保を行わない。
+        /// 送信完了まで呼び出し元をブロックする。キャンセル時は WriteAsync のタスクと同じ例外を送出する。
+        /// </summary>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        void Write(LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
+        {
+#ifdef _WIN32
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+#else
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+#endif
+            if (size > limitSize) {
+                throw std::length_error("size is too long");
+            }
+            EnqueueWriteAndWait(buffer, size, priority, ct);
+        }
+
+        void Write(LPCVOID buffer, size_t size, SendPriority priority)
+        {
+            Write(buffer, size, priority, CancellationToken::none());
+        }
+
+        void Write(LPCVOID buffer, size_t size, CancellationToken ct)
+        {
+            Write(buffer, size, SendPriority::NORMAL, ct);
+        }
+
+        void Write(LPCVOID buffer, size_t size)
+        {
+            Write(buffer, size, SendPriority::NORMAL, CancellationToken::none());
+        }
+
+        /// <summary>
+        /// 送信優先度毎の送信キューの統計
+        /// </summary>
+        /// <returns>SendPriorityの値をインデックスとした統計</returns>
+        std::array<SendLaneStats, SEND_PRIORITIES> SendStats() const
+        {
+            std::array<SendLaneStats, SEND_PRIORITIES> stats;
+            for (size_t i = 0; i < SEND_PRIORITIES; ++i) {
+                const auto& lane = sendLanes[i];
+                stats[i].queued = lane.queued.load();
+                stats[i].maxQueued = lane.maxQueued.load();
+                stats[i].sent = lane.sent.load(std::memory_order_relaxed);
+                stats[i].totalWait = std::chrono::nanoseconds(lane.totalWait.load(std::memory_order_relaxed));
+                stats[i].maxWait = std::chrono::nanoseconds(lane.maxWait.load(std::memory_order_relaxed));
+            }
+            return stats;
+        }
+
+        /// <summary>
+        /// パイプインスタンスの統計
+        /// 任意のスレッドから呼び出せる。各値は個別に読み込むため、値の間の整合は保証しない。
+        /// SNP_DISABLE_STATS を定義してビルドした場合は計数を行わず、全て0を返す。
+        /// </summary>
+        PipeStats Stats() const
+        {
+            return pipeStats.Snapshot();
+        }
+
+        /// <summary>
+        /// メッセージ毎の遅延計測を有効化
+        /// 送信するメッセージの先頭パケットにタイムスタンプを付加し、タイムスタンプ付きで受信したメッセージの区間毎の遅延を集計する。
+        /// 区間全体を計測するには送信側と受信側の両方で有効化すること。未対応の相手はタイムスタンプを読み飛ばす。
+        /// タイムスタンプはsteady_clockのため、送信側と受信側が同一マシン上にあることが前提。
+        /// 受信イベントの振り分け、受信箱、AwaitReceive、RPCでの受信は組み立て完了までを計測する。
+        /// </summary>
+        void EnableTracing()
+        {
+            auto created = std::make_unique<MessageTracer>();
+            MessageTracer* expected = nullptr;
+            if (!tracer.compare_exchange_strong(expected, created.get())) {
+                throw std::logic_error("tracing is already enabled");
+            }
+            tracerStorage = std::move(created);
+        }
+
+        /// <summary>
+        /// 遅延計測の区間毎の集計。任意のスレッドから呼び出せる。
+        /// </summary>
+        /// <returns>遅延計測が無効の場合は全て0</returns>
+        TraceStats TraceStatistics() const
+        {
+            auto t = tracer.load();
+            return t != nullptr ? t->Snapshot() : TraceStats();
+        }
+
+        /// <summary>
+        /// 直近に受信したメッセージ(最大TRACE_RECORDS件)の遅延計測をChrome trace形式(JSON)で取得
+        /// chrome://tracing や Perfetto で読み込める。
+        /// </summary>
+        /// <returns>遅延計測が無効の場合はイベントが空のJSON</returns>
+        std::string ChromeTrace() const
+        {
+            auto t = tracer.load();
+            return t != nullptr ? t->ChromeTrace() : std::string("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}");
+        }
+
+#ifdef SNP_HAS_COROUTINE
+        /// <summary>
+        /// AwaitWrite の待機オブジェクト
+        /// </summary>
+        class WriteOperation final : private WriteNotify
+        {
+            friend class SimpleNamedPipeBase;
+        private:
+            SimpleNamedPipeBase& pipe;
+            WriteRequest request;
+            std::coroutine_handle<> handle;
+            std::exception_ptr error;
+
+            WriteOperation(SimpleNamedPipeBase& pipe, LPCVOID buffer, size_t size, CancellationToken ct)
+                : pipe(pipe)
+                , request{ Buffer(buffer, size), {}, ct, std::nullopt, this }
+            {}
+
+            virtual void Complete(std::exception_ptr exception) noexcept override
+            {
+                error = exception;
+                handle.resume();
+            }
+        public:
+            WriteOperation(WriteOperation&&) = delete;
+            WriteOperation(const WriteOperation&) = delete;
+            WriteOperation& operator=(WriteOperation&&) = delete;
+            WriteOperation& operator=(const WriteOperation&) = delete;
+
+            /// <summary>
+            /// 送信ループが処理中でなければ、サスペンドせずに呼び出し元のスレッドで送信する
+            /// </summary>
+            bool await_ready() { return pipe.TryWriteInline(request, error); }
+            void await_suspend(std::coroutine_handle<> awaiting)
+            {
+                handle = awaiting;
+                pipe.PushWrite(request);
+            }
+            void await_resume() const
+            {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        };
+
+        /// <summary>
+        /// AwaitReceive の待機オブジェクト
+        /// 生成時に受信待ちを登録し、破棄時に解除する。保持中の受信メッセージがあれば登録せずに受信済みとする。
+        /// </summary>
+        class ReceiveOperation final
+        {
+            friend class SimpleNamedPipeBase;
+        private:
+            enum State : int {
+                //受信待ち
+                WAITING,
+                //コルーチンがサスペンド中
+                SUSPENDED,
+                //受信済み、エラー発生
+                READY,
+            };
+            SimpleNamedPipeBase& pipe;
+            std::atomic_int state{ WAITING };
+            std::coroutine_handle<> handle;
+            PipeMessage message;
+            std::exception_ptr error;
+
+            explicit ReceiveOperation(SimpleNamedPipeBase& pipe)
+                : pipe(pipe)
+            {
+                std::unique_lock<std::mutex> lock(pipe.receiveLock);
+                if (pipe.pendingReceive.load() != nullptr) {
+                    throw std::logic_error("receive is already pending");
+                }
+                pipe.awaitReceiving.store(true);
+                //受信待ちが無い間に届いたメッセージは受信順に渡す(次の接続までは切断後も渡す)
+                if (!pipe.unclaimedReceives.empty()) {
+                    message = std::move(pipe.unclaimedReceives.front());
+                    pipe.unclaimedReceives.pop_front();
+                    const auto remain = pipe.unclaimedCount.fetch_sub(1) - 1;
+                    state.store(READY);
+                    lock.unlock();
+                    //半分まで空いたら停止中の受信を再開させる
+                    if (pipe.readPaused.load() && remain <= DEFAULT_INBOX_SIZE / 2) {
+                        pipe.NotifyReadSpace();
+                    }
+                    pipe.ConsumeCredits(1);
+                    return;
+                }
+                if (!pipe.Valid()) {
+#ifdef _WIN32
+                    winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+#else
+                    ThrowErrno(EBADF);
+#endif
+                }
+                pipe.pendingReceive.store(this);
+            }
+        public:
+            ReceiveOperation(ReceiveOperation&&) = delete;
+            ReceiveOperation(const ReceiveOperation&) = delete;
+            ReceiveOperation& operator=(ReceiveOperation&&) = delete;
+            ReceiveOperation& operator=(const ReceiveOperation&) = delete;
+            ~ReceiveOperation()
+            {
+                std::lock_guard<std::mutex> lock(pipe.receiveLock);
+                ReceiveOperation* expected = this;
+                pipe.pendingReceive.compare_exchange_strong(expected, nullptr);
+            }
+
+            bool await_ready() const noexcept { return state.load() == READY; }
+            bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle = awaiting;
+                int expected = WAITING;
+                //既に受信済みであればサスペンドせずに続行する
+                return state.compare_exchange_strong(expected, SUSPENDED);
+            }
+            PipeMessage await_resume()
+            {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                return std::move(message);
+            }
+        };
+
+        /// <summary>
+        /// co_await 可能な送信処理
+        /// バッファーサイズ以下のメッセージは送信ループが処理中でなければサスペンドせずに呼び出し元のスレッドで送信する。
+        /// それ以外は送信キューに追加し、送信完了時に送信ループのスレッドでコルーチンを再開する。
+        /// 再開したコルーチンから同期送信(Write)を呼び出さないこと(送信ループ自身を待つため終了しない)。
+        /// </summary>
+        /// <param name="buffer">送信バッファー。送信完了まで維持すること。</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>待機オブジェクト。キャンセル時、エラー時は co_await で例外を送出する。</returns>
+        WriteOperation AwaitWrite(LPCVOID buffer, size_t size, CancellationToken ct)
+        {
+#ifdef _WIN32
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+#else
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+#endif
+            if (size > limitSize) {
+                throw std::length_error("size is too long");
+            }
+            return WriteOperation(*this, buffer, size, ct);
+        }
+
+        WriteOperation AwaitWrite(LPCVOID buffer, size_t size)
+        {
+            return AwaitWrite(buffer, size, CancellationToken::none());
+        }
+
+        /// <summary>
+        /// co_await 可能な受信処理
+        /// 次の受信メッセージを受け取る。待機中のコルーチンは監視タスクのスレッドで再開する。
+        /// 一度呼び出した後、その接続の受信メッセージは受信イベントに通知せず、受信待ちが無い間に届いたものは次のAwaitReceiveで受信順に渡す。
+        /// 保持するメッセージがDEFAULT_INBOX_SIZEに達すると受信を停止する。サーバーは次の接続を受け付けた時点で保持したメッセージを破棄する。
+        /// 受信待ちは同時に1つまで。
+        /// </summary>
+        /// <returns>待機オブジェクト。co_await で受信メッセージのハンドルを返す。切断時は例外を送出する。</returns>
+        ReceiveOperation AwaitReceive()
+        {
+            return ReceiveOperation(*this);
+        }
+#endif
+
+        /// <summary>
+        /// 複数メッセージの非同期一括送信
+        /// メッセージのパケットを連続して集約し、できるだけ少ない書き込み回数で送信する。
+        /// 受信側ではメッセージ毎に受信イベントとなる。
+        /// 送信完了まで各送信バッファーを維持すること(buffers配列自体は呼び出し後に破棄してよい)。
+        /// キャンセル時、キャンセル前に送信済みのメッセージは受信側に届く。
+        /// </summary>
+        /// <param name="buffers">送信バッファーの配列</param>
+        /// <param name="count">メッセージ数</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>全メッセージの送信完了を通知する非同期タスク</returns>
+        PipeTask WriteBatchAsync(const ConstBuffer* buffers, size_t count, CancellationToken ct)
+        {
+#ifdef _WIN32
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+#else
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+#endif
+            WriteRequest request{ Buffer(nullptr, 0), {}, ct, PipeTaskCompletion(), nullptr };
+            request.batch.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                if (buffers[i].size > limitSize) {
+                    throw std::length_error("size is too long");
+                }
+                request.batch.emplace_back(buffers[i].buffer, buffers[i].size);
+            }
+            return EnqueueWrite(std::move(request));
+        }
+
+        PipeTask WriteBatchAsync(const ConstBuffer* buffers, size_t count)
+        {
+            return WriteBatchAsync(buffers, count, CancellationToken::none());
+        }
+
+        PipeTask WriteBatchAsync(const std::vector<ConstBuffer>& buffers, CancellationToken ct)
+        {
+            return WriteBatchAsync(buffers.data(), buffers.size(), ct);
+        }
+
+        PipeTask WriteBatchAsync(const std::vector<ConstBuffer>& buffers)
+        {
+            return WriteBatchAsync(buffers.data(), buffers.size(), CancellationToken::none());
+        }
+
+        /// <summary>
+        /// 分割送信
+        /// 読み出し関数から断片サイズ(バッファーサイズ、EnableAdaptiveFragments時は適応的な断片サイズ)ずつ読み出したデータを1メッセージとして送信する。
+        /// メッセージ全体をメモリーに置かずに送信でき、送信側のメモリーは断片サイズ程度となる。
+        /// 読み出し関数は送信ループで呼び出すため、読み出し中は他の送信も待機する。多重化(EnableMultiplex)は適用しない。
+        /// 読み出し関数の例外、上限サイズの超過、キャンセル時は送信途中のメッセージを受信側で破棄させ、タスクはその例外で完了する。
+        /// </summary>
+        /// <param name="reader">読み出し関数。完了通知まで送信ループが保持する</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>非同期タスク</returns>
+        PipeTask WriteStreamAsync(ChunkReader reader, SendPriority priority, CancellationToken ct)
+        {
+#ifdef _WIN32
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+#else
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+#endif
+            if (!reader) {
+                throw std::invalid_argument("bad reader");
+            }
+            WriteRequest request{ Buffer(nullptr, 0), {}, ct, PipeTaskCompletion(), nullptr, false, priority };
+            request.source = std::move(reader);
+            return EnqueueWrite(std::move(request));
+        }
+
+        PipeTask WriteStreamAsync(ChunkReader reader, SendPriority priority)
+        {
+            return WriteStreamAsync(std::move(reader), priority, CancellationToken::none());
+        }
+
+        PipeTask WriteStreamAsync(ChunkReader reader, CancellationToken ct)
+        {
+            return WriteStreamAsync(std::move(reader), SendPriority::NORMAL, ct);
+        }
+
+        PipeTask WriteStreamAsync(ChunkReader reader)
+        {
+            return WriteStreamAsync(std::move(reader), SendPriority::NORMAL, CancellationToken::none());
+        }
+
+        /// <summary>
+        /// 受信メッセージプールを有効化
+        /// 以降の受信イベントではPipeEventParam::messageに参照カウント付きのハンドルを設定し、readBufferはその領域を指す。
+        /// ハンドルをコピーすればコールバック後もデータを参照できる。
+        /// </summary>
+        /// <param name="pool">受信メッセージプール。複数インスタンスで共有できる。</param>
+        void EnableMessagePool(std::shared_ptr<MessagePool> pool)
+        {
+            if (!pool) {
+                throw std::invalid_argument("bad message pool");
+            }
+            deserializer.SetMessagePool(std::move(pool));
+        }
+
+        void EnableMessagePool()
+        {
+            EnableMessagePool(MessagePool::Create(bufferSize, limitSize));
+        }
+
+        /// <summary>
+        /// 受信イベントをワーカースレッドプールで実行
+        /// 監視タスクは読み込みとメッセージの組み立てのみを行い、受信イベントは受信順に1つずつワーカースレッドで通知する。
+        /// 接続、切断イベントは監視タスクで通知し、切断イベントは振り分け済みの受信イベントが全て終わってから通知する。
+        /// 未処理の受信イベントが DISPATCH_QUEUE_SIZE に達すると、半分まで減るまで受信を停止する。受信箱の方が優先される。
+        /// </summary>
+        /// <param name="pool">ワーカースレッドプール。複数のパイプで共有できる。</param>
+        void EnableDispatcher(std::shared_ptr<Dispatcher> pool)
+        {
+            if (!pool) {
+                throw std::invalid_argument("bad dispatcher");
+            }
+            auto created = pool->CreateStrand([this](PipeMessage& message) { RunDispatched(message); });
+            Dispatcher::Strand* expected = nullptr;
+            if (!strand.compare_exchange_strong(expected, created.get())) {
+                throw std::logic_error("dispatcher is already enabled");
+            }
+            dispatcher = std::move(pool);
+            strandStorage = std::move(created);
+        }
+
+        /// <summary>
+        /// 振り分け済みで未処理の受信イベント数(実行中を含む)
+        /// </summary>
+        size_t DispatchDepth() const
+        {
+            auto s = strand.load();
+            return s != nullptr ? s->Depth() : 0;
+        }
+
+        /// <summary>
+        /// 送信の多重化を有効化
+        /// バッファーサイズを超えるメッセージはストリームIDを付けた断片に分割し、他の送信と交互に送信する。
+        /// 1パケットに収まるメッセージは大きなメッセージの送信中も断片の合間に直ちに送信するため、
+        /// 大きなメッセージより後に送信したメッセージが先に届くことがある。
+        /// 相手も本ライブラリの多重化に対応している必要がある(受信側の設定は不要)。
+        /// </summary>
+        void EnableMultiplex()
+        {
+            multiplex.store(true);
+        }
+
+        /// <summary>
+        /// 適応的な断片サイズを有効化
+        /// バッファーサイズ単位の分割に代えて、書き込みの実測スループットから1断片の書き込みがADAPTIVE_FRAGMENT_TARGET程度となる
+        /// サイズ(バッファーサイズ以上、上限以下)で分割する。上限以下のメッセージは分割しない。
+        /// 受信側はバッファーサイズを超えるパケットも結合して受信するため、相手側の設定は不要。
+        /// 多重化(EnableMultiplex)で送信する断片には適用しない。
+        /// </summary>
+        /// <param name="maxFragment">断片サイズの上限。コンストラクタのlimitSizeまたはMaxPacketDataSizeを超える場合はその小さい方</param>
+        void EnableAdaptiveFragments(size_t maxFragment = DEFAULT_MAX_FRAGMENT_SIZE)
+        {
+            if (maxFragment < bufferSize) {
+                throw std::invalid_argument("maxFragment must be greater than or equal to buffer size");
+            }
+            maxFragmentSize.store((std::min)({ maxFragment, limitSize, MaxPacketDataSize }));
+        }
+
+        /// <summary>
+        /// 分割受信を有効化
+        /// 以降の複数パケットのメッセージ(バッファーサイズを超えるメッセージ)は結合せずに、RECEIVED_BEGIN、パケット毎のRECEIVED_CHUNK、
+        /// RECEIVED_ENDの受信イベントで通知する。メッセージの大きさに関わらず、受信側のメモリーはバッファーサイズ程度となる。
+        /// 送信側のキャンセルで途中で終了したメッセージはRECEIVED_CANCELEDで通知する。切断時は終了の通知は無い。
+        /// 分割受信のイベントは監視タスクで呼び出し、振り分け(EnableDispatcher)、受信箱、AwaitReceiveを経由しない。
+        /// 1パケットに収まるメッセージ、多重化したメッセージは従来通りRECEIVEDで通知する。RPCとは併用できない。
+        /// </summary>
+        void EnableChunkedReceive()
+        {
+            if (rpc.load() != nullptr) {
+                throw std::logic_error("rpc is already enabled");
+            }
+            deserializer.SetChunked(true);
+        }
+
+        /// <summary>
+        /// 大きなメッセージの一時ファイルへの退避を有効化
+        /// 以降に受信する複数パケットのメッセージは、全体のサイズ(HeaderV2)か結合中のサイズがしきい値に達すると一時ファイルのマッピングで結合し、
+        /// 受信イベントのreadBufferはマッピングを指す。結合領域の再確保とコピーが無く、参照されないページはカーネルがメモリーから追い出せる。
+        /// 受信メッセージプール(EnableMessagePool)で結合するメッセージ、分割受信(EnableChunkedReceive)で通知するメッセージには適用しない。
+        /// 受信箱、振り分け、AwaitReceiveで受信するメッセージは受信後も参照できるようプールへコピーする。
+        /// </summary>
+        /// <param name="threshold">一時ファイルで結合するメッセージサイズのしきい値</param>
+        void EnableSpill(size_t threshold = DEFAULT_SPILL_THRESHOLD)
+        {
+            if (threshold == 0) {
+                throw std::invalid_argument("threshold must be greater than 0");
+            }
+            deserializer.SetSpillThreshold(threshold);
+        }
+
+        /// <summary>
+        /// メッセージ単位の流量制御を有効化
+        /// 相手へ送信枠(送信してよいメッセージ数)を付与し、受信イベントの完了またはプル型受信での取り出し毎に再付与する。
+        /// 送信枠を使い切った相手は付与まで送信ループで待機するため、パイプへの書き込みで止まらない。
+        /// 相手も本ライブラリの流量制御に対応している必要がある。
+        /// </summary>
+        /// <param name="window">付与する送信枠</param>
+        void EnableFlowControl(DWORD window)
+        {
+            if (window == 0) {
+                throw std::invalid_argument("bad window size");
+            }
+            flowWindow.store(window);
+            //接続済みであれば直ちに付与
+            GrantInitialCredits();
+        }
+
+        /// <summary>
+        /// 相手から付与された残りの送信枠
+        /// </summary>
+        /// <returns>相手が流量制御を有効にしていない場合はstd::nullopt</returns>
+        std::optional<size_t> SendWindow() const
+        {
+            if (!sendFlowActive.load()) {
+                return std::nullopt;
+            }
+            return sendCredits.load();
+        }
+
+        /// <summary>
+        /// プル型受信を有効化
+        /// 以降の受信メッセージは受信イベントに通知せずに受信箱へ追加し、TryReceive, ReceiveBatch, ReceiveAsyncで取り出す。
+        /// 受信箱が満杯になると受信を停止し、半分まで空くと再開する。受信停止中は送信側がパイプのバッファーで待機する。
+        /// 受信の停止中は切断を検知しない。
+        /// </summary>
+        /// <param name="capacity">受信箱の長さ(2のべき乗)</param>
+        void EnableInbox(size_t capacity = DEFAULT_INBOX_SIZE)
+        {
+            auto created = std::make_unique<Inbox>(capacity);
+            Inbox* expected = nullptr;
+            if (!inbox.compare_exchange_strong(expected, created.get())) {
+                throw std::logic_error("inbox is already enabled");
+            }
+            inboxStorage = std::move(created);
+        }
+
+        /// <summary>
+        /// 受信箱から受信メッセージを取り出す
+        /// 複数のスレッドから同時に呼び出せる。
+        /// </summary>
+        /// <returns>受信箱が空の場合は無効値</returns>
+        std::optional<PipeMessage> TryReceive()
+        {
+            auto& box = InboxOrThrow();
+            auto message = box.TryPop();
+            if (message) {
+                NotifyInboxSpace(box);
+                ConsumeCredits(1);
+            }
+            return message;
+        }
+
+        /// <summary>
+        /// 受信箱から受信メッセージをまとめて取り出す
+        /// </summary>
+        /// <param name="messages">取り出したメッセージの追加先</param>
+        /// <param name="maxCount">取り出す最大数</param>
+        /// <returns>取り出した数。受信箱が空の場合は0</returns>
+        size_t ReceiveBatch(std::vector<PipeMessage>& messages, size_t maxCount)
+        {
+            auto& box = InboxOrThrow();
+            auto count = box.PopBatch(messages, maxCount);
+            if (count != 0) {
+                NotifyInboxSpace(box);
+                ConsumeCredits(count);
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// 受信箱から受信メッセージを非同期に取り出す
+        /// 受信箱が空の場合は次の受信で完了する。切断時は待機中のタスクを例外で完了させる。
+        /// </summary>
+        /// <returns>受信メッセージの非同期タスク</returns>
+        PipeMessageTask ReceiveAsync()
+        {
+            auto& box = InboxOrThrow();
+            bool popped = false;
+            auto task = box.PopAsync(popped);
+            NotifyInboxSpace(box);
+            if (popped) {
+                ConsumeCredits(1);
+            }
+            return task;
+        }
+
+        //要求を受け取るRPCハンドラー
+        using RpcHandler = RpcTable::Handler;
+
+        /// <summary>
+        /// 要求と応答を呼び出しIDで照合するRPCを有効化
+        /// 以降の送受信メッセージは全てRPCの要求、応答となり、受信イベントには通知しない。
+        /// 応答を待たずに複数の呼び出しを送信でき、応答は要求の順序に関係なく照合する。
+        /// 相手もEnableRpcを呼び出している必要がある。
+        /// </summary>
+        /// <param name="handler">要求を処理するRPCハンドラー。監視タスク(EnableDispatcher時はワーカースレッド)で実行される</param>
+        /// <param name="maxPendingCalls">応答待ちにできる呼び出し数。超える場合はCallAsyncが空きを待機する</param>
+        void EnableRpc(RpcHandler handler, size_t maxPendingCalls = DEFAULT_RPC_PENDING_CALLS)
+        {
+            if (deserializer.Chunked()) {
+                throw std::logic_error("chunked receive is enabled");
+            }
+            auto created = std::make_unique<RpcTable>(std::move(handler), maxPendingCalls);
+            RpcTable* expected = nullptr;
+            if (!rpc.compare_exchange_strong(expected, created.get())) {
+                throw std::logic_error("rpc is already enabled");
+            }
+            rpcStorage = std::move(created);
+        }
+
+        /// <summary>
+        /// RPCの呼び出し
+        /// 引数は送信キューへ追加する前にコピーするので、呼び出し後に破棄してよい。
+        /// 相手のハンドラーが例外で終了した場合はRpcError、切断時は切断の例外でタスクが完了する。
+        /// </summary>
+        /// <param name="buffer">引数</param>
+        /// <param name="size">引数のサイズ</param>
+        /// <param name="ct">送信のキャンセルトークン。送信後はキャンセルしても応答を待つ</param>
+        /// <returns>応答の非同期タスク</returns>
+        RpcTask CallAsync(LPCVOID buffer, size_t size, CancellationToken ct)
+        {
+            auto& table = RpcOrThrow();
+#ifdef _WIN32
+            if (!handlePipe) {
+                //handleが無効
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            }
+#else
+            if (closed.load()) {
+                //handleが無効
+                ThrowErrno(EBADF);
+            }
+#endif
+            if (size > limitSize || limitSize - size < sizeof(RpcEnvelope)) {
+                throw std::length_error("size is too long");
+            }
+            RpcTask task;
+            auto& call = table.Add(buffer, size, task);
+            WriteRequest request{ Buffer(call.frame.data(), call.frame.size()), {}, ct, std::nullopt, &call };
+            PushWrite(request);
+            return task;
+        }
+
+        RpcTask CallAsync(LPCVOID buffer, size_t size)
+        {
+            return CallAsync(buffer, size, CancellationToken::none());
+        }
+
+        /// <summary>
+        /// RPCの応答を送信
+        /// RPCハンドラーの中でも、要求をコピーして別スレッドから後で呼び出してもよい。
+        /// 戻り値は送信キューへ追加する前にコピーするので、呼び出し後に破棄してよい。
+        /// </summary>
+        /// <param name="request">応答する要求</param>
+        /// <param name="buffer">戻り値</param>
+        /// <param name="size">戻り値のサイズ</param>
+        /// <returns>送信完了を通知する非同期タスク</returns>
+        PipeTask ReplyAsync(const RpcMessage& request, LPCVOID buffer, size_t size)
+        {
+            RpcOrThrow();
+            if (size > limitSize || limitSize - size < sizeof(RpcEnvelope)) {
+                throw std::length_error("size is too long");
+            }
+            return WriteRpcReply(request.Id(), RpcKind::RESPONSE, buffer, size);
+        }
+
+        /// <summary>
+        /// 応答待ちのRPCの呼び出し数
+        /// </summary>
+        size_t PendingCalls() const
+        {
+            auto table = rpc.load();
+            return table != nullptr ? table->Pending() : 0;
+        }
+
+        void Close()
+        {
+            auto s = strand.load();
+            closeRequested.store(true);
+#ifdef _WIN32
+            winrt::check_bool(SetEvent(closeEvent.get()));
+            if (watchThreadId != GetCurrentThreadId() && !(s != nullptr && s->RunningInThisThread())) {
+                //監視タスク、受信イベント実行中のワーカーと異なるスレッドであればタスク終了を待つ
+                watcherTask.wait();
+                //送信中の要求はハンドル破棄によりエラーとなるので、送信ループの終了を待つ
+                WaitWriteLoop();
+                //振り分け済みの受信イベントの終了を待つ
+                if (s != nullptr) {
+                    s->Wait();
+                }
+            }
+#else
+            SetEventFd(closeEvent.get());
+            if (watchThreadId.load() != std::this_thread::get_id() && !(s != nullptr && s->RunningInThisThread())) {
+                //監視タスク、受信イベント実行中のワーカーと異なるスレッドであればタスク終了を待つ
+                watcherTask.wait();
+                //送信中の要求はハンドル破棄によりエラーとなるので、送信ループの終了を待つ
+                WaitWriteLoop();
+                //振り分け済みの受信イベントの終了を待つ
+                if (s != nullptr) {
+                    s->Wait();
+                }
+            }
+#endif
+        }
+
+#ifdef _WIN32
+        bool Valid() const { return bool{ handlePipe }; }
+#else
+        bool Valid() const { return !closed.load(); }
+#endif
+
+#ifdef SNP_TEST_MODE
+        //テスト用の定義
+        std::function<void(void)> onWritePacket;
+#endif
+    };
+
+    //送信・受信の最大サイズ。ただし、実際はメモリー状況によるのでこの値を保証するものではない。
+    inline static constexpr size_t MAX_DATA_SIZE = (std::numeric_limits<DWORD>::max)() - static_cast<DWORD>(sizeof(SimpleNamedPipeBase::Header));
+    //64bit長の送受信上限サイズ。LIMITに指定するとMAX_DATA_SIZEを超えるメッセージを断片に分けて送受信する(32bit環境ではMAX_DATA_SIZEと同値)
+    inline static constexpr size_t MAX_DATA_SIZE64 = (std::numeric_limits<size_t>::max)() - sizeof(SimpleNamedPipeBase::Header);
+
+#ifdef _WIN32
+    /// <summary>
+    /// 名前付きパイプサーバークラス
+    /// </summary>
+    template<DWORD BUF_SIZE, size_t LIMIT=MAX_DATA_SIZE>
+    class SimpleNamedPipeServer : public SimpleNamedPipeBase
+    {
+        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+        static_assert(LIMIT <= MAX_DATA_SIZE64, "LIMIT must be less than or equal to MAX_DATA_SIZE64");
+    public:
+        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
+        using Callback = std::function<void(SimpleNamedPipeServer<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
+
+    private:
+        const winrt::hstring pipeName;
+        Callback callback;
+        std::unique_ptr<OVERLAPPED> connectionOverlap;
+        HANDLE connectionEvent;
+        HANDLE disconnectionEvent;
+        std::atomic_int connectedCount{0};
+
+        /// <summary>
+        /// 次回の接続待ち開始
+        /// </summary>
+        void BeginConnect()
+        {
+            ResetReceiver();
+            *connectionOverlap = { 0 };
+            connectionOverlap->hEvent = connectionEvent;
+            if (!ConnectNamedPipe(Handle(), connectionOverlap.get())) {
+                WrapReadState state{ GetLastError() };
+                if (state.LastErr() == ERROR_PIPE_CONNECTED) {
+                    //すでに接続済み
+                    winrt::check_bool(SetEvent(connectionEvent));
+                }
+                state.ThrowIfInvalid();
+            }
+        }
+
+    protected:
+        virtual bool OnFireEvent(HANDLE handle) override
+        {
+            winrt::check_bool(ResetEvent(handle));
+            bool connected = false;
+            if (handle == connectionEvent) {
+                //クライアント接続
+                connectedCount.fetch_add(1);
+                //前の接続のメッセージを次の接続の受信と混在させない
+                DiscardUnclaimed();
+                //送信枠の付与は接続イベントでの送信より前
+                BeginFlowControl();
+                //接続イベント
+                OnConnected();
+                // 非同期データ受信処理開始
+                auto state = OverappedRead();
+                connected = !state.IsDisconn();
+            }
+            else if (handle == disconnectionEvent) {
+                //切断処理実行イベント
+                connected = false;
+            }
+            if (!connected) {
+                //切断要求/検知したら切断
+                //終了した接続の後始末をして次回接続の待機
+                if (!NotifyDisconnected()) {
+                    //クローズ要求時
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        virtual void OnReceived(Buffer buffer) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size(), std::nullopt, 0, ReceivedMessage() });
+        }
+
+        virtual void OnReceivedChunk(PipeEventType type, LPCVOID data, size_t size) override
+        {
+            callback(*this, PipeEventParam{ type, data, size });
+        }
+
+        virtual bool OnDisconnected() override
+        {
+            int expceted = 0;
+            if (connectedCount.compare_exchange_weak(expceted, 0)) {
+                //すでに切断済み
+                return true;
+            }
+            connectedCount.fetch_sub(1);
+            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+            if (!Valid() || CloseRequested()) {
+                //ハンドルが破棄済み、または切断イベント中にCloseを要求済みであれば次の接続を待ち受けない
+                return false;
+            }
+            try {
+                //切断処理も行う
+                DisconnectInner();
+                //次回接続待ち開始
+                BeginConnect();
+            }
+            catch (winrt::hresult_error& ex) {
+                //INVALID_HANDLEの場合はすでにClose済みということなので例外とはしない
+                if ( static_cast<HRESULT>(ex.code().value) != HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE)) {
+                    throw;
+                }
+            }
+            //引き続きパイプの処理は続ける
+            return true;
+        }
+
+        virtual void OnClosed()
+        {
+            callback(*this, PipeEventParam{ PipeEventType::CLOSED, nullptr, 0 });
+        }
+
+        virtual void OnTrapException(concurrency::task<void> errTask) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
+        }
+
+        /// <summary>
+        /// 接続時処理
+        /// </summary>
+        virtual void OnConnected()
+        {
+            callback(*this, PipeEventParam{ PipeEventType::CONNECTED, nullptr, 0 });
+        }
+
+        /// <summary>
+        /// 接続中のClientを切断する
+        /// </summary>
+        void DisconnectInner()
+        {
+            FlushFileBuffers(Handle());
+            if (!DisconnectNamedPipe(Handle())) {
+                WrapReadState{ GetLastError() }.ThrowIfInvalid();
+            }
+        }
+
+    public:
+        SimpleNamedPipeServer() = delete;
+        SimpleNamedPipeServer(SimpleNamedPipeServer&&) = delete;
+        SimpleNamedPipeServer(const SimpleNamedPipeServer&) = delete;
+
+        SimpleNamedPipeServer& operator=(SimpleNamedPipeServer&&) = delete;
+        SimpleNamedPipeServer& operator=(const SimpleNamedPipeServer&) = delete;
+
+        /// <summary>
+        /// 名前付きパイプサーバーハンドルの生成
+        /// </summary>
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="psa">セキュリティディスクリプタ</param>
+        /// <returns>名前付きパイプハンドル</returns>
+        static HANDLE CreateServerHandle(LPCWSTR name, LPSECURITY_ATTRIBUTES psa)
+        {
+            // 接続可能クライアント数=1
+            return CreateServerHandle(name, psa, 1, true);
+        }
+
+        /// <summary>
+        /// 名前付きパイプサーバーハンドル(インスタンス)の生成
+        /// </summary>
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="psa">セキュリティディスクリプタ</param>
+        /// <param name="maxInstances">最大インスタンス数。同名のインスタンスは全て同じ値とすること。</param>
+        /// <param name="firstInstance">最初のインスタンスか。trueの場合は同名のパイプが既に存在するとエラー。</param>
+        /// <returns>名前付きパイプハンドル</returns>
+        static HANDLE CreateServerHandle(LPCWSTR name, LPSECURITY_ATTRIBUTES psa, DWORD maxInstances, bool firstInstance)
+        {
+            //名前付きパイプの作成
+            // ローカルマシン接続のみ許可
+            HANDLE handle = CreateNamedPipeW(
+                name,
+                PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (firstInstance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                PIPE_TYPE_BYTE | PIPE_REJECT_REMOTE_CLIENTS,
+                maxInstances,
+                BUF_SIZE,
+                BUF_SIZE,
+                0,
+                psa);
+
+            if (INVALID_HANDLE_VALUE == handle) {
+                winrt::throw_last_error();
+            }
+            return handle;
+        }
+
+        /// <summary>
+        /// コンストラクタ
+        /// </summary>
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="psa">セキュリティディスクリプタ</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeServer(LPCWSTR name, LPSECURITY_ATTRIBUTES psa, Callback callback)
+            : SimpleNamedPipeServer(name, psa, 1, true, callback)
+        {
+        }
+
+        /// <summary>
+        /// コンストラクタ（複数インスタンス用）
+        /// </summary>
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="psa">セキュリティディスクリプタ</param>
+        /// <param name="maxInstances">最大インスタンス数</param>
+        /// <param name="firstInstance">最初のインスタンスか</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeServer(LPCWSTR name, LPSECURITY_ATTRIBUTES psa, DWORD maxInstances, bool firstInstance, Callback callback)
+            : SimpleNamedPipeBase(CreateServerHandle(name, psa, maxInstances, firstInstance), BUF_SIZE, LIMIT, 2)
+            , pipeName(name)
+            , callback(callback)
+            , connectionEvent{ CustomEvents()[0].get() }
+            , disconnectionEvent{ CustomEvents()[1].get() }
+            , connectionOverlap{std::make_unique<OVERLAPPED>()}
+        {
+            if (!callback) {
+                throw std::invalid_argument("bad callback error");
+            }
+            *connectionOverlap = { 0 };
+            //接続待ち開始
+            BeginConnect();
+        }
+
+        virtual winrt::hstring PipeName() const { return pipeName; }
+
+        /// <summary>
+        /// クライアントを切断
+        /// </summary>
+        virtual void Disconnect()
+        {
+            int expceted = 0;
+            if (connectedCount.compare_exchange_weak(expceted, 0)) {
+                //すでに切断済み
+                return;
+            }
+            //切断イベントをシグナル
+            winrt::check_bool(SetEvent(disconnectionEvent));
+        }
+
+        virtual ~SimpleNamedPipeServer()
+        {
+            //監視タスク終了
+            try {
+                Close();
+            }
+            catch (...) {}
+        }
+    };
+
+    /// <summary>
+    /// 名前付きパイプクライアント
+    /// </summary>
+    template<DWORD BUF_SIZE, size_t LIMIT=MAX_DATA_SIZE>
+    class SimpleNamedPipeClient : public SimpleNamedPipeBase
+    {
+        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+        static_assert(LIMIT <= MAX_DATA_SIZE64, "LIMIT must be less than or equal to MAX_DATA_SIZE64");
+    public:
+        using Callback = std::function<void(SimpleNamedPipeClient<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
+        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
+    private:
+        const winrt::hstring pipeName;
+        const Callback callback;
+
+    protected:
+        virtual void OnReceived(Buffer buffer) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size(), std::nullopt, 0, ReceivedMessage() });
+        }
+
+        virtual void OnReceivedChunk(PipeEventType type, LPCVOID data, size_t size) override
+        {
+            callback(*this, PipeEventParam{ type, data, size });
+        }
+
+        virtual bool OnFireEvent(HANDLE) override { return true; }
+
+        virtual bool OnDisconnected() override
+        {
+            //切断時はパイプも閉じる
+            //切断イベントはOnClosedまで遅延
+            return false;
+        }
+
+        virtual void OnTrapException(concurrency::task<void> errTask)
+        {
+            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
+        }
+
+        virtual void OnClosed()
+        {
+            //クライアントはこの時点で切断イベントとする
+            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+        }
+
+    public:
+        SimpleNamedPipeClient() = delete;
+        SimpleNamedPipeClient(const SimpleNamedPipeClient&) = delete;
+        SimpleNamedPipeClient& operator=(const SimpleNamedPipeClient&) = delete;
+
+        SimpleNamedPipeClient(SimpleNamedPipeClient&&) = delete;
+        SimpleNamedPipeClient& operator=(SimpleNamedPipeClient&&) = delete;
+
+        /// <summary>
+        /// 名前付きパイプサーバーへの接続
+        /// </summary>
+        /// <param name="name">名称</param>
+        /// <returns>ハンドル</returns>
+        static HANDLE OpendPipeHandle(LPCWSTR name)
+        {
+            //接続可能状態まで待つ
+            winrt::check_bool(WaitNamedPipe(name, NMPWAIT_USE_DEFAULT_WAIT));
+            //サーバーへ接続
+            HANDLE handle = CreateFileW(
+                name,
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+                nullptr);
+
+            if(INVALID_HANDLE_VALUE == handle){
+                winrt::throw_last_error();
+            }
+            return handle;
+        }
+
+        /// <summary>
+        /// コンストラクタ
+        /// </summary>
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeClient(LPCWSTR name, Callback callback)
+            : SimpleNamedPipeBase(OpendPipeHandle(name), BUF_SIZE, LIMIT)
+            , pipeName(name)
+            , callback(callback)
+        {
+            if (!callback) {
+                throw std::invalid_argument("bad callback error");
+            }
+            BeginFlowControl();
+            //非同期受信処理開始
+            auto state = OverappedRead();
+            if (state.IsDisconn()) {
+                //接続後に即切断の場合
+                callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+                Close();
+            }
+        }
+
+        virtual winrt::hstring PipeName() const { return pipeName; }
+
+        virtual ~SimpleNamedPipeClient()
+        {
+            //監視タスク終了
+            try{
+                Close();
+            }
+            catch (...) {}
+        }
+    };
+
+#else
+    /// <summary>
+    /// 名前付きパイプサーバークラス（POSIX版: UNIXドメインソケット）
+    /// </summary>
+    template<DWORD BUF_SIZE, size_t LIMIT=MAX_DATA_SIZE>
+    class SimpleNamedPipeServer : public SimpleNamedPipeBase
+    {
+        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+        static_assert(LIMIT <= MAX_DATA_SIZE64, "LIMIT must be less than or equal to MAX_DATA_SIZE64");
+    public:
+        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
+        using Callback = std::function<void(SimpleNamedPipeServer<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
+
+    private:
+        const std::string pipeName;
+        Callback callback;
+        //待ち受けソケット。複数インスタンス時は共有する。
+        std::shared_ptr<ListenSocket> listener;
+        const int listenHandle;
+        //複数インスタンスの1つとして動作するか
+        const bool pooled;
+        //共有メモリー転送のリングバッファーサイズ。0の場合はソケット転送
+        const size_t sharedMemorySize;
+        int disconnectionEvent;
+        std::atomic_int connectedCount{0};
+
+        /// <summary>
+        /// 共有メモリーのリングバッファーサイズの検証
+        /// </summary>
+        static size_t ValidSharedMemorySize(size_t size)
+        {
+            if (size < BUF_SIZE + HeaderSize || (size & (size - 1)) != 0) {
+                throw std::invalid_argument("bad shared memory size error");
+            }
+            return size;
+        }
+
+        /// <summary>
+        /// 次回の接続待ち開始
+        /// </summary>
+        void BeginConnect()
+        {
+            ResetReceiver();
+            if (pooled) {
+                //接続中は待ち受けソケットを他のインスタンスに任せる
+                WatchHandle(listenHandle, true);
+            }
+        }
+
+        SimpleNamedPipeServer(std::shared_ptr<ListenSocket> listener, bool pooled, Callback callback, size_t sharedMemorySize)
+            : SimpleNamedPipeBase(UniqueFd{}, BUF_SIZE, LIMIT, 1)
+            , pipeName(listener->path)
+            , callback(callback)
+            , listener(std::move(listener))
+            , listenHandle(this->listener->handle.get())
+            , pooled(pooled)
+            , sharedMemorySize(sharedMemorySize)
+            , disconnectionEvent{ CustomEvents()[0].get() }
+        {
+            if (!callback) {
+                throw std::invalid_argument("bad callback error");
+            }
+            if (!pooled) {
+                //単一インスタンス時は接続中も待ち受けて、後続の接続は即座に切断する
+                WatchHandle(listenHandle);
+            }
+            //接続待ち開始
+            BeginConnect();
+        }
+
+    protected:
+        virtual bool OnFireEvent(int handle) override
+        {
+            bool connected = false;
+            if (handle == listenHandle) {
+                //クライアント接続
+                UniqueFd accepted{ ::accept4(handle, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC) };
+                if (!accepted) {
+                    //他のインスタンスが受け付けた場合や接続前に切断された場合などは無視
+                    WrapReadState{ static_cast<DWORD>(errno) }.ThrowIfInvalid();
+                    return true;
+                }
+                if (connectedCount.load() > 0) {
+                    //接続可能クライアント数=1; 接続済みの場合は即座に切断する
+                    return true;
+                }
+                if (pooled) {
+                    UnwatchHandle(listenHandle);
+                }
+                AttachSocket(std::move(accepted));
+                if (sharedMemorySize > 0) {
+                    //受信開始前に共有メモリーを渡す
+                    OfferSharedMemory(sharedMemorySize);
+                }
+                connectedCount.fetch_add(1);
+                //前の接続のメッセージを次の接続の受信と混在させない
+                DiscardUnclaimed();
+                //送信枠の付与は接続イベントでの送信より前
+                BeginFlowControl();
+                //接続イベント
+                OnConnected();
+                // 非同期データ受信処理開始
+                auto state = OverappedRead();
+                connected = !state.IsDisconn();
+            }
+            else if (handle == disconnectionEvent) {
+                //切断処理実行イベント
+                ResetEventFd(handle);
+                connected = false;
+            }
+            if (!connected) {
+                //切断要求/検知したら切断
+                //終了した接続の後始末をして次回接続の待機
+                if (!NotifyDisconnected()) {
+                    //クローズ要求時
+                    return false;
                 }
             }
             return true;
         }
 
-        //監視タスクのスレッドID
-        DWORD watchThreadId{ 0 };
+        virtual void OnReceived(Buffer buffer) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size(), std::nullopt, 0, ReceivedMessage() });
+        }
 
-        /// <summary>
-        /// イベント監視タスク
-        /// </summary>
-        /// <returns>非同期タスク</returns>
-        concurrency::task<void> WatchAsync()
+        virtual void OnReceivedChunk(PipeEventType type, LPCVOID data, size_t size) override
         {
-            //タスクを実行
-            return concurrency::create_task([this](){
-                //再入チェックのためにスレッドIDを保存
-                watchThreadId = GetCurrentThreadId();
-                //既知のイベント登録 Close要求イベント, 非同期I/Oの読み込み完了イベント
-                std::vector<HANDLE> handles {closeEvent.get(), readEvent.get()};
-                //派生クラスで利用するイベントを追加
-                std::vector<HANDLE> customEventHandels;
-                std::transform(customEvents.begin(), customEvents.end(), std::back_inserter(customEventHandels), [](const auto& e) {return e.get(); });
-                handles.insert(handles.end(), customEventHandels.begin(), customEventHandels.end());
+            callback(*this, PipeEventParam{ type, data, size });
+        }
 
-                Defer defer([this]() {
-                    //関数から抜ける前に必ず実行する
-                    ClosePipeHandle();
-                    //終了時のイベント通知の例外は無視する
-                    try{ OnDisconnected(); }
-                    catch (...) {}
-                    try { OnClosed(); }
-                    catch (...) {}
-                });
-                while (true) {
-                    //接続、受信イベントを監視
-                    auto res = WaitForMultipleObjects(static_cast<DWORD>(handles.size()), &handles[0], false, INFINITE);
-                    if (res == WAIT_FAILED) {
-                        //エラー
-                        winrt::throw_last_error();
-                    }
-                    if (!Valid()) {
-                        //ハンドルが破棄されていたら終了
-                        break;
-                    }
-                    auto index = res - WAIT_OBJECT_0;
-                    if (index < handles.size()) {
-                        auto signaled = handles[index];
-                        if (closeEvent.get() == signaled) {
-                            //Close要求イベント
-                            break;
-                        }
-                        else if (readEvent.get() == signaled) {
-                            //受信イベント
-                            winrt::check_bool(ResetEvent(signaled));
-                            auto state = OnSignalRead();
-                            if(state.IsDisconn()){
-                                if (!OnDisconnected()) {
-                                    //クローズ要求時
-                                    break;
-                                }
-                            }
-                        } else {
-                            //継承先のイベントハンドラを呼び出し
-                            if (!OnFireEvent(signaled)) {
-                                //クローズ要求時
-                                break;
-                            }
-                        }
-                    }
-                    else {
-                        //いずれかのハンドルが破棄されたのならインスタンスが破棄されている
-                        break;
-                    }
-                }
-            });
+        virtual bool OnDisconnected() override
+        {
+            int expceted = 0;
+            if (connectedCount.compare_exchange_weak(expceted, 0)) {
+                //すでに切断済み
+                return true;
+            }
+            connectedCount.fetch_sub(1);
+            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+            if (!Valid() || CloseRequested()) {
+                //ハンドルが破棄済み、または切断イベント中にCloseを要求済みであれば次の接続を待ち受けない
+                return false;
+            }
+            //切断処理も行う
+            DisconnectInner();
+            //次回接続待ち開始
+            BeginConnect();
+            //引き続きパイプの処理は続ける
+            return true;
         }
 
-        void OnReceivedPacket(const Packet* packet)
+        virtual void OnClosed() override
         {
-            //受信したパケットをデシリアライズ処理
-            deserializer.Feed(packet);
+            //最後のインスタンスであればソケットファイルも削除される
+            listener.reset();
+            callback(*this, PipeEventParam{ PipeEventType::CLOSED, nullptr, 0 });
+        }
+
+        virtual void OnTrapException(PipeTask errTask) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
         }
 
         /// <summary>
-        /// パイプハンドルを閉じる
+        /// 接続時処理
         /// </summary>
-         void ClosePipeHandle() noexcept
+        virtual void OnConnected()
         {
-            if (handlePipe) {
-                FlushFileBuffers(handlePipe.get());
-                handlePipe.close();
-            }
+            callback(*this, PipeEventParam{ PipeEventType::CONNECTED, nullptr, 0 });
         }
-    protected:
+
         /// <summary>
-        /// 名前付きパイプのGetLastError値のラッパークラス
+        /// 接続中のClientを切断する
         /// </summary>
-        class WrapReadState
+        void DisconnectInner()
         {
-        private:
-            DWORD lastErr;
-        public:
-            static constexpr DWORD SUCCESSES[]
-            { ERROR_SUCCESS, ERROR_PIPE_LISTENING, ERROR_IO_INCOMPLETE ,ERROR_IO_PENDING , ERROR_PIPE_CONNECTED,ERROR_OPERATION_ABORTED };
-            static constexpr DWORD DISCONNECT[]
-            { ERROR_PIPE_NOT_CONNECTED, ERROR_PIPE_LISTENING, ERROR_NO_DATA, ERROR_BROKEN_PIPE };
+            CloseSocket();
+        }
 
-            WrapReadState() = delete;
-            inline WrapReadState(DWORD lastErr) : lastErr(lastErr) {}
-            inline const DWORD LastErr() const noexcept { return lastErr; }
+    public:
+        SimpleNamedPipeServer() = delete;
+        SimpleNamedPipeServer(SimpleNamedPipeServer&&) = delete;
+        SimpleNamedPipeServer(const SimpleNamedPipeServer&) = delete;
 
-            /// <summary>
-            /// エラー値であったらwinrt::hresult_error例外を送出
-            /// </summary>
-            inline void ThrowIfInvalid() {
-                if (IsInvalid()) {
-                    winrt::throw_hresult(HRESULT_FROM_WIN32(lastErr));
-                }
-            }
-            inline bool IsSuccess() const noexcept { return std::find(std::begin(SUCCESSES), std::end(SUCCESSES), lastErr) != std::end(SUCCESSES); }
-            inline bool IsDisconn() const noexcept { return std::find(std::begin(DISCONNECT), std::end(DISCONNECT), lastErr) != std::end(DISCONNECT); }
-            inline bool IsInvalid() const noexcept { return !IsSuccess() && !IsDisconn(); }
-        };
+        SimpleNamedPipeServer& operator=(SimpleNamedPipeServer&&) = delete;
+        SimpleNamedPipeServer& operator=(const SimpleNamedPipeServer&) = delete;
 
         /// <summary>
-        /// コンストラクタ
+        /// 待ち受けソケットの生成
         /// </summary>
-        /// <param name="handle">パイプハンドル</param>
-        /// <param name="bufferSize">送信・受信バッファーサイズ</param>
-        /// <param name="limitSize">送信・受信上限サイズ</param>
-        /// <param name="costomEventCount">継承先のOnFireEvent呼び出し対象のイベント作成数。作成したイベントハンドルはCustomEventsで取得する。</param>
-        SimpleNamedPipeBase(HANDLE handle, DWORD bufferSize, DWORD limitSize, size_t costomEventCount = 0)
-            : handlePipe(handle)
-            , bufferSize(bufferSize)
-            , limitSize(limitSize)
-            , readOverlap(std::make_unique<OVERLAPPED>())
-            , readBuffer(std::make_unique<BYTE[]>(bufferSize))
-            , receiver(bufferSize, limitSize, std::bind(&SimpleNamedPipeBase::OnReceivedPacket, this, std::placeholders::_1))
-            , deserializer(bufferSize, limitSize, std::bind(&SimpleNamedPipeBase::OnReceived, this, std::placeholders::_1))
+        /// <param name="name">ソケットファイルのパス。先頭が'@'の場合は抽象名前空間。</param>
+        /// <param name="psa">ソケットファイルのアクセス権。nullptr時はumaskに従う。</param>
+        /// <returns>待ち受けソケット</returns>
+        static std::shared_ptr<ListenSocket> CreateServerHandle(const char* name, LPSOCKET_SECURITY_ATTRIBUTES psa)
         {
-            if( bufferSize < MIN_BUFFER_SIZE) {
-                throw std::invalid_argument("BUF_SIZE is too short");
-            }
-            if (!handle) {
-                throw std::invalid_argument("handle is invalid");
+            sockaddr_un addr;
+            auto addrLength = MakeSocketAddress(name, addr);
+            UniqueFd handle{ ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) };
+            CheckErrno(bool{ handle });
+            if (::bind(handle.get(), reinterpret_cast<const sockaddr*>(&addr), addrLength) != 0) {
+                auto err = errno;
+                if (err != EADDRINUSE || name[0] == '@') {
+                    //同名のパイプが既に存在する場合はEADDRINUSE
+                    ThrowErrno(err);
+                }
+                //ソケットファイルが残っているだけなら削除して再試行
+                UniqueFd probe{ ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+                CheckErrno(bool{ probe });
+                if (::connect(probe.get(), reinterpret_cast<const sockaddr*>(&addr), addrLength) == 0 || errno != ECONNREFUSED) {
+                    ThrowErrno(EADDRINUSE);
+                }
+                ::unlink(name);
+                CheckErrno(::bind(handle.get(), reinterpret_cast<const sockaddr*>(&addr), addrLength) == 0);
             }
-
-            //受信イベント
-            *readOverlap = { 0 };
-            readEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
-            winrt::check_bool(bool{ readEvent });
-            readOverlap->hEvent = readEvent.get();
-
-            //Close要求イベント
-            closeEvent = winrt::handle{ CreateEventW(nullptr, true, false, nullptr) };
-            winrt::check_bool(bool{ closeEvent });
-
-            //引数で指定された継承クラス用のカスタムイベント
-            for (size_t i = 0; i < costomEventCount; ++i) {
-                winrt::handle h({ CreateEventW(nullptr, true , false, nullptr) });
-                winrt::check_bool(bool{ h });
-                customEvents.emplace_back(std::move(h));
+            auto listener = std::make_shared<ListenSocket>(std::move(handle), name);
+            if (psa != nullptr && name[0] != '@') {
+                CheckErrno(::chmod(name, psa->mode) == 0);
             }
+            CheckErrno(::listen(listener->handle.get(), SOMAXCONN) == 0);
+            return listener;
+        }
 
-            //監視タスク開始
-            watcherTask = WatchAsync().then([this](concurrency::task<void> prevTask) {
-                try {
-                    prevTask.wait();
-                }
-                catch (...)
-                {
-                    //監視タスクが例外発生で終了していた場合
-                    OnTrapException(prevTask);
-                }
-            });
+        /// <summary>
+        /// コンストラクタ
+        /// </summary>
+        /// <param name="name">ソケットファイルのパス。先頭が'@'の場合は抽象名前空間。</param>
+        /// <param name="psa">ソケットファイルのアクセス権</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeServer(const char* name, LPSOCKET_SECURITY_ATTRIBUTES psa, Callback callback)
+            : SimpleNamedPipeServer(CreateServerHandle(name, psa), false, callback, 0)
+        {
         }
 
         /// <summary>
-        /// パイプハンドル
+        /// コンストラクタ（複数インスタンス用）
         /// </summary>
-        /// <returns>パイプハンドル</returns>
-        const HANDLE Handle() const { return handlePipe.get(); }
+        /// <param name="listener">インスタンス間で共有する待ち受けソケット</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeServer(std::shared_ptr<ListenSocket> listener, Callback callback)
+            : SimpleNamedPipeServer(std::move(listener), true, callback, 0)
+        {
+        }
 
         /// <summary>
-        /// 継承クラスで指定したカスタムイベントのリスト
+        /// コンストラクタ（共有メモリー転送用）
+        /// 接続時に送信方向毎のリングバッファーを配置した共有メモリーをクライアントへ渡し、以降のデータは共有メモリー上で受け渡す。
+        /// クライアントは共有メモリー転送用のコンストラクタで接続すること。
         /// </summary>
-        /// <returns>継承クラスで指定したカスタムイベントのリスト</returns>
-        const std::vector<winrt::handle>& CustomEvents() const { return customEvents; }
+        /// <param name="name">ソケットファイルのパス。先頭が'@'の場合は抽象名前空間。</param>
+        /// <param name="psa">ソケットファイルのアクセス権</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        /// <param name="sharedMemorySize">方向毎のリングバッファーサイズ。2のべき乗かつBUF_SIZE+HeaderSize以上。</param>
+        SimpleNamedPipeServer(const char* name, LPSOCKET_SECURITY_ATTRIBUTES psa, Callback callback, size_t sharedMemorySize)
+            : SimpleNamedPipeServer(CreateServerHandle(name, psa), false, callback, ValidSharedMemorySize(sharedMemorySize))
+        {
+        }
+
+        virtual std::string PipeName() const { return pipeName; }
 
         /// <summary>
-        /// レシーバーを初期化
+        /// クライアントを切断
         /// </summary>
-        void ResetReceiver() {
-            receiver.Reset();
-            deserializer.Reset();
+        virtual void Disconnect()
+        {
+            int expceted = 0;
+            if (connectedCount.compare_exchange_weak(expceted, 0)) {
+                //すでに切断済み
+                return;
+            }
+            //切断イベントをシグナル
+            SetEventFd(disconnectionEvent);
+        }
+
+        virtual ~SimpleNamedPipeServer()
+        {
+            //監視タスク終了
+            try {
+                Close();
+            }
+            catch (...) {}
+        }
+    };
+
+    /// <summary>
+    /// 名前付きパイプクライアント（POSIX版: UNIXドメインソケット）
+    /// </summary>
+    template<DWORD BUF_SIZE, size_t LIMIT=MAX_DATA_SIZE>
+    class SimpleNamedPipeClient : public SimpleNamedPipeBase
+    {
+        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
+        static_assert(LIMIT <= MAX_DATA_SIZE64, "LIMIT must be less than or equal to MAX_DATA_SIZE64");
+    public:
+        using Callback = std::function<void(SimpleNamedPipeClient<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
+        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
+    private:
+        const std::string pipeName;
+        const Callback callback;
+
+    protected:
+        virtual void OnReceived(Buffer buffer) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size(), std::nullopt, 0, ReceivedMessage() });
+        }
+
+        virtual void OnReceivedChunk(PipeEventType type, LPCVOID data, size_t size) override
+        {
+            callback(*this, PipeEventParam{ type, data, size });
+        }
+
+        virtual bool OnFireEvent(int) override { return true; }
+
+        virtual bool OnDisconnected() override
+        {
+            //切断時はパイプも閉じる
+            //切断イベントはOnClosedまで遅延
+            return false;
+        }
+
+        virtual void OnTrapException(PipeTask errTask) override
+        {
+            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
         }
 
-        /// 受信イベント
-        /// </summary>
-        /// <param name="buffer">受信データ</param>
-        virtual void OnReceived(Buffer buffer) = 0;
+        virtual void OnClosed() override
+        {
+            //クライアントはこの時点で切断イベントとする
+            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+        }
+
+    public:
+        SimpleNamedPipeClient() = delete;
+        SimpleNamedPipeClient(const SimpleNamedPipeClient&) = delete;
+        SimpleNamedPipeClient& operator=(const SimpleNamedPipeClient&) = delete;
+
+        SimpleNamedPipeClient(SimpleNamedPipeClient&&) = delete;
+        SimpleNamedPipeClient& operator=(SimpleNamedPipeClient&&) = delete;
 
         /// <summary>
-        /// 切断イベント
+        /// サーバーへの接続
         /// </summary>
-        /// <returns>false:時はハンドルを閉じて以降は利用不可能とする。</returns>
-        virtual bool OnDisconnected() = 0;
+        /// <param name="name">ソケットファイルのパス。先頭が'@'の場合は抽象名前空間。</param>
+        /// <returns>接続済みソケット</returns>
+        static UniqueFd OpendPipeHandle(const char* name)
+        {
+            sockaddr_un addr;
+            auto addrLength = MakeSocketAddress(name, addr);
+            UniqueFd handle{ ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+            CheckErrno(bool{ handle });
+            //サーバーへ接続 存在しない場合はENOENT(抽象名前空間ではECONNREFUSED)
+            CheckErrno(::connect(handle.get(), reinterpret_cast<const sockaddr*>(&addr), addrLength) == 0);
+            //接続後はノンブロッキングで扱う
+            auto flags = ::fcntl(handle.get(), F_GETFL);
+            CheckErrno(flags >= 0 && ::fcntl(handle.get(), F_SETFL, flags | O_NONBLOCK) == 0);
+            return handle;
+        }
 
         /// <summary>
-        /// 監視タスクでの捕捉例外通知
+        /// コンストラクタ
         /// </summary>
-        /// <param name="errTask">エラーが発生したタスクオブジェクト</param>
-        virtual void OnTrapException(concurrency::task<void> errTask) = 0;
+        /// <param name="name">ソケットファイルのパス</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        SimpleNamedPipeClient(const char* name, Callback callback)
+            : SimpleNamedPipeClient(name, callback, false)
+        {
+        }
 
         /// <summary>
-        /// 継承クラスで設定したイベント発生通知
+        /// コンストラクタ
+        /// 共有メモリー転送時は共有メモリー転送用のコンストラクタで生成したサーバーに接続すること。
         /// </summary>
-        /// <param name="handle">イベントハンドル</param>
-        /// <returns>false:時はハンドルを閉じて以降は利用不可能とする。</returns>
-        virtual bool OnFireEvent(HANDLE handle) = 0;
+        /// <param name="name">ソケットファイルのパス</param>
+        /// <param name="callback">イベント通知コールバック</param>
+        /// <param name="sharedMemory">サーバーから共有メモリーを受け取り、共有メモリー転送を行う場合はtrue</param>
+        SimpleNamedPipeClient(const char* name, Callback callback, bool sharedMemory)
+            : SimpleNamedPipeBase(OpendPipeHandle(name), BUF_SIZE, LIMIT)
+            , pipeName(name)
+            , callback(callback)
+        {
+            if (!callback) {
+                throw std::invalid_argument("bad callback error");
+            }
+            if (sharedMemory) {
+                bool accepted = false;
+                try {
+                    accepted = AcceptSharedMemory();
+                }
+                catch (...) {
+                    //監視タスクを終了してから例外を送出する
+                    Close();
+                    throw;
+                }
+                if (!accepted) {
+                    //共有メモリーを受け取る前に切断(接続済みクライアントがいるなど)
+                    callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+                    Close();
+                    return;
+                }
+            }
+            BeginFlowControl();
+            //非同期受信処理開始
+            auto state = OverappedRead();
+            if (state.IsDisconn()) {
+                //接続後に即切断の場合
+                callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+                Close();
+            }
+        }
 
-        /// <summary>
-        /// Close後のイベント
-        /// </summary>
-        virtual void OnClosed() = 0;
+        virtual std::string PipeName() const { return pipeName; }
 
-        /// <summary>
-        /// 非同期受信完了時の処理
-        /// </summary>
-        /// <returns>パイプデータ読み込みステータス</returns>
-        virtual WrapReadState OnRead()
+        virtual ~SimpleNamedPipeClient()
         {
-            DWORD readSize = 0;
-            if (!GetOverlappedResult(handlePipe.get(), readOverlap.get(), &readSize, FALSE)) {
-                auto state = WrapReadState{ GetLastError() };
-                state.ThrowIfInvalid();
-                return state;
+            //監視タスク終了
+            try{
+                Close();
             }
-            //データ受信
-            receiver.Feed(readBuffer.get(), readSize);
-            return WrapReadState{ ERROR_SUCCESS };
+            catch (...) {}
         }
+    };
+#endif
+
+    using TypicalSimpleNamedPipeServer = SimpleNamedPipeServer<TYPICAL_BUFFER_SIZE>;
+    using TypicalSimpleNamedPipeClient = SimpleNamedPipeClient<TYPICAL_BUFFER_SIZE>;
+
+    /// <summary>
+    /// 複数クライアント同時接続対応の名前付きパイプサーバークラス
+    /// 待ち受け中のインスタンスをプールしておき、接続したクライアント毎に1つのインスタンス(セッション)を割り当てる。
+    /// セッションは個別に受信処理と送信ロックを持つため、クライアント間で処理が干渉しない。
+    /// </summary>
+    template<DWORD BUF_SIZE, size_t LIMIT=MAX_DATA_SIZE>
+    class SimpleNamedPipeMultiServer
+    {
+    public:
+        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
+        //最大インスタンス数の既定値
+#ifdef _WIN32
+        inline static constexpr DWORD UNLIMITED_INSTANCES = PIPE_UNLIMITED_INSTANCES;
+#else
+        inline static constexpr DWORD UNLIMITED_INSTANCES = 255;
+#endif
+        //待ち受けインスタンス数の既定値
+        inline static constexpr DWORD DEFAULT_POOL_SIZE = 4;
+
+        //セッション。コールバックの第1引数で接続中のクライアントに送信できる。
+        using Session = SimpleNamedPipeServer<BUF_SIZE, LIMIT>;
+        using Callback = std::function<void(Session&, const PipeEventParam&)>;
+
+    private:
+        struct Instance {
+            std::unique_ptr<Session> pipe;
+            //接続中のセッションID。未接続時は0
+            std::atomic<size_t> sessionId{ 0 };
+            //セッションIDの切り替えとセッションIDを指定した操作を排他
+            std::mutex sessionLock;
+            //待ち受け数の超過で閉じたインスタンス。次のインスタンスの追加時に破棄する
+            std::atomic_bool retired{ false };
+        };
+
+#ifdef _WIN32
+        const winrt::hstring pipeName;
+        const LPSECURITY_ATTRIBUTES psa;
+#else
+        std::shared_ptr<ListenSocket> listener;
+#endif
+        const Callback callback;
+        const DWORD poolSize;
+        const DWORD maxInstances;
+        std::mutex instancesLock;
+        //セッションIDを指定した操作が参照中でも破棄しないようshared_ptrで保持
+        std::vector<std::shared_ptr<Instance>> instances;
+        std::atomic<size_t> lastSessionId{ 0 };
+        std::atomic<DWORD> listeningCount{ 0 };
+        std::atomic_bool closing{ false };
+        //全セッションで共有する受信メッセージプール(instancesLockで保護)
+        std::shared_ptr<MessagePool> messagePool;
+        //全セッションで共有する受信イベントのワーカースレッドプール(instancesLockで保護)
+        std::shared_ptr<Dispatcher> dispatcher;
+        //全セッションで送信を多重化(instancesLockで保護)
+        bool multiplex{ false };
+        //全セッションの適応的な断片サイズの上限。0は無効(instancesLockで保護)
+        size_t maxFragmentSize{ 0 };
+        //全セッションで分割受信(instancesLockで保護)
+        bool chunkedReceive{ false };
+        //全セッションの一時ファイルへ退避するしきい値。0は無効(instancesLockで保護)
+        size_t spillThreshold{ 0 };
+        //全セッションのRPCハンドラーと応答待ちにできる呼び出し数。0はRPC無効(instancesLockで保護)
+        SimpleNamedPipeBase::RpcHandler rpcHandler;
+        size_t rpcPendingCalls{ 0 };
+        //全セッションで遅延計測(instancesLockで保護)
+        bool tracing{ false };
 
         /// <summary>
-        /// 非同期受信開始
+        /// 待ち受け数の超過で閉じたインスタンスを破棄
+        /// 監視タスクの終了を待つため、閉じたインスタンスの監視タスクから呼び出さないこと。
         /// </summary>
-        /// <returns>パイプデータ読み込みステータス</returns>
-        virtual WrapReadState OverappedRead()
+        void RemoveRetired()
         {
-            //受信イベントリセット
-            readOverlap->Offset = 0;
-            readOverlap->OffsetHigh = 0;
-            //受信処理
-            // 同期的の受信できる限りは受信処理を継続
-            while (ReadFile(handlePipe.get(), readBuffer.get(), bufferSize, nullptr, readOverlap.get())) {
-                auto state = OnRead();
-                if(state.IsDisconn()) {
-                    //切断状態となった
-                    return state;
+            std::vector<std::shared_ptr<Instance>> retired;
+            {
+                std::lock_guard<std::mutex> lock(instancesLock);
+                if (closing.load()) {
+                    //Closeが全インスタンスを閉じる
+                    return;
                 }
-                readOverlap->Offset = 0;
-                readOverlap->OffsetHigh = 0;
+                auto it = std::stable_partition(instances.begin(), instances.end(), [](const auto& i) { return !i->retired.load(); });
+                std::move(it, instances.end(), std::back_inserter(retired));
+                instances.erase(it, instances.end());
+            }
+            for (const auto& i : retired) {
+                //インスタンス自体はセッションIDを指定した操作が参照中であれば手放すまで残る(セッションIDは0のため操作しない)
+                i->pipe.reset();
             }
-            //同期的に受信データを取得できないかエラーの場合
-            auto state = WrapReadState{ GetLastError() };
-            state.ThrowIfInvalid();
-            return state;
         }
 
         /// <summary>
-        /// 受信イベントシグナル時の処理
+        /// 待ち受け数をプールサイズまでの範囲で1つ予約
         /// </summary>
-        /// <returns>false時は切断状態</returns>
-        virtual WrapReadState OnSignalRead()
+        /// <returns>プールサイズに達している場合はfalse</returns>
+        bool ReserveListening() noexcept
         {
-            //非同期受信完了時処理実行
-            auto state = OnRead();
-            if (!state.IsDisconn()) {
-                //切断していなければ、次回分の非同期受信処理を実行
-                state = OverappedRead();
+            auto listening = listeningCount.load();
+            while (listening < poolSize && !listeningCount.compare_exchange_weak(listening, listening + 1)) {
             }
-            return state;
+            return listening < poolSize;
         }
 
-    public:
         /// <summary>
-        /// 非同期送信処理
+        /// 待ち受けインスタンスを追加
+        /// 待ち受け数は呼び出し元がReserveListeningで予約しておき、追加できない場合は予約を戻す。
         /// </summary>
-        /// <param name="buffer">送信バッファー</param>
-        /// <param name="size">送信サイズ</param>
-        /// <param name="ct">キャンセルトークン</param>
-        /// <returns>非同期タスク</returns>
-        virtual concurrency::task<void> WriteAsync(LPCVOID buffer, size_t size, concurrency::cancellation_token ct)
+        /// <returns>最大インスタンス数に達している場合やClose済みの場合はfalse</returns>
+        bool AddInstance()
         {
-            if (!handlePipe) {
-                //handleが無効
-                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE));
+            //閉じたインスタンスは最大インスタンス数に含めない
+            RemoveRetired();
+            bool first = false;
+            {
+                std::lock_guard<std::mutex> lock(instancesLock);
+                if (closing.load() || instances.size() >= maxInstances) {
+                    listeningCount.fetch_sub(1);
+                    return false;
+                }
+                first = instances.empty();
             }
-            if (size > limitSize) {
-                throw std::length_error("size is too long");
+            auto instance = std::make_shared<Instance>();
+            auto forward = [this, p = instance.get()](Session& ps, const PipeEventParam& param) {
+                OnInstanceEvent(*p, ps, param);
+            };
+            try {
+#ifdef _WIN32
+                instance->pipe = std::make_unique<Session>(pipeName.c_str(), psa, maxInstances, first, forward);
+#else
+                (void)first;
+                instance->pipe = std::make_unique<Session>(listener, forward);
+#endif
             }
-            //非同期時の送信完了待機のタスク
-            return concurrency::create_task([this, buffer, size, ct]() {
-                //書き込み出来るのは同時に１つのみ
-                concurrency::critical_section::scoped_lock lock(writeCs);
-                std::atomic_bool cancelFlag{false};
-                concurrency::cancellation_token_registration cookie;
-                if (ct.is_cancelable()) {
-                    //キャンセル可能な場合のイベントディスパッチ処理
-                    cookie = ct.register_callback([&cancelFlag, ct, &cookie]() {
-                        cancelFlag.store(true);
-                        try {
-                            ct.deregister_callback(cookie);
-                        }
-                        catch (...) {}
-                    });
-                }
-                Defer cancelDefer([&]() {
-                    if (ct.is_cancelable()) {
-                        try {
-                            ct.deregister_callback(cookie);
-                        }
-                        catch (...) {}
-                    }
-                });
-                //バッファーサイズ単位に分割して送信
-                Serializer serialier(Buffer(buffer, size), bufferSize);
-                winrt::handle dummyEvent{CreateEventW(nullptr, true, false, nullptr)};
-                while(!cancelFlag.load()){
-                    auto [packetData, header] = serialier.Next();
-                    if (packetData.Empty()) {
-                        //完了
+            catch (...) {
+                listeningCount.fetch_sub(1);
+                throw;
+            }
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (closing.load()) {
+                //構築中にCloseされた場合は破棄する(デストラクタでClose)
+                return false;
+            }
+            if (messagePool) {
+                instance->pipe->EnableMessagePool(messagePool);
+            }
+            if (dispatcher) {
+                instance->pipe->EnableDispatcher(dispatcher);
+            }
+            if (multiplex) {
+                instance->pipe->EnableMultiplex();
+            }
+            if (maxFragmentSize != 0) {
+                instance->pipe->EnableAdaptiveFragments(maxFragmentSize);
+            }
+            if (chunkedReceive) {
+                instance->pipe->EnableChunkedReceive();
+            }
+            if (spillThreshold != 0) {
+                instance->pipe->EnableSpill(spillThreshold);
+            }
+            if (rpcPendingCalls != 0) {
+                instance->pipe->EnableRpc(rpcHandler, rpcPendingCalls);
+            }
+            if (tracing) {
+                instance->pipe->EnableTracing();
+            }
+            instances.emplace_back(std::move(instance));
+            return true;
+        }
+
+        /// <summary>
+        /// 待ち受けインスタンスをプールサイズまで補充
+        /// </summary>
+        void FillPool() noexcept
+        {
+            while (ReserveListening()) {
+                try {
+                    if (!AddInstance()) {
                         break;
                     }
-                    //ヘッダーを送信
-                    WriteRaw(&header, sizeof(header), dummyEvent);
-                    //データ本体を送信
-                    WriteRaw(packetData.Pointer(), static_cast<DWORD>(packetData.Size()), dummyEvent);
-#ifdef SNP_TEST_MODE
-                    //テスト用の定義
-                    if (onWritePacket) {
-                        onWritePacket();
-                    }
-#endif
                 }
-                if (cancelFlag.load()) {
-                    //キャンセル発生を送信
-                    auto cancelHeader = Header::CreateCancel();
-                    WriteRaw(&cancelHeader, sizeof(cancelHeader), dummyEvent);
-                    if (ct.is_cancelable()) {
-                        concurrency::cancel_current_task();
-                    }
+                catch (...) {
+                    //インスタンス数の上限などで作成できない場合は既存のインスタンスの解放を待つ
+                    break;
                 }
-            }, concurrency::task_options(ct));
+            }
         }
 
-        virtual concurrency::task<void> WriteAsync(LPCVOID buffer, size_t size)
+        /// <summary>
+        /// 各インスタンスのイベントにセッションIDを付けて通知
+        /// </summary>
+        void OnInstanceEvent(Instance& instance, Session& ps, const PipeEventParam& param)
         {
-            return WriteAsync(buffer, size, concurrency::cancellation_token::none());
+            if (param.type == PipeEventType::CONNECTED) {
+                {
+                    std::lock_guard<std::mutex> lock(instance.sessionLock);
+                    instance.sessionId.store(lastSessionId.fetch_add(1) + 1);
+                }
+                listeningCount.fetch_sub(1);
+                //接続したインスタンスの代わりを用意
+                FillPool();
+            }
+            else if (param.type == PipeEventType::CLOSED && instance.retired.load()) {
+                //待ち受け数の超過で閉じたインスタンスは通知しない
+                return;
+            }
+            auto sessionId = instance.sessionId.load();
+            if (param.type == PipeEventType::DISCONNECTED && sessionId != 0) {
+                //以降はセッションIDを指定した操作を受け付けない。操作中であれば完了を待ち、次の接続へ操作させない
+                std::lock_guard<std::mutex> lock(instance.sessionLock);
+                instance.sessionId.store(0);
+            }
+            callback(ps, PipeEventParam{ param.type, param.readBuffer, param.readedSize, param.errTask, sessionId, param.message });
+            if (param.type == PipeEventType::DISCONNECTED && sessionId != 0) {
+                //待ち受け数がプールサイズに満たなければ次の接続を待ち受ける
+                if (!ReserveListening()) {
+                    //接続時に補充した分で足りているので閉じる(切断処理の後に監視タスクを終了する)
+                    ps.Close();
+                    instance.retired.store(true);
+                }
+            }
         }
 
-        void Close()
+        /// <summary>
+        /// セッションIDのインスタンスで操作を実行
+        /// 操作中はインスタンスの切断によるセッションIDの切り替えを待たせるので、切断後に次のクライアントへ操作しない。
+        /// 操作は送信キューへの追加までとし、送信完了を待たないこと(切断処理が止まる)。
+        /// </summary>
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="operation">セッションへの操作</param>
+        /// <returns>切断済みのセッションの場合は操作せずにfalse</returns>
+        template<typename F>
+        bool WithSession(size_t sessionId, F&& operation)
         {
-            winrt::check_bool(SetEvent(closeEvent.get()));
-            if (watchThreadId != GetCurrentThreadId()) {
-                //監視タスクと異なるスレッドであればタスク終了を待つ
-                watcherTask.wait();
+            if (sessionId == 0) {
+                //未接続のインスタンスは対象外
+                return false;
+            }
+            std::shared_ptr<Instance> instance;
+            {
+                std::lock_guard<std::mutex> lock(instancesLock);
+                auto it = std::find_if(instances.begin(), instances.end(), [sessionId](const auto& i) { return i->sessionId.load() == sessionId; });
+                if (it == instances.end()) {
+                    return false;
+                }
+                instance = *it;
+            }
+            std::lock_guard<std::mutex> lock(instance->sessionLock);
+            if (instance->sessionId.load() != sessionId) {
+                //検索後に切断した
+                return false;
             }
+            operation(*instance->pipe);
+            return true;
         }
 
-        bool Valid() const { return bool{ handlePipe }; }
-
-#ifdef SNP_TEST_MODE
-        //テスト用の定義
-        std::function<void(void)> onWritePacket;
-#endif
-    };
-
-    //送信・受信の最大サイズ。ただし、実際はメモリー状況によるのでこの値を保証するものではない。
-    inline static constexpr size_t MAX_DATA_SIZE = (std::numeric_limits<DWORD>::max)() - static_cast<DWORD>(sizeof SimpleNamedPipeBase::Header);
-
-    /// <summary>
-    /// 名前付きパイプサーバークラス
-    /// </summary>
-    template<DWORD BUF_SIZE, DWORD LIMIT=MAX_DATA_SIZE>
-    class SimpleNamedPipeServer : public SimpleNamedPipeBase
-    {
-        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
-        static_assert(LIMIT <= MAX_DATA_SIZE, "LIMIT must be less than or equal to MAX_DATA_SIZE");
     public:
-        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
-        using Callback = std::function<void(SimpleNamedPipeServer<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
+        SimpleNamedPipeMultiServer() = delete;
+        SimpleNamedPipeMultiServer(SimpleNamedPipeMultiServer&&) = delete;
+        SimpleNamedPipeMultiServer(const SimpleNamedPipeMultiServer&) = delete;
 
-    private:
-        const winrt::hstring pipeName;
-        Callback callback;
-        std::unique_ptr<OVERLAPPED> connectionOverlap;
-        HANDLE connectionEvent;
-        HANDLE disconnectionEvent;
-        std::atomic_int connectedCount{0};
+        SimpleNamedPipeMultiServer& operator=(SimpleNamedPipeMultiServer&&) = delete;
+        SimpleNamedPipeMultiServer& operator=(const SimpleNamedPipeMultiServer&) = delete;
 
         /// <summary>
-        /// 次回の接続待ち開始
+        /// コンストラクタ
         /// </summary>
-        void BeginConnect()
-        {
-            ResetReceiver();
-            *connectionOverlap = { 0 };
-            connectionOverlap->hEvent = connectionEvent;
-            if (!ConnectNamedPipe(Handle(), connectionOverlap.get())) {
-                WrapReadState state{ GetLastError() };
-                if (state.LastErr() == ERROR_PIPE_CONNECTED) {
-                    //すでに接続済み
-                    winrt::check_bool(SetEvent(connectionEvent));
-                }
-                state.ThrowIfInvalid();
-            }
-        }
-
-    protected:
-        virtual bool OnFireEvent(HANDLE handle) override
+        /// <param name="name">名前付きパイプ名称</param>
+        /// <param name="psa">セキュリティディスクリプタ。インスタンスの追加時にも参照するので、サーバーの破棄まで維持すること。</param>
+        /// <param name="callback">イベント通知コールバック。全セッションで共通。</param>
+        /// <param name="poolSize">接続を待ち受けるインスタンス数</param>
+        /// <param name="maxInstances">最大インスタンス数(最大同時接続数)</param>
+#ifdef _WIN32
+        SimpleNamedPipeMultiServer(LPCWSTR name, LPSECURITY_ATTRIBUTES psa, Callback callback, DWORD poolSize = DEFAULT_POOL_SIZE, DWORD maxInstances = UNLIMITED_INSTANCES)
+            : pipeName(name)
+            , psa(psa)
+#else
+        SimpleNamedPipeMultiServer(const char* name, LPSOCKET_SECURITY_ATTRIBUTES psa, Callback callback, DWORD poolSize = DEFAULT_POOL_SIZE, DWORD maxInstances = UNLIMITED_INSTANCES)
+            : listener(Session::CreateServerHandle(name, psa))
+#endif
+            , callback(callback)
+            , poolSize(poolSize)
+            , maxInstances(maxInstances)
         {
-            winrt::check_bool(ResetEvent(handle));
-            bool connected = false;
-            if (handle == connectionEvent) {
-                //クライアント接続
-                connectedCount.fetch_add(1);
-                //接続イベント
-                OnConnected();
-                // 非同期データ受信処理開始
-                auto state = OverappedRead();
-                connected = !state.IsDisconn();
-            }
-            else if (handle == disconnectionEvent) {
-                //切断処理実行イベント
-                connected = false;
-            }
-            if (!connected) {
-                //切断要求/検知したら切断
-                //終了した接続の後始末をして次回接続の待機
-                if (!OnDisconnected()) {
-                    //クローズ要求時
-                    return false;
-                }
+            if (!callback) {
+                throw std::invalid_argument("bad callback error");
             }
-            return true;
+            if (poolSize == 0 || poolSize > maxInstances) {
+                throw std::invalid_argument("bad pool size");
+            }
+            //最初のインスタンスの作成エラー(同名のパイプが存在する等)は例外とする
+            ReserveListening();
+            AddInstance();
+            FillPool();
         }
 
-        virtual void OnReceived(Buffer buffer) override
+#ifdef _WIN32
+        virtual winrt::hstring PipeName() const { return pipeName; }
+#else
+        virtual std::string PipeName() const { return listener->path; }
+#endif
+
+        /// <summary>
+        /// 接続中のセッション数
+        /// </summary>
+        size_t SessionCount()
         {
-            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size()});
+            std::lock_guard<std::mutex> lock(instancesLock);
+            return static_cast<size_t>(std::count_if(instances.begin(), instances.end(), [](const auto& i) { return i->sessionId.load() != 0; }));
         }
 
-        virtual bool OnDisconnected() override
+        /// <summary>
+        /// 接続中のセッションIDの一覧
+        /// </summary>
+        std::vector<size_t> SessionIds()
         {
-            int expceted = 0;
-            if (connectedCount.compare_exchange_weak(expceted, 0)) {
-                //すでに切断済み
-                return true;
-            }
-            connectedCount.fetch_sub(1);
-            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
-            if (!Valid()) {
-                //ハンドルが破棄済み
-                return false;
-            }
-            try {
-                //切断処理も行う
-                DisconnectInner();
-                //次回接続待ち開始
-                BeginConnect();
-            }
-            catch (winrt::hresult_error& ex) {
-                //INVALID_HANDLEの場合はすでにClose済みということなので例外とはしない
-                if ( static_cast<HRESULT>(ex.code().value) != HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE)) {
-                    throw;
+            std::lock_guard<std::mutex> lock(instancesLock);
+            std::vector<size_t> ids;
+            for (const auto& i : instances) {
+                auto id = i->sessionId.load();
+                if (id != 0) {
+                    ids.push_back(id);
                 }
             }
-            //引き続きパイプの処理は続ける
-            return true;
+            return ids;
         }
 
-        virtual void OnClosed()
+        /// <summary>
+        /// 指定セッションへ非同期送信
+        /// </summary>
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>非同期タスク</returns>
+        PipeTask WriteAsync(size_t sessionId, LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
         {
-            callback(*this, PipeEventParam{ PipeEventType::CLOSED, nullptr, 0 });
+            std::optional<PipeTask> task;
+            if (!WithSession(sessionId, [&](Session& session) { task = session.WriteAsync(buffer, size, priority, ct); })) {
+                //切断済みのセッション
+#ifdef _WIN32
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED));
+#else
+                ThrowErrno(ENOTCONN);
+#endif
+            }
+            return std::move(*task);
         }
 
-        virtual void OnTrapException(concurrency::task<void> errTask) override
+        PipeTask WriteAsync(size_t sessionId, LPCVOID buffer, size_t size, SendPriority priority)
         {
-            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
+            return WriteAsync(sessionId, buffer, size, priority, CancellationToken::none());
         }
 
-        /// <summary>
-        /// 接続時処理
-        /// </summary>
-        virtual void OnConnected()
+        PipeTask WriteAsync(size_t sessionId, LPCVOID buffer, size_t size, CancellationToken ct)
         {
-            callback(*this, PipeEventParam{ PipeEventType::CONNECTED, nullptr, 0 });
+            return WriteAsync(sessionId, buffer, size, SendPriority::NORMAL, ct);
+        }
+
+        PipeTask WriteAsync(size_t sessionId, LPCVOID buffer, size_t size)
+        {
+            return WriteAsync(sessionId, buffer, size, SendPriority::NORMAL, CancellationToken::none());
         }
 
         /// <summary>
-        /// 接続中のClientを切断する
+        /// 指定セッションへ同期送信(SimpleNamedPipeBase::Write)
+        /// 送信キューへの追加後、セッションの操作の外で送信完了まで呼び出し元をブロックする(WriteAsync(...).wait()と同じ動作)。
         /// </summary>
-        void DisconnectInner()
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="buffer">送信バッファー</param>
+        /// <param name="size">送信サイズ</param>
+        /// <param name="priority">送信優先度</param>
+        /// <param name="ct">キャンセルトークン</param>
+        void Write(size_t sessionId, LPCVOID buffer, size_t size, SendPriority priority, CancellationToken ct)
         {
-            FlushFileBuffers(Handle());
-            if (!DisconnectNamedPipe(Handle())) {
-                WrapReadState{ GetLastError() }.ThrowIfInvalid();
+            std::optional<PipeTask> task;
+            if (!WithSession(sessionId, [&](Session& session) { task = session.WriteAsync(buffer, size, priority, ct); })) {
+                //切断済みのセッション
+#ifdef _WIN32
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED));
+#else
+                ThrowErrno(ENOTCONN);
+#endif
             }
+            //送信完了はセッションの操作の外で待機
+            task->get();
         }
 
-    public:
-        SimpleNamedPipeServer() = delete;
-        SimpleNamedPipeServer(SimpleNamedPipeServer&&) = delete;
-        SimpleNamedPipeServer(const SimpleNamedPipeServer&) = delete;
+        void Write(size_t sessionId, LPCVOID buffer, size_t size, SendPriority priority)
+        {
+            Write(sessionId, buffer, size, priority, CancellationToken::none());
+        }
 
-        SimpleNamedPipeServer& operator=(SimpleNamedPipeServer&&) = delete;
-        SimpleNamedPipeServer& operator=(const SimpleNamedPipeServer&) = delete;
+        void Write(size_t sessionId, LPCVOID buffer, size_t size, CancellationToken ct)
+        {
+            Write(sessionId, buffer, size, SendPriority::NORMAL, ct);
+        }
+
+        void Write(size_t sessionId, LPCVOID buffer, size_t size)
+        {
+            Write(sessionId, buffer, size, SendPriority::NORMAL, CancellationToken::none());
+        }
 
         /// <summary>
-        /// 名前付きパイプサーバーハンドルの生成
+        /// 指定セッションへ複数メッセージを非同期一括送信
         /// </summary>
-        /// <param name="name">名前付きパイプ名称</param>
-        /// <param name="psa">セキュリティディスクリプタ</param>
-        /// <returns>名前付きパイプハンドル</returns>
-        static HANDLE CreateServerHandle(LPCWSTR name, LPSECURITY_ATTRIBUTES psa)
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="buffers">送信バッファーの配列</param>
+        /// <param name="count">メッセージ数</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>非同期タスク</returns>
+        PipeTask WriteBatchAsync(size_t sessionId, const ConstBuffer* buffers, size_t count, CancellationToken ct)
         {
-            //名前付きパイプの作成
-            // 接続可能クライアント数=1; ローカルマシン接続のみ許可
-            HANDLE handle = CreateNamedPipeW(
-                name,
-                PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
-                PIPE_TYPE_BYTE | PIPE_REJECT_REMOTE_CLIENTS,
-                1,
-                BUF_SIZE,
-                BUF_SIZE,
-                0,
-                psa);
-
-            if (INVALID_HANDLE_VALUE == handle) {
-                winrt::throw_last_error();
+            std::optional<PipeTask> task;
+            if (!WithSession(sessionId, [&](Session& session) { task = session.WriteBatchAsync(buffers, count, ct); })) {
+                //切断済みのセッション
+#ifdef _WIN32
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED));
+#else
+                ThrowErrno(ENOTCONN);
+#endif
             }
-            return handle;
+            return std::move(*task);
+        }
+
+        PipeTask WriteBatchAsync(size_t sessionId, const ConstBuffer* buffers, size_t count)
+        {
+            return WriteBatchAsync(sessionId, buffers, count, CancellationToken::none());
         }
 
         /// <summary>
-        /// コンストラクタ
+        /// 指定セッションへ分割送信(SimpleNamedPipeBase::WriteStreamAsync)
         /// </summary>
-        /// <param name="name">名前付きパイプ名称</param>
-        /// <param name="psa">セキュリティディスクリプタ</param>
-        /// <param name="callback">イベント通知コールバック</param>
-        SimpleNamedPipeServer(LPCWSTR name, LPSECURITY_ATTRIBUTES psa, Callback callback)
-            : SimpleNamedPipeBase(CreateServerHandle(name, psa), BUF_SIZE, LIMIT, 2)
-            , pipeName(name)
-            , callback(callback)
-            , connectionEvent{ CustomEvents()[0].get() }
-            , disconnectionEvent{ CustomEvents()[1].get() }
-            , connectionOverlap{std::make_unique<OVERLAPPED>()}
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="reader">読み出し関数</param>
+        /// <param name="ct">キャンセルトークン</param>
+        /// <returns>非同期タスク</returns>
+        PipeTask WriteStreamAsync(size_t sessionId, ChunkReader reader, CancellationToken ct)
         {
-            if (!callback) {
-                throw std::invalid_argument("bad callback error");
+            std::optional<PipeTask> task;
+            if (!WithSession(sessionId, [&](Session& session) { task = session.WriteStreamAsync(std::move(reader), ct); })) {
+                //切断済みのセッション
+#ifdef _WIN32
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED));
+#else
+                ThrowErrno(ENOTCONN);
+#endif
             }
-            *connectionOverlap = { 0 };
-            //接続待ち開始
-            BeginConnect();
+            return std::move(*task);
         }
 
-        virtual winrt::hstring PipeName() const { return pipeName; }
+        PipeTask WriteStreamAsync(size_t sessionId, ChunkReader reader)
+        {
+            return WriteStreamAsync(sessionId, std::move(reader), CancellationToken::none());
+        }
 
         /// <summary>
-        /// クライアントを切断
+        /// 全セッションで受信メッセージプールを有効化
+        /// 以降の受信イベントではPipeEventParam::messageにハンドルを設定する。プールはセッション間で共有する。
         /// </summary>
-        virtual void Disconnect()
+        void EnableMessagePool()
         {
-            int expceted = 0;
-            if (connectedCount.compare_exchange_weak(expceted, 0)) {
-                //すでに切断済み
-                return;
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (!messagePool) {
+                messagePool = MessagePool::Create(BUF_SIZE, LIMIT);
+            }
+            for (const auto& i : instances) {
+                i->pipe->EnableMessagePool(messagePool);
             }
-            //切断イベントをシグナル
-            winrt::check_bool(SetEvent(disconnectionEvent));
         }
 
-        virtual ~SimpleNamedPipeServer()
+        /// <summary>
+        /// 全セッションの受信イベントをワーカースレッドプールで実行
+        /// セッション毎に受信順を保ち、異なるセッションの受信イベントは並列に実行する。
+        /// </summary>
+        /// <param name="pool">ワーカースレッドプール</param>
+        void EnableDispatcher(std::shared_ptr<Dispatcher> pool)
         {
-            //監視タスク終了
-            try {
-                Close();
+            if (!pool) {
+                throw std::invalid_argument("bad dispatcher");
+            }
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (dispatcher) {
+                throw std::logic_error("dispatcher is already enabled");
+            }
+            dispatcher = std::move(pool);
+            for (const auto& i : instances) {
+                i->pipe->EnableDispatcher(dispatcher);
             }
-            catch (...) {}
         }
-    };
-
-    using TypicalSimpleNamedPipeServer = SimpleNamedPipeServer<TYPICAL_BUFFER_SIZE>;
 
-    /// <summary>
-    /// 名前付きパイプクライアント
-    /// </summary>
-    template<DWORD BUF_SIZE, DWORD LIMIT=MAX_DATA_SIZE>
-    class SimpleNamedPipeClient : public SimpleNamedPipeBase
-    {
-        static_assert(BUF_SIZE >= MIN_BUFFER_SIZE, "BUF_SIZE must be greater than or equal to MIN_BUFFER_SIZE");
-        static_assert(LIMIT <= MAX_DATA_SIZE, "LIMIT must be less than or equal to MAX_DATA_SIZE");
-    public:
-        using Callback = std::function<void(SimpleNamedPipeClient<BUF_SIZE, LIMIT>&, const PipeEventParam&)>;
-        inline static constexpr DWORD BUFFER_SIZE = BUF_SIZE;
-    private:
-        const winrt::hstring pipeName;
-        const Callback callback;
+        /// <summary>
+        /// 全セッションで送信の多重化を有効化
+        /// </summary>
+        void EnableMultiplex()
+        {
+            std::lock_guard<std::mutex> lock(instancesLock);
+            multiplex = true;
+            for (const auto& i : instances) {
+                i->pipe->EnableMultiplex();
+            }
+        }
 
-    protected:
-        virtual void OnReceived(Buffer buffer) override
+        /// <summary>
+        /// 全セッションで適応的な断片サイズを有効化(SimpleNamedPipeBase::EnableAdaptiveFragments)
+        /// </summary>
+        /// <param name="maxFragment">断片サイズの上限</param>
+        void EnableAdaptiveFragments(size_t maxFragment = DEFAULT_MAX_FRAGMENT_SIZE)
         {
-            callback(*this, PipeEventParam{ PipeEventType::RECEIVED, buffer.Pointer(), buffer.Size() });
+            if (maxFragment < BUF_SIZE) {
+                throw std::invalid_argument("maxFragment must be greater than or equal to buffer size");
+            }
+            std::lock_guard<std::mutex> lock(instancesLock);
+            maxFragmentSize = maxFragment;
+            for (const auto& i : instances) {
+                i->pipe->EnableAdaptiveFragments(maxFragmentSize);
+            }
         }
 
-        virtual bool OnFireEvent(HANDLE) override { return true; }
+        /// <summary>
+        /// 全セッションで分割受信を有効化(SimpleNamedPipeBase::EnableChunkedReceive)
+        /// </summary>
+        void EnableChunkedReceive()
+        {
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (rpcPendingCalls != 0) {
+                throw std::logic_error("rpc is already enabled");
+            }
+            chunkedReceive = true;
+            for (const auto& i : instances) {
+                i->pipe->EnableChunkedReceive();
+            }
+        }
 
-        virtual bool OnDisconnected() override
+        /// <summary>
+        /// 全セッションで大きなメッセージの一時ファイルへの退避を有効化(SimpleNamedPipeBase::EnableSpill)
+        /// </summary>
+        void EnableSpill(size_t threshold = DEFAULT_SPILL_THRESHOLD)
         {
-            //切断時はパイプも閉じる
-            //切断イベントはOnClosedまで遅延
-            return false;
+            if (threshold == 0) {
+                throw std::invalid_argument("threshold must be greater than 0");
+            }
+            std::lock_guard<std::mutex> lock(instancesLock);
+            spillThreshold = threshold;
+            for (const auto& i : instances) {
+                i->pipe->EnableSpill(spillThreshold);
+            }
         }
 
-        virtual void OnTrapException(concurrency::task<void> errTask)
+        /// <summary>
+        /// 全セッションでRPCを有効化(SimpleNamedPipeBase::EnableRpc)
+        /// RPCハンドラーは全セッションで共有し、応答は引数のセッションのReplyAsyncで返す。
+        /// </summary>
+        /// <param name="handler">要求を処理するRPCハンドラー</param>
+        /// <param name="maxPendingCalls">セッション毎に応答待ちにできる呼び出し数</param>
+        void EnableRpc(SimpleNamedPipeBase::RpcHandler handler, size_t maxPendingCalls = DEFAULT_RPC_PENDING_CALLS)
         {
-            callback(*this, PipeEventParam{ PipeEventType::EXCEPTION, nullptr, 0, errTask });
+            if (maxPendingCalls == 0) {
+                throw std::invalid_argument("capacity must be greater than 0");
+            }
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (rpcPendingCalls != 0) {
+                throw std::logic_error("rpc is already enabled");
+            }
+            if (chunkedReceive) {
+                throw std::logic_error("chunked receive is enabled");
+            }
+            rpcHandler = std::move(handler);
+            rpcPendingCalls = maxPendingCalls;
+            for (const auto& i : instances) {
+                i->pipe->EnableRpc(rpcHandler, rpcPendingCalls);
+            }
         }
 
-        virtual void OnClosed()
+        /// <summary>
+        /// 指定セッションのRPCを呼び出す(SimpleNamedPipeBase::CallAsync)
+        /// </summary>
+        /// <param name="sessionId">セッションID</param>
+        /// <param name="buffer">引数</param>
+        /// <param name="size">引数のサイズ</param>
+        /// <param name="ct">送信のキャンセルトークン</param>
+        /// <returns>応答の非同期タスク</returns>
+        RpcTask CallAsync(size_t sessionId, LPCVOID buffer, size_t size, CancellationToken ct)
         {
-            //クライアントはこの時点で切断イベントとする
-            callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
+            std::optional<RpcTask> task;
+            if (!WithSession(sessionId, [&](Session& session) { task = session.CallAsync(buffer, size, ct); })) {
+                //切断済みのセッション
+#ifdef _WIN32
+                winrt::throw_hresult(HRESULT_FROM_WIN32(ERROR_PIPE_NOT_CONNECTED));
+#else
+                ThrowErrno(ENOTCONN);
+#endif
+            }
+            return std::move(*task);
         }
 
-    public:
-        SimpleNamedPipeClient() = delete;
-        SimpleNamedPipeClient(const SimpleNamedPipeClient&) = delete;
-        SimpleNamedPipeClient& operator=(const SimpleNamedPipeClient&) = delete;
+        RpcTask CallAsync(size_t sessionId, LPCVOID buffer, size_t size)
+        {
+            return CallAsync(sessionId, buffer, size, CancellationToken::none());
+        }
 
-        SimpleNamedPipeClient(SimpleNamedPipeClient&&) = delete;
-        SimpleNamedPipeClient& operator=(SimpleNamedPipeClient&&) = delete;
+        /// <summary>
+        /// 全セッションで遅延計測を有効化(SimpleNamedPipeBase::EnableTracing)
+        /// </summary>
+        void EnableTracing()
+        {
+            std::lock_guard<std::mutex> lock(instancesLock);
+            if (tracing) {
+                throw std::logic_error("tracing is already enabled");
+            }
+            tracing = true;
+            for (const auto& i : instances) {
+                i->pipe->EnableTracing();
+            }
+        }
 
         /// <summary>
-        /// 名前付きパイプサーバーへの接続
+        /// 指定セッションの遅延計測の集計(SimpleNamedPipeBase::TraceStatistics)
         /// </summary>
-        /// <param name="name">名称</param>
-        /// <returns>ハンドル</returns>
-        static HANDLE OpendPipeHandle(LPCWSTR name)
+        /// <param name="sessionId">セッションID</param>
+        /// <returns>切断済みのセッションは全て0</returns>
+        TraceStats TraceStatistics(size_t sessionId)
         {
-            //接続可能状態まで待つ
-            winrt::check_bool(WaitNamedPipe(name, NMPWAIT_USE_DEFAULT_WAIT));
-            //サーバーへ接続
-            HANDLE handle = CreateFileW(
-                name,
-                GENERIC_READ | GENERIC_WRITE,
-                0,
-                nullptr,
-                OPEN_EXISTING,
-                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
-                nullptr);
+            TraceStats stats{};
+            WithSession(sessionId, [&](Session& session) { stats = session.TraceStatistics(); });
+            return stats;
+        }
 
-            if(INVALID_HANDLE_VALUE == handle){
-                winrt::throw_last_error();
-            }
-            return handle;
+        /// <summary>
+        /// 指定セッションを切断
+        /// </summary>
+        /// <param name="sessionId">セッションID</param>
+        void Disconnect(size_t sessionId)
+        {
+            //切断の実行は監視タスクで行うので、操作中に切断処理を待たない
+            WithSession(sessionId, [](Session& session) { session.Disconnect(); });
         }
 
         /// <summary>
-        /// コンストラクタ
+        /// 全インスタンスを閉じる。CLOSEDイベントはインスタンス毎に通知する。
         /// </summary>
-        /// <param name="name">名前付きパイプ名称</param>
-        /// <param name="callback">イベント通知コールバック</param>
-        SimpleNamedPipeClient(LPCWSTR name, Callback callback)
-            : SimpleNamedPipeBase(OpendPipeHandle(name), BUF_SIZE, LIMIT)
-            , pipeName(name)
-            , callback(callback)
+        void Close()
         {
-            if (!callback) {
-                throw std::invalid_argument("bad callback error");
+            closing.store(true);
+            std::vector<Session*> sessions;
+            {
+                std::lock_guard<std::mutex> lock(instancesLock);
+                for (const auto& i : instances) {
+                    sessions.push_back(i->pipe.get());
+                }
             }
-            //非同期受信処理開始
-            auto state = OverappedRead();
-            if (state.IsDisconn()) {
-                //接続後に即切断の場合
-                callback(*this, PipeEventParam{ PipeEventType::DISCONNECTED, nullptr, 0 });
-                Close();
+            for (auto session : sessions) {
+                session->Close();
             }
         }
 
-        virtual winrt::hstring PipeName() const { return pipeName; }
-
-        virtual ~SimpleNamedPipeClient()
+        virtual ~SimpleNamedPipeMultiServer()
         {
-            //監視タスク終了
-            try{
+            try {
                 Close();
             }
             catch (...) {}
         }
     };
 
-    using TypicalSimpleNamedPipeClient = SimpleNamedPipeClient<TYPICAL_BUFFER_SIZE>;
+    using TypicalSimpleNamedPipeMultiServer = SimpleNamedPipeMultiServer<TYPICAL_BUFFER_SIZE>;
 }